@@ -8,6 +8,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <dborb/netinfo.h>
 #include <dborb/logging.h>
@@ -27,44 +28,6 @@
 #include "files.h"
 
 
-/*
- * After the process has finished, upload the output
- */
-static void
-ni_testbus_agent_upload_output(ni_dbus_object_t *proc_object, const char *filename,
-			ni_buffer_chain_t **chain, ni_testbus_file_t *file)
-{
-	ni_dbus_object_t *file_object;
-	ni_buffer_t *bp;
-
-	if (ni_buffer_chain_count(*chain) == 0)
-		return;
-
-	if (file && file->object_path) {
-		file_object = ni_testbus_client_get_and_refresh_object(file->object_path);
-	} else {
-		file_object = ni_testbus_client_create_tempfile(filename, NI_TESTBUS_FILE_READ, proc_object);
-		if (file_object == NULL)
-			goto failed;
-	}
-
-	ni_debug_testbus("%s(%s, %s, %u bytes)", __func__, proc_object->path, filename,
-			ni_buffer_chain_count(*chain));
-	while ((bp = ni_buffer_chain_get_next(chain)) != NULL) {
-		if (!ni_testbus_client_upload_file(file_object, bp)) {
-			ni_buffer_free(bp);
-			goto failed;
-		}
-		ni_buffer_free(bp);
-	}
-
-	return;
-
-failed:
-	ni_error("%s: failed to upload %s", proc_object->path, filename);
-	return;
-}
-
 /*
  * Handle running processes.
  *
@@ -82,14 +45,100 @@ struct __ni_testbus_process_context {
 	ni_process_t *		process;
 	ni_testbus_file_array_t *files;
 
-	struct {
-		ni_testbus_file_t *file;
-		ni_buffer_chain_t *buffers;
+	ni_bool_t		exited;
+	ni_process_exit_info_t	exit_info;
+	uint64_t		queue_wait_usec;
+	unsigned int		queue_depth;
+
+	struct __ni_testbus_output_stream {
+		struct __ni_testbus_process_context *ctx;
+		const char *		name;
+		ni_process_buffer_t *	pbf;
+		ni_testbus_file_t *	file;
+		ni_dbus_object_t *	handle;
+		ni_buffer_chain_t *	buffers;
+		int			spool_fd;
+		uint64_t		spool_head;
+		uint64_t		spool_tail;
+		unsigned int		in_flight;
+		ni_codec_t *		codec;
+		ni_bool_t		throttled;
+		ni_bool_t		failed;
+
+		/* tail-only mode */
+		unsigned int		tail_size;
+		unsigned char *		tail;
+		uint64_t		tail_total;
 	} stdout, stderr;
 };
 
+/*
+ * Process output is streamed to the master while the process is running.
+ * We keep one append() call in flight per stream; while it is pending,
+ * new output piles up in the buffer chain. If the master cannot keep up
+ * and the backlog grows beyond the spool threshold, further output goes
+ * to a spool file on disk, and is read back as the backlog in memory
+ * drains.
+ *
+ * Only if the backlog grows beyond the maximum file size (or if we cannot
+ * spool to disk), we stop reading from the process until it has drained
+ * to a quarter of that.
+ *
+ * If compression is enabled, we use appendEncoded() instead of append().
+ */
+#define NI_TESTBUS_OUTPUT_UNSPOOL_CHUNK	(64 * 1024)
+
+/*
+ * The agent's run queue.
+ *
+ * The master does not know how busy a host is when it schedules a command,
+ * so a test suite that fires off a few hundred commands at once would make
+ * us fork a few hundred processes at once. Instead, we run at most a
+ * limited number of commands concurrently, and queue the rest. Commands
+ * are started in order of priority, and in the order they arrived if they
+ * have the same priority.
+ *
+ * The input files of a command are fetched as soon as it is queued (see
+ * agent/files.c). When a slot becomes free, the command holds on to it
+ * while it waits for any downloads still in flight, and is started once
+ * these have completed.
+ *
+ * How long a command was queued is reported to the master as part of its
+ * exit info.
+ */
+#define NI_TESTBUS_RUNQUEUE_SLOTS_PER_CPU	2
+#define NI_TESTBUS_RUNQUEUE_MIN_SLOTS		4
+
+struct __ni_testbus_queued_command {
+	struct __ni_testbus_queued_command *next;
+
+	ni_process_t *		process;
+	char *			object_path;
+	ni_testbus_file_array_t *files;
+	int			priority;
+	unsigned int		output_tail;
+
+	struct timeval		queued;
+	unsigned int		depth;
+
+	ni_testbus_agent_fetch_t *fetch;
+};
+
+static struct {
+	struct __ni_testbus_queued_command *head;
+	struct __ni_testbus_queued_command *starting;	/* waiting for their files */
+	unsigned int		count;
+	unsigned int		running;
+	unsigned int		slots;
+} ni_testbus_runqueue;
+
 static struct __ni_testbus_process_context *ni_testbus_active_processes;
 
+static void		__ni_testbus_output_stream_kick(struct __ni_testbus_output_stream *);
+static void		__ni_testbus_output_stream_append(struct __ni_testbus_output_stream *, ni_buffer_t *);
+static void		__ni_testbus_process_finish(struct __ni_testbus_process_context *);
+static void		__ni_testbus_runqueue_kick(void);
+
 static void
 __ni_testbus_process_context_link(struct __ni_testbus_process_context **pos, struct __ni_testbus_process_context *ctx)
 {
@@ -136,19 +185,45 @@ __ni_testbus_process_context_new(const char *master_object_path, ni_process_t *p
 	ctx->object_path = ni_strdup(master_object_path);
 	ctx->process = pi;
 
+	ctx->stdout.ctx = ctx;
+	ctx->stdout.name = "stdout";
+	ctx->stdout.pbf = &pi->stdout;
+	ctx->stdout.spool_fd = -1;
+	ctx->stdout.codec = ni_codec_default();
+	ctx->stderr.ctx = ctx;
+	ctx->stderr.name = "stderr";
+	ctx->stderr.pbf = &pi->stderr;
+	ctx->stderr.spool_fd = -1;
+	ctx->stderr.codec = ni_codec_default();
+
 	__ni_testbus_process_context_link(&ni_testbus_active_processes, ctx);
 	return ctx;
 }
 
+static void
+__ni_testbus_output_stream_destroy(struct __ni_testbus_output_stream *stream)
+{
+	ni_assert(stream->in_flight == 0);
+
+	ni_buffer_chain_discard(&stream->buffers);
+	free(stream->tail);
+	stream->tail = NULL;
+	if (stream->spool_fd >= 0)
+		close(stream->spool_fd);
+	stream->spool_fd = -1;
+	if (stream->file)
+		ni_testbus_file_put(stream->file);
+	stream->file = NULL;
+	if (stream->handle)
+		ni_dbus_object_free(stream->handle);
+	stream->handle = NULL;
+}
+
 static void
 __ni_testbus_process_context_free(struct __ni_testbus_process_context *ctx)
 {
-	ni_buffer_chain_discard(&ctx->stdout.buffers);
-	ni_buffer_chain_discard(&ctx->stderr.buffers);
-	if (ctx->stdout.file)
-		ni_testbus_file_put(ctx->stdout.file);
-	if (ctx->stderr.file)
-		ni_testbus_file_put(ctx->stderr.file);
+	__ni_testbus_output_stream_destroy(&ctx->stdout);
+	__ni_testbus_output_stream_destroy(&ctx->stderr);
 	ni_string_free(&ctx->object_path);
 
 	if (ctx->files)
@@ -158,68 +233,436 @@ __ni_testbus_process_context_free(struct __ni_testbus_process_context *ctx)
 }
 
 static void
-__ni_testbus_process_notify(const char *master_object_path, ni_process_exit_info_t *exit_info,
-				struct __ni_testbus_process_context *ctx)
+__ni_testbus_process_notify(const char *master_object_path, ni_process_exit_info_t *exit_info)
 {
 	ni_dbus_object_t *proc_object;
 
 	if (!(proc_object = ni_testbus_client_get_and_refresh_object(master_object_path)))
 		return;
 
-	if (ctx) {
-		ni_testbus_agent_upload_output(proc_object, "stdout", &ctx->stdout.buffers, ctx->stdout.file);
-		ni_testbus_agent_upload_output(proc_object, "stderr", &ctx->stderr.buffers, ctx->stderr.file);
+	ni_testbus_client_process_exit(proc_object, exit_info);
+}
+
+/*
+ * Find the master's Tmpfile object for this stream, creating it if needed.
+ */
+static ni_bool_t
+__ni_testbus_output_stream_open(struct __ni_testbus_output_stream *stream)
+{
+	struct __ni_testbus_process_context *ctx = stream->ctx;
+	ni_dbus_object_t *proc_object, *file_object;
+	const char *file_path;
+
+	if (stream->file && stream->file->object_path) {
+		file_path = stream->file->object_path;
+	} else {
+		if (!(proc_object = ni_testbus_client_get_and_refresh_object(ctx->object_path)))
+			return FALSE;
+
+		file_object = ni_testbus_client_create_tempfile(stream->name, NI_TESTBUS_FILE_READ, proc_object);
+		if (file_object == NULL)
+			return FALSE;
+		file_path = file_object->path;
 	}
 
-	ni_testbus_client_process_exit(proc_object, exit_info);
+	stream->handle = ni_testbus_client_file_handle(file_path, stream);
+	return stream->handle != NULL;
+}
+
+static inline uint64_t
+__ni_testbus_output_stream_spooled(const struct __ni_testbus_output_stream *stream)
+{
+	return stream->spool_tail - stream->spool_head;
+}
+
+static void
+__ni_testbus_output_stream_discard(struct __ni_testbus_output_stream *stream)
+{
+	ni_buffer_chain_discard(&stream->buffers);
+	stream->spool_head = stream->spool_tail = 0;
+}
+
+/*
+ * Append output to the spool file
+ */
+static ni_bool_t
+__ni_testbus_output_stream_spool(struct __ni_testbus_output_stream *stream, const void *data, size_t count)
+{
+	uint64_t offset = stream->spool_tail;
+
+	if (stream->spool_fd < 0) {
+		if ((stream->spool_fd = ni_testbus_spool_open(stream->name)) < 0)
+			return FALSE;
+		ni_debug_testbus("%s: spooling %s to disk", stream->ctx->object_path, stream->name);
+	}
+
+	while (count) {
+		ssize_t written;
+
+		written = pwrite(stream->spool_fd, data, count, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			ni_error("%s: cannot write %s to spool file: %m", stream->ctx->object_path, stream->name);
+			return FALSE;
+		}
+		data += written;
+		count -= written;
+		offset += written;
+	}
+
+	stream->spool_tail = offset;
+	return TRUE;
+}
+
+/*
+ * Move spooled output back to memory, as the backlog there drains.
+ */
+static ni_bool_t
+__ni_testbus_output_stream_unspool(struct __ni_testbus_output_stream *stream)
+{
+	unsigned int low_water = ni_testbus_spool_threshold() / 2;
+
+	while (__ni_testbus_output_stream_spooled(stream)
+	    && ni_buffer_chain_count(stream->buffers) < low_water) {
+		uint64_t count = __ni_testbus_output_stream_spooled(stream);
+		ni_buffer_t *bp;
+		ssize_t n;
+
+		if (count > NI_TESTBUS_OUTPUT_UNSPOOL_CHUNK)
+			count = NI_TESTBUS_OUTPUT_UNSPOOL_CHUNK;
+
+		bp = ni_buffer_new(count);
+		n = pread(stream->spool_fd, ni_buffer_tail(bp), count, stream->spool_head);
+		if (n <= 0) {
+			ni_buffer_free(bp);
+			if (n < 0 && errno == EINTR)
+				continue;
+			ni_error("%s: cannot read %s from spool file: %s", stream->ctx->object_path, stream->name,
+					n < 0? strerror(errno) : "unexpected EOF");
+			return FALSE;
+		}
+
+		ni_buffer_push_tail(bp, n);
+		ni_buffer_chain_append(&stream->buffers, bp);
+		stream->spool_head += n;
+	}
+
+	/* Release the disk space once the spool file has been drained */
+	if (stream->spool_head != 0 && stream->spool_head == stream->spool_tail) {
+		stream->spool_head = stream->spool_tail = 0;
+		if (ftruncate(stream->spool_fd, 0) < 0)
+			ni_warn("%s: cannot truncate %s spool file: %m", stream->ctx->object_path, stream->name);
+	}
+	return TRUE;
+}
+
+static void
+__ni_testbus_output_stream_throttle(struct __ni_testbus_output_stream *stream, ni_bool_t stop)
+{
+	if (stream->throttled == stop)
+		return;
+
+	ni_debug_testbus("%s: %s %s", stream->ctx->object_path,
+			stop? "throttling" : "resuming", stream->name);
+	if (stream->pbf)
+		ni_process_buffer_throttle(stream->pbf, stop);
+	stream->throttled = stop;
+}
+
+static void
+__ni_testbus_output_stream_append_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
+{
+	struct __ni_testbus_output_stream *stream = handle->handle;
+	struct __ni_testbus_process_context *ctx = stream->ctx;
+
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		DBusError error = DBUS_ERROR_INIT;
+
+		dbus_set_error_from_message(&error, reply);
+		if (stream->codec && dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD)) {
+			/* The master does not support compression; send
+			 * the same data again using plain append() */
+			ni_debug_testbus("%s: master does not support compressed output", ctx->object_path);
+			stream->codec = NULL;
+			stream->in_flight = 0;
+		} else {
+			ni_dbus_print_error(&error, "%s: failed to upload %s", ctx->object_path, stream->name);
+			stream->failed = TRUE;
+		}
+		dbus_error_free(&error);
+	}
+
+	ni_buffer_chain_pull(&stream->buffers, stream->in_flight);
+	stream->in_flight = 0;
+
+	__ni_testbus_output_stream_kick(stream);
+	if (ctx->exited)
+		__ni_testbus_process_finish(ctx);
+}
+
+/*
+ * Send the next chunk of output to the master, unless there's a call
+ * in flight already.
+ */
+static void
+__ni_testbus_output_stream_kick(struct __ni_testbus_output_stream *stream)
+{
+	struct __ni_testbus_process_context *ctx = stream->ctx;
+	uint64_t backlog, limit;
+	int count;
+
+	if (stream->in_flight)
+		return;
+
+	if (stream->failed || ctx->deleted_on_master) {
+		__ni_testbus_output_stream_discard(stream);
+		__ni_testbus_output_stream_throttle(stream, FALSE);
+		return;
+	}
+
+	if (!__ni_testbus_output_stream_unspool(stream))
+		goto failed;
+
+	if (stream->buffers == NULL)
+		goto out;
+
+	if (stream->handle == NULL && !__ni_testbus_output_stream_open(stream)) {
+		ni_error("%s: unable to create %s file", ctx->object_path, stream->name);
+		goto failed;
+	}
+
+	count = ni_testbus_client_append_chain_async(stream->handle, stream->buffers, stream->codec,
+					__ni_testbus_output_stream_append_done);
+	if (count < 0) {
+		ni_error("%s: failed to upload %s", ctx->object_path, stream->name);
+		goto failed;
+	}
+	if (count == 0)
+		ni_buffer_chain_discard(&stream->buffers);
+	stream->in_flight = count;
+
+out:
+	backlog = ni_buffer_chain_count(stream->buffers) + __ni_testbus_output_stream_spooled(stream);
+	if (stream->spool_fd >= 0)
+		limit = ni_testbus_file_size_max(stream->file);
+	else
+		limit = ni_testbus_spool_threshold();
+
+	if (backlog >= limit)
+		__ni_testbus_output_stream_throttle(stream, TRUE);
+	else if (backlog < limit / 4)
+		__ni_testbus_output_stream_throttle(stream, FALSE);
+	return;
+
+failed:
+	stream->failed = TRUE;
+	__ni_testbus_output_stream_discard(stream);
+	__ni_testbus_output_stream_throttle(stream, FALSE);
+}
+
+/*
+ * Some commands write huge amounts of output, of which only the last
+ * few lines are interesting. In tail-only mode, the output is not
+ * streamed to the master; instead, we keep the last tail_size bytes of
+ * each stream in a ring buffer, and send them when the process exits.
+ * Memory use is bounded by tail_size, no matter how much the process
+ * writes.
+ */
+static void
+__ni_testbus_output_stream_tail_put(struct __ni_testbus_output_stream *stream, const unsigned char *data, size_t count)
+{
+	size_t size = stream->tail_size;
+
+	if (stream->tail == NULL)
+		stream->tail = ni_malloc(size);
+
+	/* Only the last tail_size bytes can survive anyway */
+	if (count > size) {
+		stream->tail_total += count - size;
+		data += count - size;
+		count = size;
+	}
+
+	while (count) {
+		size_t pos = stream->tail_total % size;
+		size_t n = size - pos;
+
+		if (n > count)
+			n = count;
+		memcpy(stream->tail + pos, data, n);
+		stream->tail_total += n;
+		data += n;
+		count -= n;
+	}
+}
+
+static void
+__ni_testbus_output_stream_tail_append(struct __ni_testbus_output_stream *stream, const unsigned char *data, size_t count)
+{
+	ni_buffer_t *bp;
+
+	if (count == 0)
+		return;
+
+	bp = ni_buffer_new(count);
+	ni_buffer_put(bp, data, count);
+	__ni_testbus_output_stream_append(stream, bp);
+}
+
+/*
+ * The process has exited; queue what we have in the ring buffer for
+ * upload to the master, oldest data first. Returns the number of bytes
+ * that were dropped.
+ */
+static uint64_t
+__ni_testbus_output_stream_tail_flush(struct __ni_testbus_output_stream *stream)
+{
+	uint64_t total = stream->tail_total;
+	size_t size = stream->tail_size, pos;
+
+	if (stream->tail == NULL)
+		return 0;
+
+	if (total <= size) {
+		__ni_testbus_output_stream_tail_append(stream, stream->tail, total);
+	} else {
+		pos = total % size;
+		__ni_testbus_output_stream_tail_append(stream, stream->tail + pos, size - pos);
+		__ni_testbus_output_stream_tail_append(stream, stream->tail, pos);
+	}
+
+	free(stream->tail);
+	stream->tail = NULL;
+	return total > size? total - size : 0;
+}
+
+static inline ni_bool_t
+__ni_testbus_output_stream_idle(const struct __ni_testbus_output_stream *stream)
+{
+	return stream->in_flight == 0 && stream->buffers == NULL
+	    && __ni_testbus_output_stream_spooled(stream) == 0;
+}
+
+/*
+ * Once the process has exited and all of its output has made it to
+ * the master, report the exit status.
+ */
+static void
+__ni_testbus_process_finish(struct __ni_testbus_process_context *ctx)
+{
+	if (!__ni_testbus_output_stream_idle(&ctx->stdout)
+	 || !__ni_testbus_output_stream_idle(&ctx->stderr))
+		return;
+
+	if (!ctx->deleted_on_master)
+		__ni_testbus_process_notify(ctx->object_path, &ctx->exit_info);
+
+	__ni_testbus_process_context_free(ctx);
 }
 
 static void
 __ni_testbus_process_exit_notify(ni_process_t *pi)
 {
 	struct __ni_testbus_process_context *ctx = pi->user_data;
-	ni_process_exit_info_t exit_info;
 
 	ni_debug_testbus("process %s exited", ctx->object_path);
-	ni_process_get_exit_info(pi, &exit_info);
+	ni_process_get_exit_info(pi, &ctx->exit_info);
+	ctx->exit_info.queue.wait_usec = ctx->queue_wait_usec;
+	ctx->exit_info.queue.depth = ctx->queue_depth;
+	ctx->exit_info.stdout_discarded = __ni_testbus_output_stream_tail_flush(&ctx->stdout);
+	ctx->exit_info.stderr_discarded = __ni_testbus_output_stream_tail_flush(&ctx->stderr);
 
 	/* Now poll all event monitors to see whether there are
 	 * new events. Then, push all pending events to the server */
 	ni_testbus_agent_monitors_poll();
 	ni_testbus_agent_eventlog_flush();
 
-	if (!ctx->deleted_on_master)
-		__ni_testbus_process_notify(ctx->object_path, &exit_info, ctx);
+	/* All output has been read from the pipes at this point;
+	 * we don't need the process anymore. */
+	ctx->stdout.pbf = NULL;
+	ctx->stderr.pbf = NULL;
+	ctx->process = NULL;
+	ctx->exited = TRUE;
 
-	__ni_testbus_process_context_free(ctx);
 	pi->user_data = NULL;
-
 	ni_process_free(pi);
+
+	__ni_testbus_output_stream_kick(&ctx->stdout);
+	__ni_testbus_output_stream_kick(&ctx->stderr);
+	__ni_testbus_process_finish(ctx);
+
+	/* This frees up a slot for the next command */
+	ni_testbus_runqueue.running--;
+	__ni_testbus_runqueue_kick();
+}
+
+/*
+ * We ask the process code to hand us output as soon as it arrives, which
+ * means we may see lots of small buffers. Copy those into the last buffer
+ * of the chain if it has room, rather than queueing a mostly empty 4K
+ * buffer for each line of output.
+ *
+ * Once we're spooling to disk, all output goes there until the spool file
+ * has drained, so that it stays in order.
+ */
+static void
+__ni_testbus_output_stream_append(struct __ni_testbus_output_stream *stream, ni_buffer_t *bp)
+{
+	unsigned int count = ni_buffer_count(bp);
+	ni_buffer_chain_t *tail;
+
+	if (__ni_testbus_output_stream_spooled(stream)
+	 || ni_buffer_chain_count(stream->buffers) + count > ni_testbus_spool_threshold()) {
+		if (__ni_testbus_output_stream_spool(stream, ni_buffer_head(bp), count)) {
+			ni_buffer_free(bp);
+			return;
+		}
+
+		/* We cannot put this in memory without messing up the order */
+		if (__ni_testbus_output_stream_spooled(stream)) {
+			stream->failed = TRUE;
+			ni_buffer_free(bp);
+			return;
+		}
+	}
+
+	for (tail = stream->buffers; tail && tail->next; tail = tail->next)
+		;
+
+	if (tail && ni_buffer_tailroom(tail->data) >= ni_buffer_count(bp)) {
+		ni_buffer_put(tail->data, ni_buffer_head(bp), ni_buffer_count(bp));
+		ni_buffer_free(bp);
+	} else {
+		ni_buffer_chain_append(&stream->buffers, bp);
+	}
 }
 
 static void
 __ni_testbus_process_read_notify(ni_process_t *pi, ni_process_buffer_t *pbf)
 {
 	struct __ni_testbus_process_context *ctx = pi->user_data;
-	ni_buffer_chain_t **chain = NULL;
+	struct __ni_testbus_output_stream *stream = NULL;
 
 	if (pbf == &pi->stdout)
-		chain = &ctx->stdout.buffers;
+		stream = &ctx->stdout;
 	else
 	if (pbf == &pi->stderr)
-		chain = &ctx->stderr.buffers;
-
-	if (chain != NULL) {
-		ni_buffer_chain_append(chain, pbf->wbuf);
+		stream = &ctx->stderr;
+
+	if (stream != NULL && stream->tail_size) {
+		/* The process code discards the buffer for us */
+		__ni_testbus_output_stream_tail_put(stream, ni_buffer_head(pbf->wbuf), ni_buffer_count(pbf->wbuf));
+	} else
+	if (stream != NULL && ni_buffer_count(pbf->wbuf) != 0) {
+		__ni_testbus_output_stream_append(stream, pbf->wbuf);
 		pbf->wbuf = NULL;
-	}
 
-	/* Future extension: signal the master that we have data.
-	 * This would allow continuous streaming of the process output,
-	 * rather than transferring everything in bulk on process exit. */
+		__ni_testbus_output_stream_kick(stream);
+	}
 }
 
-static ni_bool_t
+static struct __ni_testbus_process_context *
 __ni_testbus_process_run(ni_process_t *pi, const char *master_object_path, ni_testbus_file_array_t *files)
 {
 	struct __ni_testbus_process_context *ctx;
@@ -231,12 +674,18 @@ __ni_testbus_process_run(ni_process_t *pi, const char *master_object_path, ni_te
 		if (!ni_testbus_agent_process_attach_files(pi, files)
 		 || !ni_testbus_agent_process_export_files(pi, files)) {
 			ni_error("process %u: failed to attach files", pi->pid);
-			return FALSE;
+			return NULL;
 		}
 	}
 
+	if (ni_config_process_cgroup())
+		ni_process_set_cgroup(pi, ni_config_process_cgroup());
+
 	if (ni_process_run(pi) < 0)
-		return FALSE;
+		return NULL;
+
+	/* The command is likely to generate events; stop backing off */
+	ni_testbus_agent_monitors_kick();
 
 	ctx = __ni_testbus_process_context_new(master_object_path, pi);
 
@@ -245,26 +694,212 @@ __ni_testbus_process_run(ni_process_t *pi, const char *master_object_path, ni_te
 	if ((f = ni_testbus_file_array_find_by_name(files, "stderr")) != NULL)
 		ctx->stderr.file = ni_testbus_file_get(f);
 
+	/* Stream output to the master as soon as we see it */
+	pi->stdout.low_water_mark = 1;
+	pi->stderr.low_water_mark = 1;
+
 	pi->exit_callback = __ni_testbus_process_exit_notify;
 	pi->read_callback = __ni_testbus_process_read_notify;
 	pi->user_data = ctx;
 
-	return TRUE;
+	return ctx;
+}
+
+static unsigned int
+__ni_testbus_runqueue_slots(void)
+{
+	long ncpus;
+
+	if (ni_testbus_runqueue.slots)
+		return ni_testbus_runqueue.slots;
+
+	if ((ni_testbus_runqueue.slots = ni_config_run_queue_slots()) == 0) {
+		if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpus = 1;
+		ni_testbus_runqueue.slots = NI_TESTBUS_RUNQUEUE_SLOTS_PER_CPU * ncpus;
+		if (ni_testbus_runqueue.slots < NI_TESTBUS_RUNQUEUE_MIN_SLOTS)
+			ni_testbus_runqueue.slots = NI_TESTBUS_RUNQUEUE_MIN_SLOTS;
+	}
+
+	ni_debug_testbus("running up to %u commands concurrently", ni_testbus_runqueue.slots);
+	return ni_testbus_runqueue.slots;
+}
+
+static void
+__ni_testbus_queued_command_free(struct __ni_testbus_queued_command *qc)
+{
+	if (qc->fetch)
+		ni_testbus_agent_fetch_cancel(qc->fetch);
+	if (qc->files)
+		ni_testbus_file_array_free(qc->files);
+	if (qc->process)
+		ni_process_free(qc->process);
+	ni_string_free(&qc->object_path);
+	free(qc);
+}
+
+static void
+__ni_testbus_runqueue_unlink_starting(struct __ni_testbus_queued_command *qc)
+{
+	struct __ni_testbus_queued_command **pos;
+
+	for (pos = &ni_testbus_runqueue.starting; *pos; pos = &(*pos)->next) {
+		if (*pos == qc) {
+			*pos = qc->next;
+			qc->next = NULL;
+			break;
+		}
+	}
 }
 
-ni_bool_t
-ni_testbus_agent_run_command(ni_process_t *pi, const char *master_object_path, ni_testbus_file_array_t *files)
+/*
+ * All input files of the command have arrived, or failed to
+ */
+static void
+__ni_testbus_runqueue_files_ready(ni_bool_t ok, void *user_data)
 {
-	if (!__ni_testbus_process_run(pi, master_object_path, files)) {
+	struct __ni_testbus_queued_command *qc = user_data;
+	struct __ni_testbus_process_context *ctx = NULL;
+	struct timeval now, delta;
+	uint64_t wait_usec;
+
+	qc->fetch = NULL;
+	__ni_testbus_runqueue_unlink_starting(qc);
+
+	ni_timer_get_time(&now);
+	timersub(&now, &qc->queued, &delta);
+	wait_usec = delta.tv_sec * 1000000ULL + delta.tv_usec;
+
+	if (!ok || !(ctx = __ni_testbus_process_run(qc->process, qc->object_path, qc->files))) {
 		ni_process_exit_info_t exit_info = { .how = NI_PROCESS_NONSTARTER };
 
-		__ni_testbus_process_notify(master_object_path, &exit_info, NULL);
-		ni_testbus_file_array_free(files);
-		ni_process_free(pi);
-		return FALSE;
+		if (!ok)
+			ni_error("%s: failed to fetch input files", qc->object_path);
+
+		exit_info.queue.wait_usec = wait_usec;
+		exit_info.queue.depth = qc->depth;
+		__ni_testbus_process_notify(qc->object_path, &exit_info);
+		__ni_testbus_queued_command_free(qc);
+
+		ni_testbus_runqueue.running--;
+		__ni_testbus_runqueue_kick();
+		return;
 	}
 
-	return TRUE;
+	ni_debug_testbus("%s: started after %llu.%03llus in run queue", qc->object_path,
+			(unsigned long long) wait_usec / 1000000,
+			(unsigned long long) (wait_usec / 1000) % 1000);
+
+	ctx->queue_wait_usec = wait_usec;
+	ctx->queue_depth = qc->depth;
+	ctx->stdout.tail_size = qc->output_tail;
+	ctx->stderr.tail_size = qc->output_tail;
+
+	/* The process and the files are owned by the process context now */
+	qc->process = NULL;
+	qc->files = NULL;
+	__ni_testbus_queued_command_free(qc);
+}
+
+/*
+ * Take a slot, and wait for the command's input files
+ */
+static void
+__ni_testbus_runqueue_start(struct __ni_testbus_queued_command *qc)
+{
+	ni_testbus_runqueue.running++;
+
+	qc->next = ni_testbus_runqueue.starting;
+	ni_testbus_runqueue.starting = qc;
+
+	qc->fetch = ni_testbus_agent_fetch_files(qc->files, __ni_testbus_runqueue_files_ready, qc);
+}
+
+static void
+__ni_testbus_runqueue_kick(void)
+{
+	struct __ni_testbus_queued_command *qc;
+
+	while (ni_testbus_runqueue.running < __ni_testbus_runqueue_slots()
+	    && (qc = ni_testbus_runqueue.head) != NULL) {
+		ni_testbus_runqueue.head = qc->next;
+		ni_testbus_runqueue.count--;
+		qc->next = NULL;
+
+		__ni_testbus_runqueue_start(qc);
+	}
+}
+
+void
+ni_testbus_agent_run_command(ni_process_t *pi, const char *master_object_path, ni_testbus_file_array_t *files, int priority,
+				unsigned int output_tail)
+{
+	struct __ni_testbus_queued_command *qc, *other, **pos;
+
+	qc = ni_calloc(1, sizeof(*qc));
+	qc->process = pi;
+	qc->object_path = ni_strdup(master_object_path);
+	qc->files = files;
+	qc->priority = priority;
+	qc->output_tail = output_tail;
+	ni_timer_get_time(&qc->queued);
+
+	/* Commands waiting for their files already hold a slot, so they
+	 * will run before this one no matter what */
+	for (other = ni_testbus_runqueue.starting; other; other = other->next)
+		qc->depth++;
+
+	/* Insert behind all commands of the same or higher priority */
+	for (pos = &ni_testbus_runqueue.head; *pos; pos = &(*pos)->next) {
+		if ((*pos)->priority < priority)
+			break;
+		qc->depth++;
+	}
+	qc->next = *pos;
+	*pos = qc;
+	ni_testbus_runqueue.count++;
+
+	if (ni_testbus_runqueue.running >= __ni_testbus_runqueue_slots())
+		ni_debug_testbus("%s: all %u slots busy, queued behind %u other commands",
+				master_object_path, ni_testbus_runqueue.slots, qc->depth);
+
+	/* Get the downloads going while the command waits for a slot */
+	ni_testbus_agent_fetch_files(files, NULL, NULL);
+
+	__ni_testbus_runqueue_kick();
+}
+
+/*
+ * The master deleted a command before we got around to running it
+ */
+static ni_bool_t
+__ni_testbus_runqueue_discard(const char *object_path)
+{
+	struct __ni_testbus_queued_command *qc, **pos;
+
+	for (pos = &ni_testbus_runqueue.head; (qc = *pos) != NULL; pos = &qc->next) {
+		if (ni_string_eq(qc->object_path, object_path)) {
+			ni_debug_testbus("Process %s was deleted, removing it from run queue", object_path);
+			*pos = qc->next;
+			ni_testbus_runqueue.count--;
+			__ni_testbus_queued_command_free(qc);
+			return TRUE;
+		}
+	}
+
+	for (qc = ni_testbus_runqueue.starting; qc; qc = qc->next) {
+		if (ni_string_eq(qc->object_path, object_path)) {
+			ni_debug_testbus("Process %s was deleted while waiting for its files", object_path);
+			__ni_testbus_runqueue_unlink_starting(qc);
+			__ni_testbus_queued_command_free(qc);
+
+			ni_testbus_runqueue.running--;
+			__ni_testbus_runqueue_kick();
+			return TRUE;
+		}
+	}
+
+	return FALSE;
 }
 
 void
@@ -272,6 +907,9 @@ ni_testbus_agent_discard_process(const char *object_path)
 {
 	struct __ni_testbus_process_context *ctx;
 
+	if (__ni_testbus_runqueue_discard(object_path))
+		return;
+
 	/* look up the process by the object path; if it's still running,
 	 * kill it */
 	if (!(ctx = __ni_testbus_process_context_by_path(object_path)))
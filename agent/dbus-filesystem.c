@@ -8,7 +8,11 @@
 #include <dborb/dbus-service.h>
 #include <dborb/logging.h>
 #include <dborb/buffer.h>
+#include <dborb/codec.h>
+#include <dborb/workqueue.h>
+#include <dborb/socket.h>
 #include <testbus/model.h>
+#include <testbus/file.h>
 
 #include "dbus-filesystem.h"
 
@@ -18,170 +22,946 @@ ni_testbus_create_static_objects_filesystem(ni_dbus_server_t *server)
 	ni_objectmodel_create_object(server, NI_TESTBUS_AGENT_FS_PATH, ni_testbus_filesystem_class(), NULL);
 }
 
+/*
+ * All file system access happens in the worker pool, so that a slow disk
+ * or a big file does not stall the agent's main loop.
+ * The work handlers parse the arguments on the main thread and stash
+ * everything the worker needs in a ni_testbus_fsio_t. The worker only
+ * does the system calls, and records errno plus a short description of
+ * what failed. The completion handlers build the reply.
+ */
+typedef struct ni_testbus_fs_session ni_testbus_fs_session_t;
+
+typedef struct ni_testbus_fsio {
+	char *			path;
+	ni_testbus_fs_session_t *session;	/* read, readEncoded */
+	uint64_t		offset;
+	uint32_t		count;
+
+	struct stat		stb;		/* getInfo */
+	ni_buffer_t *		data;		/* download, uploadEncoded */
+	ni_dbus_variant_t	wdata;		/* upload */
+	ni_codec_t *		codec;		/* downloadEncoded */
+	unsigned int		written;
+	int			fd;		/* downloadFd */
+	uint64_t		copied;		/* uploadFd */
+
+	int			error;
+	const char *		failed;
+} ni_testbus_fsio_t;
+
+static ni_work_t *
+ni_testbus_fsio_new(const char *path, ni_work_func_t *run)
+{
+	ni_testbus_fsio_t *io;
+
+	io = ni_calloc(1, sizeof(*io));
+	ni_string_dup(&io->path, path);
+	ni_dbus_variant_init(&io->wdata);
+	io->fd = -1;
+
+	return ni_work_new(run, NULL, io);
+}
+
+static void		ni_testbus_fs_session_put(ni_testbus_fs_session_t *);
+
+static void
+ni_testbus_fsio_free(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	if (io->session)
+		ni_testbus_fs_session_put(io->session);
+	ni_string_free(&io->path);
+	if (io->data)
+		ni_buffer_free(io->data);
+	ni_dbus_variant_destroy(&io->wdata);
+	if (io->fd >= 0)
+		close(io->fd);
+	free(io);
+	ni_work_free(work);
+}
+
+static void
+__ni_testbus_fsio_fail(ni_testbus_fsio_t *io, const char *what)
+{
+	io->error = errno;
+	io->failed = what;
+}
+
+static dbus_bool_t
+__ni_testbus_fsio_set_error(const ni_testbus_fsio_t *io, DBusError *error)
+{
+	ni_dbus_set_error_from_errno(error, io->error, "%s \"%s\"", io->failed, io->path);
+	return FALSE;
+}
+
 /*
  * Filesystem.getInfo(path)
  *
  */
+static void
+__ni_testbus_fsio_stat(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	if (stat(io->path, &io->stb) < 0)
+		__ni_testbus_fsio_fail(io, "unable to stat file");
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_getInfo_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	const char *path;
+
+	if (argc != 1 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/') {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	return ni_testbus_fsio_new(path, __ni_testbus_fsio_stat);
+}
+
 static dbus_bool_t
-__ni_Testbus_Agent_Filesystem_getInfo(ni_dbus_object_t *object, const ni_dbus_method_t *method,
-		unsigned int argc, const ni_dbus_variant_t *argv,
+__ni_Testbus_Agent_Filesystem_getInfo_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
 		ni_dbus_message_t *reply, DBusError *error)
 {
+	ni_testbus_fsio_t *io = work->user_data;
 	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
-	struct stat stb;
-	const char *path;
-	dbus_bool_t rv;
+	dbus_bool_t rv = FALSE;
 
-	if (argc != 1 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/')
-		return ni_dbus_error_invalid_args(error, object->path, method->name);
-
-	if (stat(path, &stb) < 0) {
-		ni_dbus_set_error_from_errno(error, errno, "unable to stat file \"%s\"", path);
-		return FALSE;
+	if (io->error) {
+		__ni_testbus_fsio_set_error(io, error);
+		goto out;
 	}
-	if (!S_ISREG(stb.st_mode)) {
+	if (!S_ISREG(io->stb.st_mode)) {
 		dbus_set_error(error, DBUS_ERROR_FAILED, "not a regular file");
-		return FALSE;
+		goto out;
 	}
 
 	ni_dbus_variant_init_dict(&res);
-	ni_dbus_dict_add_uint64(&res, "size", stb.st_size);
+	ni_dbus_dict_add_uint64(&res, "size", io->stb.st_size);
 
 	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
 	ni_dbus_variant_destroy(&res);
+
+out:
+	ni_testbus_fsio_free(work);
 	return rv;
 }
 
-__NI_TESTBUS_METHOD_BINDING(Agent_Filesystem, getInfo, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, getInfo, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
 
 /*
  * Filesystem.download(path, offset, count)
  *
  */
+static void
+__ni_testbus_fsio_pread(ni_testbus_fsio_t *io, int fd)
+{
+	ni_buffer_t *bp = io->data;
+
+	while (ni_buffer_tailroom(bp)) {
+		ssize_t n;
+
+		n = pread(fd, ni_buffer_tail(bp), ni_buffer_tailroom(bp), io->offset + ni_buffer_count(bp));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			__ni_testbus_fsio_fail(io, "error reading from");
+			break;
+		}
+		if (n == 0)
+			break;
+		ni_buffer_push_tail(bp, n);
+	}
+}
+
+static void
+__ni_testbus_fsio_read(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	int fd;
+
+	if ((fd = open(io->path, O_RDONLY)) < 0) {
+		__ni_testbus_fsio_fail(io, "unable to open file");
+		return;
+	}
+
+	__ni_testbus_fsio_pread(io, fd);
+	close(fd);
+}
+
+static ni_work_t *
+__ni_testbus_fsio_download_new(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		ni_dbus_variant_t *argv, DBusError *error)
+{
+	ni_testbus_fsio_t *io;
+	ni_work_t *work;
+	const char *path;
+	uint64_t offset;
+	uint32_t count;
+
+	if (!ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/'
+	 || !ni_dbus_variant_get_uint64(&argv[1], &offset)
+	 || !ni_dbus_variant_get_uint32(&argv[2], &count)
+	 || count > 1024 * 1024
+	 || offset + count < offset) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	work = ni_testbus_fsio_new(path, __ni_testbus_fsio_read);
+	io = work->user_data;
+	io->offset = offset;
+	io->count = count;
+
+	/* Allocate the buffer here; the buffer pool is not thread safe */
+	io->data = ni_buffer_new(count);
+	return work;
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_download_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	if (argc != 3) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	return __ni_testbus_fsio_download_new(object, method, argv, error);
+}
+
 static dbus_bool_t
-__ni_Testbus_Agent_Filesystem_download(ni_dbus_object_t *object, const ni_dbus_method_t *method,
-		unsigned int argc, const ni_dbus_variant_t *argv,
+__ni_Testbus_Agent_Filesystem_download_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
 		ni_dbus_message_t *reply, DBusError *error)
 {
+	ni_testbus_fsio_t *io = work->user_data;
 	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	dbus_bool_t rv = FALSE;
+
+	if (io->error) {
+		__ni_testbus_fsio_set_error(io, error);
+	} else {
+		ni_dbus_variant_set_byte_array(&res, ni_buffer_head(io->data), ni_buffer_count(io->data));
+		rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+		ni_dbus_variant_destroy(&res);
+	}
+
+	ni_testbus_fsio_free(work);
+	return rv;
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, download, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+/*
+ * Filesystem.upload(path, offset, data)
+ */
+static void
+__ni_testbus_fsio_write(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	const unsigned char *data = io->wdata.byte_array_value;
+	unsigned int len = io->wdata.array.len;
+	int fd;
+
+	/* uploadEncoded passes the decoded data in a buffer */
+	if (io->data) {
+		data = ni_buffer_head(io->data);
+		len = ni_buffer_count(io->data);
+	}
+
+	if (io->offset == 0)
+		fd = open(io->path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	else
+		fd = open(io->path, O_WRONLY);
+	if (fd < 0) {
+		__ni_testbus_fsio_fail(io, "unable to open file");
+		return;
+	}
+
+	while (io->written < len) {
+		ssize_t n;
+
+		n = pwrite(fd, data + io->written, len - io->written, io->offset + io->written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			__ni_testbus_fsio_fail(io, "error writing to");
+			break;
+		}
+		io->written += n;
+	}
+
+	close(fd);
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_upload_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_testbus_fsio_t *io;
+	ni_work_t *work;
 	const char *path;
 	uint64_t offset;
-	uint32_t count;
-	dbus_bool_t rv;
-	ni_buffer_t *bp = NULL;
-	int fd = -1;
 
 	if (argc != 3
 	 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/'
 	 || !ni_dbus_variant_get_uint64(&argv[1], &offset)
-	 || !ni_dbus_variant_get_uint32(&argv[2], &count)
-	 || count > 1024 * 1024
-	 || offset + count < offset)
-		return ni_dbus_error_invalid_args(error, object->path, method->name);
+	 || !ni_dbus_variant_is_byte_array(&argv[2])) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	work = ni_testbus_fsio_new(path, __ni_testbus_fsio_write);
+	io = work->user_data;
+	io->offset = offset;
+
+	/* Steal the data rather than copying it */
+	io->wdata = argv[2];
+	ni_dbus_variant_init(&argv[2]);
+	return work;
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_upload_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	dbus_bool_t rv = TRUE;
+
+	if (io->error) {
+		rv = __ni_testbus_fsio_set_error(io, error);
+	} else {
+		ni_debug_testbus("%s: wrote %u bytes at offset %Lu",
+				io->path, io->written, (unsigned long long) io->offset);
+	}
+
+	ni_testbus_fsio_free(work);
+	return rv;
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, upload, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
 
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		ni_dbus_set_error_from_errno(error, errno, "unable to open file \"%s\"", path);
+/*
+ * Filesystem.downloadEncoded(path, offset, count, encoding)
+ * Same as download, but compress the data using the codec the caller
+ * asked for, if that is worth it. The compression happens on the main
+ * thread, as the codec statistics are not protected by any lock.
+ */
+static ni_bool_t
+__ni_testbus_fsio_get_codec(const char *encoding, ni_codec_t **codec_p, DBusError *error)
+{
+	*codec_p = NULL;
+	if (strcmp(encoding, NI_CODEC_IDENTITY) && !(*codec_p = ni_codec_by_name(encoding))) {
+		dbus_set_error(error, DBUS_ERROR_NOT_SUPPORTED, "unsupported encoding \"%s\"", encoding);
 		return FALSE;
 	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		ni_dbus_set_error_from_errno(error, errno, "seek faile");
-		goto out_fail;
+	return TRUE;
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_downloadEncoded_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_codec_t *codec = NULL;
+	const char *encoding;
+	ni_work_t *work;
+
+	if (argc != 4 || !ni_dbus_variant_get_string(&argv[3], &encoding)) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	if (!__ni_testbus_fsio_get_codec(encoding, &codec, error))
+		return NULL;
+
+	if ((work = __ni_testbus_fsio_download_new(object, method, argv, error)) != NULL)
+		((ni_testbus_fsio_t *) work->user_data)->codec = codec;
+	return work;
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_downloadEncoded_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	dbus_bool_t rv = FALSE;
+
+	if (io->error) {
+		__ni_testbus_fsio_set_error(io, error);
+	} else {
+		ni_codec_encode_dict(io->codec, ni_buffer_head(io->data), ni_buffer_count(io->data), &res);
+		rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+		ni_dbus_variant_destroy(&res);
+	}
+
+	ni_testbus_fsio_free(work);
+	return rv;
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, downloadEncoded, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+/*
+ * Filesystem.uploadEncoded(path, offset, encoding, size, data)
+ * Same as upload, but the data may have been compressed. We decode it
+ * before handing it to the worker, see above.
+ */
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_uploadEncoded_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_testbus_fsio_t *io;
+	ni_work_t *work;
+	const char *path, *encoding;
+	ni_buffer_t *data;
+	uint64_t offset;
+	uint32_t size;
+
+	if (argc != 5
+	 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/'
+	 || !ni_dbus_variant_get_uint64(&argv[1], &offset)
+	 || !ni_dbus_variant_get_string(&argv[2], &encoding)
+	 || !ni_dbus_variant_get_uint32(&argv[3], &size)) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	if ((data = ni_codec_decode_data(encoding, size, &argv[4], error)) == NULL)
+		return NULL;
+
+	work = ni_testbus_fsio_new(path, __ni_testbus_fsio_write);
+	io = work->user_data;
+	io->offset = offset;
+	io->data = data;
+	return work;
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_uploadEncoded_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	return __ni_Testbus_Agent_Filesystem_upload_WorkCompletion(method, work, reply, error);
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, uploadEncoded, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+/*
+ * Filesystem.downloadFd(path)
+ * Rather than copying the data, just hand the caller an open file
+ * descriptor. This only works on connections that support fd passing.
+ */
+static void
+__ni_testbus_fsio_open(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	if ((io->fd = open(io->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		__ni_testbus_fsio_fail(io, "unable to open file");
+		return;
+	}
+
+	if (fstat(io->fd, &io->stb) < 0)
+		__ni_testbus_fsio_fail(io, "unable to stat file");
+
+	/* The caller will read all of it, front to back. This also applies
+	 * to the copy of the descriptor passed to the client. */
+	(void) posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_downloadFd_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	const char *path;
+
+	if (argc != 1 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/') {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
 	}
 
-	bp = ni_buffer_new(count);
-	while (count) {
-		int n;
+	return ni_testbus_fsio_new(path, __ni_testbus_fsio_open);
+}
 
-		n = read(fd, ni_buffer_tail(bp), ni_buffer_tailroom(bp));
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_downloadFd_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	dbus_bool_t rv = FALSE;
+
+	if (io->error) {
+		__ni_testbus_fsio_set_error(io, error);
+		goto out;
+	}
+	if (!S_ISREG(io->stb.st_mode)) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "not a regular file");
+		goto out;
+	}
+
+	ni_dbus_variant_set_unix_fd(&res, io->fd);
+	io->fd = -1;
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+
+out:
+	ni_testbus_fsio_free(work);
+	return rv;
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, downloadFd, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+/*
+ * Filesystem.uploadFd(path, fd)
+ * Copy everything we can read from the descriptor to the given file.
+ * The descriptor must be a sealed memfd, so that the copy is bounded by
+ * its size; a pipe that is never closed would tie up a worker forever.
+ */
+static void
+__ni_testbus_fsio_copy(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	unsigned char buffer[65536];
+	int ifd = io->wdata.unix_fd_value;
+	int ofd;
+
+	if ((ofd = open(io->path, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644)) < 0) {
+		__ni_testbus_fsio_fail(io, "unable to open file");
+		return;
+	}
+
+	while (TRUE) {
+		ssize_t n, written;
+
+		n = read(ifd, buffer, sizeof(buffer));
 		if (n < 0) {
-			ni_dbus_set_error_from_errno(error, errno, "read failed");
-			goto out_fail;
+			if (errno == EINTR)
+				continue;
+			__ni_testbus_fsio_fail(io, "error reading data for");
+			break;
 		}
 		if (n == 0)
 			break;
-		ni_buffer_push_tail(bp, n);
+
+		if (io->copied + n > io->count) {
+			errno = EFBIG;
+			__ni_testbus_fsio_fail(io, "refusing to write");
+			break;
+		}
+
+		for (written = 0; written < n; ) {
+			ssize_t k;
+
+			k = write(ofd, buffer + written, n - written);
+			if (k < 0) {
+				if (errno == EINTR)
+					continue;
+				__ni_testbus_fsio_fail(io, "error writing to");
+				goto out;
+			}
+			written += k;
+		}
+		io->copied += n;
 	}
 
-	ni_dbus_variant_init_dict(&res);
-	ni_dbus_variant_set_byte_array(&res, ni_buffer_head(bp), ni_buffer_count(bp));
+out:
+	close(ofd);
+}
 
-	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_uploadFd_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_testbus_fsio_t *io;
+	ni_work_t *work;
+	const char *path;
+	struct stat stb;
+	int fd;
 
-	ni_dbus_variant_destroy(&res);
-	ni_buffer_free(bp);
-	close(fd);
-	return rv;
+	if (argc != 2
+	 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/'
+	 || !ni_dbus_variant_get_unix_fd(&argv[1], &fd)
+	 || fstat(fd, &stb) < 0) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
 
-out_fail:
-	if (fd >= 0)
-		close(fd);
-	return FALSE;
+	if (!ni_file_is_sealed(fd)) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "%s: file descriptor does not refer to a sealed memfd",
+				method->name);
+		return NULL;
+	}
+
+	if (stb.st_size > ni_testbus_file_size_max(NULL)) {
+		dbus_set_error(error, DBUS_ERROR_LIMITS_EXCEEDED, "%s: file size exceeds limit of %u bytes",
+				method->name, ni_testbus_file_size_max(NULL));
+		return NULL;
+	}
+
+	work = ni_testbus_fsio_new(path, __ni_testbus_fsio_copy);
+	io = work->user_data;
+	io->count = stb.st_size;
+
+	/* Steal the descriptor */
+	io->wdata = argv[1];
+	ni_dbus_variant_init(&argv[1]);
+	return work;
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_uploadFd_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+	dbus_bool_t rv = TRUE;
+
+	if (io->error) {
+		rv = __ni_testbus_fsio_set_error(io, error);
+	} else {
+		ni_debug_testbus("%s: wrote %llu bytes", io->path, (unsigned long long) io->copied);
+	}
+
+	ni_testbus_fsio_free(work);
+	return rv;
 }
 
-__NI_TESTBUS_METHOD_BINDING(Agent_Filesystem, download, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, uploadFd, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
 
 /*
- * Tmpfile.upload(path, offset, data)
+ * Filesystem.open(path), read(handle, offset, count), close(handle)
+ *
+ * download() opens the file again for every chunk, which adds up when
+ * collecting a big core dump. Instead, the caller can open the file once,
+ * and read it through the descriptor we keep open in the meantime.
+ * If the caller goes away without closing the file, the session is
+ * closed once it has been idle for NI_TESTBUS_FS_SESSION_TIMEOUT msec.
+ *
+ * Reads in progress hold a reference to the session, so that the
+ * descriptor does not get closed underneath the worker thread. Sessions
+ * are only ever touched on the main thread.
+ *
+ * A session belongs to the client that opened it; read and close calls
+ * from anyone else are rejected. We learn the caller's bus name from the
+ * destination of the reply, so reads are checked when they complete.
+ * Opens that are still being processed count against the limit, too.
  */
+#define NI_TESTBUS_FS_SESSION_TIMEOUT	(60 * 1000)
+#define NI_TESTBUS_FS_SESSION_MAX	64
+
+struct ni_testbus_fs_session {
+	ni_testbus_fs_session_t *next;
+	unsigned int		refcount;
+
+	uint32_t		id;
+	char *			owner;
+	char *			path;
+	int			fd;
+	const ni_timer_t *	timer;
+};
+
+static ni_testbus_fs_session_t *ni_testbus_fs_sessions;
+static unsigned int		ni_testbus_fs_session_count;
+static unsigned int		ni_testbus_fs_session_pending;
+static uint32_t			ni_testbus_fs_session_next_id = 1;
+
+static void			__ni_testbus_fs_session_timeout(void *, const ni_timer_t *);
+
+static ni_testbus_fs_session_t *
+ni_testbus_fs_session_new(const char *path, int fd, const char *owner)
+{
+	ni_testbus_fs_session_t *s;
+
+	s = ni_calloc(1, sizeof(*s));
+	s->refcount = 1;
+	s->id = ni_testbus_fs_session_next_id++;
+	ni_string_dup(&s->owner, owner);
+	ni_string_dup(&s->path, path);
+	s->fd = fd;
+	s->timer = ni_timer_register(NI_TESTBUS_FS_SESSION_TIMEOUT, __ni_testbus_fs_session_timeout, s);
+
+	s->next = ni_testbus_fs_sessions;
+	ni_testbus_fs_sessions = s;
+	ni_testbus_fs_session_count++;
+	return s;
+}
+
+static ni_testbus_fs_session_t *
+ni_testbus_fs_session_get(uint32_t id)
+{
+	ni_testbus_fs_session_t *s;
+
+	for (s = ni_testbus_fs_sessions; s; s = s->next) {
+		if (s->id == id) {
+			s->refcount++;
+			if (s->timer)
+				s->timer = ni_timer_rearm(s->timer, NI_TESTBUS_FS_SESSION_TIMEOUT);
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static void
+ni_testbus_fs_session_put(ni_testbus_fs_session_t *s)
+{
+	ni_assert(s->refcount);
+	if (--(s->refcount) == 0) {
+		close(s->fd);
+		ni_string_free(&s->owner);
+		ni_string_free(&s->path);
+		free(s);
+	}
+}
+
 static dbus_bool_t
-__ni_Testbus_Agent_Filesystem_upload(ni_dbus_object_t *object, const ni_dbus_method_t *method,
-		unsigned int argc, const ni_dbus_variant_t *argv,
+ni_testbus_fs_session_check_owner(const ni_testbus_fs_session_t *s, ni_dbus_message_t *reply, DBusError *error)
+{
+	if (!ni_string_eq(s->owner, dbus_message_get_destination(reply))) {
+		dbus_set_error(error, DBUS_ERROR_ACCESS_DENIED, "file handle %u belongs to a different client", s->id);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+ni_testbus_fs_session_close(ni_testbus_fs_session_t *s)
+{
+	ni_testbus_fs_session_t **pos;
+
+	for (pos = &ni_testbus_fs_sessions; *pos; pos = &(*pos)->next) {
+		if (*pos == s) {
+			*pos = s->next;
+			ni_testbus_fs_session_count--;
+			break;
+		}
+	}
+
+	if (s->timer)
+		ni_timer_cancel(s->timer);
+	s->timer = NULL;
+	ni_testbus_fs_session_put(s);
+}
+
+static void
+__ni_testbus_fs_session_timeout(void *user_data, const ni_timer_t *timer)
+{
+	ni_testbus_fs_session_t *s = user_data;
+
+	if (s->timer != timer)
+		return;
+	s->timer = NULL;
+
+	ni_debug_testbus("%s: closing idle file handle %u", s->path, s->id);
+	ni_testbus_fs_session_close(s);
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_open_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_work_t *work;
+
+	if (ni_testbus_fs_session_count + ni_testbus_fs_session_pending >= NI_TESTBUS_FS_SESSION_MAX) {
+		dbus_set_error(error, DBUS_ERROR_LIMITS_EXCEEDED, "too many open files");
+		return NULL;
+	}
+
+	work = __ni_Testbus_Agent_Filesystem_downloadFd_WorkCall(object, method, argc, argv, error);
+	if (work != NULL)
+		ni_testbus_fs_session_pending++;
+	return work;
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_open_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
 		ni_dbus_message_t *reply, DBusError *error)
 {
-	ni_buffer_t wbuf;
-	const char *path;
+	ni_testbus_fsio_t *io = work->user_data;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_testbus_fs_session_t *s;
+	dbus_bool_t rv = FALSE;
+
+	ni_assert(ni_testbus_fs_session_pending);
+	ni_testbus_fs_session_pending--;
+
+	if (io->error) {
+		__ni_testbus_fsio_set_error(io, error);
+		goto out;
+	}
+	if (!S_ISREG(io->stb.st_mode)) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "not a regular file");
+		goto out;
+	}
+
+	s = ni_testbus_fs_session_new(io->path, io->fd, dbus_message_get_destination(reply));
+	io->fd = -1;
+
+	ni_debug_testbus("%s: opened as file handle %u", s->path, s->id);
+
+	ni_dbus_variant_init_dict(&res);
+	ni_dbus_dict_add_uint32(&res, "handle", s->id);
+	ni_dbus_dict_add_uint64(&res, "size", io->stb.st_size);
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+
+out:
+	ni_testbus_fsio_free(work);
+	return rv;
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, open, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+static void
+__ni_testbus_fsio_session_read(ni_work_t *work)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	__ni_testbus_fsio_pread(io, io->session->fd);
+}
+
+static ni_work_t *
+__ni_testbus_fsio_read_new(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		ni_dbus_variant_t *argv, DBusError *error)
+{
+	ni_testbus_fs_session_t *s;
+	ni_testbus_fsio_t *io;
+	ni_work_t *work;
+	uint32_t handle;
 	uint64_t offset;
-	unsigned int written = 0;
-	int fd;
+	uint32_t count;
 
-	if (argc != 3
-	 || !ni_dbus_variant_get_string(&argv[0], &path) || path[0] != '/'
+	if (!ni_dbus_variant_get_uint32(&argv[0], &handle)
 	 || !ni_dbus_variant_get_uint64(&argv[1], &offset)
-	 || !ni_dbus_variant_is_byte_array(&argv[2]))
-		return ni_dbus_error_invalid_args(error, object->path, method->name);
+	 || !ni_dbus_variant_get_uint32(&argv[2], &count)
+	 || count > 1024 * 1024
+	 || offset + count < offset) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
 
-	if (offset == 0)
-		fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-	else
-		fd = open(path, O_WRONLY);
-	if (fd < 0) {
-		ni_dbus_set_error_from_errno(error, errno, "unable to open file \"%s\"", path);
+	if ((s = ni_testbus_fs_session_get(handle)) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "unknown file handle %u", handle);
+		return NULL;
+	}
+
+	work = ni_testbus_fsio_new(s->path, __ni_testbus_fsio_session_read);
+	io = work->user_data;
+	io->session = s;
+	io->offset = offset;
+	io->count = count;
+	io->data = ni_buffer_new(count);
+	return work;
+}
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_read_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	if (argc != 3) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
+	}
+
+	return __ni_testbus_fsio_read_new(object, method, argv, error);
+}
+
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_read_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	if (!ni_testbus_fs_session_check_owner(io->session, reply, error)) {
+		ni_testbus_fsio_free(work);
 		return FALSE;
 	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		ni_dbus_set_error_from_errno(error, errno, "seek faile");
-		goto out_fail;
+	return __ni_Testbus_Agent_Filesystem_download_WorkCompletion(method, work, reply, error);
+}
+
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, read, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+
+static ni_work_t *
+__ni_Testbus_Agent_Filesystem_readEncoded_WorkCall(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, ni_dbus_variant_t *argv,
+		DBusError *error)
+{
+	ni_codec_t *codec = NULL;
+	const char *encoding;
+	ni_work_t *work;
+
+	if (argc != 4 || !ni_dbus_variant_get_string(&argv[3], &encoding)) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return NULL;
 	}
 
-	ni_buffer_init_reader(&wbuf, argv[2].byte_array_value, argv[2].array.len);
-	while (ni_buffer_count(&wbuf)) {
-		int n;
+	if (!__ni_testbus_fsio_get_codec(encoding, &codec, error))
+		return NULL;
 
-		n = write(fd, ni_buffer_head(&wbuf), ni_buffer_count(&wbuf));
-		if (n < 0) {
-			ni_dbus_set_error_from_errno(error, errno,
-						"error writing to \"%s\" at offset %Lu",
-						path, (unsigned long long) offset + written);
-			goto out_fail;
-		}
+	if ((work = __ni_testbus_fsio_read_new(object, method, argv, error)) != NULL)
+		((ni_testbus_fsio_t *) work->user_data)->codec = codec;
+	return work;
+}
 
-		ni_buffer_pull_head(&wbuf, n);
-		written += n;
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_readEncoded_WorkCompletion(const ni_dbus_method_t *method, ni_work_t *work,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fsio_t *io = work->user_data;
+
+	if (!ni_testbus_fs_session_check_owner(io->session, reply, error)) {
+		ni_testbus_fsio_free(work);
+		return FALSE;
 	}
+	return __ni_Testbus_Agent_Filesystem_downloadEncoded_WorkCompletion(method, work, reply, error);
+}
 
-	close(fd);
+__NI_TESTBUS_WORK_METHOD_BINDING(Agent_Filesystem, readEncoded, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
 
-	ni_debug_testbus("%s: wrote %u bytes at offset %Lu",
-			path, written, (unsigned long long) offset);
-	return TRUE;
+static dbus_bool_t
+__ni_Testbus_Agent_Filesystem_close(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_fs_session_t *s;
+	uint32_t handle;
 
-out_fail:
-	if (fd >= 0)
-		close(fd);
-	return FALSE;
+	if (argc != 1 || !ni_dbus_variant_get_uint32(&argv[0], &handle)) {
+		ni_dbus_error_invalid_args(error, object->path, method->name);
+		return FALSE;
+	}
+
+	if ((s = ni_testbus_fs_session_get(handle)) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "unknown file handle %u", handle);
+		return FALSE;
+	}
+
+	if (!ni_testbus_fs_session_check_owner(s, reply, error)) {
+		ni_testbus_fs_session_put(s);
+		return FALSE;
+	}
+
+	ni_debug_testbus("%s: closing file handle %u", s->path, s->id);
+	ni_testbus_fs_session_close(s);
+	ni_testbus_fs_session_put(s);
+	return TRUE;
 }
 
-__NI_TESTBUS_METHOD_BINDING(Agent_Filesystem, upload, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
+__NI_TESTBUS_METHOD_BINDING(Agent_Filesystem, close, NI_TESTBUS_NAMESPACE ".Agent.Filesystem");
 
 void
 ni_testbus_bind_builtin_filesystem(void)
@@ -189,4 +969,12 @@ ni_testbus_bind_builtin_filesystem(void)
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_getInfo_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_download_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_upload_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_downloadFd_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_uploadFd_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_downloadEncoded_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_uploadEncoded_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_open_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_read_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_readEncoded_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Agent_Filesystem_close_binding);
 }
@@ -0,0 +1,239 @@
+/*
+ * On-disk cache of input files.
+ *
+ * The agent keeps the input files it downloads in memory for as long
+ * as the master's file object exists, but that does not help after the
+ * agent is restarted or the host is rebooted. So we also keep a copy
+ * below the state directory, named after the md5 digest the master
+ * reports for the file.
+ *
+ * The cache is bounded in size. When it grows too large, the files used
+ * least recently are removed. We track this through the mtime of the
+ * cache files, so there is no index that needs to be kept in sync.
+ */
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <dborb/netinfo.h>
+#include <dborb/logging.h>
+#include <dborb/buffer.h>
+#include <dborb/util.h>
+
+#include "files.h"
+
+#define NI_TESTBUS_FILE_CACHE_SIZE	(256 * 1024 * 1024)
+
+typedef struct ni_testbus_filecache_entry {
+	char			name[2 * NI_TESTBUS_MD5_LEN + 8];
+	off_t			size;
+	struct timespec		mtime;
+} ni_testbus_filecache_entry_t;
+
+static unsigned int
+__ni_testbus_filecache_size_max(void)
+{
+	unsigned int size_max;
+
+	if ((size_max = ni_config_file_cache_size()) == 0)
+		size_max = NI_TESTBUS_FILE_CACHE_SIZE;
+	return size_max;
+}
+
+static const char *
+__ni_testbus_filecache_dir(void)
+{
+	static char *path;
+
+	if (path == NULL) {
+		ni_string_printf(&path, "%s/file-cache", ni_config_statedir());
+		if (ni_mkdir_maybe(path, 0700) < 0) {
+			ni_error("cannot create file cache directory %s: %m", path);
+			ni_string_free(&path);
+			return NULL;
+		}
+	}
+	return path;
+}
+
+static const char *
+__ni_testbus_filecache_path(const unsigned char *md5, const char *suffix)
+{
+	static char pathbuf[PATH_MAX];
+	const char *dir;
+	unsigned int i, len;
+
+	if ((dir = __ni_testbus_filecache_dir()) == NULL)
+		return NULL;
+
+	len = snprintf(pathbuf, sizeof(pathbuf), "%s/", dir);
+	for (i = 0; i < NI_TESTBUS_MD5_LEN && len + 3 < sizeof(pathbuf); ++i)
+		len += snprintf(pathbuf + len, sizeof(pathbuf) - len, "%02x", md5[i]);
+	if (suffix)
+		snprintf(pathbuf + len, sizeof(pathbuf) - len, "%s", suffix);
+	return pathbuf;
+}
+
+/*
+ * Look up a file in the cache. We verify the digest, so that a damaged
+ * cache file is never handed to a command.
+ */
+ni_buffer_t *
+ni_testbus_agent_filecache_lookup(const unsigned char *md5)
+{
+	unsigned char actual[NI_TESTBUS_MD5_LEN];
+	ni_buffer_t *data;
+	const char *path;
+	int fd;
+
+	if ((path = __ni_testbus_filecache_path(md5, NULL)) == NULL)
+		return NULL;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			ni_warn("file cache: unable to open %s: %m", path);
+		return NULL;
+	}
+
+	data = ni_buffer_new(0);
+	if (!ni_file_read_fd(fd, data)
+	 || !ni_md5_digest(ni_buffer_head(data), ni_buffer_count(data), actual, sizeof(actual))
+	 || memcmp(actual, md5, sizeof(actual))) {
+		ni_warn("file cache: discarding bad entry %s", path);
+		unlink(path);
+		ni_buffer_free(data);
+		data = NULL;
+	} else {
+		/* Mark as recently used */
+		futimens(fd, NULL);
+	}
+
+	close(fd);
+	return data;
+}
+
+static int
+__ni_testbus_filecache_entry_cmp(const void *a, const void *b)
+{
+	const ni_testbus_filecache_entry_t *ea = a, *eb = b;
+
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+		return ea->mtime.tv_sec < eb->mtime.tv_sec? -1 : 1;
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+		return ea->mtime.tv_nsec < eb->mtime.tv_nsec? -1 : 1;
+	return 0;
+}
+
+/*
+ * Remove the least recently used files until the cache fits into
+ * its size limit again.
+ */
+static void
+__ni_testbus_filecache_expire(const char *dirpath, unsigned int size_max)
+{
+	ni_testbus_filecache_entry_t *entries = NULL;
+	unsigned int i, count = 0;
+	uint64_t total = 0;
+	struct dirent *dp;
+	DIR *dir;
+
+	if ((dir = opendir(dirpath)) == NULL) {
+		ni_error("file cache: unable to open %s: %m", dirpath);
+		return;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		ni_testbus_filecache_entry_t *entry;
+		struct stat stb;
+
+		if (dp->d_name[0] == '.' || strlen(dp->d_name) >= sizeof(entry->name))
+			continue;
+		if (fstatat(dirfd(dir), dp->d_name, &stb, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(stb.st_mode))
+			continue;
+
+		if ((count % 64) == 0)
+			entries = ni_realloc(entries, (count + 64) * sizeof(entries[0]));
+		entry = &entries[count++];
+		strcpy(entry->name, dp->d_name);
+		entry->size = stb.st_size;
+		entry->mtime = stb.st_mtim;
+		total += stb.st_size;
+	}
+
+	if (total > size_max) {
+		qsort(entries, count, sizeof(entries[0]), __ni_testbus_filecache_entry_cmp);
+		for (i = 0; i < count && total > size_max; ++i) {
+			ni_debug_testbus("file cache: expiring %s (%llu bytes)", entries[i].name,
+					(unsigned long long) entries[i].size);
+			if (unlinkat(dirfd(dir), entries[i].name, 0) < 0)
+				ni_warn("file cache: unable to remove %s: %m", entries[i].name);
+			total -= entries[i].size;
+		}
+	}
+
+	closedir(dir);
+	free(entries);
+}
+
+/*
+ * Add a file to the cache. The data is written to a temporary file
+ * first, so that a crash never leaves a partial file under its
+ * final name.
+ */
+void
+ni_testbus_agent_filecache_store(const unsigned char *md5, const ni_buffer_t *data)
+{
+	unsigned char actual[NI_TESTBUS_MD5_LEN];
+	unsigned int size_max = __ni_testbus_filecache_size_max();
+	char *tmppath = NULL;
+	const char *path;
+	FILE *fp;
+	int rv;
+
+	if (ni_buffer_count(data) > size_max)
+		return;
+
+	/* The file may have changed since the master told us its digest */
+	if (!ni_md5_digest(ni_buffer_head(data), ni_buffer_count(data), actual, sizeof(actual))
+	 || memcmp(actual, md5, sizeof(actual))) {
+		ni_debug_testbus("file cache: digest mismatch, not caching file");
+		return;
+	}
+
+	if ((path = __ni_testbus_filecache_path(md5, ".tmp")) == NULL)
+		return;
+	ni_string_dup(&tmppath, path);
+
+	if ((fp = fopen(tmppath, "we")) == NULL) {
+		ni_error("file cache: unable to create %s: %m", tmppath);
+		goto out;
+	}
+
+	rv = ni_file_write(fp, data);
+	if (fclose(fp) != 0)
+		rv = -1;
+	if (rv < 0) {
+		ni_error("file cache: unable to write %s: %m", tmppath);
+		unlink(tmppath);
+		goto out;
+	}
+
+	path = __ni_testbus_filecache_path(md5, NULL);
+	if (rename(tmppath, path) < 0) {
+		ni_error("file cache: unable to rename %s: %m", tmppath);
+		unlink(tmppath);
+		goto out;
+	}
+
+	ni_debug_testbus("file cache: stored %u bytes as %s", ni_buffer_count(data), path);
+	__ni_testbus_filecache_expire(__ni_testbus_filecache_dir(), size_max);
+
+out:
+	ni_string_free(&tmppath);
+}
@@ -1,48 +1,317 @@
 
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <dborb/process.h>
 #include <dborb/buffer.h>
+#include <dborb/socket.h>
+#include <dborb/workqueue.h>
 #include <testbus/client.h>
 
 #include "files.h"
 
 static ni_testbus_file_array_t	global_files;
 
-static ni_bool_t		ni_testbus_agent_download_file(ni_testbus_file_t *);
+/*
+ * Fetching input files.
+ *
+ * As soon as the master schedules a command, we start downloading all of
+ * its input files concurrently, even if the command has to wait in the run
+ * queue for a while. When the command is about to be started, it waits
+ * for whatever is still in flight, and is launched once the last of its
+ * files has arrived.
+ *
+ * Input files are shared by all commands through the global_files array,
+ * so a file needed by several commands is downloaded only once; a command
+ * that needs a file that is being downloaded just joins that download.
+ */
+struct ni_testbus_agent_fetch {
+	unsigned int		pending;
+	ni_bool_t		failed;
+	const ni_timer_t *	timer;
 
-ni_bool_t
-ni_testbus_agent_process_attach_files(ni_process_t *pi, ni_testbus_file_array_t *files)
+	ni_testbus_agent_fetch_callback_t *callback;
+	void *			user_data;
+};
+
+typedef struct ni_testbus_agent_download ni_testbus_agent_download_t;
+struct ni_testbus_agent_download {
+	ni_testbus_agent_download_t *next;
+	ni_testbus_file_t *	file;
+	ni_bool_t		stale;		/* file changed while downloading */
+
+	unsigned int		nwaiters;
+	ni_testbus_agent_fetch_t **waiters;
+};
+
+static ni_testbus_agent_download_t *ni_testbus_agent_downloads;
+
+static ni_testbus_agent_download_t *
+__ni_testbus_agent_download_find(const ni_testbus_file_t *file)
+{
+	ni_testbus_agent_download_t *dl;
+
+	for (dl = ni_testbus_agent_downloads; dl; dl = dl->next) {
+		if (dl->file == file && !dl->stale)
+			return dl;
+	}
+	return NULL;
+}
+
+static void
+__ni_testbus_agent_download_join(ni_testbus_agent_download_t *dl, ni_testbus_agent_fetch_t *fetch)
+{
+	if (fetch == NULL)
+		return;
+
+	dl->waiters = ni_realloc(dl->waiters, (dl->nwaiters + 1) * sizeof(dl->waiters[0]));
+	dl->waiters[dl->nwaiters++] = fetch;
+	fetch->pending++;
+}
+
+static void
+__ni_testbus_agent_download_unlink(ni_testbus_agent_download_t *dl)
 {
+	ni_testbus_agent_download_t **pos;
+
+	for (pos = &ni_testbus_agent_downloads; *pos; pos = &(*pos)->next) {
+		if (*pos == dl) {
+			*pos = dl->next;
+			break;
+		}
+	}
+}
+
+static void
+__ni_testbus_agent_download_free(ni_testbus_agent_download_t *dl)
+{
+	ni_testbus_file_put(dl->file);
+	free(dl->waiters);
+	free(dl);
+}
+
+static void
+__ni_testbus_agent_fetch_timeout(void *user_data, const ni_timer_t *timer)
+{
+	ni_testbus_agent_fetch_t *fetch = user_data;
+
+	fetch->timer = NULL;
+	fetch->callback(!fetch->failed, fetch->user_data);
+	free(fetch);
+}
+
+/*
+ * The callback is always invoked from the main loop, rather than from
+ * within whatever dbus call happened to complete the last download.
+ */
+static void
+__ni_testbus_agent_fetch_put(ni_testbus_agent_fetch_t *fetch, ni_bool_t ok)
+{
+	if (!ok)
+		fetch->failed = TRUE;
+
+	ni_assert(fetch->pending);
+	if (--(fetch->pending) == 0)
+		fetch->timer = ni_timer_register(0, __ni_testbus_agent_fetch_timeout, fetch);
+}
+
+static void
+__ni_testbus_agent_download_done(ni_buffer_t *data, void *user_data)
+{
+	ni_testbus_agent_download_t *dl = user_data;
+	ni_testbus_file_t *file = dl->file;
 	unsigned int i;
 
-	for (i = 0; i < files->count; ++i) {
+	__ni_testbus_agent_download_unlink(dl);
+
+	if (data == NULL) {
+		ni_error("Cannot download file content for %s (object path %s)", file->name, file->object_path);
+	} else if (dl->stale) {
+		ni_debug_testbus("file %s changed while downloading, discarding data", file->name);
+		ni_buffer_free(data);
+	} else {
+		file->data = data;
+		file->size = ni_buffer_count(data);
+		ni_debug_testbus("file %s (%s): downloaded %u bytes",
+				file->name, file->object_path, file->size);
+
+		if (file->md5_valid)
+			ni_testbus_agent_filecache_store(file->md5, file->data);
+	}
+
+	for (i = 0; i < dl->nwaiters; ++i)
+		__ni_testbus_agent_fetch_put(dl->waiters[i], data != NULL);
+
+	__ni_testbus_agent_download_free(dl);
+}
+
+/*
+ * Download a file. If we have an older version of it, only
+ * download what changed.
+ */
+static void
+__ni_testbus_agent_download_start(ni_testbus_file_t *file, ni_buffer_t *base,
+				ni_testbus_agent_download_t *stale, ni_testbus_agent_fetch_t *fetch)
+{
+	ni_testbus_agent_download_t *dl;
+	unsigned int i;
+
+	/* We may have a copy in the file cache already */
+	if (file->md5_valid && (file->data = ni_testbus_agent_filecache_lookup(file->md5)) != NULL) {
+		file->size = ni_buffer_count(file->data);
+		ni_debug_testbus("file %s: found %u bytes in file cache", file->name, file->size);
+		goto out;
+	}
+
+	/* Need to download file data */
+	if (file->object_path == NULL) {
+		ni_error("Cannot download file content for %s: no object path", file->name);
+		if (fetch)
+			fetch->failed = TRUE;
+		goto out;
+	}
+
+	ni_debug_testbus("need to download file %s (inum %u)", file->name, file->inum);
+
+	dl = ni_calloc(1, sizeof(*dl));
+	dl->file = ni_testbus_file_get(file);
+	dl->next = ni_testbus_agent_downloads;
+	ni_testbus_agent_downloads = dl;
+
+	/* Whoever waited for the previous version gets this one */
+	if (stale) {
+		for (i = 0; i < stale->nwaiters; ++i) {
+			dl->waiters = ni_realloc(dl->waiters, (dl->nwaiters + 1) * sizeof(dl->waiters[0]));
+			dl->waiters[dl->nwaiters++] = stale->waiters[i];
+		}
+		stale->nwaiters = 0;
+	}
+	__ni_testbus_agent_download_join(dl, fetch);
+
+	/* Note, this may complete the download right away */
+	if (!ni_testbus_client_download_file_async(file->object_path, base, __ni_testbus_agent_download_done, dl)) {
+		ni_error("Cannot download file content for %s (object path %s)", file->name, file->object_path);
+		__ni_testbus_agent_download_unlink(dl);
+		for (i = 0; i < dl->nwaiters; ++i)
+			__ni_testbus_agent_fetch_put(dl->waiters[i], FALSE);
+		__ni_testbus_agent_download_free(dl);
+	}
+	return;
+
+out:
+	if (base)
+		ni_buffer_free(base);
+}
+
+/*
+ * Make sure we have the contents of all input files, or are in the process
+ * of downloading them. If a callback is given, it is invoked once all of
+ * them are available, or once something failed; the returned handle can be
+ * used to cancel this. Without a callback, this just gets the downloads
+ * going, and returns NULL.
+ */
+ni_testbus_agent_fetch_t *
+ni_testbus_agent_fetch_files(ni_testbus_file_array_t *files,
+			ni_testbus_agent_fetch_callback_t *callback, void *user_data)
+{
+	ni_testbus_agent_fetch_t *fetch = NULL;
+	unsigned int i;
+
+	if (callback) {
+		fetch = ni_calloc(1, sizeof(*fetch));
+		fetch->callback = callback;
+		fetch->user_data = user_data;
+		fetch->pending = 1;
+	}
+
+	for (i = 0; files && i < files->count; ++i) {
 		ni_testbus_file_t *file = files->data[i];
+		ni_testbus_agent_download_t *stale = NULL;
 		ni_testbus_file_t *gfile;
+		ni_buffer_t *base = NULL;
 
 		gfile = ni_testbus_file_array_find_by_inum(&global_files, file->inum);
 		if (gfile == NULL) {
 			ni_testbus_file_array_append(&global_files, file);
 		} else {
-			/* Make sure the data we cached is still valid */
-			if (gfile->iseq == file->iseq)
-				continue;
+			ni_testbus_agent_download_t *dl = __ni_testbus_agent_download_find(gfile);
+
+			if (gfile->iseq == file->iseq) {
+				ni_testbus_file_array_set(files, i, gfile);
+
+				/* Make sure the data we cached is still valid */
+				if (gfile->data || !(gfile->mode & NI_TESTBUS_FILE_READ))
+					continue;
+
+				if (dl) {
+					__ni_testbus_agent_download_join(dl, fetch);
+					continue;
+				}
+			} else {
+				/* Keep the old contents around for a delta transfer */
+				base = gfile->data;
+				gfile->data = NULL;
 
-			ni_testbus_file_drop_cache(gfile);
+				ni_testbus_file_drop_cache(gfile);
+				gfile->iseq = file->iseq;
+				gfile->md5_valid = file->md5_valid;
+				memcpy(gfile->md5, file->md5, sizeof(gfile->md5));
 
-			ni_testbus_file_array_set(files, i, gfile);
+				ni_testbus_file_array_set(files, i, gfile);
+
+				if (dl) {
+					dl->stale = TRUE;
+					stale = dl;
+				}
+			}
 			file = gfile;
 		}
 
 		/* only download files marked as NI_TESTBUS_FILE_READ */
 		if (file->mode & NI_TESTBUS_FILE_READ) {
-			if (!ni_testbus_agent_download_file(file)) {
-				ni_error("Cannot download file content for %s (object path %s)", file->name, file->object_path);
-				return FALSE;
-			}
+			__ni_testbus_agent_download_start(file, base, stale, fetch);
+		} else if (base) {
+			ni_buffer_free(base);
 		}
 	}
 
+	if (fetch)
+		__ni_testbus_agent_fetch_put(fetch, TRUE);
+	return fetch;
+}
+
+/*
+ * The command was deleted while waiting for its files
+ */
+void
+ni_testbus_agent_fetch_cancel(ni_testbus_agent_fetch_t *fetch)
+{
+	ni_testbus_agent_download_t *dl;
+	unsigned int i, j;
+
+	for (dl = ni_testbus_agent_downloads; dl; dl = dl->next) {
+		for (i = j = 0; i < dl->nwaiters; ++i) {
+			if (dl->waiters[i] != fetch)
+				dl->waiters[j++] = dl->waiters[i];
+		}
+		dl->nwaiters = j;
+	}
+
+	if (fetch->timer)
+		ni_timer_cancel(fetch->timer);
+	free(fetch);
+}
+
+/*
+ * Write the input files to the process' temp directory. The files must
+ * have been fetched using ni_testbus_agent_fetch_files() before.
+ */
+ni_bool_t
+ni_testbus_agent_process_attach_files(ni_process_t *pi, ni_testbus_file_array_t *files)
+{
+	unsigned int i;
+
 	ni_process_capture_stdout(pi);
 
 	for (i = 0; i < files->count; ++i) {
@@ -60,6 +329,11 @@ ni_testbus_agent_process_attach_files(ni_process_t *pi, ni_testbus_file_array_t
 			continue;
 		}
 
+		if ((file->mode & NI_TESTBUS_FILE_READ) && file->data == NULL) {
+			ni_error("no data for file \"%s\"", file->name);
+			return FALSE;
+		}
+
 		path = ni_tempstate_mkfile(ts, file->name, file->data);
 		if (!path) {
 			ni_error("unable to write file \"%s\"", file->name);
@@ -88,33 +362,6 @@ ni_testbus_agent_process_attach_files(ni_process_t *pi, ni_testbus_file_array_t
 	return TRUE;
 }
 
-/*
- * Download a file
- */
-ni_bool_t
-ni_testbus_agent_download_file(ni_testbus_file_t *file)
-{
-	ni_dbus_object_t *file_object;
-
-	/* Need to download file data */
-	if (file->object_path == NULL)
-		return FALSE;
-
-	ni_debug_testbus("need to download file %s (inum %u)", file->name, file->inum);
-	file_object = ni_testbus_client_get_and_refresh_object(file->object_path);
-	if (!file_object)
-		return FALSE;
-		
-	file->data = ni_testbus_client_download_file(file_object);
-	if (file->data == NULL)
-		return FALSE;
-
-	file->size = ni_buffer_count(file->data);
-	ni_debug_testbus("file %s (%s): downloaded %u bytes",
-			file->name, file->object_path, file->size);
-	return TRUE;
-}
-
 /*
  * Substitute %{...} strings in arguments and file names
  */
@@ -257,6 +504,165 @@ ni_testbus_agent_discard_cached_file(const char *object_path)
 	global_files.count = j;
 }
 
+/*
+ * Distributed files.
+ *
+ * When the master distributes a file to a host set, it tells us where to
+ * copy the file from - either the master itself, or another agent that
+ * already has it - and where to store it. Once we report back that we have
+ * it, other agents may start copying it from us. The file is written under
+ * a temporary name first, so that nobody ever sees a partial copy.
+ */
+typedef struct ni_testbus_agent_distribution {
+	ni_dbus_object_t *	host_object;
+	uint32_t		id;
+	char *			dest_path;
+	char *			temp_path;
+	ni_buffer_t *		data;
+	int			error;
+	ni_bool_t		ok;
+} ni_testbus_agent_distribution_t;
+
+static void
+ni_testbus_agent_distribution_free(ni_testbus_agent_distribution_t *dd)
+{
+	ni_string_free(&dd->dest_path);
+	ni_string_free(&dd->temp_path);
+	if (dd->data)
+		ni_buffer_free(dd->data);
+	free(dd);
+}
+
+static void
+__ni_testbus_agent_distribution_report(void *user_data, const ni_timer_t *timer)
+{
+	ni_testbus_agent_distribution_t *dd = user_data;
+
+	ni_testbus_agent_file_distributed(dd->host_object, dd->id, dd->ok);
+	ni_testbus_agent_distribution_free(dd);
+}
+
+/*
+ * As with input files, we report back from the main loop, rather than
+ * from within the dbus call that completed the download.
+ */
+static void
+__ni_testbus_agent_distribution_done(ni_testbus_agent_distribution_t *dd, ni_bool_t ok)
+{
+	if (!ok)
+		ni_error("distribution %u: unable to get a copy of %s", dd->id, dd->dest_path);
+	dd->ok = ok;
+	ni_timer_register(0, __ni_testbus_agent_distribution_report, dd);
+}
+
+static void
+__ni_testbus_agent_distribution_write(ni_work_t *work)
+{
+	ni_testbus_agent_distribution_t *dd = work->user_data;
+	const unsigned char *data = ni_buffer_head(dd->data);
+	unsigned int len = ni_buffer_count(dd->data), written = 0;
+	int fd;
+
+	if ((fd = open(dd->temp_path, O_CREAT|O_TRUNC|O_WRONLY, 0644)) < 0) {
+		dd->error = errno;
+		return;
+	}
+
+	while (written < len) {
+		ssize_t n;
+
+		n = write(fd, data + written, len - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			dd->error = errno;
+			break;
+		}
+		written += n;
+	}
+
+	if (close(fd) < 0 && dd->error == 0)
+		dd->error = errno;
+	if (dd->error == 0 && rename(dd->temp_path, dd->dest_path) < 0)
+		dd->error = errno;
+	if (dd->error)
+		unlink(dd->temp_path);
+}
+
+static void
+__ni_testbus_agent_distribution_written(ni_work_t *work)
+{
+	ni_testbus_agent_distribution_t *dd = work->user_data;
+
+	ni_work_free(work);
+	if (dd->error) {
+		ni_error("%s: unable to write file: %s", dd->dest_path, strerror(dd->error));
+	} else {
+		ni_debug_testbus("distribution %u: stored %u bytes as %s", dd->id,
+				ni_buffer_count(dd->data), dd->dest_path);
+	}
+	__ni_testbus_agent_distribution_done(dd, dd->error == 0);
+}
+
+static void
+__ni_testbus_agent_distribution_received(ni_buffer_t *data, void *user_data)
+{
+	ni_testbus_agent_distribution_t *dd = user_data;
+	ni_work_t *work;
+
+	if (data == NULL) {
+		__ni_testbus_agent_distribution_done(dd, FALSE);
+		return;
+	}
+
+	dd->data = data;
+	work = ni_work_new(__ni_testbus_agent_distribution_write, __ni_testbus_agent_distribution_written, dd);
+	if (!ni_work_submit(work)) {
+		ni_work_free(work);
+		__ni_testbus_agent_distribution_done(dd, FALSE);
+	}
+}
+
+void
+ni_testbus_agent_distribute_file(ni_dbus_object_t *host_object, const ni_dbus_variant_t *info)
+{
+	ni_testbus_agent_distribution_t *dd;
+	const char *dest_path, *source_file, *source_agent, *source_path;
+	ni_bool_t started;
+	uint32_t id;
+
+	if (!ni_dbus_dict_get_uint32(info, "id", &id)
+	 || !ni_dbus_dict_get_string(info, "dest-path", &dest_path)) {
+		ni_error("distributeFile: bad arguments");
+		return;
+	}
+
+	dd = ni_calloc(1, sizeof(*dd));
+	dd->host_object = host_object;
+	dd->id = id;
+	ni_string_dup(&dd->dest_path, dest_path);
+	ni_string_printf(&dd->temp_path, "%s.testbus-%d-%u", dest_path, (int) getpid(), id);
+
+	/* Note, these may complete the download right away */
+	if (ni_dbus_dict_get_string(info, "source-file", &source_file)) {
+		ni_debug_testbus("distribution %u: copying %s from master", id, dest_path);
+		started = ni_testbus_client_download_file_async(source_file, NULL,
+				__ni_testbus_agent_distribution_received, dd);
+	} else
+	if (ni_dbus_dict_get_string(info, "source-agent", &source_agent)
+	 && ni_dbus_dict_get_string(info, "source-path", &source_path)) {
+		ni_debug_testbus("distribution %u: copying %s from %s", id, dest_path, source_agent);
+		started = ni_testbus_client_agent_download_file_async(source_agent, source_path,
+				__ni_testbus_agent_distribution_received, dd);
+	} else {
+		ni_error("distributeFile: no source given");
+		started = FALSE;
+	}
+
+	if (!started)
+		__ni_testbus_agent_distribution_done(dd, FALSE);
+}
+
 /*
  * Prior to running a process, modify the environment that we pass to it.
  * All user environment variables should be prefixed with "testbus_" to
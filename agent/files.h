@@ -4,12 +4,23 @@
 
 #include <testbus/file.h>
 
+typedef struct ni_testbus_agent_fetch ni_testbus_agent_fetch_t;
+typedef void		ni_testbus_agent_fetch_callback_t(ni_bool_t ok, void *user_data);
+
+extern ni_testbus_agent_fetch_t *ni_testbus_agent_fetch_files(ni_testbus_file_array_t *,
+				ni_testbus_agent_fetch_callback_t *, void *user_data);
+extern void		ni_testbus_agent_fetch_cancel(ni_testbus_agent_fetch_t *);
 extern ni_bool_t	ni_testbus_agent_process_attach_files(ni_process_t *, ni_testbus_file_array_t *);
 extern ni_bool_t	ni_testbus_agent_process_export_files(ni_process_t *, ni_testbus_file_array_t *);
 extern void		ni_testbus_agent_discard_cached_file(const char *);
+extern void		ni_testbus_agent_distribute_file(ni_dbus_object_t *, const ni_dbus_variant_t *);
 extern void		ni_testbus_agent_process_frob_environ(ni_process_t *);
 
-extern ni_bool_t	ni_testbus_agent_run_command(ni_process_t *pi, const char *master_object_path, ni_testbus_file_array_t *files);
+extern ni_buffer_t *	ni_testbus_agent_filecache_lookup(const unsigned char *md5);
+extern void		ni_testbus_agent_filecache_store(const unsigned char *md5, const ni_buffer_t *);
+
+extern void		ni_testbus_agent_run_command(ni_process_t *pi, const char *master_object_path, ni_testbus_file_array_t *files,
+				int priority, unsigned int output_tail);
 extern void		ni_testbus_agent_discard_process(const char *);
 
 #endif /* __AGENT_FILES_H__ */
@@ -24,6 +24,7 @@
 #include <dborb/process.h>
 #include <dborb/xml.h>
 #include <dborb/buffer.h>
+#include <dborb/loopstats.h>
 #include <testbus/model.h>
 #include <testbus/client.h>
 #include <testbus/process.h>
@@ -444,6 +445,8 @@ __ni_testbus_agent_handle_host_signal(ni_dbus_connection_t *connection, ni_dbus_
 		const char *object_path;
 		ni_process_t *pi = NULL;
 		ni_testbus_file_array_t *files = NULL;
+		int32_t priority = 0;
+		uint32_t output_tail = 0;
 
 		if (argc < 2
 		 || !(pi = ni_testbus_process_deserialize(&argv[0]))
@@ -455,9 +458,22 @@ __ni_testbus_agent_handle_host_signal(ni_dbus_connection_t *connection, ni_dbus_
 			goto out;
 		}
 
+		ni_dbus_dict_get_int32(&argv[0], "priority", &priority);
+		ni_dbus_dict_get_uint32(&argv[0], "output-tail", &output_tail);
+		if (output_tail > ni_testbus_file_size_max(NULL))
+			output_tail = ni_testbus_file_size_max(NULL);
+
 		ni_debug_testbus("received signal %s(%s)", signal_name, object_path);
 
-		ni_testbus_agent_run_command(pi, object_path, files);
+		ni_testbus_agent_run_command(pi, object_path, files, priority, output_tail);
+	} else
+	if (ni_string_eq(signal_name, "distributeFile")) {
+		if (argc < 1) {
+			ni_error("%s: bad argument for signal %s()", __func__, signal_name);
+			goto out;
+		}
+
+		ni_testbus_agent_distribute_file(user_data, &argv[0]);
 	} else
 	if (ni_string_eq(signal_name, "shutdownRequested")) {
 		ni_debug_testbus("received signal %s", signal_name);
@@ -538,7 +554,7 @@ ni_testbus_agent_setup_signals(ni_dbus_client_t *client, ni_dbus_object_t *host_
 			host_object->path,			/* path */
 			NI_TESTBUS_HOST_INTERFACE,		/* interface */
 			__ni_testbus_agent_handle_host_signal,
-			NULL);
+			host_object);
 
 	ni_dbus_client_add_signal_handler(client,
 			NI_TESTBUS_DBUS_BUS_NAME,		/* sender */
@@ -566,12 +582,14 @@ static void
 ni_testbus_agent_bind_builtin()
 {
 	ni_testbus_bind_builtin_filesystem();
+	ni_testbus_bind_builtin_stats();
 }
 
 static void
 ni_testbus_agent_create_static_objects(ni_dbus_server_t *server)
 {
 	ni_testbus_create_static_objects_filesystem(server);
+	ni_testbus_create_static_objects_stats(server);
 }
 
 
@@ -671,6 +689,11 @@ ni_testbus_agent(ni_testbus_agent_state_t *state)
 	if (!opt_foreground && ni_server_background(APP_IDENTITY) < 0)
 		ni_fatal("unable to background testbus agent");
 
+	/* This must happen after we've detached, because the processes
+	 * spawned by the helper become children of its parent. */
+	if (ni_config_spawn_helper() && !ni_process_start_spawn_helper())
+		ni_warn("unable to start spawn helper, running commands directly");
+
 	/* Inform master that we're ready to serve requests */
 	ni_dbus_server_send_signal(dbus_server,
 			ni_dbus_server_get_root_object(dbus_server),
@@ -678,6 +701,7 @@ ni_testbus_agent(ni_testbus_agent_state_t *state)
 			"ready",
 			0, NULL);
 
+	ni_loopstats_catch_signal(SIGUSR1);
 	while (!ni_caught_terminal_signal()) {
 		long timeout;
 
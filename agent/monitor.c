@@ -7,7 +7,13 @@ static ni_monitor_array_t	__ni_monitors;
 static ni_eventlog_t *		__ni_agent_eventlog;
 static ni_dbus_object_t *	__ni_eventlog_object;
 static const ni_timer_t *	__ni_mon_timer;
-static unsigned long		__ni_mon_timeout;
+
+/*
+ * A monitor's poll may be delayed by up to 1/NI_MONITOR_SLACK of its
+ * current interval, so that monitors with nearby deadlines can be
+ * polled in a single wakeup.
+ */
+#define NI_MONITOR_SLACK		4
 
 static void			__ni_testbus_agent_monitors_poll_timeout(void *, const ni_timer_t *);
 
@@ -47,55 +53,159 @@ ni_testbus_agent_eventlog_flush(void)
 	ni_eventlog_prune(log);
 }
 
-void
-ni_testbus_agent_register_monitor(ni_monitor_t *mon)
+/*
+ * Monitor polling.
+ *
+ * Every monitor has its own deadline. We arm a single timer for the
+ * latest point in time that still lies within every monitor's slack,
+ * and when it fires, we poll all monitors that are due. This way,
+ * monitors with similar intervals share their wakeups.
+ *
+ * A monitor that reports no change backs off exponentially, up to its
+ * max_interval. As soon as it reports an event, or a command is started,
+ * it goes back to polling at its base interval.
+ */
+static unsigned long long
+__ni_testbus_agent_monitors_now(void)
 {
-	unsigned int i, interval = 0;
+	struct timeval now;
+
+	ni_timer_get_time(&now);
+	return now.tv_sec * 1000ULL + now.tv_usec / 1000;
+}
+
+static void
+__ni_testbus_agent_monitor_schedule(ni_monitor_t *mon, unsigned long long now, ni_bool_t active)
+{
+	unsigned long base = mon->interval * 1000;
+	unsigned long max = mon->max_interval * 1000;
+
+	if (active || mon->poll_interval == 0) {
+		mon->poll_interval = base;
+	} else if (mon->poll_interval < max) {
+		mon->poll_interval *= 2;
+		if (mon->poll_interval > max)
+			mon->poll_interval = max;
+	}
+	mon->poll_deadline = now + mon->poll_interval;
+}
+
+static void
+__ni_testbus_agent_monitors_arm_timer(unsigned long long now)
+{
+	unsigned long long wakeup = 0;
+	unsigned long timeout;
+	unsigned int i;
 
-	ni_monitor_array_append(&__ni_monitors, mon);
 	for (i = 0; i < __ni_monitors.count; ++i) {
 		ni_monitor_t *mon = __ni_monitors.data[i];
+		unsigned long long latest;
 
-		if (mon->interval) {
-			if (!interval || mon->interval < interval)
-				interval = mon->interval;
-		}
+		if (!mon->interval)
+			continue;
+
+		latest = mon->poll_deadline + mon->poll_interval / NI_MONITOR_SLACK;
+		if (!wakeup || latest < wakeup)
+			wakeup = latest;
 	}
 
-	__ni_mon_timeout = interval * 1000;
-	if (__ni_mon_timeout) {
+	if (wakeup == 0) {
 		if (__ni_mon_timer)
-			__ni_mon_timer = ni_timer_rearm(__ni_mon_timer, __ni_mon_timeout);
-		else
-			__ni_mon_timer = ni_timer_register(__ni_mon_timeout, __ni_testbus_agent_monitors_poll_timeout, NULL);
+			ni_timer_cancel(__ni_mon_timer);
+		__ni_mon_timer = NULL;
+		return;
 	}
+
+	timeout = (wakeup > now)? wakeup - now : 0;
+	if (__ni_mon_timer)
+		__ni_mon_timer = ni_timer_rearm(__ni_mon_timer, timeout);
+	if (__ni_mon_timer == NULL)
+		__ni_mon_timer = ni_timer_register(timeout, __ni_testbus_agent_monitors_poll_timeout, NULL);
 }
 
+void
+ni_testbus_agent_register_monitor(ni_monitor_t *mon)
+{
+	unsigned long long now = __ni_testbus_agent_monitors_now();
+
+	ni_monitor_array_append(&__ni_monitors, mon);
+	if (mon->interval) {
+		__ni_testbus_agent_monitor_schedule(mon, now, TRUE);
+		__ni_testbus_agent_monitors_arm_timer(now);
+	}
+}
+
+/*
+ * Poll all monitors right now, eg because a process exited.
+ */
 ni_bool_t
 ni_testbus_agent_monitors_poll(void)
 {
+	unsigned long long now = __ni_testbus_agent_monitors_now();
+	ni_bool_t rv = FALSE;
 	unsigned int i;
-	ni_bool_t rv;
 
 	for (i = 0; i < __ni_monitors.count; ++i) {
 		ni_monitor_t *mon = __ni_monitors.data[i];
+		ni_bool_t changed;
 
-		if (ni_monitor_poll(mon) && mon->push)
+		changed = ni_monitor_poll(mon);
+		if (changed && mon->push)
 			rv = TRUE;
+		if (mon->interval)
+			__ni_testbus_agent_monitor_schedule(mon, now, changed);
 	}
 
+	__ni_testbus_agent_monitors_arm_timer(now);
 	return rv;
 }
 
+/*
+ * Something is going on; make all monitors poll at their base interval again.
+ */
+void
+ni_testbus_agent_monitors_kick(void)
+{
+	unsigned long long now = __ni_testbus_agent_monitors_now();
+	ni_bool_t rearm = FALSE;
+	unsigned int i;
+
+	for (i = 0; i < __ni_monitors.count; ++i) {
+		ni_monitor_t *mon = __ni_monitors.data[i];
+
+		if (mon->interval && mon->poll_interval > mon->interval * 1000) {
+			__ni_testbus_agent_monitor_schedule(mon, now, TRUE);
+			rearm = TRUE;
+		}
+	}
+
+	if (rearm)
+		__ni_testbus_agent_monitors_arm_timer(now);
+}
+
 static void
 __ni_testbus_agent_monitors_poll_timeout(void *user_data, const ni_timer_t *timer)
 {
-#ifdef notworkie
-	__ni_mon_timer = ni_timer_rearm(timer, __ni_mon_timeout);
-#else
-	__ni_mon_timer = ni_timer_register(__ni_mon_timeout, __ni_testbus_agent_monitors_poll_timeout, NULL);
-#endif
+	unsigned long long now = __ni_testbus_agent_monitors_now();
+	ni_bool_t push = FALSE;
+	unsigned int i;
+
+	for (i = 0; i < __ni_monitors.count; ++i) {
+		ni_monitor_t *mon = __ni_monitors.data[i];
+		ni_bool_t changed;
+
+		if (!mon->interval || mon->poll_deadline > now)
+			continue;
+
+		changed = ni_monitor_poll(mon);
+		if (changed && mon->push)
+			push = TRUE;
+		__ni_testbus_agent_monitor_schedule(mon, now, changed);
+	}
+
+	__ni_mon_timer = timer;
+	__ni_testbus_agent_monitors_arm_timer(now);
 
-	if (ni_testbus_agent_monitors_poll())
+	if (push)
 		ni_testbus_agent_eventlog_flush();
 }
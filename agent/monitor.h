@@ -10,6 +10,7 @@ extern ni_eventlog_t *	ni_testbus_agent_eventlog(void);
 extern void		ni_testbus_agent_eventlog_flush(void);
 extern void		ni_testbus_agent_register_monitor(ni_monitor_t *);
 extern ni_bool_t	ni_testbus_agent_monitors_poll(void);
+extern void		ni_testbus_agent_monitors_kick(void);
 
 extern ni_monitor_t *	ni_agent_create_syslog_monitor(ni_eventlog_t *);
 
@@ -15,5 +15,6 @@ ni_agent_create_syslog_monitor(ni_eventlog_t *log)
 
 	mon = ni_file_monitor_new("syslog", "/var/log/messages", log);
 	mon->interval = 1;
+	mon->max_interval = 30;
 	return mon;
 }
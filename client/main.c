@@ -20,6 +20,7 @@
 #include <dborb/xml.h>
 #include <dborb/buffer.h>
 #include <dborb/process.h>
+#include <dborb/socket.h>
 #include <dborb/dbus-errors.h>
 #include <dborb/dbus-model.h>
 #include <testbus/model.h>
@@ -1088,18 +1089,74 @@ do_download_file(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Copy an uploaded file to all hosts of the container, and wait until
+ * every host either has a copy or has failed.
+ */
+#define DISTRIBUTE_POLL_MSEC	200
+
+static ni_bool_t
+__do_distribute_file(ni_dbus_object_t *context_object, ni_dbus_object_t *file_object, const char *dest_path)
+{
+	uint32_t id;
+
+	if (!ni_testbus_client_distribute_file(context_object, file_object, dest_path, &id))
+		return FALSE;
+
+	while (TRUE) {
+		ni_dbus_variant_t result = NI_DBUS_VARIANT_INIT;
+		const ni_dbus_variant_t *dict;
+		unsigned int i, ndone = 0, nfailed = 0, count;
+		const char *host, *state;
+
+		if (!ni_testbus_client_get_distribution_status(context_object, id, &result))
+			return FALSE;
+
+		for (i = 0; (dict = ni_dbus_dict_array_at(&result, i)) != NULL; ++i) {
+			if (!ni_dbus_dict_get_string(dict, "state", &state))
+				continue;
+			if (ni_string_eq(state, "done"))
+				ndone++;
+			else if (ni_string_eq(state, "failed"))
+				nfailed++;
+		}
+		count = i;
+
+		if (ndone + nfailed < count) {
+			ni_dbus_variant_destroy(&result);
+			ni_socket_wait(DISTRIBUTE_POLL_MSEC);
+			continue;
+		}
+
+		for (i = 0; (dict = ni_dbus_dict_array_at(&result, i)) != NULL; ++i) {
+			if (ni_dbus_dict_get_string(dict, "host", &host)
+			 && ni_dbus_dict_get_string(dict, "state", &state)
+			 && ni_string_eq(state, "failed"))
+				ni_error("host %s: unable to copy file to %s", host, dest_path);
+		}
+		printf("Distributed to %u of %u hosts\n", ndone, count);
+
+		ni_dbus_variant_destroy(&result);
+		return nfailed == 0;
+	}
+}
+
 static int
 do_upload_file(int argc, char **argv)
 {
-	enum  { OPT_HELP, OPT_HOST, OPT_CONTEXT };
+	enum  { OPT_HELP, OPT_HOST, OPT_CONTEXT, OPT_DISTRIBUTE, OPT_REPLACE };
 	static struct option local_options[] = {
 		{ "host", required_argument, NULL, OPT_HOST },
 		{ "context", required_argument, NULL, OPT_CONTEXT },
+		{ "distribute", required_argument, NULL, OPT_DISTRIBUTE },
+		{ "replace", no_argument, NULL, OPT_REPLACE },
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ NULL }
 	};
 	const char *opt_hostname = NULL;
 	const char *opt_context = NULL;
+	const char *opt_distribute = NULL;
+	ni_bool_t opt_replace = FALSE;
 	int c;
 
 	optind = 1;
@@ -1117,6 +1174,12 @@ do_upload_file(int argc, char **argv)
 				"  --context <container-object>\n"
 				"      Argument is a DBus object path. The file is uploaded to the testbus master, and is distributed\n"
 				"      from there to all hosts the test runs on.\n"
+				"  --distribute <destpath>\n"
+				"      With --context, also copy the file to <destpath> on all hosts of the container right away.\n"
+				"      The hosts pass the file on to each other, so that the master serves it only once. Note that\n"
+				"      all copies still go through the master's dbus-daemon.\n"
+				"  --replace\n"
+				"      With --context, replace the contents of the file if it exists already.\n"
 				"  --help\n"
 				"      Show this help text.\n"
 				);
@@ -1129,9 +1192,25 @@ do_upload_file(int argc, char **argv)
 		case OPT_CONTEXT:
 			opt_context = optarg;
 			break;
+
+		case OPT_DISTRIBUTE:
+			opt_distribute = optarg;
+			break;
+
+		case OPT_REPLACE:
+			opt_replace = TRUE;
+			break;
 		}
 	}
 
+	if (opt_distribute && !opt_context) {
+		ni_error("--distribute requires the --context option");
+		goto usage;
+	}
+	if (opt_replace && !opt_context) {
+		ni_error("--replace requires the --context option");
+		goto usage;
+	}
 	if (opt_hostname && opt_context) {
 		ni_error("--host and --context options are mutually exclusive");
 		goto usage;
@@ -1188,15 +1267,26 @@ do_upload_file(int argc, char **argv)
 			return 1;
 		count = ni_buffer_count(data);
 
-		file_object = ni_testbus_client_create_tempfile(identifier, NI_TESTBUS_FILE_READ, context_object);
-		if (file_object == NULL)
-			return 1;
+		file_object = NULL;
+		if (opt_replace)
+			file_object = ni_testbus_client_container_child_by_name(context_object,
+						ni_testbus_file_class(), identifier);
 
-		if (!ni_testbus_client_upload_file(file_object, data))
-			return 1;
+		if (file_object != NULL) {
+			if (!ni_testbus_client_truncate_file(file_object)
+			 || !ni_testbus_client_upload_file(file_object, data))
+				return 1;
+		} else {
+			file_object = ni_testbus_client_upload_tempfile(identifier, NI_TESTBUS_FILE_READ, data, context_object);
+			if (file_object == NULL)
+				return 1;
+		}
 
 		printf("Uploaded %u bytes\n", count);
 		ni_buffer_free(data);
+
+		if (opt_distribute && !__do_distribute_file(context_object, file_object, opt_distribute))
+			return 1;
 	}
 
 	return 0;
@@ -1368,7 +1458,8 @@ __samefile(int fd1, int fd2)
  * Helper function for creating a command
  */
 static ni_dbus_object_t *
-__do_create_command(ni_dbus_object_t *container_object, int argc, char **argv, ni_bool_t send_stdin, ni_bool_t send_script, ni_bool_t use_terminal)
+__do_create_command(ni_dbus_object_t *container_object, int argc, char **argv, ni_bool_t send_stdin, ni_bool_t send_script, ni_bool_t use_terminal,
+			unsigned int output_limit, int priority, unsigned int output_tail)
 {
 	ni_string_array_t command_argv = NI_STRING_ARRAY_INIT;
 	ni_dbus_object_t *cmd_object;
@@ -1383,7 +1474,7 @@ __do_create_command(ni_dbus_object_t *container_object, int argc, char **argv, n
 	for (index = 0; index < argc; ++index)
 		ni_string_array_append(&command_argv, argv[index]);
 
-	cmd_object = ni_testbus_client_create_command(container_object, &command_argv, use_terminal);
+	cmd_object = ni_testbus_client_create_command_ext(container_object, &command_argv, use_terminal, priority, output_tail);
 	ni_string_array_destroy(&command_argv);
 
 	if (send_stdin) {
@@ -1417,9 +1508,9 @@ __do_create_command(ni_dbus_object_t *container_object, int argc, char **argv, n
 	 * If they refer to different files, we should tell the server to capture
 	 * these separately.
 	 */
-	ni_testbus_client_create_tempfile("stdout", NI_TESTBUS_FILE_WRITE, cmd_object);
+	ni_testbus_client_create_tempfile_ext("stdout", NI_TESTBUS_FILE_WRITE, output_limit, cmd_object);
 	if (!__samefile(1, 2)) {
-		ni_testbus_client_create_tempfile("stderr", NI_TESTBUS_FILE_WRITE, cmd_object);
+		ni_testbus_client_create_tempfile_ext("stderr", NI_TESTBUS_FILE_WRITE, output_limit, cmd_object);
 	}
 
 	return cmd_object;
@@ -1466,14 +1557,20 @@ flush_process_file(ni_dbus_object_t *proc_object, const char *filename, FILE *of
 static int
 do_create_command(int argc, char **argv)
 {
-	enum  { OPT_HELP, OPT_CONTEXT, };
+	enum  { OPT_HELP, OPT_CONTEXT, OPT_OUTPUT_LIMIT, OPT_OUTPUT_TAIL, OPT_PRIORITY, };
 	static struct option local_options[] = {
 		{ "context", required_argument, NULL, OPT_CONTEXT },
+		{ "output-limit", required_argument, NULL, OPT_OUTPUT_LIMIT },
+		{ "output-tail", required_argument, NULL, OPT_OUTPUT_TAIL },
+		{ "priority", required_argument, NULL, OPT_PRIORITY },
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ NULL }
 	};
 	ni_dbus_object_t *container_object, *cmd_object;
 	const char *opt_container = NULL;
+	unsigned int opt_output_limit = 0;
+	unsigned int opt_output_tail = 0;
+	int opt_priority = 0;
 	int c;
 
 	optind = 1;
@@ -1487,6 +1584,14 @@ do_create_command(int argc, char **argv)
 				"\nSupported options:\n"
 				"  --context <object-path>\n"
 				"      Argument is a the object path of a container object, such as a testcase or a test group\n"
+				"  --output-limit <bytes>\n"
+				"      Maximum size of the command's stdout and stderr, each. The default is set by the master.\n"
+				"  --output-tail <bytes>\n"
+				"      Keep only the last <bytes> of the command's stdout and stderr, each.\n"
+				"      The output is sent to the master when the command has exited.\n"
+				"  --priority <n>\n"
+				"      When the host has more commands to run than it can run at once, it starts those\n"
+				"      with higher priority first. The default is 0.\n"
 				"  --help\n"
 				"      Show this help text.\n"
 				);
@@ -1496,6 +1601,26 @@ do_create_command(int argc, char **argv)
 			opt_container = optarg;
 			break;
 
+		case OPT_OUTPUT_LIMIT:
+			if (ni_parse_uint(optarg, &opt_output_limit, 10) < 0) {
+				ni_error("could not parse output limit");
+				return 1;
+			}
+			break;
+
+		case OPT_OUTPUT_TAIL:
+			if (ni_parse_uint(optarg, &opt_output_tail, 10) < 0) {
+				ni_error("could not parse output tail size");
+				return 1;
+			}
+			break;
+
+		case OPT_PRIORITY:
+			if (ni_parse_int(optarg, &opt_priority, 10) < 0) {
+				ni_error("could not parse priority");
+				return 1;
+			}
+			break;
 		}
 	}
 
@@ -1513,7 +1638,8 @@ do_create_command(int argc, char **argv)
 	if (optind > argc - 1)
 		goto usage;
 
-	cmd_object = __do_create_command(container_object, argc - optind, argv + optind, FALSE, FALSE, FALSE);
+	cmd_object = __do_create_command(container_object, argc - optind, argv + optind, FALSE, FALSE, FALSE, opt_output_limit, opt_priority,
+				opt_output_tail);
 	if (cmd_object == NULL)
 		return 1;
 
@@ -1521,26 +1647,179 @@ do_create_command(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Follow the output of a running process. The agent streams the output
+ * to the master while the process runs, so we just poll the stdout and
+ * stderr files periodically and print whatever was added since last time.
+ */
+#define FOLLOW_INTERVAL_MS	250
+
+struct follow_stream {
+	const char *		name;
+	FILE *			ofp;
+	ni_dbus_object_t *	handle;
+	uint64_t		offset;
+};
+
+struct follow_state {
+	ni_dbus_object_t *	proc_object;
+	ni_bool_t		safe_output;
+	const ni_timer_t *	timer;
+	struct follow_stream	streams[2];
+};
+
+static void
+follow_process_file(struct follow_state *state, struct follow_stream *fs)
+{
+	ni_buffer_t *data;
+
+	if (fs->handle == NULL) {
+		ni_dbus_object_t *file_object;
+
+		file_object = ni_testbus_client_container_child_by_name(state->proc_object,
+						ni_testbus_file_class(),
+						fs->name);
+		if (file_object == NULL)
+			return;
+
+		fs->handle = ni_testbus_client_file_handle(file_object->path, NULL);
+		if (fs->handle == NULL)
+			return;
+	}
+
+	data = ni_buffer_new(0);
+	if (ni_testbus_client_retrieve_file(fs->handle, &fs->offset, data) && ni_buffer_count(data)) {
+		if (state->safe_output)
+			ni_file_write_safe(fs->ofp, data);
+		else
+			ni_file_write(fs->ofp, data);
+		fflush(fs->ofp);
+	}
+	ni_buffer_free(data);
+}
+
+static void
+follow_process_output(struct follow_state *state)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2; ++i)
+		follow_process_file(state, &state->streams[i]);
+}
+
+static void
+follow_process_timeout(void *user_data, const ni_timer_t *timer)
+{
+	struct follow_state *state = user_data;
+
+	follow_process_output(state);
+	state->timer = ni_timer_register(FOLLOW_INTERVAL_MS, follow_process_timeout, state);
+}
+
+static void
+follow_process_destroy(struct follow_state *state)
+{
+	unsigned int i;
+
+	if (state->timer)
+		ni_timer_cancel(state->timer);
+	state->timer = NULL;
+
+	for (i = 0; i < 2; ++i) {
+		if (state->streams[i].handle)
+			ni_dbus_object_free(state->streams[i].handle);
+		state->streams[i].handle = NULL;
+	}
+}
+
+static void
+show_resource_usage(const ni_process_exit_info_t *exit_info)
+{
+	if (!exit_info->rusage.valid) {
+		fprintf(stderr, "resource usage: not available\n");
+		return;
+	}
+
+	fprintf(stderr,
+		"resource usage (%s):\n"
+		"  wall time     %llu.%03llus\n"
+		"  user time     %llu.%03llus\n"
+		"  system time   %llu.%03llus\n"
+		"  max rss       %llu kB\n"
+		"  block input   %llu bytes\n"
+		"  block output  %llu bytes\n"
+		"  ctx switches  %llu voluntary, %llu involuntary\n"
+		"  queued for    %llu.%03llus (%u commands ahead)\n",
+		exit_info->rusage.from_cgroup? "cgroup" : "wait4",
+		(unsigned long long) exit_info->rusage.wall_usec / 1000000,
+		(unsigned long long) (exit_info->rusage.wall_usec / 1000) % 1000,
+		(unsigned long long) exit_info->rusage.user_usec / 1000000,
+		(unsigned long long) (exit_info->rusage.user_usec / 1000) % 1000,
+		(unsigned long long) exit_info->rusage.sys_usec / 1000000,
+		(unsigned long long) (exit_info->rusage.sys_usec / 1000) % 1000,
+		(unsigned long long) exit_info->rusage.max_rss_kb,
+		(unsigned long long) exit_info->rusage.io_read_bytes,
+		(unsigned long long) exit_info->rusage.io_write_bytes,
+		(unsigned long long) exit_info->rusage.voluntary_ctxsw,
+		(unsigned long long) exit_info->rusage.involuntary_ctxsw,
+		(unsigned long long) exit_info->queue.wait_usec / 1000000,
+		(unsigned long long) (exit_info->queue.wait_usec / 1000) % 1000,
+		exit_info->queue.depth);
+}
+
 /*
  * Common code for waiting for a command and displaying its output
  */
 static int
-__do_wait_command(ni_dbus_object_t *proc_object, unsigned int timeout_ms, ni_bool_t safe_output)
+__do_wait_command(ni_dbus_object_t *proc_object, unsigned int timeout_ms, ni_bool_t safe_output, ni_bool_t follow,
+		ni_bool_t show_usage)
 {
+	struct follow_state follow_state = {
+		.proc_object	= proc_object,
+		.safe_output	= safe_output,
+		.streams	= {
+			{ .name = "stdout", .ofp = stdout },
+			{ .name = "stderr", .ofp = stderr },
+		},
+	};
 	ni_process_exit_info_t exit_info;
 
+	if (follow)
+		follow_state.timer = ni_timer_register(FOLLOW_INTERVAL_MS, follow_process_timeout, &follow_state);
+
 	if (!ni_testbus_wait_for_process(proc_object, timeout_ms, &exit_info)) {
 		ni_error("failed to wait for process to complete");
+		follow_process_destroy(&follow_state);
 		return 1;
 	}
 
-	if (exit_info.stdout_bytes)
-		flush_process_file(proc_object, "stdout", stdout, safe_output);
-	if (exit_info.stderr_bytes)
-		flush_process_file(proc_object, "stderr", stderr, safe_output);
+	/* In tail-only mode, the agent drops all but the last N bytes */
+	if (exit_info.stdout_discarded)
+		ni_note("discarded %llu bytes of stdout, showing the last %u",
+				(unsigned long long) exit_info.stdout_discarded, exit_info.stdout_bytes);
+	if (exit_info.stderr_discarded)
+		ni_note("discarded %llu bytes of stderr, showing the last %u",
+				(unsigned long long) exit_info.stderr_discarded, exit_info.stderr_bytes);
+
+	if (follow) {
+		/* Pick up whatever arrived since the last poll */
+		if (follow_state.timer)
+			ni_timer_cancel(follow_state.timer);
+		follow_state.timer = NULL;
+		follow_process_output(&follow_state);
+		follow_process_destroy(&follow_state);
+	} else {
+		if (exit_info.stdout_bytes)
+			flush_process_file(proc_object, "stdout", stdout, safe_output);
+		if (exit_info.stderr_bytes)
+			flush_process_file(proc_object, "stderr", stderr, safe_output);
+	}
 
 	ni_testbus_client_delete(proc_object);
 
+	if (show_usage && exit_info.how != NI_PROCESS_NONSTARTER && exit_info.how != NI_PROCESS_TIMED_OUT)
+		show_resource_usage(&exit_info);
+
 	switch (exit_info.how) {
 	case NI_PROCESS_NONSTARTER:
 		ni_error("failed to start process");
@@ -1573,7 +1852,7 @@ __do_wait_command(ni_dbus_object_t *proc_object, unsigned int timeout_ms, ni_boo
 static int
 do_run_command(int argc, char **argv)
 {
-	enum  { OPT_HELP, OPT_HOSTPATH, OPT_CONTEXT, OPT_SEND_STDIN, OPT_SEND_SCRIPT, OPT_USE_TERMINAL, OPT_NO_OUPUT_PROCESSING, OPT_TIMEOUT, OPT_NO_WAIT };
+	enum  { OPT_HELP, OPT_HOSTPATH, OPT_CONTEXT, OPT_SEND_STDIN, OPT_SEND_SCRIPT, OPT_USE_TERMINAL, OPT_NO_OUPUT_PROCESSING, OPT_TIMEOUT, OPT_NO_WAIT, OPT_OUTPUT_LIMIT, OPT_OUTPUT_TAIL, OPT_SHOW_USAGE, OPT_PRIORITY };
 	static struct option local_options[] = {
 		{ "host", required_argument, NULL, OPT_HOSTPATH },
 		{ "context", required_argument, NULL, OPT_CONTEXT },
@@ -1583,6 +1862,10 @@ do_run_command(int argc, char **argv)
 		{ "no-output-processing", no_argument, NULL, OPT_NO_OUPUT_PROCESSING },
 		{ "timeout", required_argument, NULL, OPT_TIMEOUT },
 		{ "nowait", no_argument, NULL, OPT_NO_WAIT },
+		{ "output-limit", required_argument, NULL, OPT_OUTPUT_LIMIT },
+		{ "output-tail", required_argument, NULL, OPT_OUTPUT_TAIL },
+		{ "show-usage", no_argument, NULL, OPT_SHOW_USAGE },
+		{ "priority", required_argument, NULL, OPT_PRIORITY },
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ NULL }
 	};
@@ -1594,6 +1877,10 @@ do_run_command(int argc, char **argv)
 	ni_bool_t opt_use_terminal = FALSE;
 	ni_bool_t opt_safe_output = TRUE;
 	ni_bool_t opt_wait_for_process = TRUE;
+	ni_bool_t opt_show_usage = FALSE;
+	unsigned int opt_output_limit = 0;
+	unsigned int opt_output_tail = 0;
+	int opt_priority = 0;
 	long opt_timeout = -1;
 	int c, rv;
 
@@ -1610,6 +1897,16 @@ do_run_command(int argc, char **argv)
 				"      Argument is a host object path, as returned by claim-host.\n"
 				"  --send-stdin\n"
 				"      Send the stdin of this command to the executing host, and pipe it into the command\n"
+				"  --output-limit <bytes>\n"
+				"      Maximum size of the command's stdout and stderr, each. The default is set by the master.\n"
+				"  --output-tail <bytes>\n"
+				"      Keep only the last <bytes> of the command's stdout and stderr, each.\n"
+				"      The output is sent to the master when the command has exited.\n"
+				"  --priority <n>\n"
+				"      When the host has more commands to run than it can run at once, it starts those\n"
+				"      with higher priority first. The default is 0.\n"
+				"  --show-usage\n"
+				"      Display the command's resource usage (CPU time, memory, I/O) when it has completed.\n"
 				"  --help\n"
 				"      Show this help text.\n"
 				);
@@ -1655,6 +1952,31 @@ do_run_command(int argc, char **argv)
 		case OPT_NO_WAIT:
 			opt_wait_for_process = FALSE;
 			break;
+
+		case OPT_OUTPUT_LIMIT:
+			if (ni_parse_uint(optarg, &opt_output_limit, 10) < 0) {
+				ni_error("could not parse output limit");
+				return 1;
+			}
+			break;
+
+		case OPT_OUTPUT_TAIL:
+			if (ni_parse_uint(optarg, &opt_output_tail, 10) < 0) {
+				ni_error("could not parse output tail size");
+				return 1;
+			}
+			break;
+
+		case OPT_SHOW_USAGE:
+			opt_show_usage = TRUE;
+			break;
+
+		case OPT_PRIORITY:
+			if (ni_parse_int(optarg, &opt_priority, 10) < 0) {
+				ni_error("could not parse priority");
+				return 1;
+			}
+			break;
 		}
 	}
 
@@ -1682,7 +2004,8 @@ do_run_command(int argc, char **argv)
 	if (optind > argc - 1)
 		goto usage;
 
-	cmd_object = __do_create_command(ctxt_object, argc - optind, argv + optind, opt_send_stdin, opt_send_script, opt_use_terminal);
+	cmd_object = __do_create_command(ctxt_object, argc - optind, argv + optind, opt_send_stdin, opt_send_script, opt_use_terminal,
+				opt_output_limit, opt_priority, opt_output_tail);
 	if (!cmd_object)
 		return 1;
 
@@ -1696,7 +2019,7 @@ do_run_command(int argc, char **argv)
 		return 0;
 	}
 
-	rv = __do_wait_command(proc_object, opt_timeout, opt_safe_output);
+	rv = __do_wait_command(proc_object, opt_timeout, opt_safe_output, FALSE, opt_show_usage);
 	ni_testbus_client_delete(cmd_object);
 
 	return rv;
@@ -1708,14 +2031,18 @@ do_run_command(int argc, char **argv)
 static int
 do_wait_command(int argc, char **argv)
 {
-	enum  { OPT_HELP, OPT_TIMEOUT };
+	enum  { OPT_HELP, OPT_TIMEOUT, OPT_FOLLOW, OPT_SHOW_USAGE };
 	static struct option local_options[] = {
 		{ "timeout", required_argument, NULL, OPT_TIMEOUT },
+		{ "follow", no_argument, NULL, OPT_FOLLOW },
+		{ "show-usage", no_argument, NULL, OPT_SHOW_USAGE },
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ NULL }
 	};
 	ni_dbus_object_t *proc_object;
 	ni_bool_t opt_safe_output = TRUE;
+	ni_bool_t opt_follow = FALSE;
+	ni_bool_t opt_show_usage = FALSE;
 	long opt_timeout = -1;
 	int c;
 
@@ -1730,6 +2057,10 @@ do_wait_command(int argc, char **argv)
 				"\nSupported options:\n"
 				"  --timeout <count>\n"
 				"      If the command is not done yet, wait for up to <count>\n"
+				"  --follow\n"
+				"      Display the output of the command while it is running.\n"
+				"  --show-usage\n"
+				"      Display the command's resource usage (CPU time, memory, I/O) when it has completed.\n"
 				"  --help\n"
 				"      Show this help text.\n"
 				);
@@ -1747,6 +2078,14 @@ do_wait_command(int argc, char **argv)
 				opt_timeout *= 1000;
 			}
 			break;
+
+		case OPT_FOLLOW:
+			opt_follow = TRUE;
+			break;
+
+		case OPT_SHOW_USAGE:
+			opt_show_usage = TRUE;
+			break;
 		}
 	}
 
@@ -1757,7 +2096,7 @@ do_wait_command(int argc, char **argv)
 	if (!proc_object)
 		return 1;
 
-	return __do_wait_command(proc_object, opt_timeout, opt_safe_output);
+	return __do_wait_command(proc_object, opt_timeout, opt_safe_output, opt_follow, opt_show_usage);
 }
 
 /*
@@ -1918,6 +2257,226 @@ do_get_events(int argc, char **argv)
 	return 0;
 }
 
+static void
+show_stats_latency(const ni_dbus_variant_t *dict)
+{
+	uint64_t count, total, max, p50, p90, p99;
+	const char *name;
+
+	if (!ni_dbus_dict_get_string(dict, "name", &name)
+	 || !ni_dbus_dict_get_uint64(dict, "count", &count)
+	 || !ni_dbus_dict_get_uint64(dict, "total-usec", &total)
+	 || !ni_dbus_dict_get_uint64(dict, "max-usec", &max)
+	 || !ni_dbus_dict_get_uint64(dict, "p50-usec", &p50)
+	 || !ni_dbus_dict_get_uint64(dict, "p90-usec", &p90)
+	 || !ni_dbus_dict_get_uint64(dict, "p99-usec", &p99)) {
+		ni_warn("ignoring bad stats entry");
+		return;
+	}
+
+	if (count == 0)
+		return;
+
+	printf("%-40s %10llu %10llu %10llu %10llu %10llu %10llu\n", name,
+			(unsigned long long) count,
+			(unsigned long long) (total / count),
+			(unsigned long long) p50,
+			(unsigned long long) p90,
+			(unsigned long long) p99,
+			(unsigned long long) max);
+}
+
+static int
+show_stats_buffer_pools(ni_dbus_object_t *agent_object)
+{
+	ni_dbus_variant_t result = NI_DBUS_VARIANT_INIT;
+	const ni_dbus_variant_t *dict;
+	unsigned int i;
+
+	if (!ni_testbus_client_get_buffer_pool_stats(agent_object, &result))
+		return 1;
+
+	printf("%-10s %12s %12s %10s %10s %10s\n", "size", "allocs", "hits", "in-use", "high-water", "cached");
+	for (i = 0; (dict = ni_dbus_dict_array_at(&result, i)) != NULL; ++i) {
+		uint64_t size = 0, allocs = 0, hits = 0;
+		uint32_t in_use = 0, high_water = 0, cached = 0;
+		char sizebuf[32];
+
+		ni_dbus_dict_get_uint64(dict, "size", &size);
+		ni_dbus_dict_get_uint64(dict, "allocs", &allocs);
+		ni_dbus_dict_get_uint64(dict, "hits", &hits);
+		ni_dbus_dict_get_uint32(dict, "in-use", &in_use);
+		ni_dbus_dict_get_uint32(dict, "high-water", &high_water);
+		ni_dbus_dict_get_uint32(dict, "cached", &cached);
+
+		if (allocs == 0)
+			continue;
+
+		if (size)
+			snprintf(sizebuf, sizeof(sizebuf), "%llu", (unsigned long long) size);
+		else
+			snprintf(sizebuf, sizeof(sizebuf), "oversized");
+		printf("%-10s %12llu %12llu %10u %10u %10u\n", sizebuf,
+				(unsigned long long) allocs, (unsigned long long) hits,
+				in_use, high_water, cached);
+	}
+
+	ni_dbus_variant_destroy(&result);
+	return 0;
+}
+
+static void
+show_stats_codec(const char *name, const char *dir, const ni_dbus_variant_t *dict)
+{
+	uint64_t calls = 0, skipped = 0, bytes_in = 0, bytes_out = 0, cpu_usec = 0;
+	uint64_t raw, packed;
+
+	ni_dbus_dict_get_uint64(dict, "calls", &calls);
+	ni_dbus_dict_get_uint64(dict, "skipped", &skipped);
+	ni_dbus_dict_get_uint64(dict, "bytes-in", &bytes_in);
+	ni_dbus_dict_get_uint64(dict, "bytes-out", &bytes_out);
+	ni_dbus_dict_get_uint64(dict, "cpu-usec", &cpu_usec);
+
+	if (calls == 0)
+		return;
+
+	/* The ratio is always compressed vs uncompressed size */
+	raw = bytes_in > bytes_out? bytes_in : bytes_out;
+	packed = bytes_in > bytes_out? bytes_out : bytes_in;
+
+	printf("%-10s %-8s %10llu %10llu %14llu %14llu %6llu%% %12llu\n", name, dir,
+			(unsigned long long) calls, (unsigned long long) skipped,
+			(unsigned long long) bytes_in, (unsigned long long) bytes_out,
+			raw? (unsigned long long) (packed * 100 / raw) : 0ULL,
+			(unsigned long long) cpu_usec);
+}
+
+static int
+show_stats_codecs(ni_dbus_object_t *agent_object)
+{
+	ni_dbus_variant_t result = NI_DBUS_VARIANT_INIT;
+	const ni_dbus_variant_t *dict, *var;
+	const char *name;
+	unsigned int i;
+
+	if (!ni_testbus_client_get_codec_stats(agent_object, &result))
+		return 1;
+
+	printf("%-10s %-8s %10s %10s %14s %14s %7s %12s\n",
+			"codec", "", "calls", "skipped", "bytes-in", "bytes-out", "ratio", "cpu-usec");
+	for (i = 0; (dict = ni_dbus_dict_array_at(&result, i)) != NULL; ++i) {
+		if (!ni_dbus_dict_get_string(dict, "name", &name))
+			continue;
+		if ((var = ni_dbus_dict_get(dict, "encode")) != NULL)
+			show_stats_codec(name, "encode", var);
+		if ((var = ni_dbus_dict_get(dict, "decode")) != NULL)
+			show_stats_codec(name, "decode", var);
+	}
+
+	ni_dbus_variant_destroy(&result);
+	return 0;
+}
+
+static int
+do_show_stats(int argc, char **argv)
+{
+	enum  { OPT_HELP, OPT_HOST, OPT_RESET, OPT_BUFFERS, OPT_CODECS };
+	static struct option local_options[] = {
+		{ "help", no_argument, NULL, OPT_HELP },
+		{ "host", required_argument, NULL, OPT_HOST },
+		{ "reset", no_argument, NULL, OPT_RESET },
+		{ "buffers", no_argument, NULL, OPT_BUFFERS },
+		{ "codecs", no_argument, NULL, OPT_CODECS },
+		{ NULL }
+	};
+	ni_dbus_variant_t result = NI_DBUS_VARIANT_INIT;
+	ni_dbus_object_t *agent_object = NULL;
+	const ni_dbus_variant_t *var;
+	const char *opt_hostname = NULL;
+	ni_bool_t opt_reset = FALSE;
+	ni_bool_t opt_buffers = FALSE;
+	ni_bool_t opt_codecs = FALSE;
+	uint64_t iterations = 0;
+	unsigned int i;
+	int c, rv = 1;
+
+	optind = 1;
+	while ((c = getopt_long(argc, argv, "", local_options, NULL)) != EOF) {
+		switch (c) {
+		default:
+		case OPT_HELP:
+		usage:
+			fprintf(stderr,
+				"testbus [options] show-stats\n"
+				"\nSupported options:\n"
+				"  --host <hostname>\n"
+				"      Show the statistics of the agent running on the given host\n"
+				"      rather than those of the master.\n"
+				"  --reset\n"
+				"      Reset event loop statistics after displaying them.\n"
+				"  --buffers\n"
+				"      Show buffer pool statistics instead of event loop statistics.\n"
+				"  --codecs\n"
+				"      Show compression statistics instead of event loop statistics.\n"
+				"  --help\n"
+				"      Show this help text.\n"
+				);
+			return 1;
+
+		case OPT_HOST:
+			opt_hostname = optarg;
+			break;
+
+		case OPT_RESET:
+			opt_reset = TRUE;
+			break;
+
+		case OPT_BUFFERS:
+			opt_buffers = TRUE;
+			break;
+
+		case OPT_CODECS:
+			opt_codecs = TRUE;
+			break;
+		}
+	}
+
+	if (optind != argc)
+		goto usage;
+
+	if (opt_hostname && !(agent_object = ni_testbus_client_get_agent(opt_hostname)))
+		return 1;
+
+	if (opt_buffers)
+		return show_stats_buffer_pools(agent_object);
+	if (opt_codecs)
+		return show_stats_codecs(agent_object);
+
+	if (!ni_testbus_client_get_eventloop_stats(agent_object, opt_reset, &result))
+		goto out;
+
+	ni_dbus_dict_get_uint64(&result, "iterations", &iterations);
+	printf("%llu event loop iterations\n", (unsigned long long) iterations);
+	printf("%-40s %10s %10s %10s %10s %10s %10s\n", "callback",
+			"count", "avg-usec", "p50-usec", "p90-usec", "p99-usec", "max-usec");
+
+	if ((var = ni_dbus_dict_get(&result, "wait")) != NULL)
+		show_stats_latency(var);
+	if ((var = ni_dbus_dict_get(&result, "busy")) != NULL)
+		show_stats_latency(var);
+	if ((var = ni_dbus_dict_get(&result, "callbacks")) != NULL) {
+		const ni_dbus_variant_t *entry;
+
+		for (i = 0; (entry = ni_dbus_dict_array_at(var, i)) != NULL; ++i)
+			show_stats_latency(entry);
+	}
+	rv = 0;
+
+out:
+	ni_dbus_variant_destroy(&result);
+	return rv;
+}
+
 long
 ni_testbus_write_local_file(const char *filename, const ni_buffer_t *data)
 {
@@ -1965,6 +2524,7 @@ static struct client_command	client_command_table[] = {
 	{ "setenv",		do_setenv,		"Set environment variable in container"		},
 	{ "getenv",		do_getenv,		"Get container variable"			},
 	{ "get-events",		do_get_events,		"Get the event log"				},
+	{ "show-stats",		do_show_stats,		"Show event loop statistics"			},
 	{ "shutdown",		do_shutdown,		"Shutdown agent"				},
 	{ "reboot",		do_reboot,		"Reboot agent"					},
 
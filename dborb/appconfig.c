@@ -57,6 +57,9 @@ void
 ni_config_free(ni_config_t *conf)
 {
 	ni_string_free(&conf->dbus_name);
+	ni_string_free(&conf->spool_dir);
+	ni_string_free(&conf->process_cgroup);
+	ni_string_free(&conf->compression_codec);
 	ni_string_free(&conf->dbus_type);
 	ni_string_free(&conf->dbus_socket);
 	ni_config_fslocation_destroy(&conf->piddir);
@@ -115,6 +118,56 @@ __ni_config_parse(ni_config_t *conf, const char *filename, ni_init_appdata_callb
 			if ((attrval = xml_node_get_attr(child, "name")) != NULL)
 				ni_string_dup(&conf->dbus_xml_schema_file, attrval);
 		} else
+		if (strcmp(child->name, "eventloop") == 0) {
+			const char *attrval;
+
+			if ((attrval = xml_node_get_attr(child, "backend")) != NULL) {
+				if (!strcmp(attrval, "poll"))
+					conf->eventloop_backend = NI_CONFIG_EVENTLOOP_POLL;
+				else if (!strcmp(attrval, "epoll"))
+					conf->eventloop_backend = NI_CONFIG_EVENTLOOP_EPOLL;
+				else
+					ni_warn("%s: unknown event loop backend \"%s\"",
+							xml_node_location(child), attrval);
+			}
+		} else
+		if (strcmp(child->name, "buffer-pool") == 0) {
+			xml_node_get_attr_boolean(child, "poison", &conf->buffer_pool_poison);
+		} else
+		if (strcmp(child->name, "worker-pool") == 0) {
+			xml_node_get_attr_uint(child, "threads", &conf->worker_threads);
+		} else
+		if (strcmp(child->name, "spool") == 0) {
+			const char *attrval;
+
+			if ((attrval = xml_node_get_attr(child, "dir")) != NULL)
+				ni_string_dup(&conf->spool_dir, attrval);
+			xml_node_get_attr_uint(child, "threshold", &conf->spool_threshold);
+			xml_node_get_attr_uint(child, "max-file-size", &conf->file_size_max);
+			xml_node_get_attr_uint(child, "idle-timeout", &conf->spool_idle_timeout);
+		} else
+		if (strcmp(child->name, "process-accounting") == 0) {
+			const char *attrval;
+
+			if ((attrval = xml_node_get_attr(child, "cgroup")) != NULL)
+				ni_string_dup(&conf->process_cgroup, attrval);
+		} else
+		if (strcmp(child->name, "run-queue") == 0) {
+			xml_node_get_attr_uint(child, "slots", &conf->run_queue_slots);
+		} else
+		if (strcmp(child->name, "spawn-helper") == 0) {
+			xml_node_get_attr_boolean(child, "enabled", &conf->spawn_helper);
+		} else
+		if (strcmp(child->name, "file-cache") == 0) {
+			xml_node_get_attr_uint(child, "max-size", &conf->file_cache_size);
+		} else
+		if (strcmp(child->name, "compression") == 0) {
+			const char *attrval;
+
+			if ((attrval = xml_node_get_attr(child, "codec")) != NULL)
+				ni_string_dup(&conf->compression_codec, attrval);
+			xml_node_get_attr_uint(child, "min-size", &conf->compression_min_size);
+		} else
 		if (strcmp(child->name, "extension") == 0) {
 			if (!ni_config_parse_objectmodel_extension(conf, child))
 				goto failed;
@@ -54,11 +54,33 @@ typedef struct ni_config_fslocation {
 	unsigned int		mode;
 } ni_config_fslocation_t;
 
+enum {
+	NI_CONFIG_EVENTLOOP_DEFAULT = 0,
+	NI_CONFIG_EVENTLOOP_POLL,
+	NI_CONFIG_EVENTLOOP_EPOLL,
+};
+
 typedef struct ni_config {
 	ni_config_fslocation_t	piddir;
 	ni_config_fslocation_t	statedir;
 	ni_config_fslocation_t	backupdir;
 	unsigned int		recv_max;
+	unsigned int		eventloop_backend;
+	ni_bool_t		buffer_pool_poison;
+	unsigned int		worker_threads;
+
+	char *			spool_dir;
+	unsigned int		spool_threshold;
+	unsigned int		spool_idle_timeout;
+	unsigned int		file_size_max;
+
+	char *			process_cgroup;
+	unsigned int		run_queue_slots;
+	ni_bool_t		spawn_helper;
+	unsigned int		file_cache_size;
+
+	char *			compression_codec;
+	unsigned int		compression_min_size;
 
 	ni_extension_t *	dbus_extensions;
 	ni_extension_t *	ns_extensions;
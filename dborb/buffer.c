@@ -9,8 +9,251 @@
 #endif
 
 #include <dborb/buffer.h>
+#include <dborb/logging.h>
 #include "util_priv.h"
+#include "appconfig.h"
 
+/*
+ * Buffer pool.
+ *
+ * Size classes are powers of two from 256 bytes to 64K. Each buffer is
+ * a single malloc'ed chunk holding the ni_buffer_t header followed by
+ * the data, so a chunk that somehow loses track of its class can still
+ * be released with plain free(). Larger buffers bypass the pool.
+ *
+ * Each class caches at most NI_BUFFER_POOL_MAX_CACHED bytes worth of
+ * free chunks (but at least a few), the rest is returned to malloc.
+ *
+ * With <buffer-pool poison="true"/> in the config file, freed chunks are
+ * filled with a poison pattern that is verified when the chunk is handed
+ * out again, to catch writes to freed buffers.
+ */
+#define NI_BUFFER_POOL_MIN_SHIFT	8
+#define NI_BUFFER_POOL_CLASSES		9
+#define NI_BUFFER_POOL_OVERSIZE		(NI_BUFFER_POOL_CLASSES + 1)
+#define NI_BUFFER_POOL_MAX_CACHED	(256 * 1024)
+#define NI_BUFFER_POOL_MIN_CACHED	4
+#define NI_BUFFER_POISON		0x6b
+
+typedef struct ni_buffer_pool_chunk ni_buffer_pool_chunk_t;
+struct ni_buffer_pool_chunk {
+	ni_buffer_pool_chunk_t *next;
+};
+
+typedef struct ni_buffer_pool {
+	ni_buffer_pool_stats_t	stats;
+	unsigned int		max_cached;
+	ni_buffer_pool_chunk_t *free_list;
+} ni_buffer_pool_t;
+
+static ni_buffer_pool_t		ni_buffer_pools[NI_BUFFER_POOL_OVERSIZE];
+
+static inline ni_bool_t
+__ni_buffer_pool_poison(void)
+{
+	return ni_global.config && ni_global.config->buffer_pool_poison;
+}
+
+static ni_buffer_pool_t *
+__ni_buffer_pool(unsigned int pool_class)
+{
+	ni_buffer_pool_t *pool = &ni_buffer_pools[pool_class - 1];
+
+	if (pool->stats.size == 0 && pool_class != NI_BUFFER_POOL_OVERSIZE) {
+		pool->stats.size = 1 << (NI_BUFFER_POOL_MIN_SHIFT + pool_class - 1);
+		pool->max_cached = NI_BUFFER_POOL_MAX_CACHED / pool->stats.size;
+		if (pool->max_cached < NI_BUFFER_POOL_MIN_CACHED)
+			pool->max_cached = NI_BUFFER_POOL_MIN_CACHED;
+	}
+	return pool;
+}
+
+static unsigned int
+__ni_buffer_pool_class(size_t size)
+{
+	unsigned int pool_class;
+
+	for (pool_class = 1; pool_class <= NI_BUFFER_POOL_CLASSES; ++pool_class) {
+		if (size <= (1 << (NI_BUFFER_POOL_MIN_SHIFT + pool_class - 1)))
+			return pool_class;
+	}
+	return NI_BUFFER_POOL_OVERSIZE;
+}
+
+static ni_bool_t
+__ni_buffer_pool_check_poison(const ni_buffer_pool_t *pool, const ni_buffer_pool_chunk_t *chunk)
+{
+	const unsigned char *p = (const unsigned char *) (chunk + 1);
+	const unsigned char *end = (const unsigned char *) chunk + sizeof(ni_buffer_t) + pool->stats.size;
+
+	for (; p < end; ++p) {
+		if (*p != NI_BUFFER_POISON) {
+			ni_error("buffer pool: freed buffer %p was modified at offset %u",
+					chunk, (unsigned int) (p - (const unsigned char *) chunk));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+ni_buffer_t *
+ni_buffer_new(size_t size)
+{
+	unsigned int pool_class = __ni_buffer_pool_class(size);
+	ni_buffer_pool_t *pool = __ni_buffer_pool(pool_class);
+	ni_buffer_pool_chunk_t *chunk;
+	ni_buffer_t *bp = NULL;
+
+	while ((chunk = pool->free_list) != NULL) {
+		pool->free_list = chunk->next;
+		pool->stats.cached--;
+
+		if (__ni_buffer_pool_poison() && !__ni_buffer_pool_check_poison(pool, chunk)) {
+			free(chunk);
+			continue;
+		}
+
+		bp = (ni_buffer_t *) chunk;
+		memset(bp, 0, sizeof(*bp) + size);
+		pool->stats.hits++;
+		break;
+	}
+
+	if (bp == NULL) {
+		if (pool_class == NI_BUFFER_POOL_OVERSIZE)
+			bp = xcalloc(1, sizeof(*bp) + size);
+		else
+			bp = xcalloc(1, sizeof(*bp) + pool->stats.size);
+	}
+
+	ni_buffer_init(bp, (char *) (bp + 1), size);
+	bp->pool_class = pool_class;
+	bp->refcount = 1;
+
+	pool->stats.allocs++;
+	if (++(pool->stats.in_use) > pool->stats.high_water)
+		pool->stats.high_water = pool->stats.in_use;
+	return bp;
+}
+
+void
+ni_buffer_free(ni_buffer_t *bp)
+{
+	unsigned int pool_class = bp->pool_class;
+	ni_buffer_pool_chunk_t *chunk;
+	ni_buffer_pool_t *pool;
+
+	if (bp->refcount > 1) {
+		bp->refcount--;
+		return;
+	}
+
+	ni_buffer_destroy(bp);
+
+	/* Buffers from ni_buffer_new_dynamic() are not pooled */
+	if (pool_class == 0) {
+		free(bp);
+		return;
+	}
+
+	pool = __ni_buffer_pool(pool_class);
+	pool->stats.in_use--;
+
+	if (pool_class == NI_BUFFER_POOL_OVERSIZE || pool->stats.cached >= pool->max_cached) {
+		free(bp);
+		return;
+	}
+
+	chunk = (ni_buffer_pool_chunk_t *) bp;
+	if (__ni_buffer_pool_poison())
+		memset(chunk, NI_BUFFER_POISON, sizeof(ni_buffer_t) + pool->stats.size);
+	chunk->next = pool->free_list;
+	pool->free_list = chunk;
+	pool->stats.cached++;
+}
+
+/*
+ * Create a slice referring to len bytes at the given offset from the
+ * buffer's head. The slice shares storage with the original buffer,
+ * and keeps it alive until the slice is freed.
+ * Slices have no tailroom; ni_buffer_ensure_tailroom() will give the
+ * slice a private copy of its data.
+ */
+ni_buffer_t *
+ni_buffer_slice(ni_buffer_t *bp, size_t offset, size_t len)
+{
+	ni_buffer_t *slice;
+
+	if (offset + len > ni_buffer_count(bp))
+		return NULL;
+
+	slice = ni_buffer_new(0);
+	slice->base = (unsigned char *) ni_buffer_head(bp) + offset;
+	slice->size = slice->tail = len;
+	slice->backing = ni_buffer_hold(bp->backing? bp->backing : bp);
+	return slice;
+}
+
+/*
+ * Return all cached chunks to malloc
+ */
+void
+ni_buffer_pool_trim(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NI_BUFFER_POOL_OVERSIZE; ++i) {
+		ni_buffer_pool_t *pool = &ni_buffer_pools[i];
+		ni_buffer_pool_chunk_t *chunk;
+
+		while ((chunk = pool->free_list) != NULL) {
+			pool->free_list = chunk->next;
+			free(chunk);
+		}
+		pool->stats.cached = 0;
+	}
+}
+
+unsigned int
+ni_buffer_pool_get_stats(ni_buffer_pool_stats_t *stats, unsigned int max)
+{
+	unsigned int i;
+
+	for (i = 0; i < NI_BUFFER_POOL_OVERSIZE && i < max; ++i)
+		stats[i] = __ni_buffer_pool(i + 1)->stats;
+	return i;
+}
+
+void
+ni_buffer_pool_dump(void)
+{
+	unsigned int i;
+
+	ni_note("Buffer pool statistics:");
+	ni_note("  %-10s %12s %12s %10s %10s %10s", "size", "allocs", "hits", "in-use", "high-water", "cached");
+	for (i = 0; i < NI_BUFFER_POOL_OVERSIZE; ++i) {
+		const ni_buffer_pool_stats_t *stats = &__ni_buffer_pool(i + 1)->stats;
+		char sizebuf[32];
+
+		if (stats->allocs == 0)
+			continue;
+
+		if (stats->size)
+			snprintf(sizebuf, sizeof(sizebuf), "%lu", (unsigned long) stats->size);
+		else
+			snprintf(sizebuf, sizeof(sizebuf), "oversized");
+		ni_note("  %-10s %12llu %12llu %10u %10u %10u", sizebuf,
+				(unsigned long long) stats->allocs,
+				(unsigned long long) stats->hits,
+				stats->in_use, stats->high_water, stats->cached);
+	}
+}
+
+/*
+ * Grow the buffer so that it has room for at least min_room more bytes.
+ * We grow geometrically to avoid reallocating on every call when a buffer
+ * is filled incrementally.
+ */
 ni_bool_t
 ni_buffer_ensure_tailroom(ni_buffer_t *bp, unsigned int min_room)
 {
@@ -20,6 +263,8 @@ ni_buffer_ensure_tailroom(ni_buffer_t *bp, unsigned int min_room)
 		return TRUE;
 
 	new_size = bp->size + min_room;
+	if (new_size < 2 * bp->size)
+		new_size = 2 * bp->size;
 	if (bp->allocated) {
 		bp->base = xrealloc(bp->base, new_size);
 	} else {
@@ -66,6 +311,64 @@ ni_buffer_chain_count(const ni_buffer_chain_t *chain)
 	return count;
 }
 
+/*
+ * Fill an iovec array with the data in a buffer chain, so that it can be
+ * passed to writev() and friends without copying it into a single buffer
+ * first. Stops after max_iov entries or once max_bytes bytes have been
+ * gathered (the last entry is trimmed accordingly). A max_bytes value of 0
+ * means no limit.
+ * Returns the number of iovec entries used.
+ */
+unsigned int
+ni_buffer_chain_iovec(const ni_buffer_chain_t *chain, struct iovec *iov, unsigned int max_iov, size_t max_bytes)
+{
+	unsigned int n = 0;
+	size_t total = 0;
+
+	for (; chain && n < max_iov; chain = chain->next) {
+		size_t count = ni_buffer_count(chain->data);
+
+		if (count == 0)
+			continue;
+		if (max_bytes) {
+			if (total >= max_bytes)
+				break;
+			if (count > max_bytes - total)
+				count = max_bytes - total;
+		}
+
+		iov[n].iov_base = ni_buffer_head(chain->data);
+		iov[n].iov_len = count;
+		total += count;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Consume count bytes from the head of a buffer chain, freeing all buffers
+ * that have been drained completely.
+ */
+void
+ni_buffer_chain_pull(ni_buffer_chain_t **head, size_t count)
+{
+	ni_buffer_chain_t *chain;
+
+	while ((chain = *head) != NULL) {
+		ni_buffer_t *bp = chain->data;
+		size_t avail = ni_buffer_count(bp);
+
+		if (count < avail) {
+			ni_buffer_pull_head(bp, count);
+			break;
+		}
+
+		count -= avail;
+		ni_buffer_free(ni_buffer_chain_get_next(head));
+	}
+}
+
 ni_buffer_t *
 ni_buffer_chain_get_next(ni_buffer_chain_t **head)
 {
@@ -0,0 +1,306 @@
+/*
+ * Compression codecs for bulk data transfers.
+ *
+ * Test logs and the like compress very well, which makes a big
+ * difference when the agent talks to the master through a serial line.
+ * Compression is off by default; it is enabled by naming a codec in
+ * the config file using <compression codec="zlib"/>. The sender of a
+ * chunk of data picks the codec and tells the receiver which one it
+ * used, so every call negotiates this on its own, and peers that do not
+ * know about compression at all just keep using the plain methods.
+ *
+ * Small chunks are sent as is, because compressing them costs more
+ * than it saves. The same goes for data that does not get any smaller.
+ * For each codec, we count the number of bytes going in and out, and
+ * the CPU time spent, so that it is possible to tell whether
+ * compression actually pays off on a given link.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <dborb/codec.h>
+#include <dborb/buffer.h>
+#include <dborb/logging.h>
+#include <dborb/util.h>
+#include "appconfig.h"
+
+/*
+ * zlib
+ * We use the fastest compression level; on a slow link, this already
+ * gets us most of the benefit, and the agent may be running on a
+ * rather weak VM.
+ */
+static ni_bool_t
+__ni_codec_zlib_compress(const void *data, size_t len, ni_buffer_t *out)
+{
+	uLongf count = compressBound(len);
+
+	if (!ni_buffer_ensure_tailroom(out, count))
+		return FALSE;
+	if (compress2(ni_buffer_tail(out), &count, data, len, Z_BEST_SPEED) != Z_OK)
+		return FALSE;
+	ni_buffer_push_tail(out, count);
+	return TRUE;
+}
+
+static ni_bool_t
+__ni_codec_zlib_decompress(const void *data, size_t len, ni_buffer_t *out)
+{
+	uLongf count = ni_buffer_tailroom(out);
+
+	if (uncompress(ni_buffer_tail(out), &count, data, len) != Z_OK)
+		return FALSE;
+	ni_buffer_push_tail(out, count);
+	return TRUE;
+}
+
+static ni_codec_t		ni_codecs[] = {
+	{
+		.name		= "zlib",
+		.compress	= __ni_codec_zlib_compress,
+		.decompress	= __ni_codec_zlib_decompress,
+	},
+
+	{ .name = NULL }
+};
+
+ni_codec_t *
+ni_codec_by_name(const char *name)
+{
+	ni_codec_t *codec;
+
+	if (name == NULL)
+		return NULL;
+
+	for (codec = ni_codecs; codec->name; ++codec) {
+		if (!strcmp(codec->name, name))
+			return codec;
+	}
+	return NULL;
+}
+
+/*
+ * Return the codec we should use when sending data, or NULL if
+ * compression is disabled.
+ */
+ni_codec_t *
+ni_codec_default(void)
+{
+	static ni_bool_t warned = FALSE;
+	const char *name = NULL;
+	ni_codec_t *codec;
+
+	if (ni_global.config)
+		name = ni_global.config->compression_codec;
+	if (name == NULL || !strcmp(name, NI_CODEC_IDENTITY))
+		return NULL;
+
+	if ((codec = ni_codec_by_name(name)) == NULL && !warned) {
+		ni_warn("unknown compression codec \"%s\", not compressing data", name);
+		warned = TRUE;
+	}
+	return codec;
+}
+
+ni_codec_t *
+ni_codec_get(unsigned int index)
+{
+	if (index >= sizeof(ni_codecs) / sizeof(ni_codecs[0]) - 1)
+		return NULL;
+	return &ni_codecs[index];
+}
+
+static unsigned int
+__ni_codec_min_size(void)
+{
+	if (ni_global.config && ni_global.config->compression_min_size)
+		return ni_global.config->compression_min_size;
+	return NI_CODEC_DEFAULT_MIN_SIZE;
+}
+
+static uint64_t
+__ni_codec_cputime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Compress a chunk of data. Returns NULL if the data should rather be
+ * sent as is.
+ */
+ni_buffer_t *
+ni_codec_encode(ni_codec_t *codec, const void *data, size_t len)
+{
+	ni_codec_stats_t *stats = &codec->encode;
+	ni_buffer_t *out;
+	uint64_t begin;
+
+	stats->calls++;
+	if (len < __ni_codec_min_size()) {
+		stats->skipped++;
+		return NULL;
+	}
+
+	begin = __ni_codec_cputime();
+	out = ni_buffer_new(len);
+	if (!codec->compress(data, len, out) || ni_buffer_count(out) >= len) {
+		ni_buffer_free(out);
+		out = NULL;
+	}
+	stats->cpu_usec += __ni_codec_cputime() - begin;
+
+	if (out == NULL) {
+		stats->skipped++;
+		return NULL;
+	}
+
+	stats->bytes_in += len;
+	stats->bytes_out += ni_buffer_count(out);
+	return out;
+}
+
+/*
+ * Decompress a chunk of data, which must decode to exactly size bytes.
+ */
+ni_buffer_t *
+ni_codec_decode(ni_codec_t *codec, const void *data, size_t len, size_t size)
+{
+	ni_codec_stats_t *stats = &codec->decode;
+	ni_buffer_t *out;
+	uint64_t begin;
+
+	if (size > NI_CODEC_SIZE_MAX) {
+		ni_error("%s: refusing to decode %lu bytes of data", codec->name, (unsigned long) size);
+		return NULL;
+	}
+
+	begin = __ni_codec_cputime();
+	out = ni_buffer_new(size);
+	if (!codec->decompress(data, len, out) || ni_buffer_count(out) != size) {
+		ni_error("%s: unable to decode data (%lu bytes)", codec->name, (unsigned long) len);
+		ni_buffer_free(out);
+		out = NULL;
+	}
+	stats->cpu_usec += __ni_codec_cputime() - begin;
+	stats->calls++;
+
+	if (out) {
+		stats->bytes_in += len;
+		stats->bytes_out += size;
+	}
+	return out;
+}
+
+static void
+__ni_codec_dump_stats(const char *name, const char *dir, const ni_codec_stats_t *stats)
+{
+	uint64_t big, small;
+
+	if (stats->calls == 0)
+		return;
+
+	/* Ratio is always compressed vs uncompressed size */
+	big = stats->bytes_in > stats->bytes_out? stats->bytes_in : stats->bytes_out;
+	small = stats->bytes_in > stats->bytes_out? stats->bytes_out : stats->bytes_in;
+
+	ni_note("  %-10s %-8s %10llu %10llu %14llu %14llu %6llu%% %12llu",
+			name, dir,
+			(unsigned long long) stats->calls,
+			(unsigned long long) stats->skipped,
+			(unsigned long long) stats->bytes_in,
+			(unsigned long long) stats->bytes_out,
+			big? (unsigned long long) (small * 100 / big) : 0ULL,
+			(unsigned long long) stats->cpu_usec);
+}
+
+void
+ni_codec_dump(void)
+{
+	ni_codec_t *codec;
+
+	ni_note("Compression statistics:");
+	ni_note("  %-10s %-8s %10s %10s %14s %14s %7s %12s",
+			"codec", "", "calls", "skipped", "bytes-in", "bytes-out", "ratio", "cpu-usec");
+	for (codec = ni_codecs; codec->name; ++codec) {
+		__ni_codec_dump_stats(codec->name, "encode", &codec->encode);
+		__ni_codec_dump_stats(codec->name, "decode", &codec->decode);
+	}
+}
+
+/*
+ * Encoded data is passed over D-Bus as three values: the name of the
+ * codec (or "identity"), the size of the decoded data, and the data
+ * itself. Methods that return encoded data wrap these in a dict.
+ */
+void
+ni_codec_encode_dict(ni_codec_t *codec, const void *data, size_t len, ni_dbus_variant_t *dict)
+{
+	ni_buffer_t *encoded = NULL;
+
+	if (codec && len)
+		encoded = ni_codec_encode(codec, data, len);
+
+	ni_dbus_variant_init_dict(dict);
+	ni_dbus_dict_add_string(dict, "encoding", encoded? codec->name : NI_CODEC_IDENTITY);
+	ni_dbus_dict_add_uint32(dict, "size", len);
+	if (encoded) {
+		ni_dbus_dict_add_byte_array(dict, "data", ni_buffer_head(encoded), ni_buffer_count(encoded));
+		ni_buffer_free(encoded);
+	} else {
+		ni_dbus_dict_add_byte_array(dict, "data", data, len);
+	}
+}
+
+ni_buffer_t *
+ni_codec_decode_dict(const ni_dbus_variant_t *dict, DBusError *error)
+{
+	const ni_dbus_variant_t *data;
+	const char *encoding;
+	uint32_t size;
+
+	if (!ni_dbus_dict_get_string(dict, "encoding", &encoding)
+	 || !ni_dbus_dict_get_uint32(dict, "size", &size)
+	 || !(data = ni_dbus_dict_get(dict, "data"))) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "incomplete encoded data");
+		return NULL;
+	}
+
+	return ni_codec_decode_data(encoding, size, data, error);
+}
+
+ni_buffer_t *
+ni_codec_decode_data(const char *encoding, uint32_t size, const ni_dbus_variant_t *data, DBusError *error)
+{
+	ni_buffer_t *result;
+	ni_codec_t *codec;
+
+	if (!ni_dbus_variant_is_byte_array(data)) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "encoded data is not a byte array");
+		return NULL;
+	}
+
+	if (!strcmp(encoding, NI_CODEC_IDENTITY)) {
+		if (data->array.len != size) {
+			dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "data size mismatch");
+			return NULL;
+		}
+		result = ni_buffer_new(size);
+		ni_buffer_put(result, data->byte_array_value, size);
+		return result;
+	}
+
+	if ((codec = ni_codec_by_name(encoding)) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_NOT_SUPPORTED, "unsupported encoding \"%s\"", encoding);
+		return NULL;
+	}
+
+	if (!(result = ni_codec_decode(codec, data->byte_array_value, data->array.len, size)))
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "unable to decode %s data", encoding);
+	return result;
+}
@@ -78,6 +78,16 @@ ni_dbus_client_create(ni_dbus_connection_t *connection, const char *bus_name)
 	return client;
 }
 
+/*
+ * Create a client handle for talking to a different service over
+ * the connection of an existing client.
+ */
+ni_dbus_client_t *
+ni_dbus_client_open_peer(const ni_dbus_client_t *client, const char *bus_name)
+{
+	return ni_dbus_client_create(client->connection, bus_name);
+}
+
 /*
  * Destructor for DBus client handle
  */
@@ -394,58 +404,67 @@ out:
 	return rv;
 }
 
-dbus_bool_t
-ni_dbus_object_call_variant(const ni_dbus_object_t *proxy,
-					const char *interface_name, const char *method,
-					unsigned int nargs, const ni_dbus_variant_t *args,
-					unsigned int maxres, ni_dbus_variant_t *res,
-					DBusError *error)
+/*
+ * Find the interface providing the given method. If several interfaces
+ * provide it, pick the most specific one.
+ */
+static const char *
+__ni_dbus_object_method_interface(const ni_dbus_object_t *proxy, const char *method, DBusError *error)
 {
-	ni_dbus_message_t *call = NULL, *reply = NULL;
-	ni_dbus_client_t *client;
-	dbus_bool_t rv = FALSE;
-	int nres;
-
-	if (!interface_name) {
-		const ni_dbus_service_t **pos, *service, *best = NULL;
+	const ni_dbus_service_t **pos, *service, *best = NULL;
+	const char *interface_name;
 
-		pos = proxy->interfaces;
-		while (pos && (service = *pos++) != NULL) {
-			if (ni_dbus_service_get_method(service, method) == NULL)
-				continue;
+	pos = proxy->interfaces;
+	while (pos && (service = *pos++) != NULL) {
+		if (ni_dbus_service_get_method(service, method) == NULL)
+			continue;
 
-			if (best == NULL) {
-				best = service;
+		if (best == NULL) {
+			best = service;
+		} else
+		if (best->compatible && service->compatible) {
+			if (ni_dbus_class_is_subclass(best->compatible, service->compatible)) {
+				/* best is more specific than service */
 			} else
-			if (best->compatible && service->compatible) {
-				if (ni_dbus_class_is_subclass(best->compatible, service->compatible)) {
-					/* best is more specific than service */
-				} else
-				if (ni_dbus_class_is_subclass(service->compatible, best->compatible)) {
-					/* service is more specific than best */
-					best = service;
-				} else {
-					dbus_set_error(error, DBUS_ERROR_UNKNOWN_METHOD,
-							"%s: several dbus interfaces provide method %s",
-							proxy->path, method);
-					return FALSE;
-				}
+			if (ni_dbus_class_is_subclass(service->compatible, best->compatible)) {
+				/* service is more specific than best */
+				best = service;
+			} else {
+				dbus_set_error(error, DBUS_ERROR_UNKNOWN_METHOD,
+						"%s: several dbus interfaces provide method %s",
+						proxy->path, method);
+				return NULL;
 			}
 		}
-
-		if (best != NULL)
-			interface_name = best->name;
 	}
 
-	if (interface_name == NULL)
-		interface_name = ni_dbus_object_get_default_interface(proxy);
+	if (best != NULL)
+		return best->name;
 
+	interface_name = ni_dbus_object_get_default_interface(proxy);
 	if (interface_name == NULL) {
 		dbus_set_error(error, DBUS_ERROR_UNKNOWN_METHOD,
 				"%s: no registered dbus interface provides method %s",
 				proxy->path, method);
-		return FALSE;
 	}
+	return interface_name;
+}
+
+dbus_bool_t
+ni_dbus_object_call_variant(const ni_dbus_object_t *proxy,
+					const char *interface_name, const char *method,
+					unsigned int nargs, const ni_dbus_variant_t *args,
+					unsigned int maxres, ni_dbus_variant_t *res,
+					DBusError *error)
+{
+	ni_dbus_message_t *call = NULL, *reply = NULL;
+	ni_dbus_client_t *client;
+	dbus_bool_t rv = FALSE;
+	int nres;
+
+	if (interface_name == NULL
+	 && !(interface_name = __ni_dbus_object_method_interface(proxy, method, error)))
+		return FALSE;
 
 	if (!(client = ni_dbus_object_get_client(proxy))) {
 		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "%s: bad proxy object", __FUNCTION__);
@@ -512,6 +531,82 @@ ni_dbus_object_call_async(ni_dbus_object_t *proxy,
 	return rv;
 }
 
+/*
+ * Same as above, but with the arguments given as a vector of variants.
+ * The callback is invoked with the reply or error message; if the call could
+ * not be sent at all, a negative error code is returned, and the callback is
+ * never invoked.
+ */
+int
+ni_dbus_object_call_variant_async(ni_dbus_object_t *proxy,
+			const char *interface_name, const char *method,
+			unsigned int nargs, const ni_dbus_variant_t *args,
+			ni_dbus_async_callback_t *callback)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_message_t *call = NULL;
+	ni_dbus_client_t *client;
+	int rv;
+
+	ni_debug_dbus("%s(%s, %s)", __FUNCTION__, method, proxy->path);
+	if (!(client = ni_dbus_object_get_client(proxy)))
+		return -NI_ERROR_INVALID_ARGS;
+
+	if (interface_name == NULL
+	 && !(interface_name = __ni_dbus_object_method_interface(proxy, method, &error))) {
+		rv = -NI_ERROR_METHOD_NOT_SUPPORTED;
+		goto out;
+	}
+
+	call = __ni_dbus_object_new_message(proxy, interface_name, method);
+	if (call == NULL) {
+		rv = -NI_ERROR_GENERAL_FAILURE;
+		goto out;
+	}
+
+	if (nargs && !ni_dbus_message_serialize_variants(call, nargs, args, &error)) {
+		rv = -NI_ERROR_INVALID_ARGS;
+		goto out;
+	}
+
+	rv = ni_dbus_connection_call_async(client->connection,
+			call, client->call_timeout,
+			callback, proxy);
+
+out:
+	if (dbus_error_is_set(&error))
+		ni_error("%s.%s(): %s", proxy->path, method, error.message);
+	if (call)
+		dbus_message_unref(call);
+	dbus_error_free(&error);
+	return rv;
+}
+
+/*
+ * Block until all async calls issued through this proxy have completed
+ */
+void
+ni_dbus_object_wait_async(ni_dbus_object_t *proxy)
+{
+	ni_dbus_client_t *client;
+
+	if ((client = ni_dbus_object_get_client(proxy)) != NULL)
+		ni_dbus_connection_wait_async(client->connection, proxy);
+}
+
+/*
+ * Check whether we can pass file descriptors to the server
+ */
+ni_bool_t
+ni_dbus_object_can_pass_fds(const ni_dbus_object_t *proxy)
+{
+	ni_dbus_client_t *client;
+
+	if ((client = ni_dbus_object_get_client(proxy)) == NULL)
+		return FALSE;
+	return ni_dbus_connection_can_pass_fds(client->connection);
+}
+
 /*
  * Use ObjectManager.GetManagedObjects to retrieve (part of)
  * the server's object hierarchy
@@ -7,6 +7,8 @@
 #include "config.h"
 #endif
 
+#include <unistd.h>
+
 #include <dborb/util.h>
 #include <dborb/logging.h>
 #include <dborb/dbus-errors.h>
@@ -220,7 +222,8 @@ __ni_dbus_variant_change_type(ni_dbus_variant_t *var, int new_type)
 		if (var->type == DBUS_TYPE_STRING
 		 || var->type == DBUS_TYPE_OBJECT_PATH
 		 || var->type == DBUS_TYPE_ARRAY
-		 || var->type == DBUS_TYPE_STRUCT)
+		 || var->type == DBUS_TYPE_STRUCT
+		 || var->type == DBUS_TYPE_UNIX_FD)
 			ni_dbus_variant_destroy(var);
 	}
 	var->type = new_type;
@@ -366,6 +369,19 @@ ni_dbus_variant_set_double(ni_dbus_variant_t *var, double value)
 	var->double_value = value;
 }
 
+/*
+ * The variant takes ownership of the file descriptor, and closes it
+ * when destroyed. When the variant is serialized, libdbus duplicates
+ * the descriptor; when deserializing, we receive a descriptor of our own.
+ */
+void
+ni_dbus_variant_set_unix_fd(ni_dbus_variant_t *var, int fd)
+{
+	ni_dbus_variant_destroy(var);
+	var->type = DBUS_TYPE_UNIX_FD;
+	var->unix_fd_value = fd;
+}
+
 /*
  * Get simple types from a variant
  */
@@ -469,6 +485,18 @@ ni_dbus_variant_get_double(const ni_dbus_variant_t *var, double *ret)
 	return TRUE;
 }
 
+/*
+ * The descriptor returned is still owned by the variant
+ */
+dbus_bool_t
+ni_dbus_variant_get_unix_fd(const ni_dbus_variant_t *var, int *ret)
+{
+	if (var->type != DBUS_TYPE_UNIX_FD || var->unix_fd_value < 0)
+		return FALSE;
+	*ret = var->unix_fd_value;
+	return TRUE;
+}
+
 /*
  * The following functions "cast" the value of a variant integer to a
  * C type, and vice versa.
@@ -658,6 +686,30 @@ ni_dbus_variant_set_byte_array(ni_dbus_variant_t *var,
 	}
 }
 
+/*
+ * Gather data from an iovec array into a byte array. Together with
+ * ni_buffer_chain_iovec(), this avoids having to coalesce a buffer chain
+ * into a temporary buffer first.
+ */
+void
+ni_dbus_variant_set_byte_array_iovec(ni_dbus_variant_t *var,
+				const struct iovec *iov, unsigned int iovcnt)
+{
+	unsigned int i, len = 0;
+
+	ni_dbus_variant_destroy(var);
+	__ni_dbus_init_array(var, DBUS_TYPE_BYTE);
+
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+
+	__ni_dbus_array_grow(var, sizeof(unsigned char), len);
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(var->byte_array_value + var->array.len, iov[i].iov_base, iov[i].iov_len);
+		var->array.len += iov[i].iov_len;
+	}
+}
+
 dbus_bool_t
 ni_dbus_variant_append_byte_array(ni_dbus_variant_t *var, unsigned char byte)
 {
@@ -802,7 +854,10 @@ ni_dbus_variant_destroy(ni_dbus_variant_t *var)
 	if (var->type == DBUS_TYPE_STRING
 	 || var->type == DBUS_TYPE_OBJECT_PATH)
 		ni_string_free(&var->string_value);
-	else if (var->type == DBUS_TYPE_ARRAY) {
+	else if (var->type == DBUS_TYPE_UNIX_FD) {
+		if (var->unix_fd_value >= 0)
+			close(var->unix_fd_value);
+	} else if (var->type == DBUS_TYPE_ARRAY) {
 		unsigned int i;
 
 		switch (var->array.element_type) {
@@ -895,6 +950,10 @@ ni_dbus_variant_sprint(const ni_dbus_variant_t *var)
 		snprintf(buffer, sizeof(buffer), "%f", var->double_value);
 		break;
 
+	case DBUS_TYPE_UNIX_FD:
+		snprintf(buffer, sizeof(buffer), "<fd %d>", var->unix_fd_value);
+		break;
+
 	case DBUS_TYPE_STRUCT:
 		return "<struct>";
 
@@ -1498,6 +1557,16 @@ ni_dbus_dict_get_uint16(const ni_dbus_variant_t *dict, const char *key, uint16_t
 	return ni_dbus_variant_get_uint16(var, value);
 }
 
+dbus_bool_t
+ni_dbus_dict_get_int32(const ni_dbus_variant_t *dict, const char *key, int32_t *value)
+{
+	const ni_dbus_variant_t *var;
+
+	if (!(var = ni_dbus_dict_get(dict, key)))
+		return FALSE;
+	return ni_dbus_variant_get_int32(var, value);
+}
+
 dbus_bool_t
 ni_dbus_dict_get_uint32(const ni_dbus_variant_t *dict, const char *key, uint32_t *value)
 {
@@ -1722,6 +1791,7 @@ static const char * __ni_dbus_basic_type_as_string[256] = {
 [DBUS_TYPE_DOUBLE]	= DBUS_TYPE_DOUBLE_AS_STRING,
 [DBUS_TYPE_STRING]	= DBUS_TYPE_STRING_AS_STRING,
 [DBUS_TYPE_OBJECT_PATH]	= DBUS_TYPE_OBJECT_PATH_AS_STRING,
+[DBUS_TYPE_UNIX_FD]	= DBUS_TYPE_UNIX_FD_AS_STRING,
 };
 
 const char *
@@ -1748,4 +1818,5 @@ __ni_dbus_variant_offsets[256] = {
 [DBUS_TYPE_INT64]		= offsetof(ni_dbus_variant_t, int64_value),
 [DBUS_TYPE_UINT64]		= offsetof(ni_dbus_variant_t, uint64_value),
 [DBUS_TYPE_DOUBLE]		= offsetof(ni_dbus_variant_t, double_value),
+[DBUS_TYPE_UNIX_FD]		= offsetof(ni_dbus_variant_t, unix_fd_value),
 };
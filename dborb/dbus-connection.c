@@ -14,6 +14,7 @@
 #include <dborb/logging.h>
 #include <dborb/dbus-errors.h>
 #include <dborb/process.h>
+#include <dborb/workqueue.h>
 #include "socket_priv.h"
 #include "util_priv.h"
 #include "dbus-connection.h"
@@ -39,6 +40,10 @@ struct ni_dbus_async_server_call {
 	const ni_dbus_method_t *method;
 	DBusMessage *		call_message;
 	ni_process_t *		sub_process;
+
+	/* For calls handed to the worker pool */
+	ni_dbus_connection_t *	connection;
+	ni_work_t *		work;
 };
 
 typedef struct ni_dbus_sigaction ni_dbus_sigaction_t;
@@ -290,6 +295,13 @@ ni_dbus_connection_free(ni_dbus_connection_t *dbc)
 		ni_dbus_async_server_call_t *async = dbc->async_server_calls;
 
 		dbc->async_server_calls = async->next;
+
+		/* We cannot cancel work that is being processed by a worker
+		 * thread; just orphan it, and drop the reply when it completes. */
+		if (async->work) {
+			async->connection = NULL;
+			continue;
+		}
 		__ni_dbus_async_server_call_free(async);
 	}
 
@@ -435,6 +447,54 @@ __ni_dbus_notify_async(DBusPendingCall *pending, void *call_data)
 	__ni_dbus_process_pending(conn, pending);
 }
 
+/*
+ * Wait for all async calls issued through the given proxy to complete,
+ * and invoke their callbacks. This blocks on the pending calls directly
+ * rather than going through the main loop, so it can also be used from
+ * within a dbus callback.
+ */
+void
+ni_dbus_connection_wait_async(ni_dbus_connection_t *connection, const ni_dbus_object_t *proxy)
+{
+	ni_dbus_async_client_call_t *async, *oldest;
+
+	while (TRUE) {
+		DBusPendingCall *call;
+
+		/* The list is in LIFO order; start with the oldest call */
+		oldest = NULL;
+		for (async = connection->async_client_calls; async; async = async->next) {
+			if (async->proxy == proxy)
+				oldest = async;
+		}
+		if (oldest == NULL)
+			break;
+
+		call = dbus_pending_call_ref(oldest->call);
+		dbus_pending_call_block(call);
+
+		/* Completing the call should have invoked the notify function.
+		 * If it did not, process the reply ourselves. */
+		for (async = connection->async_client_calls; async; async = async->next) {
+			if (async->call == call) {
+				__ni_dbus_process_pending(connection, call);
+				break;
+			}
+		}
+		dbus_pending_call_unref(call);
+	}
+}
+
+/*
+ * File descriptors can only be passed over local sockets, and only if
+ * both ends agreed to do so when authenticating.
+ */
+ni_bool_t
+ni_dbus_connection_can_pass_fds(const ni_dbus_connection_t *connection)
+{
+	return dbus_connection_can_send_type(connection->conn, DBUS_TYPE_UNIX_FD);
+}
+
 /*
  * Send a message out
  */
@@ -675,6 +735,73 @@ ni_dbus_async_server_call_run_command(ni_dbus_connection_t *conn,
 	return 0;
 }
 
+/*
+ * Server side: hand the call to the worker pool.
+ * When the work item is done, we invoke the method's async_work_completion
+ * function to build the reply, and send it out.
+ */
+static void
+__ni_dbus_async_server_work_callback(ni_work_t *work)
+{
+	ni_dbus_async_server_call_t **pos, *async = work->owner;
+	ni_dbus_connection_t *conn = async->connection;
+	const ni_dbus_method_t *method = async->method;
+	DBusError error = DBUS_ERROR_INIT;
+	DBusMessage *reply;
+
+	if (conn != NULL) {
+		for (pos = &conn->async_server_calls; *pos; pos = &(*pos)->next) {
+			if (*pos == async) {
+				*pos = async->next;
+				break;
+			}
+		}
+	}
+	async->work = NULL;
+
+	reply = dbus_message_new_method_return(async->call_message);
+	if (!method->async_work_completion(method, work, reply, &error)) {
+		dbus_message_unref(reply);
+		if (!dbus_error_is_set(&error))
+			dbus_set_error(&error, DBUS_ERROR_FAILED, "Unexpected error in method call");
+		reply = dbus_message_new_error(async->call_message, error.name, error.message);
+	}
+
+	if (conn == NULL)
+		ni_debug_dbus("%s: connection went away, discarding reply", method->name);
+	else if (ni_dbus_connection_send_message(conn, reply) < 0)
+		ni_error("unable to send reply (out of memory)");
+
+	dbus_error_free(&error);
+	dbus_message_unref(reply);
+	__ni_dbus_async_server_call_free(async);
+}
+
+void
+ni_dbus_async_server_call_run_work(ni_dbus_connection_t *conn,
+					const ni_dbus_method_t *method,
+					DBusMessage *call_message,
+					ni_work_t *work)
+{
+	ni_dbus_async_server_call_t *async;
+
+	ni_assert(method->async_work_completion);
+
+	async = __ni_dbus_async_server_call_new(conn, method, call_message);
+	async->connection = conn;
+	async->work = work;
+
+	work->complete = __ni_dbus_async_server_work_callback;
+	work->owner = async;
+
+	/* If we cannot start any worker threads, do the work right here */
+	if (!ni_work_submit(work)) {
+		ni_warn("%s: unable to queue work, executing synchronously", method->name);
+		work->run(work);
+		work->complete(work);
+	}
+}
+
 /*
  * Get the uid of the process having sent us a specific message
  */
@@ -804,7 +931,7 @@ __ni_dbus_watch_handle(const char *func, ni_socket_t *sock, int flags)
 #endif
 	}
 
-	sock->poll_flags = poll_flags;
+	ni_socket_set_poll_flags(sock, poll_flags);
 	if (!found)
 		ni_warn("%s: dead socket", func);
 }
@@ -876,6 +1003,7 @@ __ni_dbus_add_watch(DBusWatch *watch, void *data)
 
 	if (sock == NULL) {
 		sock = ni_socket_wrap(dbus_watch_get_socket(watch), -1);
+		sock->name = "dbus";
 		sock->close = __ni_dbus_watch_close;
 		sock->receive = __ni_dbus_watch_recv;
 		sock->transmit = __ni_dbus_watch_send;
@@ -24,6 +24,8 @@ extern ni_dbus_message_t *	ni_dbus_connection_call(ni_dbus_connection_t *connect
 extern int			ni_dbus_connection_call_async(ni_dbus_connection_t *connection,
 					ni_dbus_message_t *call, unsigned int timeout,
 					ni_dbus_async_callback_t *callback, ni_dbus_object_t *proxy);
+extern void			ni_dbus_connection_wait_async(ni_dbus_connection_t *, const ni_dbus_object_t *);
+extern ni_bool_t		ni_dbus_connection_can_pass_fds(const ni_dbus_connection_t *);
 extern int			ni_dbus_connection_send_message(ni_dbus_connection_t *, ni_dbus_message_t *);
 extern void			ni_dbus_connection_send_error(ni_dbus_connection_t *, ni_dbus_message_t *, DBusError *);
 extern void			ni_dbus_add_signal_handler(ni_dbus_connection_t *conn,
@@ -39,6 +41,10 @@ extern int			ni_dbus_async_server_call_run_command(ni_dbus_connection_t *conn,
 					const ni_dbus_method_t *method,
 					DBusMessage *call_message,
 					ni_process_t *process);
+extern void			ni_dbus_async_server_call_run_work(ni_dbus_connection_t *conn,
+					const ni_dbus_method_t *method,
+					DBusMessage *call_message,
+					ni_work_t *work);
 extern void			ni_dbus_mainloop(ni_dbus_connection_t *);
 
 extern int			ni_dbus_connection_get_caller_uid(ni_dbus_connection_t *, const char *, uid_t *);
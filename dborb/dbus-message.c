@@ -23,19 +23,16 @@ ni_dbus_message_iter_append_byte_array(DBusMessageIter *iter,
 				const unsigned char *value, unsigned int len)
 {
 	DBusMessageIter iter_array;
-	unsigned int i;
 
 	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
 					      DBUS_TYPE_BYTE_AS_STRING,
 					      &iter_array))
 		return FALSE;
 
-	for (i = 0; i < len; i++) {
-		if (!dbus_message_iter_append_basic(&iter_array,
-						    DBUS_TYPE_BYTE,
-						    &(value[i])))
-			return FALSE;
-	}
+	if (!dbus_message_iter_append_fixed_array(&iter_array,
+						  DBUS_TYPE_BYTE,
+						  &value, len))
+		return FALSE;
 
 	if (!dbus_message_iter_close_container(iter, &iter_array))
 		return FALSE;
@@ -298,16 +295,14 @@ ni_dbus_message_iter_append_variant(DBusMessageIter *iter, const ni_dbus_variant
 dbus_bool_t
 ni_dbus_message_iter_get_byte_array(DBusMessageIter *iter, ni_dbus_variant_t *variant)
 {
-	ni_dbus_variant_init_byte_array(variant);
-
-	while (dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_BYTE) {
-		unsigned char byte;
-
-		dbus_message_iter_get_basic(iter, &byte);
-		ni_dbus_variant_append_byte_array(variant, byte);
-		dbus_message_iter_next(iter);
-	}
+	const unsigned char *data = NULL;
+	int len = 0;
 
+	/* Fetch the whole array at once. Appending byte by byte grows the
+	 * array in small increments, which gets very slow for large file
+	 * chunks. */
+	dbus_message_iter_get_fixed_array(iter, &data, &len);
+	ni_dbus_variant_set_byte_array(variant, data, len);
 	return TRUE;
 }
 
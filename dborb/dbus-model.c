@@ -524,6 +524,10 @@ __ni_dbus_method_bind(ni_dbus_method_t *method, const ni_dbus_method_t *binding)
 
 	method->handler = binding->handler;
 	method->handler_ex = binding->handler_ex;
+	method->async_handler = binding->async_handler;
+	method->async_completion = binding->async_completion;
+	method->async_work_handler = binding->async_work_handler;
+	method->async_work_completion = binding->async_work_completion;
 	return TRUE;
 }
 
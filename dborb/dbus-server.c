@@ -674,7 +674,7 @@ __ni_dbus_object_message(DBusConnection *conn, DBusMessage *call, void *user_dat
 
 	method = ni_dbus_service_get_method(svc, method_name);
 	if (method == NULL
-	 || (!method->handler && !method->handler_ex && !method->async_handler)) {
+	 || (!method->handler && !method->handler_ex && !method->async_handler && !method->async_work_handler)) {
 		ni_error("No server side handler for method %s.%s", interface, method_name);
 		dbus_set_error(&error,
 				DBUS_ERROR_UNKNOWN_METHOD,
@@ -718,7 +718,7 @@ __ni_dbus_object_message(DBusConnection *conn, DBusMessage *call, void *user_dat
 			goto error_reply;
 		}
 
-		if (method->handler || method->handler_ex) {
+		if (method->handler || method->handler_ex || method->async_work_handler) {
 			/* Deserialize dbus message */
 			argc = ni_dbus_message_get_args_variants(call, argv, 16);
 			if (argc < 0) {
@@ -748,14 +748,24 @@ __ni_dbus_object_message(DBusConnection *conn, DBusMessage *call, void *user_dat
 				}
 			}
 
-			/* Allocate a reply message */
-			reply = dbus_message_new_method_return(call);
+			if (method->async_work_handler) {
+				ni_work_t *work;
 
-			/* Now do the call. */
-			if (method->handler_ex) {
-				rv = method->handler_ex(object, &call_ctx, reply, &error);
+				/* The reply is sent when the work is complete */
+				work = method->async_work_handler(object, method, argc, argv, &error);
+				if (work != NULL)
+					ni_dbus_async_server_call_run_work(server->connection, method, call, work);
+				rv = (work != NULL);
 			} else {
-				rv = method->handler(object, method, argc, argv, reply, &error);
+				/* Allocate a reply message */
+				reply = dbus_message_new_method_return(call);
+
+				/* Now do the call. */
+				if (method->handler_ex) {
+					rv = method->handler_ex(object, &call_ctx, reply, &error);
+				} else {
+					rv = method->handler(object, method, argc, argv, reply, &error);
+				}
 			}
 
 			/* Beware, object may be gone after this! */
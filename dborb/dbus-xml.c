@@ -1344,6 +1344,7 @@ ni_dbus_define_scalar_types(ni_xs_scope_t *typedict)
 		{ "int32",	DBUS_TYPE_INT32 },
 		{ "int64",	DBUS_TYPE_INT64 },
 		{ "object-path",DBUS_TYPE_OBJECT_PATH },
+		{ "unix-fd",	DBUS_TYPE_UNIX_FD },
 		{ "flag",	DBUS_TYPE_INVALID },
 
 		{ NULL }
@@ -8,12 +8,14 @@
 #endif
 
 #include <signal.h>
+#include <stdlib.h>
 #include <limits.h>
 
 #include <dborb/netinfo.h>
 #include "appconfig.h"
 
 #define NI_DEFAULT_CONFIG_PATH	TESTBUS_CONFIGDIR "/config.xml"
+#define NI_DEFAULT_SPOOLDIR	"/var/tmp"
 
 
 /*
@@ -84,6 +86,79 @@ ni_config_piddir(void)
 	return fsloc->path;
 }
 
+/*
+ * Large files are spooled to disk rather than kept in memory.
+ * The threshold and maximum file size are 0 unless configured, in which
+ * case the caller should use its own defaults.
+ */
+const char *
+ni_config_spooldir(void)
+{
+	const char *path = ni_global.config->spool_dir;
+
+	if (path == NULL && (path = getenv("TMPDIR")) == NULL)
+		path = NI_DEFAULT_SPOOLDIR;
+	return path;
+}
+
+unsigned int
+ni_config_spool_threshold(void)
+{
+	return ni_global.config->spool_threshold;
+}
+
+/*
+ * Number of seconds after which the master spools files that have
+ * not changed. 0 means never.
+ */
+unsigned int
+ni_config_spool_idle_timeout(void)
+{
+	return ni_global.config->spool_idle_timeout;
+}
+
+unsigned int
+ni_config_file_size_max(void)
+{
+	return ni_global.config->file_size_max;
+}
+
+/*
+ * The cgroup v2 directory below which commands get their own cgroup
+ * for resource accounting. NULL if not configured.
+ */
+const char *
+ni_config_process_cgroup(void)
+{
+	return ni_global.config->process_cgroup;
+}
+
+/*
+ * The number of commands an agent runs concurrently. 0 unless configured,
+ * in which case the agent picks a default based on the number of CPUs.
+ */
+unsigned int
+ni_config_run_queue_slots(void)
+{
+	return ni_global.config->run_queue_slots;
+}
+
+ni_bool_t
+ni_config_spawn_helper(void)
+{
+	return ni_global.config->spawn_helper;
+}
+
+/*
+ * Size limit of the agent's on-disk file cache. 0 unless configured,
+ * in which case the agent uses its own default.
+ */
+unsigned int
+ni_config_file_cache_size(void)
+{
+	return ni_global.config->file_cache_size;
+}
+
 const char *
 ni_config_statedir(void)
 {
@@ -0,0 +1,254 @@
+/*
+ * Event loop instrumentation.
+ *
+ * We keep latency histograms for every kind of socket callback and
+ * every timer callback the main loop dispatches, plus the time spent
+ * sleeping in poll vs the time spent doing work. The numbers can be
+ * dumped to the log by sending the process a signal (see
+ * ni_loopstats_catch_signal), or queried over D-Bus. The signal also
+ * dumps the buffer pool and compression statistics.
+ */
+
+#include <sys/time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include <dborb/loopstats.h>
+#include <dborb/socket.h>
+#include <dborb/buffer.h>
+#include <dborb/codec.h>
+#include <dborb/logging.h>
+#include <dborb/util.h>
+
+static ni_loopstats_t		ni_loopstats;
+static volatile int		ni_loopstats_signalled;
+
+static const char *		__ni_loopstats_event_names[__NI_LOOPSTATS_EVENT_MAX] = {
+	[NI_LOOPSTATS_RECEIVE]	= "receive",
+	[NI_LOOPSTATS_TRANSMIT]	= "transmit",
+	[NI_LOOPSTATS_HANGUP]	= "hangup",
+	[NI_LOOPSTATS_ERROR]	= "error",
+	[NI_LOOPSTATS_TIMER]	= "timer",
+};
+
+const char *
+ni_loopstats_event_name(ni_loopstats_event_t event)
+{
+	if (event >= __NI_LOOPSTATS_EVENT_MAX)
+		return NULL;
+	return __ni_loopstats_event_names[event];
+}
+
+/*
+ * Monotonic time stamp in usec
+ */
+uint64_t
+ni_loopstats_now(void)
+{
+	struct timeval tv;
+
+	ni_timer_get_time(&tv);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Histogram helpers
+ */
+static void
+__ni_latency_histogram_add(ni_latency_histogram_t *hist, uint64_t usec)
+{
+	unsigned int i = 0;
+
+	while (i < NI_LATENCY_BUCKETS - 1 && usec >= (1ULL << i))
+		++i;
+
+	hist->bucket[i]++;
+	hist->count++;
+	hist->total_usec += usec;
+	if (usec > hist->max_usec)
+		hist->max_usec = usec;
+}
+
+/*
+ * Return an upper bound for the given percentile, in usec.
+ * This is only as accurate as the bucket size allows.
+ */
+uint64_t
+ni_latency_histogram_percentile(const ni_latency_histogram_t *hist, unsigned int pct)
+{
+	uint64_t threshold, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	threshold = (hist->count * pct + 99) / 100;
+	for (i = 0; i < NI_LATENCY_BUCKETS - 1; ++i) {
+		seen += hist->bucket[i];
+		if (seen >= threshold)
+			break;
+	}
+
+	if (i == NI_LATENCY_BUCKETS - 1 || (1ULL << i) > hist->max_usec)
+		return hist->max_usec;
+	return 1ULL << i;
+}
+
+/*
+ * Find the stats entry for a given callback.
+ * The number of distinct callbacks is small, so a linear search will do.
+ */
+static ni_loopstats_entry_t *
+__ni_loopstats_entry(const void *key, ni_loopstats_event_t event)
+{
+	ni_loopstats_entry_t *entry;
+	unsigned int i;
+
+	for (i = 0, entry = ni_loopstats.data; i < ni_loopstats.count; ++i, ++entry) {
+		if (entry->key == key && entry->event == event)
+			return entry;
+	}
+
+	if ((ni_loopstats.count % 16) == 0) {
+		ni_loopstats.data = realloc(ni_loopstats.data, (ni_loopstats.count + 16) * sizeof(*entry));
+		if (ni_loopstats.data == NULL)
+			ni_fatal("%s: out of memory", __func__);
+	}
+
+	entry = &ni_loopstats.data[ni_loopstats.count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->key = key;
+	entry->event = event;
+	return entry;
+}
+
+void
+ni_loopstats_record_socket(const char *name, ni_loopstats_event_t event, uint64_t usec)
+{
+	ni_loopstats_entry_t *entry;
+
+	if (name == NULL)
+		name = "socket";
+
+	/* Socket names are string constants, so we can key on the pointer */
+	entry = __ni_loopstats_entry(name, event);
+	if (entry->name == NULL)
+		ni_string_printf(&entry->name, "%s.%s", name, ni_loopstats_event_name(event));
+	__ni_latency_histogram_add(&entry->latency, usec);
+}
+
+void
+ni_loopstats_record_timer(const void *callback, uint64_t usec)
+{
+	ni_loopstats_entry_t *entry;
+
+	entry = __ni_loopstats_entry(callback, NI_LOOPSTATS_TIMER);
+	if (entry->name == NULL) {
+		Dl_info info;
+
+		/* Static functions do not show up in the dynamic symbol table.
+		 * In that case, fall back to file+offset, which is what addr2line
+		 * wants. */
+		if (!dladdr(callback, &info))
+			memset(&info, 0, sizeof(info));
+
+		if (info.dli_sname)
+			ni_string_printf(&entry->name, "timer.%s", info.dli_sname);
+		else if (info.dli_fname)
+			ni_string_printf(&entry->name, "timer.%s+0x%lx",
+					ni_basename(info.dli_fname),
+					(unsigned long) ((const char *) callback - (const char *) info.dli_fbase));
+		else
+			ni_string_printf(&entry->name, "timer.%p", callback);
+	}
+	__ni_latency_histogram_add(&entry->latency, usec);
+}
+
+void
+ni_loopstats_record_wait(uint64_t wait_usec, uint64_t busy_usec)
+{
+	ni_loopstats.iterations++;
+	__ni_latency_histogram_add(&ni_loopstats.wait, wait_usec);
+	__ni_latency_histogram_add(&ni_loopstats.busy, busy_usec);
+}
+
+const ni_loopstats_t *
+ni_loopstats_get(void)
+{
+	return &ni_loopstats;
+}
+
+void
+ni_loopstats_reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ni_loopstats.count; ++i)
+		memset(&ni_loopstats.data[i].latency, 0, sizeof(ni_loopstats.data[i].latency));
+	memset(&ni_loopstats.wait, 0, sizeof(ni_loopstats.wait));
+	memset(&ni_loopstats.busy, 0, sizeof(ni_loopstats.busy));
+	ni_loopstats.iterations = 0;
+}
+
+/*
+ * Write the stats to the log
+ */
+static void
+__ni_loopstats_dump_histogram(const char *name, const ni_latency_histogram_t *hist)
+{
+	if (hist->count == 0)
+		return;
+
+	ni_note("  %-40s %10llu %10llu %10llu %10llu %10llu", name,
+			(unsigned long long) hist->count,
+			(unsigned long long) (hist->total_usec / hist->count),
+			(unsigned long long) ni_latency_histogram_percentile(hist, 50),
+			(unsigned long long) ni_latency_histogram_percentile(hist, 99),
+			(unsigned long long) hist->max_usec);
+}
+
+void
+ni_loopstats_dump(void)
+{
+	unsigned int i;
+
+	ni_note("Event loop statistics: %llu iterations", (unsigned long long) ni_loopstats.iterations);
+	ni_note("  %-40s %10s %10s %10s %10s %10s", "callback", "count", "avg-usec", "p50-usec", "p99-usec", "max-usec");
+	__ni_loopstats_dump_histogram("(poll-wait)", &ni_loopstats.wait);
+	__ni_loopstats_dump_histogram("(busy)", &ni_loopstats.busy);
+	for (i = 0; i < ni_loopstats.count; ++i) {
+		const ni_loopstats_entry_t *entry = &ni_loopstats.data[i];
+
+		__ni_loopstats_dump_histogram(entry->name, &entry->latency);
+	}
+}
+
+/*
+ * Dump stats when receiving a signal. The signal handler just sets a flag;
+ * the actual dump happens from the main loop.
+ */
+static void
+__ni_loopstats_catch_signal(int sig)
+{
+	ni_loopstats_signalled = 1;
+}
+
+void
+ni_loopstats_catch_signal(int sig)
+{
+	signal(sig, __ni_loopstats_catch_signal);
+}
+
+void
+ni_loopstats_check_signal(void)
+{
+	if (ni_loopstats_signalled) {
+		ni_loopstats_signalled = 0;
+		ni_loopstats_dump();
+		ni_buffer_pool_dump();
+		ni_codec_dump();
+	}
+}
@@ -123,3 +123,30 @@ ni_hashctx_puts(ni_hashctx_t *ctx, const char *string)
 	if (string)
 		gcry_md_write(ctx->handle, string, strlen(string));
 }
+
+void
+ni_hashctx_put(ni_hashctx_t *ctx, const void *data, size_t len)
+{
+	gcry_md_write(ctx->handle, data, len);
+}
+
+/*
+ * Convenience function: compute the md5 digest of a chunk of memory
+ */
+ni_bool_t
+ni_md5_digest(const void *data, size_t len, unsigned char *md_buffer, size_t md_size)
+{
+	ni_hashctx_t *ctx;
+	int rv;
+
+	if ((ctx = ni_hashctx_new()) == NULL)
+		return FALSE;
+
+	ni_hashctx_begin(ctx);
+	ni_hashctx_put(ctx, data, len);
+	ni_hashctx_finish(ctx);
+	rv = ni_hashctx_get_digest(ctx, md_buffer, md_size);
+	ni_hashctx_free(ctx);
+
+	return rv == (int) md_size;
+}
@@ -334,6 +334,7 @@ ni_file_monitor_new(const char *name, const char *path, ni_eventlog_t *log)
 	filemon = ni_malloc(sizeof(*filemon));
 	ni_monitor_init(&filemon->base, &ni_file_monitor_class, name, log);
 	filemon->base.interval = 5;
+	filemon->base.max_interval = 60;
 
 	ni_string_dup(&filemon->pathname, path);
 
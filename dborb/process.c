@@ -9,8 +9,15 @@
 
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
@@ -26,14 +33,26 @@
 
 static int				__ni_process_run(ni_process_t *); /* FIXME: change retval to bool */
 static void				__ni_process_add_waitq(ni_process_t *);
+static void				__ni_process_unlink_waitq(ni_process_t *);
+static void				__ni_process_watch_exit(ni_process_t *);
+static void				__ni_process_unwatch_exit(ni_process_t *);
+static void				__ni_process_detach(ni_process_t *);
 static void				__ni_process_flush_buffer(ni_process_t *, struct ni_process_buffer *);
 static void				__ni_process_fill_exit_info(ni_process_t *);
+static int				__ni_process_cgroup_create(ni_process_t *);
+static void				__ni_process_cgroup_destroy(ni_process_t *);
+static void				__ni_process_cgroup_retry_stale(void);
+static int				__ni_process_pidfd_open(pid_t);
+static void				__ni_process_cgroup_get_usage(const char *, ni_process_exit_info_t *);
 static const ni_string_array_t *	__ni_default_environment(void);
 
 static ni_socket_t *			__ni_process_connect_stdin(ni_process_t *pi, int fd);
 static ni_socket_t *			__ni_process_connect_stdout(ni_process_t *pi, int fd);
 static ni_socket_t *			__ni_process_connect_stderr(ni_process_t *pi, int fd);
 
+/* cgroups we failed to remove when their process exited */
+static ni_string_array_t		__ni_process_stale_cgroups = NI_STRING_ARRAY_INIT;
+
 static inline ni_bool_t
 __ni_shellcmd_parse(ni_string_array_t *argv, const char *command)
 {
@@ -191,38 +210,6 @@ ni_process_buffer_open_pty(struct ni_process_buffer *pb)
 	return TRUE;
 }
 
-static ni_bool_t
-ni_process_buffer_attach_child(struct ni_process_buffer *pb, int destfd)
-{
-	static const char *fdname[3] = { "stdin", "stdout", "stderr" };
-	int fd = -1;
-
-	ni_assert(0 <= destfd && destfd <= 2);
-	if (pb->active) {
-		ni_assert(pb->slave_fd >= 0);
-
-		fd = pb->slave_fd;
-		pb->slave_fd = -1;
-	}
-	
-	if (fd < 0) {
-		if ((fd = open("/dev/null", O_RDWR)) < 0) {
-			ni_warn("%s: unable to open /dev/null: %m", __func__);
-			return FALSE;
-		}
-	}
-
-	if (fd != destfd) {
-		if (dup2(fd, destfd) < 0) {
-			ni_warn("%s: cannot dup fd to %s: %m", __func__, fdname[destfd]);
-			return FALSE;
-		}
-		close(fd);
-	}
-
-	return TRUE;
-}
-
 static ni_bool_t
 ni_process_buffer_attach_parent(struct ni_process_buffer *pb, ni_process_t *pi)
 {
@@ -373,6 +360,9 @@ ni_process_free(ni_process_t *pi)
 			ni_error("Unable to kill process %d (%s): %m", pi->pid, pi->process->command);
 	}
 
+	__ni_process_unwatch_exit(pi);
+	__ni_process_unlink_waitq(pi);
+
 	ni_process_buffer_destroy(&pi->stdin);
 	ni_process_buffer_destroy(&pi->stdout);
 	ni_process_buffer_destroy(&pi->stderr);
@@ -382,6 +372,9 @@ ni_process_free(ni_process_t *pi)
 		pi->temp_state = NULL;
 	}
 
+	__ni_process_cgroup_destroy(pi);
+	ni_string_free(&pi->cgroup_parent);
+
 	ni_string_array_destroy(&pi->argv);
 	ni_string_array_destroy(&pi->environ);
 	ni_shellcmd_release(pi->process);
@@ -563,17 +556,18 @@ ni_process_run_and_wait(ni_process_t *pi)
 	if (rv < 0)
 		return rv;
 
-	while (waitpid(pi->pid, &pi->status, 0) < 0) {
+	while (wait4(pi->pid, &pi->status, 0, &pi->rusage) < 0) {
 		if (errno == EINTR)
 			continue;
 		ni_error("%s: waitpid returns error (%m)", __func__);
 		return -1;
 	}
 
+	__ni_process_fill_exit_info(pi);
 	__ni_process_flush_buffer(pi, &pi->stdout);
 	__ni_process_flush_buffer(pi, &pi->stderr);
 
-	pi->pid = 0;
+	__ni_process_detach(pi);
 	if (pi->exit_callback)
 		pi->exit_callback(pi);
 
@@ -585,38 +579,677 @@ ni_process_run_and_wait(ni_process_t *pi)
 	return rv;
 }
 
+/*
+ * Spawning child processes.
+ *
+ * We used to fork() the calling process, which copies the page tables of
+ * what can be a rather large agent, and then close()d every possible fd
+ * in the child. Instead, we now use clone(CLONE_VM|CLONE_VFORK), which
+ * runs the child on the parent's memory until it calls execve, and we
+ * close excess file descriptors using close_range().
+ *
+ * Since the child shares our address space, it must not modify anything
+ * but its own stack and the spawn struct, and it must not call malloc
+ * (other threads may be using the heap while we're suspended). So all
+ * the preparation is done in the parent, and the child only makes
+ * system calls.
+ */
+#define NI_PROCESS_SPAWN_STACK	(64 * 1024)
+
+typedef struct ni_process_spawn {
+	const char *		arg0;
+	char **			argv;
+	char **			envp;
+
+	ni_bool_t		use_terminal;
+	ni_bool_t		merge_stderr;
+	int			stdio[3];	/* -1 means /dev/null */
+	int			tty_fd;
+	int			cgroup_fd;	/* cgroup.procs, or -1 */
+
+	sigset_t		sigmask;
+
+	/* Written by the child */
+	int			tty_errno;
+	int			cgroup_errno;
+	int			exec_errno;
+} ni_process_spawn_t;
+
 static void
-ni_process_prepare_stdio(ni_process_t *pi)
+__ni_process_spawn_attach_fd(int fd, int destfd)
 {
-	int fd, maxfd;
+	if (fd < 0 && (fd = open("/dev/null", O_RDWR)) < 0)
+		return;
 
-	if (pi->use_terminal) {
-		if (login_tty(pi->stdout.slave_fd) >= 0)
+	if (fd != destfd) {
+		dup2(fd, destfd);
+		close(fd);
+	}
+}
+
+/*
+ * Close all file descriptors from minfd upwards.
+ */
+static void
+__ni_process_close_from(int minfd)
+{
+	char buf[1024] __attribute__((aligned(8)));
+	int dirfd, fd, maxfd;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, minfd, ~0U, 0) == 0)
+		return;
+#endif
+
+	/* Older kernel; walk /proc/self/fd instead. We cannot use opendir
+	 * here, because that would call malloc. */
+	if ((dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+		unsigned int closed;
+		long n;
+
+		/* Closing fds while reading the directory may make us skip
+		 * entries; start over until a full pass finds nothing to close. */
+		do {
+			closed = 0;
+			lseek(dirfd, 0, SEEK_SET);
+			while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+				long pos = 0;
+
+				while (pos < n) {
+					struct {
+						uint64_t	d_ino;
+						int64_t		d_off;
+						unsigned short	d_reclen;
+						unsigned char	d_type;
+						char		d_name[];
+					} *de = (void *) (buf + pos);
+					const char *s;
+
+					for (fd = 0, s = de->d_name; '0' <= *s && *s <= '9'; ++s)
+						fd = 10 * fd + *s - '0';
+					if (s != de->d_name && *s == '\0' && fd >= minfd && fd != dirfd) {
+						close(fd);
+						closed++;
+					}
+					pos += de->d_reclen;
+				}
+			}
+		} while (n == 0 && closed);
+
+		close(dirfd);
+		if (n == 0)
 			return;
+	}
+
+	maxfd = getdtablesize();
+	for (fd = minfd; fd < maxfd; ++fd)
+		close(fd);
+}
+
+static int
+__ni_process_spawn_child(void *arg)
+{
+	ni_process_spawn_t *sp = arg;
+	struct sigaction act;
+	int sig;
+
+	/* Do not run any of our parent's signal handlers on the shared
+	 * memory. All signals are blocked at this point. */
+	memset(&act, 0, sizeof(act));
+	for (sig = 1; sig < _NSIG; ++sig) {
+		struct sigaction old;
+
+		if (sigaction(sig, NULL, &old) == 0 && old.sa_handler != SIG_IGN) {
+			act.sa_handler = SIG_DFL;
+			sigaction(sig, &act, NULL);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &sp->sigmask, NULL);
+
+	/* Nothing we can do if this fails */
+	(void) chdir("/");
+
+	/* Become leader of our own process group */
+	setsid();
+
+	/* Move into the cgroup before exec'ing, so that all of the command's
+	 * resource usage is accounted there. */
+	if (sp->cgroup_fd >= 0 && write(sp->cgroup_fd, "0", 1) < 0)
+		sp->cgroup_errno = errno;
+
+	if (sp->use_terminal) {
+		if (login_tty(sp->tty_fd) < 0) {
+			sp->tty_errno = errno;
+			__ni_process_spawn_attach_fd(-1, 0);
+			__ni_process_spawn_attach_fd(-1, 1);
+			__ni_process_spawn_attach_fd(-1, 2);
+		}
+	} else {
+		__ni_process_spawn_attach_fd(sp->stdio[0], 0);
+		__ni_process_spawn_attach_fd(sp->stdio[1], 1);
+		if (sp->merge_stderr)
+			dup2(1, 2);
+		else
+			__ni_process_spawn_attach_fd(sp->stdio[2], 2);
+	}
+
+	__ni_process_close_from(3);
+
+	execve(sp->arg0, sp->argv, sp->envp);
+
+	sp->exec_errno = errno;
+	_exit(127);
+}
+
+static char **
+__ni_process_spawn_vector(const ni_string_array_t *array)
+{
+	char **vec;
+
+	vec = xcalloc(array->count + 1, sizeof(char *));
+	if (array->count)
+		memcpy(vec, array->data, array->count * sizeof(char *));
+	return vec;
+}
+
+static int
+__ni_process_spawn_stdio(const struct ni_process_buffer *pb)
+{
+	return pb->active? pb->slave_fd : -1;
+}
+
+/*
+ * The spawn helper.
+ *
+ * Optionally, the agent forks a small helper process right after startup,
+ * and hands it all subsequent spawn requests over a unix socket: argv and
+ * environment in the message body, and the stdio, tty and cgroup fds as
+ * SCM_RIGHTS. The helper clones the child from its own image, which stays
+ * small no matter how much memory the agent accumulates over time.
+ *
+ * The helper uses CLONE_PARENT, so the new process is a child of the agent
+ * rather than the helper. Reaping it through pidfds or SIGCHLD works just
+ * the same as for processes we spawned ourselves.
+ *
+ * If anything goes wrong talking to the helper, we shut it down and spawn
+ * directly.
+ */
+#define NI_PROCESS_SPAWN_HELPER_MSGMAX	(128 * 1024)
+
+enum {
+	NI_PROCESS_SPAWN_FD_STDIN,
+	NI_PROCESS_SPAWN_FD_STDOUT,
+	NI_PROCESS_SPAWN_FD_STDERR,
+	NI_PROCESS_SPAWN_FD_TTY,
+	NI_PROCESS_SPAWN_FD_CGROUP,
+
+	__NI_PROCESS_SPAWN_FD_MAX
+};
+
+#define NI_PROCESS_SPAWN_USE_TERMINAL	0x0001
+#define NI_PROCESS_SPAWN_MERGE_STDERR	0x0002
+
+typedef struct ni_process_spawn_request {
+	uint32_t		flags;
+	uint32_t		argc;
+	uint32_t		envc;
+	int32_t			fd_index[__NI_PROCESS_SPAWN_FD_MAX];	/* index into SCM_RIGHTS array, or -1 */
+
+	/* followed by arg0, argv and envp as NUL terminated strings */
+} ni_process_spawn_request_t;
+
+typedef struct ni_process_spawn_reply {
+	int32_t			pid;
+	int32_t			spawn_errno;
+	int32_t			tty_errno;
+	int32_t			cgroup_errno;
+	int32_t			exec_errno;
+} ni_process_spawn_reply_t;
+
+static int			__ni_process_spawn_helper_fd = -1;
+static pid_t			__ni_process_spawn_helper_pid;
+static ni_socket_t *		__ni_process_spawn_helper_watch;	/* pidfd, if supported */
+
+static void			__ni_process_stop_spawn_helper(void);
+
+static char **
+__ni_process_spawn_helper_unpack(char **pos, char *end, unsigned int count)
+{
+	char **vec;
+	unsigned int i;
+
+	vec = calloc(count + 1, sizeof(char *));
+	for (i = 0; vec && i < count; ++i) {
+		char *s = *pos;
+
+		if (s >= end || (*pos = memchr(s, '\0', end - s)) == NULL) {
+			free(vec);
+			return NULL;
+		}
+		vec[i] = s;
+		(*pos)++;
+	}
+	return vec;
+}
+
+static void
+__ni_process_spawn_helper_request(int sock, char *buf, char *stack, const sigset_t *sigmask)
+{
+	union {
+		struct cmsghdr	cm;
+		char		space[CMSG_SPACE(__NI_PROCESS_SPAWN_FD_MAX * sizeof(int))];
+	} control;
+	ni_process_spawn_request_t *req = (ni_process_spawn_request_t *) buf;
+	ni_process_spawn_reply_t reply;
+	int fds[__NI_PROCESS_SPAWN_FD_MAX];
+	unsigned int i, nfds = 0;
+	ni_process_spawn_t spawn;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	char *pos, *end;
+	sigset_t all;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = NI_PROCESS_SPAWN_HELPER_MSGMAX;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control;
+	msg.msg_controllen = sizeof(control);
+
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	if (n <= 0)
+		_exit(0);
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (nfds > __NI_PROCESS_SPAWN_FD_MAX)
+				nfds = __NI_PROCESS_SPAWN_FD_MAX;
+			memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+		}
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	memset(&spawn, 0, sizeof(spawn));
+	reply.pid = -1;
+	reply.spawn_errno = EINVAL;
+
+	if (n < (ssize_t) sizeof(*req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+		goto out;
+
+	pos = buf + sizeof(*req);
+	end = buf + n;
+	spawn.arg0 = pos;
+	if ((pos = memchr(pos, '\0', end - pos)) == NULL)
+		goto out;
+	pos++;
+	if (!(spawn.argv = __ni_process_spawn_helper_unpack(&pos, end, req->argc))
+	 || !(spawn.envp = __ni_process_spawn_helper_unpack(&pos, end, req->envc)))
+		goto out;
+
+	for (i = 0; i < __NI_PROCESS_SPAWN_FD_MAX; ++i) {
+		if (req->fd_index[i] >= (int) nfds)
+			goto out;
+	}
+
+#define FD(which)	(req->fd_index[which] >= 0? fds[req->fd_index[which]] : -1)
+	spawn.use_terminal = !!(req->flags & NI_PROCESS_SPAWN_USE_TERMINAL);
+	spawn.merge_stderr = !!(req->flags & NI_PROCESS_SPAWN_MERGE_STDERR);
+	spawn.stdio[0] = FD(NI_PROCESS_SPAWN_FD_STDIN);
+	spawn.stdio[1] = FD(NI_PROCESS_SPAWN_FD_STDOUT);
+	spawn.stdio[2] = FD(NI_PROCESS_SPAWN_FD_STDERR);
+	spawn.tty_fd = FD(NI_PROCESS_SPAWN_FD_TTY);
+	spawn.cgroup_fd = FD(NI_PROCESS_SPAWN_FD_CGROUP);
+#undef FD
+	spawn.sigmask = *sigmask;
+
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, NULL);
+	reply.pid = clone(__ni_process_spawn_child, stack + NI_PROCESS_SPAWN_STACK,
+			CLONE_PARENT | CLONE_VM | CLONE_VFORK | SIGCHLD, &spawn);
+	reply.spawn_errno = reply.pid < 0? errno : 0;
+	sigprocmask(SIG_SETMASK, sigmask, NULL);
+
+	reply.tty_errno = spawn.tty_errno;
+	reply.cgroup_errno = spawn.cgroup_errno;
+	reply.exec_errno = spawn.exec_errno;
+
+out:
+	free(spawn.argv);
+	free(spawn.envp);
+	for (i = 0; i < nfds; ++i)
+		close(fds[i]);
+
+	if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+		_exit(0);
+}
+
+static void
+__ni_process_spawn_helper_main(int sock)
+{
+	struct sigaction act;
+	sigset_t sigmask;
+	char *buf, *stack;
+	int sig, fd;
+
+	/* Go away when the agent does */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	/* None of the agent's signal handlers make sense here */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = SIG_DFL;
+	for (sig = 1; sig < _NSIG; ++sig)
+		sigaction(sig, &act, NULL);
+	sigemptyset(&sigmask);
+	sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+	/* Keep only the socket; put it on fd 3 */
+	if (sock != 3) {
+		dup2(sock, 3);
+		sock = 3;
+	}
+	__ni_process_close_from(4);
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2)
+			close(fd);
+	}
+
+	if (!(buf = malloc(NI_PROCESS_SPAWN_HELPER_MSGMAX)) || !(stack = malloc(NI_PROCESS_SPAWN_STACK)))
+		_exit(1);
+
+	while (TRUE)
+		__ni_process_spawn_helper_request(sock, buf, stack, &sigmask);
+}
+
+/*
+ * The helper is not on the wait queue, so we have to reap it ourselves.
+ * If it goes away on its own, the pidfd tells us right away; otherwise
+ * we notice when the next request fails.
+ */
+static void
+__ni_process_spawn_helper_exited(ni_socket_t *sock)
+{
+	__ni_process_stop_spawn_helper();
+}
+
+static void
+__ni_process_spawn_helper_watch_exit(pid_t pid)
+{
+	ni_socket_t *sock;
+	int fd;
+
+	if ((fd = __ni_process_pidfd_open(pid)) < 0)
+		return;
+
+	sock = ni_socket_wrap(fd, SOCK_STREAM);
+	sock->name = "spawn-helper-exit";
+	sock->receive = __ni_process_spawn_helper_exited;
+	ni_socket_activate(sock);
+	__ni_process_spawn_helper_watch = sock;
+}
+
+ni_bool_t
+ni_process_start_spawn_helper(void)
+{
+	int sv[2], bufsize = NI_PROCESS_SPAWN_HELPER_MSGMAX;
+	pid_t pid;
+
+	if (__ni_process_spawn_helper_fd >= 0)
+		return TRUE;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		ni_error("%s: unable to create socket pair: %m", __func__);
+		return FALSE;
+	}
+
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	if ((pid = fork()) < 0) {
+		ni_error("%s: unable to fork: %m", __func__);
+		close(sv[0]);
+		close(sv[1]);
+		return FALSE;
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		__ni_process_spawn_helper_main(sv[1]);
+		_exit(0);
+	}
+
+	close(sv[1]);
+	__ni_process_spawn_helper_fd = sv[0];
+	__ni_process_spawn_helper_pid = pid;
+	__ni_process_spawn_helper_watch_exit(pid);
+	ni_debug_process("started spawn helper, pid %d", pid);
+	return TRUE;
+}
 
-		ni_warn("Failed to set up pty slave as controlling tty: %m");
+static void
+__ni_process_stop_spawn_helper(void)
+{
+	if (__ni_process_spawn_helper_fd < 0)
+		return;
 
-		/* Fall through and connect all stdio to /dev/null */
-		ni_process_buffer_reset(&pi->stdin);
-		ni_process_buffer_reset(&pi->stdout);
-		ni_process_buffer_reset(&pi->stderr);
+	ni_warn("shutting down spawn helper (pid %d), spawning processes directly from now on",
+			__ni_process_spawn_helper_pid);
+	close(__ni_process_spawn_helper_fd);
+	__ni_process_spawn_helper_fd = -1;
+	kill(__ni_process_spawn_helper_pid, SIGKILL);
+
+	while (waitpid(__ni_process_spawn_helper_pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	__ni_process_spawn_helper_pid = 0;
+
+	if (__ni_process_spawn_helper_watch) {
+		ni_socket_close(__ni_process_spawn_helper_watch);
+		__ni_process_spawn_helper_watch = NULL;
 	}
+}
 
-	ni_process_buffer_attach_child(&pi->stdin, 0);
-	ni_process_buffer_attach_child(&pi->stdout, 1);
+static size_t
+__ni_process_spawn_helper_pack(char *buf, size_t pos, const char **strings, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		size_t len = strlen(strings[i]) + 1;
+
+		memcpy(buf + pos, strings[i], len);
+		pos += len;
+	}
+	return pos;
+}
+
+static void
+__ni_process_spawn_helper_add_fd(ni_process_spawn_request_t *req, unsigned int which, int fd, int *fds, unsigned int *nfds)
+{
+	if (fd < 0) {
+		req->fd_index[which] = -1;
+	} else {
+		req->fd_index[which] = *nfds;
+		fds[(*nfds)++] = fd;
+	}
+}
+
+/*
+ * Send a spawn request to the helper. Returns FALSE if the helper could
+ * not handle it, in which case the caller should spawn the process itself.
+ */
+static ni_bool_t
+__ni_process_spawn_helper_call(ni_process_spawn_t *sp, pid_t *pidp)
+{
+	union {
+		struct cmsghdr	cm;
+		char		space[CMSG_SPACE(__NI_PROCESS_SPAWN_FD_MAX * sizeof(int))];
+	} control;
+	ni_process_spawn_request_t req;
+	ni_process_spawn_reply_t reply;
+	char *strings = NULL;
+	size_t len;
+	int fds[__NI_PROCESS_SPAWN_FD_MAX];
+	unsigned int i, nfds = 0;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ni_bool_t rv = FALSE;
+	ssize_t n;
+
+	if (__ni_process_spawn_helper_fd < 0)
+		return FALSE;
+
+	memset(&req, 0, sizeof(req));
+	if (sp->use_terminal)
+		req.flags |= NI_PROCESS_SPAWN_USE_TERMINAL;
+	if (sp->merge_stderr)
+		req.flags |= NI_PROCESS_SPAWN_MERGE_STDERR;
+
+	len = strlen(sp->arg0) + 1;
+	for (i = 0; sp->argv[i]; ++i, ++req.argc)
+		len += strlen(sp->argv[i]) + 1;
+	for (i = 0; sp->envp[i]; ++i, ++req.envc)
+		len += strlen(sp->envp[i]) + 1;
+
+	if (sizeof(req) + len > NI_PROCESS_SPAWN_HELPER_MSGMAX) {
+		ni_debug_process("spawn request too large for helper, spawning directly");
+		goto out;
+	}
+
+	strings = xmalloc(len);
+	len = __ni_process_spawn_helper_pack(strings, 0, &sp->arg0, 1);
+	len = __ni_process_spawn_helper_pack(strings, len, (const char **) sp->argv, req.argc);
+	len = __ni_process_spawn_helper_pack(strings, len, (const char **) sp->envp, req.envc);
+
+	if (sp->use_terminal) {
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDIN, -1, fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDOUT, -1, fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDERR, -1, fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_TTY, sp->tty_fd, fds, &nfds);
+	} else {
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDIN, sp->stdio[0], fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDOUT, sp->stdio[1], fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_STDERR, sp->stdio[2], fds, &nfds);
+		__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_TTY, -1, fds, &nfds);
+	}
+	__ni_process_spawn_helper_add_fd(&req, NI_PROCESS_SPAWN_FD_CGROUP, sp->cgroup_fd, fds, &nfds);
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = strings;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (nfds) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = &control;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		control.cm.cmsg_level = SOL_SOCKET;
+		control.cm.cmsg_type = SCM_RIGHTS;
+		control.cm.cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(&control.cm), fds, nfds * sizeof(int));
+	}
+
+	while ((n = sendmsg(__ni_process_spawn_helper_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if (n < 0) {
+		ni_error("%s: unable to send request to spawn helper: %m", __func__);
+		__ni_process_stop_spawn_helper();
+		goto out;
+	}
+
+	while ((n = recv(__ni_process_spawn_helper_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+		;
+	if (n != sizeof(reply)) {
+		if (n < 0)
+			ni_error("%s: no reply from spawn helper: %m", __func__);
+		else
+			ni_error("%s: bad reply from spawn helper", __func__);
+		__ni_process_stop_spawn_helper();
+		goto out;
+	}
+
+	sp->tty_errno = reply.tty_errno;
+	sp->cgroup_errno = reply.cgroup_errno;
+	sp->exec_errno = reply.exec_errno;
+	if ((*pidp = reply.pid) < 0)
+		errno = reply.spawn_errno;
+	rv = TRUE;
+
+out:
+	free(strings);
+	return rv;
+}
+
+static pid_t
+__ni_process_spawn(ni_process_t *pi, const char *arg0)
+{
+	ni_process_spawn_t spawn;
+	sigset_t all;
+	char *stack;
+	pid_t pid;
+
+	memset(&spawn, 0, sizeof(spawn));
+	spawn.arg0 = arg0;
+	spawn.argv = __ni_process_spawn_vector(&pi->argv);
+	spawn.envp = __ni_process_spawn_vector(&pi->environ);
+	spawn.cgroup_fd = __ni_process_cgroup_create(pi);
+
+	if (pi->use_terminal) {
+		spawn.use_terminal = TRUE;
+		spawn.tty_fd = pi->stdout.slave_fd;
+	} else {
+		spawn.stdio[0] = __ni_process_spawn_stdio(&pi->stdin);
+		spawn.stdio[1] = __ni_process_spawn_stdio(&pi->stdout);
+		spawn.stdio[2] = __ni_process_spawn_stdio(&pi->stderr);
 
-	if (pi->stdout.active && !pi->stderr.active) {
 		/* If the client is capturing stdout but not
 		 * stderr, just paste these two together */
-		if (dup2(1, 2) < 0)
-			ni_warn("%s: unable to dup stdout to stderr: %m", __func__);
-	} else {
-		ni_process_buffer_attach_child(&pi->stderr, 2);
+		spawn.merge_stderr = pi->stdout.active && !pi->stderr.active;
 	}
 
-	maxfd = getdtablesize();
-	for (fd = 3; fd < maxfd; ++fd)
-		close(fd);
+	stack = NULL;
+	if (!__ni_process_spawn_helper_call(&spawn, &pid)) {
+		stack = xmalloc(NI_PROCESS_SPAWN_STACK);
+
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &spawn.sigmask);
+
+		/* The stack grows down */
+		pid = clone(__ni_process_spawn_child, stack + NI_PROCESS_SPAWN_STACK,
+				CLONE_VM | CLONE_VFORK | SIGCHLD, &spawn);
+
+		pthread_sigmask(SIG_SETMASK, &spawn.sigmask, NULL);
+	}
+
+	if (pid < 0)
+		ni_error("%s: unable to create child process: %m", __func__);
+	if (pid > 0 && spawn.tty_errno)
+		ni_warn("Failed to set up pty slave as controlling tty: %s", strerror(spawn.tty_errno));
+	if (pid > 0 && spawn.cgroup_errno) {
+		ni_warn("Unable to move process into cgroup %s: %s", pi->cgroup_path, strerror(spawn.cgroup_errno));
+		__ni_process_cgroup_destroy(pi);
+	}
+	if (pid > 0 && spawn.exec_errno)
+		ni_error("%s: cannot execute %s: %s", __func__, arg0, strerror(spawn.exec_errno));
+
+	if (spawn.cgroup_fd >= 0)
+		close(spawn.cgroup_fd);
+	if (pid < 0)
+		__ni_process_cgroup_destroy(pi);
+
+	free(stack);
+	free(spawn.argv);
+	free(spawn.envp);
+	return pid;
 }
 
 int
@@ -638,36 +1271,20 @@ __ni_process_run(ni_process_t *pi)
 		return -1;
 	}
 
+	if (pi->use_terminal)
+		ni_process_setenv(pi, "TERM", "vt100");
+
 	__ni_process_add_waitq(pi);
 
-	if ((pid = fork()) < 0) {
-		ni_error("%s: unable to fork child process: %m", __func__);
+	ni_timer_get_time(&pi->start_time);
+	if ((pid = __ni_process_spawn(pi, arg0)) < 0) {
+		__ni_process_unlink_waitq(pi);
 		return -1;
 	}
 	pi->pid = pid;
 
-	if (pid == 0) {
-		if (pi->use_terminal)
-			ni_process_setenv(pi, "TERM", "vt100");
-
-		if (chdir("/") < 0)
-			ni_warn("%s: unable to chdir to /: %m", __func__);
-
-		/* Become leader of our own process group */
-		setsid();
-
-		ni_process_prepare_stdio(pi);
-
-		/* NULL terminate argv and env lists */
-		ni_string_array_append(&pi->argv, NULL);
-		ni_string_array_append(&pi->environ, NULL);
-
-		arg0 = pi->argv.data[0];
-
-		execve(arg0, pi->argv.data, pi->environ.data);
-
-		ni_fatal("%s: cannot execute %s: %m", __func__, arg0);
-	}
+	/* Get notified through the event loop when the child exits */
+	__ni_process_watch_exit(pi);
 
 	/* Set up a socket to receive the redirected output of the
 	 * subprocess. */
@@ -735,40 +1352,250 @@ ni_process_reap(ni_process_t *pi)
 
 /*
  * Process monitoring and exit handling.
+ *
+ * Where the kernel supports it, we open a pidfd for every child we start,
+ * and register it with the event loop. The pidfd becomes readable when the
+ * child exits, and the socket carries a pointer back to the process, so
+ * there is no need to search the wait queue.
+ *
+ * Otherwise, we fall back to catching SIGCHLD. The signal handler also
+ * writes to a pipe watched by the event loop, so that a signal arriving
+ * just before we go to sleep in poll() still wakes us up.
  */
+typedef struct ni_process_exit_watch {
+	pid_t			pid;
+	ni_process_t *		process;	/* NULL if the process was freed before it exited */
+} ni_process_exit_watch_t;
+
 static ni_bool_t	__sigchld_received = FALSE;
+static int		__sigchld_pipe[2] = { -1, -1 };
+static ni_socket_t *	__sigchld_socket;
 static ni_process_t *	__ni_process_queue;
+static unsigned int	__ni_process_sigchld_waiters;
+
+static void		__ni_process_exited(ni_process_t *, int, const struct rusage *);
+
+/*
+ * Neither WIFEXITED nor WIFSIGNALED, so this is reported as
+ * NI_PROCESS_TRANSCENDED
+ */
+#define NI_PROCESS_STATUS_UNKNOWN	0x7f
 
 static void
 __ni_process_sigchld(int signo)
 {
+	int saved_errno = errno;
+
 	__sigchld_received = TRUE;
+	if (__sigchld_pipe[1] >= 0 && write(__sigchld_pipe[1], "", 1) < 0)
+		;
+	errno = saved_errno;
 }
 
-void
-__ni_process_add_waitq(ni_process_t *pi)
+static void
+__ni_process_sigchld_recv(ni_socket_t *sock)
+{
+	char junk[64];
+
+	while (read(sock->__fd, junk, sizeof(junk)) > 0)
+		;
+	ni_process_reap_children();
+}
+
+static void
+__ni_process_sigchld_init(void)
 {
 	static int handler_established = FALSE;
+	struct sigaction act;
+
+	if (handler_established)
+		return;
+
+	if (pipe2(__sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		ni_warn("%s: unable to create SIGCHLD pipe: %m", __func__);
+	} else {
+		__sigchld_socket = ni_socket_wrap(__sigchld_pipe[0], SOCK_STREAM);
+		__sigchld_socket->name = "sigchld";
+		__sigchld_socket->receive = __ni_process_sigchld_recv;
+		ni_socket_activate(__sigchld_socket);
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = __ni_process_sigchld;
+	sigaction(SIGCHLD, &act, NULL);
+
+	handler_established = TRUE;
+}
+
+static int
+__ni_process_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	static ni_bool_t unsupported = FALSE;
+	int fd;
+
+	if (unsupported)
+		return -1;
 
-	if (!handler_established) {
-		struct sigaction act;
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0 && errno == ENOSYS) {
+		ni_debug_process("pidfd_open not supported, falling back to SIGCHLD");
+		unsupported = TRUE;
+	}
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
 
-		memset(&act, 0, sizeof(act));
-		act.sa_handler = __ni_process_sigchld;
-		sigaction(SIGCHLD, &act, NULL);
+static void
+__ni_process_exit_watch_recv(ni_socket_t *sock)
+{
+	ni_process_exit_watch_t *watch = sock->user_data;
+	ni_process_t *pi = watch->process;
+	struct rusage rusage;
+	int status;
+	pid_t pid;
 
-		handler_established = TRUE;
+	pid = wait4(watch->pid, &status, WNOHANG, &rusage);
+	if (pid == 0)
+		return;
+
+	if (pi == NULL) {
+		/* The process object is gone; we just reap the zombie */
+		ni_socket_deactivate(sock);
+		return;
 	}
 
-	if (pi->next != NULL) {
-		ni_warn("unable to add process to wait queue; next pointer is set");
+	if (pid > 0) {
+		__ni_process_exited(pi, status, &rusage);
+		return;
+	}
+
+	if (errno != ECHILD)
+		ni_error("%s: waitpid(%d) returns error (%m)", __func__, watch->pid);
+
+	/* Someone else reaped the child, so we will never learn its exit
+	 * status. Report it as having exited anyway, or its owner would
+	 * wait for it forever. This also closes the pidfd, which would
+	 * otherwise stay readable. */
+	memset(&rusage, 0, sizeof(rusage));
+	__ni_process_exited(pi, NI_PROCESS_STATUS_UNKNOWN, &rusage);
+}
+
+static void
+__ni_process_exit_watch_close(ni_socket_t *sock)
+{
+	if (sock->__fd >= 0)
+		close(sock->__fd);
+	free(sock->user_data);
+	sock->user_data = NULL;
+}
+
+void
+__ni_process_watch_exit(ni_process_t *pi)
+{
+	ni_process_exit_watch_t *watch;
+	ni_socket_t *sock;
+	int fd;
+
+	if ((fd = __ni_process_pidfd_open(pi->pid)) < 0) {
+		__ni_process_sigchld_waiters++;
+		return;
+	}
+
+	watch = xcalloc(1, sizeof(*watch));
+	watch->pid = pi->pid;
+	watch->process = pi;
+
+	sock = ni_socket_wrap(fd, SOCK_STREAM);
+	sock->name = "process-exit";
+	sock->receive = __ni_process_exit_watch_recv;
+	sock->close = __ni_process_exit_watch_close;
+	sock->user_data = watch;
+	ni_socket_activate(sock);
+
+	pi->exit_socket = sock;
+}
+
+/*
+ * Detach the process from its pidfd socket.
+ * If the child is still running, we leave the socket active so that we
+ * can still reap the child once it exits.
+ */
+void
+__ni_process_unwatch_exit(ni_process_t *pi)
+{
+	ni_socket_t *sock;
+
+	if ((sock = pi->exit_socket) == NULL)
+		return;
+
+	pi->exit_socket = NULL;
+	if (pi->pid) {
+		ni_process_exit_watch_t *watch = sock->user_data;
+
+		watch->process = NULL;
+		ni_socket_release(sock);
+	} else {
+		ni_socket_close(sock);
+	}
+}
+
+void
+__ni_process_add_waitq(ni_process_t *pi)
+{
+	__ni_process_sigchld_init();
+
+	if (pi->prev != NULL) {
+		ni_warn("unable to add process to wait queue; already queued");
 		return;
 	}
 
+	pi->prev = &__ni_process_queue;
 	pi->next = __ni_process_queue;
+	if (pi->next)
+		pi->next->prev = &pi->next;
 	__ni_process_queue = pi;
 }
 
+void
+__ni_process_unlink_waitq(ni_process_t *pi)
+{
+	if (pi->prev == NULL)
+		return;
+
+	*(pi->prev) = pi->next;
+	if (pi->next)
+		pi->next->prev = pi->prev;
+	pi->next = NULL;
+	pi->prev = NULL;
+}
+
+/*
+ * The child has been reaped; stop watching it
+ */
+void
+__ni_process_detach(ni_process_t *pi)
+{
+	if (pi->exit_socket == NULL)
+		__ni_process_sigchld_waiters--;
+
+	pi->pid = 0;
+	__ni_process_unwatch_exit(pi);
+	__ni_process_unlink_waitq(pi);
+}
+
+static void
+__ni_process_exited(ni_process_t *pi, int status, const struct rusage *rusage)
+{
+	pi->status = status;
+	pi->rusage = *rusage;
+	__ni_process_detach(pi);
+	ni_process_reap(pi);
+}
+
 void
 ni_process_reap_children(void)
 {
@@ -776,11 +1603,16 @@ ni_process_reap_children(void)
 		return;
 	__sigchld_received = FALSE;
 
+	/* All children are watched through pidfds; nothing to do */
+	if (__ni_process_sigchld_waiters == 0)
+		return;
+
 	while (TRUE) {
-		ni_process_t **pos, *pi;
+		struct rusage rusage;
+		ni_process_t *pi;
 		int pid, status;
 
-		pid = waitpid((pid_t) -1, &status, WNOHANG);
+		pid = wait4((pid_t) -1, &status, WNOHANG, &rusage);
 		if (pid == 0 || (pid < 0 && errno == ECHILD))
 			break;
 		if (pid < 0) {
@@ -788,12 +1620,9 @@ ni_process_reap_children(void)
 			break;
 		}
 
-		for (pos = &__ni_process_queue; (pi = *pos) != NULL; pos = &pi->next) {
-			if (pi->pid == pid) {
-				*pos = pi->next;
-				pi->next = NULL;
+		for (pi = __ni_process_queue; pi != NULL; pi = pi->next) {
+			if (pi->pid == pid)
 				break;
-			}
 		}
 
 		if (pi == NULL) {
@@ -801,9 +1630,7 @@ ni_process_reap_children(void)
 			continue;
 		}
 
-		pi->status = status;
-		pi->pid = 0;
-		ni_process_reap(pi);
+		__ni_process_exited(pi, status, &rusage);
 	}
 }
 
@@ -828,6 +1655,12 @@ ni_process_get_exit_info(const ni_process_t *pi, ni_process_exit_info_t *exit_in
 	*exit_info = pi->exit_info;
 }
 
+static inline uint64_t
+__ni_timeval_usec(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
 void
 __ni_process_fill_exit_info(ni_process_t *pi)
 {
@@ -845,6 +1678,160 @@ __ni_process_fill_exit_info(ni_process_t *pi)
 	} else {
 		exit_info->how = NI_PROCESS_TRANSCENDED;
 	}
+
+	if (timerisset(&pi->start_time)) {
+		struct timeval now, delta;
+
+		ni_timer_get_time(&now);
+		timersub(&now, &pi->start_time, &delta);
+		exit_info->rusage.wall_usec = __ni_timeval_usec(&delta);
+
+		exit_info->rusage.valid = TRUE;
+		exit_info->rusage.user_usec = __ni_timeval_usec(&pi->rusage.ru_utime);
+		exit_info->rusage.sys_usec = __ni_timeval_usec(&pi->rusage.ru_stime);
+		exit_info->rusage.max_rss_kb = pi->rusage.ru_maxrss;
+		exit_info->rusage.io_read_bytes = pi->rusage.ru_inblock * 512ULL;
+		exit_info->rusage.io_write_bytes = pi->rusage.ru_oublock * 512ULL;
+		exit_info->rusage.voluntary_ctxsw = pi->rusage.ru_nvcsw;
+		exit_info->rusage.involuntary_ctxsw = pi->rusage.ru_nivcsw;
+	}
+
+	if (pi->cgroup_path) {
+		__ni_process_cgroup_get_usage(pi->cgroup_path, exit_info);
+		__ni_process_cgroup_destroy(pi);
+	}
+
+	if (__ni_process_stale_cgroups.count)
+		__ni_process_cgroup_retry_stale();
+}
+
+/*
+ * Per-process cgroups.
+ *
+ * wait4() only accounts for the child itself and those of its children
+ * it waited for; anything a test script leaves running in the background
+ * escapes it. If configured, we create a cgroup for each command, and
+ * take CPU, memory and I/O usage from there. This requires cgroup v2, and
+ * the parent directory must be writable by us, with the cpu, memory and io
+ * controllers enabled in its cgroup.subtree_control.
+ */
+void
+ni_process_set_cgroup(ni_process_t *pi, const char *parent)
+{
+	ni_string_dup(&pi->cgroup_parent, parent);
+}
+
+static int
+__ni_process_cgroup_create(ni_process_t *pi)
+{
+	static unsigned int cgroup_seq;
+	char pathbuf[PATH_MAX];
+	int fd;
+
+	if (pi->cgroup_parent == NULL)
+		return -1;
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s/testbus-%u.%u", pi->cgroup_parent, (unsigned int) getpid(), ++cgroup_seq);
+	if (mkdir(pathbuf, 0755) < 0) {
+		ni_warn("Unable to create cgroup %s: %m", pathbuf);
+		return -1;
+	}
+	ni_string_dup(&pi->cgroup_path, pathbuf);
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s/cgroup.procs", pi->cgroup_path);
+	if ((fd = open(pathbuf, O_WRONLY | O_CLOEXEC)) < 0) {
+		ni_warn("Unable to open %s: %m", pathbuf);
+		__ni_process_cgroup_destroy(pi);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Removing a cgroup fails if some of the command's descendants are still
+ * around. We remember these cgroups, and try again whenever another
+ * process is reaped.
+ */
+static void
+__ni_process_cgroup_destroy(ni_process_t *pi)
+{
+	if (pi->cgroup_path == NULL)
+		return;
+
+	if (rmdir(pi->cgroup_path) < 0 && errno != ENOENT) {
+		ni_warn("unable to remove cgroup %s: %m, will retry later", pi->cgroup_path);
+		ni_string_array_append(&__ni_process_stale_cgroups, pi->cgroup_path);
+	}
+	ni_string_free(&pi->cgroup_path);
+}
+
+static void
+__ni_process_cgroup_retry_stale(void)
+{
+	unsigned int i = 0;
+
+	while (i < __ni_process_stale_cgroups.count) {
+		const char *path = __ni_process_stale_cgroups.data[i];
+
+		if (rmdir(path) < 0 && errno != ENOENT) {
+			i++;
+			continue;
+		}
+
+		ni_debug_process("removed stale cgroup %s", path);
+		ni_string_array_remove_index(&__ni_process_stale_cgroups, i);
+	}
+}
+
+static FILE *
+__ni_process_cgroup_open(const char *path, const char *name)
+{
+	char pathbuf[PATH_MAX];
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s/%s", path, name);
+	return fopen(pathbuf, "re");
+}
+
+static void
+__ni_process_cgroup_get_usage(const char *path, ni_process_exit_info_t *exit_info)
+{
+	unsigned long long value, rbytes, wbytes;
+	char line[512], *s;
+	FILE *fp;
+
+	if ((fp = __ni_process_cgroup_open(path, "cpu.stat")) != NULL) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "user_usec %llu", &value) == 1)
+				exit_info->rusage.user_usec = value;
+			else if (sscanf(line, "system_usec %llu", &value) == 1)
+				exit_info->rusage.sys_usec = value;
+		}
+		fclose(fp);
+		exit_info->rusage.from_cgroup = TRUE;
+	}
+
+	if ((fp = __ni_process_cgroup_open(path, "memory.peak")) != NULL) {
+		if (fscanf(fp, "%llu", &value) == 1)
+			exit_info->rusage.max_rss_kb = value / 1024;
+		fclose(fp);
+	}
+
+	/* One line per device: "8:0 rbytes=N wbytes=N rios=N wios=N ..." */
+	if ((fp = __ni_process_cgroup_open(path, "io.stat")) != NULL) {
+		rbytes = wbytes = 0;
+		while (fgets(line, sizeof(line), fp)) {
+			for (s = strtok(line, " \n"); s; s = strtok(NULL, " \n")) {
+				if (sscanf(s, "rbytes=%llu", &value) == 1)
+					rbytes += value;
+				else if (sscanf(s, "wbytes=%llu", &value) == 1)
+					wbytes += value;
+			}
+		}
+		fclose(fp);
+		exit_info->rusage.io_read_bytes = rbytes;
+		exit_info->rusage.io_write_bytes = wbytes;
+	}
 }
 
 /*
@@ -914,6 +1901,9 @@ repeat:
 			__ni_process_notify_buffer(pi, pb);
 		if (repeat)
 			goto repeat;
+	} else if (errno == EIO && pi->use_terminal) {
+		/* This is how a pty tells us the slave side was closed */
+		ni_socket_deactivate(sock);
 	} else if (errno != EWOULDBLOCK) {
 		ni_error("read error on subprocess pipe: %m");
 		ni_socket_deactivate(sock);
@@ -1004,13 +1994,32 @@ __ni_process_io_hangup(ni_socket_t *sock)
 	if (!(pb = __ni_process_buffer_for_socket(sock)))
 		return;
 
+	/* If reading was throttled, there may still be data in the pipe */
+	if (sock->receive && !(sock->poll_flags & POLLIN))
+		sock->receive(sock);
+
 	if (pb->socket == sock) {
 		if (pb->socket)
 			ni_socket_close(pb->socket);
 		pb->socket = NULL;
 	}
 
-	sock->poll_flags &= ~POLLOUT;
+	ni_socket_set_poll_flags(sock, sock->poll_flags & ~POLLOUT);
+}
+
+/*
+ * Stop or resume reading from a process output pipe. This lets the consumer
+ * of the output apply backpressure: while reading is suspended, the pipe
+ * fills up, and the process eventually blocks in write().
+ * Whatever is left in the pipe is still read when the process exits.
+ */
+void
+ni_process_buffer_throttle(ni_process_buffer_t *pb, ni_bool_t stop)
+{
+	if (pb->socket == NULL || pb->socket->receive == NULL)
+		return;
+
+	ni_socket_set_poll_flags(pb->socket, stop? 0 : POLLIN);
 }
 
 static ni_socket_t *
@@ -1022,6 +2031,7 @@ __ni_process_connect_stdin(ni_process_t *pi, int fd)
 		ni_warn("fcntl(O_NONBLOCK) failed: %m");
 
 	sock = ni_socket_wrap(fd, SOCK_STREAM);
+	sock->name = "process-input";
 	sock->transmit = __ni_process_stdin_send;
 	sock->handle_hangup = __ni_process_io_hangup;
 	sock->poll_flags = POLLOUT;
@@ -1039,6 +2049,7 @@ __ni_process_connect_output(ni_process_t *pi, int fd, void (*recv_fn)(ni_socket_
 		ni_warn("fcntl(O_NONBLOCK) failed: %m");
 
 	sock = ni_socket_wrap(fd, SOCK_STREAM);
+	sock->name = "process-output";
 	sock->receive = recv_fn;
 	sock->handle_hangup = __ni_process_io_hangup;
 
@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 #include <signal.h>
 #include <string.h>
@@ -19,12 +20,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <alloca.h>
 
 #include <dborb/netinfo.h>
 #include <dborb/logging.h>
 #include <dborb/xml.h>
 #include <dborb/socket.h>
 #include <dborb/process.h>
+#include <dborb/loopstats.h>
 #include "netinfo_priv.h"
 #include "socket_priv.h"
 #include "appconfig.h"
@@ -37,6 +40,157 @@ static void			__ni_default_hangup_handler(ni_socket_t *);
 static unsigned int		__ni_socket_count;
 static ni_socket_t **		__ni_sockets;
 
+/*
+ * Event loop backends.
+ * With poll(), we rebuild the pollfd array on every call to ni_socket_wait().
+ * With epoll, sockets are registered with the kernel once when activated,
+ * modified when their poll_flags change, and removed when deactivated.
+ * The cost of a wakeup then scales with the number of ready sockets rather
+ * than the total number of sockets.
+ */
+enum {
+	NI_SOCKET_BACKEND_UNSET = 0,
+	NI_SOCKET_BACKEND_POLL,
+	NI_SOCKET_BACKEND_EPOLL,
+};
+
+#define NI_SOCKET_EPOLL_MAX_EVENTS	64
+
+static int			__ni_socket_backend;
+static int			__ni_epoll_fd = -1;
+
+static void
+__ni_socket_backend_init(void)
+{
+	unsigned int wanted = NI_CONFIG_EVENTLOOP_DEFAULT;
+
+	if (__ni_socket_backend != NI_SOCKET_BACKEND_UNSET)
+		return;
+
+	if (ni_global.config)
+		wanted = ni_global.config->eventloop_backend;
+
+	if (wanted != NI_CONFIG_EVENTLOOP_POLL) {
+		__ni_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (__ni_epoll_fd >= 0) {
+			ni_debug_socket("using epoll event loop backend");
+			__ni_socket_backend = NI_SOCKET_BACKEND_EPOLL;
+			return;
+		}
+
+		ni_warn("epoll_create1 failed (%m), falling back to poll");
+	}
+
+	ni_debug_socket("using poll event loop backend");
+	__ni_socket_backend = NI_SOCKET_BACKEND_POLL;
+}
+
+static inline ni_bool_t
+__ni_socket_use_epoll(void)
+{
+	return __ni_socket_backend == NI_SOCKET_BACKEND_EPOLL;
+}
+
+/*
+ * Translate between poll and epoll event masks
+ */
+static inline unsigned int
+__ni_socket_poll_to_epoll(int poll_flags)
+{
+	unsigned int events = 0;
+
+	if (poll_flags & POLLIN)
+		events |= EPOLLIN;
+	if (poll_flags & POLLOUT)
+		events |= EPOLLOUT;
+	return events;
+}
+
+static inline int
+__ni_socket_epoll_to_poll(unsigned int events)
+{
+	int revents = 0;
+
+	if (events & EPOLLIN)
+		revents |= POLLIN;
+	if (events & EPOLLOUT)
+		revents |= POLLOUT;
+	if (events & EPOLLERR)
+		revents |= POLLERR;
+	if (events & EPOLLHUP)
+		revents |= POLLHUP;
+	return revents;
+}
+
+static void
+__ni_socket_epoll_register(ni_socket_t *sock)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = __ni_socket_poll_to_epoll(sock->poll_flags);
+	ev.data.ptr = sock;
+
+	if (epoll_ctl(__ni_epoll_fd, EPOLL_CTL_ADD, sock->__fd, &ev) < 0) {
+		ni_error("%s: cannot register fd %d with epoll: %m", __func__, sock->__fd);
+		return;
+	}
+
+	sock->epoll_events = sock->poll_flags;
+	sock->epoll_registered = 1;
+}
+
+static void
+__ni_socket_epoll_update(ni_socket_t *sock)
+{
+	struct epoll_event ev;
+
+	if (!sock->epoll_registered || sock->epoll_events == sock->poll_flags)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = __ni_socket_poll_to_epoll(sock->poll_flags);
+	ev.data.ptr = sock;
+
+	if (epoll_ctl(__ni_epoll_fd, EPOLL_CTL_MOD, sock->__fd, &ev) < 0) {
+		ni_error("%s: cannot modify epoll events for fd %d: %m", __func__, sock->__fd);
+		return;
+	}
+
+	sock->epoll_events = sock->poll_flags;
+}
+
+/*
+ * Remove the socket from the epoll set. This must happen before the
+ * file descriptor is closed; otherwise a dup'ed copy of the descriptor
+ * would keep the registration (and a stale pointer to us) alive.
+ */
+static void
+__ni_socket_epoll_unregister(ni_socket_t *sock)
+{
+	if (!sock->epoll_registered)
+		return;
+
+	sock->epoll_registered = 0;
+	if (sock->__fd < 0)
+		return;
+
+	if (epoll_ctl(__ni_epoll_fd, EPOLL_CTL_DEL, sock->__fd, NULL) < 0
+	 && errno != EBADF && errno != ENOENT)
+		ni_error("%s: cannot remove fd %d from epoll: %m", __func__, sock->__fd);
+}
+
+/*
+ * Change the set of events we're waiting for on this socket.
+ */
+void
+ni_socket_set_poll_flags(ni_socket_t *sock, int poll_flags)
+{
+	sock->poll_flags = poll_flags;
+	if (sock->active && __ni_socket_use_epoll())
+		__ni_socket_epoll_update(sock);
+}
+
 /*
  * Install a socket so we check it for incoming data.
  */
@@ -46,26 +200,50 @@ ni_socket_activate(ni_socket_t *sock)
 	if (sock->active)
 		return;
 
+	__ni_socket_backend_init();
+
 	if ((__ni_socket_count % 16) == 0) {
 		__ni_sockets = realloc(__ni_sockets, (__ni_socket_count + 16) * sizeof(ni_socket_t *));
 		if (__ni_sockets == NULL)
 			ni_fatal("%s: realloc failed", __FUNCTION__);
 	}
 
+	sock->slot = __ni_socket_count;
 	__ni_sockets[__ni_socket_count++] = sock;
 	sock->refcount++;
 	sock->active = 1;
 
 	if (sock->poll_flags == 0)
 		sock->poll_flags = POLLIN;
+
+	if (__ni_socket_use_epoll())
+		__ni_socket_epoll_register(sock);
 }
 
-static inline void
-__ni_socket_deactivate(ni_socket_t **slot)
+/*
+ * Remove the socket from the array of active sockets.
+ * With poll, we simply clear the slot; ni_socket_wait() compacts
+ * the array before building the pollfd array, and relies on the
+ * indices remaining stable while dispatching events.
+ * With epoll, events carry the socket pointer, so we can fill the
+ * hole with the last socket right away.
+ */
+static void
+__ni_socket_deactivate(ni_socket_t *sock)
 {
-	ni_socket_t *sock = *slot;
+	unsigned int slot = sock->slot;
+
+	ni_assert(slot < __ni_socket_count && __ni_sockets[slot] == sock);
+
+	if (__ni_socket_use_epoll()) {
+		__ni_socket_epoll_unregister(sock);
+
+		__ni_sockets[slot] = __ni_sockets[--__ni_socket_count];
+		__ni_sockets[slot]->slot = slot;
+	} else {
+		__ni_sockets[slot] = NULL;
+	}
 
-	*slot = NULL;
 	sock->active = 0;
 	ni_socket_release(sock);
 }
@@ -73,19 +251,10 @@ __ni_socket_deactivate(ni_socket_t **slot)
 void
 ni_socket_deactivate(ni_socket_t *sock)
 {
-	unsigned int i;
-
 	if (!sock->active)
 		return;
 
-	for (i = 0; i < __ni_socket_count; ++i) {
-		if (__ni_sockets[i] == sock) {
-			__ni_socket_deactivate(&__ni_sockets[i]);
-			return;
-		}
-	}
-
-	ni_error("%s: socket not found", __FUNCTION__);
+	__ni_socket_deactivate(sock);
 }
 
 void
@@ -93,9 +262,9 @@ ni_socket_deactivate_all(void)
 {
 	unsigned int i;
 
-	for (i = 0; i < __ni_socket_count; ++i) {
+	for (i = __ni_socket_count; i-- > 0; ) {
 		if (__ni_sockets[i] != NULL)
-			__ni_socket_deactivate(&__ni_sockets[i]);
+			__ni_socket_deactivate(__ni_sockets[i]);
 	}
 }
 
@@ -143,7 +312,7 @@ __ni_left_to_wait(const struct timeval *until)
 {
 	struct timeval now, delta;
 
-	gettimeofday(&now, NULL);
+	ni_timer_get_time(&now);
 	if (timercmp(until, &now, <=))
 		return 0;
 
@@ -164,42 +333,158 @@ __ni_timeout_min(long a, long b)
 }
 
 /*
- * Wait for incoming data on any of the sockets.
+ * Ask all sockets with a get_timeout callback for their next deadline
  */
-int
-ni_socket_wait(long timeout)
+static long
+__ni_socket_get_timeout(long timeout)
 {
-	struct pollfd pfd[__ni_socket_count];
-	struct timeval now, expires;
-	unsigned int i, j, socket_count;
-
-	/* First step - remove all inactive sockets from the array. */
-	for (i = j = 0; i < __ni_socket_count; ++i) {
-		if (__ni_sockets[i])
-			__ni_sockets[j++] = __ni_sockets[i];
-	}
-	__ni_socket_count = j;
+	struct timeval expires;
+	unsigned int i;
 
-	/* Second step - build pollfd array and get timeouts */
 	timerclear(&expires);
 	for (i = 0; i < __ni_socket_count; ++i) {
 		ni_socket_t *sock = __ni_sockets[i];
 		struct timeval socket_expires;
 
+		if (sock == NULL || sock->get_timeout == NULL)
+			continue;
+
 		timerclear(&socket_expires);
-		if (sock->get_timeout && sock->get_timeout(sock, &socket_expires) == 0) {
+		if (sock->get_timeout(sock, &socket_expires) == 0) {
 			if (!timerisset(&expires) || timercmp(&socket_expires, &expires, <))
 				expires = socket_expires;
 		}
-
-		pfd[i].fd = sock->__fd;
-		pfd[i].events = sock->poll_flags;
 	}
-	socket_count = __ni_socket_count;
 
 	if (timerisset(&expires))
 		timeout = __ni_timeout_min(timeout, __ni_left_to_wait(&expires));
+	return timeout;
+}
 
+static void
+__ni_socket_check_timeout(unsigned int socket_count)
+{
+	struct timeval now;
+	unsigned int i;
+
+	if (socket_count > __ni_socket_count)
+		socket_count = __ni_socket_count;
+
+	ni_timer_get_time(&now);
+	for (i = 0; i < socket_count; ++i) {
+		ni_socket_t *sock = __ni_sockets[i];
+
+		if (sock && sock->check_timeout)
+			sock->check_timeout(sock, &now);
+	}
+}
+
+/*
+ * Invoke the socket callbacks for the events returned by poll/epoll.
+ * The caller must hold a reference on the socket.
+ */
+static inline void
+__ni_socket_callback(ni_socket_t *sock, void (*callback)(ni_socket_t *), ni_loopstats_event_t event)
+{
+	uint64_t begin = ni_loopstats_now();
+
+	callback(sock);
+	ni_loopstats_record_socket(sock->name, event, ni_loopstats_now() - begin);
+}
+
+static void
+__ni_socket_dispatch(ni_socket_t *sock, int revents)
+{
+	/* The socket may have been deactivated by
+	 * ni_process_reap_children() */
+	if (!sock->active)
+		return;
+
+	if (revents & POLLERR) {
+		/* Deactivate socket */
+		__ni_socket_deactivate(sock);
+		__ni_socket_callback(sock, sock->handle_error, NI_LOOPSTATS_ERROR);
+		return;
+	}
+
+	if (revents & POLLIN) {
+		if (sock->receive == NULL) {
+			ni_error("socket %d has no receive callback", sock->__fd);
+			__ni_socket_deactivate(sock);
+		} else {
+			__ni_socket_callback(sock, sock->receive, NI_LOOPSTATS_RECEIVE);
+		}
+	}
+
+	if ((revents & POLLOUT) && sock->active) {
+		if (sock->transmit == NULL) {
+			ni_error("socket %d has no transmit callback", sock->__fd);
+			__ni_socket_deactivate(sock);
+		} else {
+			__ni_socket_callback(sock, sock->transmit, NI_LOOPSTATS_TRANSMIT);
+		}
+	}
+
+	if (revents & POLLHUP) {
+		if (sock->handle_hangup)
+			__ni_socket_callback(sock, sock->handle_hangup, NI_LOOPSTATS_HANGUP);
+	}
+}
+
+/*
+ * Account for the time we spend sleeping in poll, and the time we
+ * spend doing work in between.
+ */
+static uint64_t			__ni_socket_wait_started;
+static uint64_t			__ni_socket_wait_returned;
+
+static inline void
+__ni_socket_wait_begin(void)
+{
+	__ni_socket_wait_started = ni_loopstats_now();
+}
+
+static inline void
+__ni_socket_wait_end(void)
+{
+	uint64_t now = ni_loopstats_now(), busy = 0;
+
+	if (__ni_socket_wait_returned)
+		busy = __ni_socket_wait_started - __ni_socket_wait_returned;
+	ni_loopstats_record_wait(now - __ni_socket_wait_started, busy);
+	__ni_socket_wait_returned = now;
+}
+
+static int
+__ni_socket_wait_poll(long timeout)
+{
+	unsigned int i, j, socket_count;
+	struct pollfd *pfd;
+	int rv;
+
+	/* First step - remove all inactive sockets from the array. */
+	for (i = j = 0; i < __ni_socket_count; ++i) {
+		ni_socket_t *sock = __ni_sockets[i];
+
+		if (sock) {
+			sock->slot = j;
+			__ni_sockets[j++] = sock;
+		}
+	}
+	__ni_socket_count = j;
+
+	/* Second step - build pollfd array and get timeouts */
+	socket_count = __ni_socket_count;
+	pfd = alloca((socket_count + 1) * sizeof(pfd[0]));
+	for (i = 0; i < socket_count; ++i) {
+		ni_socket_t *sock = __ni_sockets[i];
+
+		pfd[i].fd = sock->__fd;
+		pfd[i].events = sock->poll_flags;
+		pfd[i].revents = 0;
+	}
+
+	timeout = __ni_socket_get_timeout(timeout);
 	timeout = __ni_timeout_min(timeout, ni_timer_next_timeout());
 
 	if (socket_count == 0 && timeout < 0) {
@@ -207,7 +492,11 @@ ni_socket_wait(long timeout)
 		return -1;
 	}
 
-	if (poll(pfd, socket_count, timeout) < 0) {
+	__ni_socket_wait_begin();
+	rv = poll(pfd, socket_count, timeout);
+	__ni_socket_wait_end();
+
+	if (rv < 0) {
 		if (errno == EINTR) {
 			ni_process_reap_children();
 			return 0;
@@ -221,62 +510,93 @@ ni_socket_wait(long timeout)
 	for (i = 0; i < socket_count; ++i) {
 		ni_socket_t *sock = __ni_sockets[i];
 
-		if (sock == NULL)
+		if (sock == NULL || pfd[i].revents == 0)
 			continue;
+
 		sock->refcount++;
+		__ni_socket_dispatch(sock, pfd[i].revents);
+		ni_socket_release(sock);
+	}
 
-		/* The socket may have been deactivated by
-		 * ni_process_reap_children() */
-		if (!sock->active)
-			continue;
+	__ni_socket_check_timeout(socket_count);
+	return 0;
+}
 
-		if (pfd[i].revents & POLLERR) {
-			/* Deactivate socket */
-			__ni_socket_deactivate(&__ni_sockets[i]);
-			sock->handle_error(sock);
-			goto done_with_this_socket;
-		}
+static int
+__ni_socket_wait_epoll(long timeout)
+{
+	struct epoll_event events[NI_SOCKET_EPOLL_MAX_EVENTS];
+	int i, nevents;
 
-		if (pfd[i].revents & POLLIN) {
-			if (sock->receive == NULL) {
-				ni_error("socket %d has no receive callback", sock->__fd);
-				__ni_socket_deactivate(&__ni_sockets[i]);
-			} else {
-				sock->receive(sock);
-			}
-		}
+	timeout = __ni_socket_get_timeout(timeout);
+	timeout = __ni_timeout_min(timeout, ni_timer_next_timeout());
 
-		if (pfd[i].revents & POLLOUT) {
-			if (sock->transmit == NULL) {
-				ni_error("socket %d has no transmit callback", sock->__fd);
-				__ni_socket_deactivate(&__ni_sockets[i]);
-			} else {
-				sock->transmit(sock);
-			}
-		}
+	if (__ni_socket_count == 0 && timeout < 0) {
+		ni_error("no sockets left to watch");
+		return -1;
+	}
 
-		if (pfd[i].revents & POLLHUP) {
-			if (sock->handle_hangup)
-				sock->handle_hangup(sock);
-			if (sock->__fd < 0)
-				goto done_with_this_socket;
-		}
+	__ni_socket_wait_begin();
+	nevents = epoll_wait(__ni_epoll_fd, events, NI_SOCKET_EPOLL_MAX_EVENTS, timeout);
+	__ni_socket_wait_end();
 
-done_with_this_socket:
-		ni_socket_release(sock);
+	if (nevents < 0) {
+		if (errno == EINTR) {
+			ni_process_reap_children();
+			return 0;
+		}
+		ni_error("epoll_wait returns error: %m");
+		return -1;
 	}
 
-	gettimeofday(&now, NULL);
-	for (i = 0; i < socket_count; ++i) {
-		ni_socket_t *sock = __ni_sockets[i];
+	/* Hold all sockets we received events for. A callback may deactivate
+	 * and release another socket further down in the list. */
+	for (i = 0; i < nevents; ++i)
+		ni_socket_hold(events[i].data.ptr);
 
-		if (sock && sock->check_timeout)
-			sock->check_timeout(sock, &now);
+	ni_process_reap_children();
+
+	for (i = 0; i < nevents; ++i) {
+		ni_socket_t *sock = events[i].data.ptr;
+
+		__ni_socket_dispatch(sock, __ni_socket_epoll_to_poll(events[i].events));
+
+		/* Callbacks change poll_flags directly; propagate
+		 * any change to the kernel. */
+		if (sock->active)
+			__ni_socket_epoll_update(sock);
 	}
 
+	for (i = 0; i < nevents; ++i)
+		ni_socket_release(events[i].data.ptr);
+
+	__ni_socket_check_timeout(__ni_socket_count);
+	return 0;
+}
+
+/*
+ * Wait for incoming data on any of the sockets.
+ */
+int
+ni_socket_wait(long timeout)
+{
+	int rv;
+
+	__ni_socket_backend_init();
+
+	if (__ni_socket_use_epoll())
+		rv = __ni_socket_wait_epoll(timeout);
+	else
+		rv = __ni_socket_wait_poll(timeout);
+
+	if (rv < 0)
+		return rv;
+
 	/* Fire all pending timers */
 	ni_timer_next_timeout();
 
+	ni_loopstats_check_signal();
+
 	return 0;
 }
 
@@ -319,6 +639,9 @@ ni_socket_wrap(int fd, int sotype)
 static void
 __ni_socket_close(ni_socket_t *sock)
 {
+	if (sock->active)
+		__ni_socket_epoll_unregister(sock);
+
 	if (sock->close) {
 		sock->close(sock);
 	} else if (sock->__fd >= 0) {
@@ -389,6 +712,7 @@ ni_local_socket_listen(const char *path, unsigned int permissions)
 	}
 
 	sock = __ni_socket_wrap(fd, SOCK_STREAM);
+	sock->name = "listener";
 	sock->receive = __ni_socket_accept;
 
 	ni_socket_activate(sock);
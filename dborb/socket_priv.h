@@ -20,6 +20,7 @@ struct ni_socket_ops {
 
 struct ni_socket {
 	unsigned int	refcount;
+	const char *	name;		/* for event loop stats; must be a string constant */
 
 	int		__fd;
 	FILE *		wfile;
@@ -27,8 +28,11 @@ struct ni_socket {
 	unsigned int	stream : 1,
 			active : 1,
 			error : 1,
-			shutdown_after_send : 1;
+			shutdown_after_send : 1,
+			epoll_registered : 1;
 	int		poll_flags;
+	int		epoll_events;	/* poll_flags as last registered with epoll */
+	unsigned int	slot;		/* index into array of active sockets */
 
 	ni_buffer_t	rbuf;
 	ni_buffer_t	wbuf;
@@ -51,6 +55,7 @@ struct ni_socket {
 	void *		user_data;
 };
 
+extern void		ni_socket_set_poll_flags(ni_socket_t *, int);
 
 #endif /* __WICKED_SOCKET_PRIV_H__ */
 
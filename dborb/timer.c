@@ -8,30 +8,81 @@
 #endif
 
 #include <sys/time.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
 #include <dborb/socket.h>
+#include <dborb/loopstats.h>
 #include "netinfo_priv.h"
 #include "util_priv.h"
 
+/*
+ * Pending timers are kept in a binary min-heap ordered by expiry time,
+ * which gives us O(log n) arm and cancel, and O(1) lookup of the next
+ * deadline.
+ *
+ * Timer structs are never returned to malloc; they're recycled through
+ * a free list instead. This allows us to validate a stale handle passed
+ * to ni_timer_cancel() or ni_timer_rearm() without touching freed memory.
+ */
+#define NI_TIMER_NOT_QUEUED	(~0U)
+
 struct ni_timer {
-	ni_timer_t *		next;
+	ni_timer_t *		next;		/* free list */
 	unsigned int		ident;
+	unsigned int		heap_index;
+	unsigned long long	seqno;		/* FIFO order for timers expiring at the same time */
 	struct timeval		expires;
 	ni_timeout_callback_t	*callback;
 	void *			user_data;
 };
 
-static ni_timer_t *		ni_timer_list;
+static struct {
+	unsigned int		count;
+	unsigned int		size;
+	ni_timer_t **		data;
+} ni_timer_heap;
+
+static ni_timer_t *		ni_timer_free_list;
+static ni_timer_t *		ni_timer_firing;
+static unsigned long long	ni_timer_seqno;
 
 static void			__ni_timer_arm(ni_timer_t *, unsigned long);
 static ni_timer_t *		__ni_timer_disarm(const ni_timer_t *);
 
+static ni_timer_t *
+__ni_timer_alloc(void)
+{
+	ni_timer_t *timer;
+
+	if ((timer = ni_timer_free_list) != NULL) {
+		ni_timer_free_list = timer->next;
+		memset(timer, 0, sizeof(*timer));
+	} else {
+		timer = xcalloc(1, sizeof(*timer));
+	}
+
+	timer->heap_index = NI_TIMER_NOT_QUEUED;
+	return timer;
+}
+
+static void
+__ni_timer_free(ni_timer_t *timer)
+{
+	timer->callback = NULL;
+	timer->user_data = NULL;
+	timer->heap_index = NI_TIMER_NOT_QUEUED;
+	timer->next = ni_timer_free_list;
+	ni_timer_free_list = timer;
+}
+
 const ni_timer_t *
 ni_timer_register(unsigned long timeout, ni_timeout_callback_t *callback, void *data)
 {
 	static unsigned int id_counter;
 	ni_timer_t *timer;
 
-	timer = xcalloc(1, sizeof(*timer));
+	timer = __ni_timer_alloc();
 	timer->callback = callback;
 	timer->user_data = data;
 	timer->ident = id_counter++;
@@ -48,7 +99,11 @@ ni_timer_cancel(const ni_timer_t *handle)
 
 	if ((timer = __ni_timer_disarm(handle)) != NULL) {
 		user_data = timer->user_data;
-		free(timer);
+
+		/* If we're being called from the timer's own callback,
+		 * ni_timer_next_timeout() will free it when we return. */
+		if (timer != ni_timer_firing)
+			__ni_timer_free(timer);
 	}
 	return user_data;
 }
@@ -73,7 +128,7 @@ ni_timer_create_alarm(unsigned long timeout_ms, ni_bool_t *flag_p)
 }
 
 /*
- * Timer internal functions
+ * Rearm a timer. This may also be called from the timer's own callback.
  */
 const ni_timer_t *
 ni_timer_rearm(const ni_timer_t *handle, unsigned long timeout)
@@ -85,15 +140,114 @@ ni_timer_rearm(const ni_timer_t *handle, unsigned long timeout)
 	 return timer;
 }
 
+/*
+ * Heap helper functions
+ */
+static inline ni_bool_t
+__ni_timer_before(const ni_timer_t *a, const ni_timer_t *b)
+{
+	if (timercmp(&a->expires, &b->expires, !=))
+		return timercmp(&a->expires, &b->expires, <);
+	return a->seqno < b->seqno;
+}
+
+static inline void
+__ni_timer_heap_set(unsigned int index, ni_timer_t *timer)
+{
+	ni_timer_heap.data[index] = timer;
+	timer->heap_index = index;
+}
+
+static void
+__ni_timer_heap_sift_up(unsigned int index)
+{
+	ni_timer_t *timer = ni_timer_heap.data[index];
+
+	while (index > 0) {
+		unsigned int parent = (index - 1) / 2;
+
+		if (!__ni_timer_before(timer, ni_timer_heap.data[parent]))
+			break;
+		__ni_timer_heap_set(index, ni_timer_heap.data[parent]);
+		index = parent;
+	}
+	__ni_timer_heap_set(index, timer);
+}
+
+static void
+__ni_timer_heap_sift_down(unsigned int index)
+{
+	ni_timer_t *timer = ni_timer_heap.data[index];
+	unsigned int count = ni_timer_heap.count;
+
+	while (TRUE) {
+		unsigned int child = 2 * index + 1;
+
+		if (child >= count)
+			break;
+		if (child + 1 < count
+		 && __ni_timer_before(ni_timer_heap.data[child + 1], ni_timer_heap.data[child]))
+			child++;
+		if (!__ni_timer_before(ni_timer_heap.data[child], timer))
+			break;
+		__ni_timer_heap_set(index, ni_timer_heap.data[child]);
+		index = child;
+	}
+	__ni_timer_heap_set(index, timer);
+}
+
+static void
+__ni_timer_heap_insert(ni_timer_t *timer)
+{
+	if (ni_timer_heap.count >= ni_timer_heap.size) {
+		ni_timer_heap.size += 64;
+		ni_timer_heap.data = realloc(ni_timer_heap.data, ni_timer_heap.size * sizeof(ni_timer_t *));
+		if (ni_timer_heap.data == NULL)
+			ni_fatal("%s: realloc failed", __func__);
+	}
+
+	__ni_timer_heap_set(ni_timer_heap.count++, timer);
+	__ni_timer_heap_sift_up(timer->heap_index);
+}
+
+static void
+__ni_timer_heap_remove(ni_timer_t *timer)
+{
+	unsigned int index = timer->heap_index;
+	ni_timer_t *last;
+
+	timer->heap_index = NI_TIMER_NOT_QUEUED;
+
+	last = ni_timer_heap.data[--ni_timer_heap.count];
+	if (last == timer)
+		return;
+
+	__ni_timer_heap_set(index, last);
+	if (index > 0 && __ni_timer_before(last, ni_timer_heap.data[(index - 1) / 2]))
+		__ni_timer_heap_sift_up(index);
+	else
+		__ni_timer_heap_sift_down(index);
+}
+
+static inline ni_timer_t *
+__ni_timer_heap_top(void)
+{
+	if (ni_timer_heap.count == 0)
+		return NULL;
+	return ni_timer_heap.data[0];
+}
+
 long
 ni_timer_next_timeout(void)
 {
 	struct timeval now, delta;
 	ni_timer_t *timer;
+	ni_timeout_callback_t *callback;
+	uint64_t begin;
 	long timeout;
 
 	ni_timer_get_time(&now);
-	while ((timer = ni_timer_list) != NULL) {
+	while ((timer = __ni_timer_heap_top()) != NULL) {
 		if (!timercmp(&timer->expires, &now, <)) {
 			timersub(&timer->expires, &now, &delta);
 			timeout = delta.tv_sec * 1000 + delta.tv_usec / 1000;
@@ -106,9 +260,18 @@ ni_timer_next_timeout(void)
 				(long) now.tv_sec, (long) now.tv_usec,
 				(long) timer->expires.tv_sec, (long) timer->expires.tv_usec);
 #endif
-		ni_timer_list = timer->next;
-		timer->callback(timer->user_data, timer);
-		free(timer);
+		__ni_timer_heap_remove(timer);
+
+		ni_timer_firing = timer;
+		callback = timer->callback;
+		begin = ni_loopstats_now();
+		callback(timer->user_data, timer);
+		ni_loopstats_record_timer(callback, ni_loopstats_now() - begin);
+		ni_timer_firing = NULL;
+
+		/* Do not free the timer if the callback rearmed it */
+		if (timer->heap_index == NI_TIMER_NOT_QUEUED)
+			__ni_timer_free(timer);
 	}
 
 	return -1;
@@ -117,8 +280,6 @@ ni_timer_next_timeout(void)
 static void
 __ni_timer_arm(ni_timer_t *timer, unsigned long timeout)
 {
-	ni_timer_t *tail, **pos;
-
 	ni_timer_get_time(&timer->expires);
 	timer->expires.tv_sec += timeout / 1000;
 	timer->expires.tv_usec += (timeout % 1000) * 1000;
@@ -127,53 +288,56 @@ __ni_timer_arm(ni_timer_t *timer, unsigned long timeout)
 		timer->expires.tv_usec -= 1000000;
 	}
 
-	for (pos = &ni_timer_list; (tail = *pos) != NULL; pos = &tail->next) {
-		if (timercmp(&timer->expires, &tail->expires, <))
-			break;
-	}
-
-	timer->next = tail;
-	*pos = timer;
+	timer->seqno = ni_timer_seqno++;
+	__ni_timer_heap_insert(timer);
 }
 
+/*
+ * Remove a timer from the heap. Returns NULL if the handle does not
+ * refer to a pending timer (or to the timer currently being fired).
+ */
 static ni_timer_t *
 __ni_timer_disarm(const ni_timer_t *handle)
 {
-	ni_timer_t **pos, *timer;
+	ni_timer_t *timer = (ni_timer_t *) handle;
 
-	for (pos = &ni_timer_list; (timer = *pos) != NULL; pos = &timer->next) {
-		if (timer == handle) {
-			*pos = timer->next;
-			timer->next = NULL;
-			break;
-		}
+	if (timer == NULL)
+		return NULL;
+
+	if (timer->heap_index < ni_timer_heap.count
+	 && ni_timer_heap.data[timer->heap_index] == timer) {
+		__ni_timer_heap_remove(timer);
+		return timer;
 	}
-	return timer;
+
+	if (timer == ni_timer_firing)
+		return timer;
+
+	return NULL;
 }
 
+/*
+ * Timers are based on the monotonic clock, so that changes to the wall
+ * clock time (eg through NTP, or when resuming a guest) do not cause
+ * them to fire early or stall.
+ */
 int
 ni_timer_get_time(struct timeval *tv)
 {
-#if 0
-/*  defined(WITH_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC) */
-	/*
-	 * Note: Requires to link using -lrt
-	 */
 	static int use_monotonic = 1;
 
-	if (use_monotonic == 1) {
-		use_monotonic = clock_getres(CLOCK_MONOTONIC, NULL);
-	}
-	if (use_monotonic == 0) {
+	if (use_monotonic) {
 		struct timespec now;
-		int ret;
 
-		ret = clock_gettime(CLOCK_MONOTONIC, &now);
-		TIMESPEC_TO_TIMEVAL(tv, &now);
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+			TIMESPEC_TO_TIMEVAL(tv, &now);
+			return 0;
+		}
 
-		return ret;
+		ni_warn("CLOCK_MONOTONIC not available, falling back to gettimeofday");
+		use_monotonic = 0;
 	}
-#endif
+
 	return gettimeofday(tv, NULL);
 }
 
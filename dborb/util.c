@@ -9,6 +9,7 @@
 
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <stdio.h>
@@ -1839,6 +1840,123 @@ ni_file_read(FILE *fp)
 	return result;
 }
 
+/*
+ * Append everything that can be read from the file descriptor to
+ * the buffer.
+ */
+ni_bool_t
+ni_file_read_fd(int fd, ni_buffer_t *result)
+{
+	struct stat stb;
+	size_t chunk = 65536;
+
+	if (fstat(fd, &stb) >= 0 && S_ISREG(stb.st_mode) && stb.st_size > 0)
+		chunk = stb.st_size;
+
+	while (TRUE) {
+		ssize_t count;
+
+		if (!ni_buffer_ensure_tailroom(result, chunk))
+			return FALSE;
+
+		count = read(fd, ni_buffer_tail(result), ni_buffer_tailroom(result));
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			ni_error("%s: read error: %m", __func__);
+			return FALSE;
+		}
+		if (count == 0)
+			break;
+		ni_buffer_push_tail(result, count);
+		chunk = 65536;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Create an anonymous in-memory file holding the given data, suitable
+ * for passing to another process. The data is sealed against further
+ * modification, and the file offset is at the start of the file.
+ */
+int
+ni_file_memfd(const char *name, const void *data, size_t count)
+{
+	struct iovec iov = { .iov_base = (void *) data, .iov_len = count };
+
+	return ni_file_memfd_iovec(name, &iov, count? 1 : 0);
+}
+
+int
+ni_file_memfd_iovec(const char *name, const struct iovec *iov, unsigned int iovcnt)
+{
+	unsigned int i;
+	int fd;
+
+	if ((fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		ni_error("unable to create memfd: %m");
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; ++i) {
+		const unsigned char *pos = iov[i].iov_base;
+		size_t count = iov[i].iov_len;
+
+		while (count) {
+			ssize_t n;
+
+			n = write(fd, pos, count);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				ni_error("unable to write to memfd: %m");
+				close(fd);
+				return -1;
+			}
+			pos += n;
+			count -= n;
+		}
+	}
+
+	/* The receiver insists on the seals, see ni_file_is_sealed() */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		ni_error("unable to seal memfd: %m");
+		close(fd);
+		return -1;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		ni_error("unable to rewind memfd: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Check whether a file descriptor we received from someone else refers
+ * to a file that cannot change underneath us. Otherwise, the sender could
+ * truncate a file we have mapped (which gets us a SIGBUS), or keep feeding
+ * us data forever.
+ */
+ni_bool_t
+ni_file_is_sealed(int fd)
+{
+	int required = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+	struct stat stb;
+	int seals;
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode))
+		return FALSE;
+
+	if ((seals = fcntl(fd, F_GET_SEALS)) < 0)
+		return FALSE;
+
+	return (seals & required) == required;
+}
+
 /*
  * Create directory if it does not exist
  */
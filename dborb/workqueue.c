@@ -0,0 +1,241 @@
+/*
+ * Worker thread pool for blocking I/O.
+ *
+ * The master and the agents are single threaded, and everything runs off
+ * ni_socket_wait(). Things like reading or writing a large file, or
+ * hashing it, can block the main loop for a long time, and stall all
+ * other dbus calls and process pipes on that host. Such work can be
+ * handed to a small pool of worker threads instead.
+ *
+ * Work items are queued on a mutex protected list; idle workers pick
+ * them up from there. When a worker is done with an item, it moves it to
+ * the completion list and kicks an eventfd, which is watched by the main
+ * loop like any other socket. The receive callback then invokes the
+ * completion functions on the main thread.
+ *
+ * Threads are started lazily when the first work item is submitted. The
+ * number of threads can be set in the config file using
+ * <worker-pool threads="N"/>.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <dborb/workqueue.h>
+#include <dborb/socket.h>
+#include <dborb/logging.h>
+#include <dborb/util.h>
+#include "socket_priv.h"
+#include "util_priv.h"
+#include "appconfig.h"
+
+typedef struct ni_workqueue {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wakeup;
+
+	ni_work_t *		queue;
+	ni_work_t **		queue_tail;
+	ni_work_t *		done;
+	ni_work_t **		done_tail;
+
+	unsigned int		nthreads;
+	unsigned int		pending;	/* submitted, but not completed yet */
+
+	int			eventfd;
+	ni_socket_t *		socket;
+} ni_workqueue_t;
+
+static ni_workqueue_t		ni_workqueue = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.wakeup		= PTHREAD_COND_INITIALIZER,
+	.queue_tail	= &ni_workqueue.queue,
+	.done_tail	= &ni_workqueue.done,
+	.eventfd	= -1,
+};
+
+ni_work_t *
+ni_work_new(ni_work_func_t *run, ni_work_func_t *complete, void *user_data)
+{
+	ni_work_t *work;
+
+	work = xcalloc(1, sizeof(*work));
+	work->run = run;
+	work->complete = complete;
+	work->user_data = user_data;
+	return work;
+}
+
+void
+ni_work_free(ni_work_t *work)
+{
+	free(work);
+}
+
+/*
+ * This is what the worker threads do all day
+ */
+static void *
+__ni_workqueue_thread(void *arg)
+{
+	ni_workqueue_t *wq = arg;
+	static const uint64_t one = 1;
+	ni_work_t *work;
+
+	while (TRUE) {
+		pthread_mutex_lock(&wq->lock);
+		while ((work = wq->queue) == NULL)
+			pthread_cond_wait(&wq->wakeup, &wq->lock);
+		if ((wq->queue = work->next) == NULL)
+			wq->queue_tail = &wq->queue;
+		work->next = NULL;
+		pthread_mutex_unlock(&wq->lock);
+
+		work->run(work);
+
+		pthread_mutex_lock(&wq->lock);
+		*wq->done_tail = work;
+		wq->done_tail = &work->next;
+		pthread_mutex_unlock(&wq->lock);
+
+		/* If this fails, the counter is about to overflow, and the
+		 * main loop will wake up anyway. */
+		(void) write(wq->eventfd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+/*
+ * The eventfd became readable; run the completion callbacks.
+ */
+static void
+__ni_workqueue_recv(ni_socket_t *sock)
+{
+	ni_workqueue_t *wq = sock->user_data;
+	ni_work_t *work;
+	uint64_t count;
+
+	if (read(wq->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		ni_error("workqueue: unable to read from eventfd: %m");
+
+	pthread_mutex_lock(&wq->lock);
+	work = wq->done;
+	wq->done = NULL;
+	wq->done_tail = &wq->done;
+	pthread_mutex_unlock(&wq->lock);
+
+	while (work) {
+		ni_work_t *next = work->next;
+
+		work->next = NULL;
+		wq->pending--;
+		work->complete(work);
+		work = next;
+	}
+}
+
+static unsigned int
+__ni_workqueue_config_threads(void)
+{
+	unsigned int nthreads = 0;
+
+	if (ni_global.config)
+		nthreads = ni_global.config->worker_threads;
+	if (nthreads == 0)
+		nthreads = NI_WORKQUEUE_DEFAULT_THREADS;
+	if (nthreads > NI_WORKQUEUE_MAX_THREADS)
+		nthreads = NI_WORKQUEUE_MAX_THREADS;
+	return nthreads;
+}
+
+static ni_bool_t
+__ni_workqueue_start(ni_workqueue_t *wq)
+{
+	unsigned int nthreads;
+	sigset_t all, saved;
+
+	if (wq->eventfd < 0) {
+		if ((wq->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			ni_error("workqueue: unable to create eventfd: %m");
+			return FALSE;
+		}
+
+		wq->socket = ni_socket_wrap(wq->eventfd, SOCK_STREAM);
+		wq->socket->name = "workqueue";
+		wq->socket->receive = __ni_workqueue_recv;
+		wq->socket->user_data = wq;
+		ni_socket_activate(wq->socket);
+	}
+
+	/* Signals should always be delivered to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+	nthreads = __ni_workqueue_config_threads();
+	while (wq->nthreads < nthreads) {
+		pthread_attr_t attr;
+		pthread_t thread;
+		int err;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&thread, &attr, __ni_workqueue_thread, wq);
+		pthread_attr_destroy(&attr);
+
+		if (err) {
+			ni_error("workqueue: unable to create worker thread: %s", strerror(err));
+			break;
+		}
+		wq->nthreads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (wq->nthreads == 0)
+		return FALSE;
+
+	ni_debug_socket("workqueue: started %u worker threads", wq->nthreads);
+	return TRUE;
+}
+
+/*
+ * Queue a work item. The caller must not touch it until its
+ * completion function has been called.
+ */
+ni_bool_t
+ni_work_submit(ni_work_t *work)
+{
+	ni_workqueue_t *wq = &ni_workqueue;
+
+	ni_assert(work->run && work->complete);
+
+	if (wq->nthreads == 0 && !__ni_workqueue_start(wq))
+		return FALSE;
+
+	work->next = NULL;
+
+	pthread_mutex_lock(&wq->lock);
+	*wq->queue_tail = work;
+	wq->queue_tail = &work->next;
+	pthread_cond_signal(&wq->wakeup);
+	pthread_mutex_unlock(&wq->lock);
+
+	wq->pending++;
+	return TRUE;
+}
+
+/*
+ * Number of work items that have been submitted but not completed yet.
+ * This is only ever modified on the main thread, so no locking needed.
+ */
+unsigned int
+ni_workqueue_pending(void)
+{
+	return ni_workqueue.pending;
+}
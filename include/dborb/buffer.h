@@ -10,6 +10,8 @@
 #define __WICKED_DHCP_BUFFER_H__
 
 #include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <dborb/types.h>
@@ -22,7 +24,17 @@ struct ni_buffer {
 	size_t			size;
 	unsigned int		overflow : 1,
 				underflow : 1,
-				allocated : 1;
+				allocated : 1,
+				pool_class : 5;	/* set by ni_buffer_new() */
+
+	/*
+	 * Heap allocated buffers can be shared. A refcount of 0 is
+	 * treated like 1, i.e. a single owner.
+	 * A slice does not own its data; it points into the storage of
+	 * another buffer, and holds a reference on that buffer.
+	 */
+	unsigned int		refcount;
+	ni_buffer_t *		backing;
 };
 
 struct ni_buffer_chain {
@@ -30,6 +42,8 @@ struct ni_buffer_chain {
 	ni_buffer_t *		data;
 };
 
+extern void		ni_buffer_free(ni_buffer_t *);
+
 /* this should really be named init_writer */
 static inline void
 ni_buffer_init(ni_buffer_t *bp, void *base, size_t size)
@@ -53,6 +67,8 @@ ni_buffer_destroy(ni_buffer_t *bp)
 {
 	if (bp->allocated)
 		free(bp->base);
+	if (bp->backing)
+		ni_buffer_free(bp->backing);
 	memset(bp, 0, sizeof(*bp));
 }
 
@@ -63,26 +79,19 @@ ni_buffer_new_dynamic(size_t size)
 
 	bp = ni_calloc(1, sizeof(*bp));
 	ni_buffer_init_dynamic(bp, size);
+	bp->refcount = 1;
 	return bp;
 }
 
 static inline ni_buffer_t *
-ni_buffer_new(size_t size)
+ni_buffer_hold(ni_buffer_t *bp)
 {
-	ni_buffer_t *bp;
-
-	bp = ni_calloc(1, sizeof(*bp) + size);
-	ni_buffer_init(bp, (char *) (bp + 1), size);
+	if (bp->refcount == 0)
+		bp->refcount = 1;
+	bp->refcount++;
 	return bp;
 }
 
-static inline void
-ni_buffer_free(ni_buffer_t *bp)
-{
-	ni_buffer_destroy(bp);
-	free(bp);
-}
-
 static inline void
 ni_buffer_init_reader(ni_buffer_t *bp, void *base, size_t size)
 {
@@ -235,11 +244,33 @@ ni_buffer_pull_head(ni_buffer_t *bp, size_t count)
 	return result;
 }
 
+/*
+ * Buffers returned by ni_buffer_new() come from a per-process pool with
+ * power-of-two size classes. Freed buffers are kept on a free list per
+ * class instead of being handed back to malloc.
+ */
+typedef struct ni_buffer_pool_stats {
+	size_t			size;		/* largest buffer served by this class; 0 means oversized */
+	uint64_t		allocs;
+	uint64_t		hits;		/* allocations served from the free list */
+	unsigned int		in_use;
+	unsigned int		high_water;	/* max value of in_use */
+	unsigned int		cached;		/* buffers on the free list */
+} ni_buffer_pool_stats_t;
+
+extern ni_buffer_t *	ni_buffer_new(size_t);
+extern ni_buffer_t *	ni_buffer_slice(ni_buffer_t *, size_t offset, size_t len);
+extern unsigned int	ni_buffer_pool_get_stats(ni_buffer_pool_stats_t *, unsigned int);
+extern void		ni_buffer_pool_dump(void);
+extern void		ni_buffer_pool_trim(void);
+
 extern ni_bool_t	ni_buffer_ensure_tailroom(ni_buffer_t *, unsigned int);
 
 extern void		ni_buffer_chain_discard(ni_buffer_chain_t **head);
 extern void		ni_buffer_chain_append(ni_buffer_chain_t **head, ni_buffer_t *);
 extern unsigned int	ni_buffer_chain_count(const ni_buffer_chain_t *);
 extern ni_buffer_t *	ni_buffer_chain_get_next(ni_buffer_chain_t **head);
+extern unsigned int	ni_buffer_chain_iovec(const ni_buffer_chain_t *, struct iovec *, unsigned int, size_t);
+extern void		ni_buffer_chain_pull(ni_buffer_chain_t **head, size_t);
 
 #endif /* __WICKED_DHCP_BUFFER_H__ */
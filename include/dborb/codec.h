@@ -0,0 +1,60 @@
+/*
+ * Compression codecs for bulk data transfers
+ */
+
+#ifndef __TESTBUS_DBORB_CODEC_H__
+#define __TESTBUS_DBORB_CODEC_H__
+
+#include <stdint.h>
+#include <dborb/types.h>
+#include <dborb/dbus.h>
+
+/*
+ * Name used on the wire for data that has not been compressed
+ */
+#define NI_CODEC_IDENTITY	"identity"
+
+/*
+ * Chunks smaller than this are not worth compressing, unless
+ * the config file says otherwise.
+ */
+#define NI_CODEC_DEFAULT_MIN_SIZE	4096
+
+/*
+ * We refuse to decode anything that claims to be bigger than this
+ */
+#define NI_CODEC_SIZE_MAX	(16 * 1024 * 1024)
+
+typedef struct ni_codec_stats {
+	uint64_t		calls;
+	uint64_t		skipped;	/* too small, or did not get any smaller */
+	uint64_t		bytes_in;
+	uint64_t		bytes_out;
+	uint64_t		cpu_usec;
+} ni_codec_stats_t;
+
+typedef struct ni_codec ni_codec_t;
+struct ni_codec {
+	const char *		name;
+
+	/* Both append to the output buffer, which has enough tailroom
+	 * for the decoded data when decompressing. */
+	ni_bool_t		(*compress)(const void *, size_t, ni_buffer_t *);
+	ni_bool_t		(*decompress)(const void *, size_t, ni_buffer_t *);
+
+	ni_codec_stats_t	encode;
+	ni_codec_stats_t	decode;
+};
+
+extern ni_codec_t *		ni_codec_by_name(const char *);
+extern ni_codec_t *		ni_codec_default(void);
+extern ni_buffer_t *		ni_codec_encode(ni_codec_t *, const void *, size_t);
+extern ni_buffer_t *		ni_codec_decode(ni_codec_t *, const void *, size_t, size_t);
+extern ni_codec_t *		ni_codec_get(unsigned int);
+extern void			ni_codec_dump(void);
+
+extern void			ni_codec_encode_dict(ni_codec_t *, const void *, size_t, ni_dbus_variant_t *);
+extern ni_buffer_t *		ni_codec_decode_dict(const ni_dbus_variant_t *, DBusError *);
+extern ni_buffer_t *		ni_codec_decode_data(const char *, uint32_t, const ni_dbus_variant_t *, DBusError *);
+
+#endif /* __TESTBUS_DBORB_CODEC_H__ */
@@ -8,6 +8,7 @@
 #ifndef __WICKED_DBUS_H__
 #define __WICKED_DBUS_H__
 
+#include <sys/uio.h>
 #include <dbus/dbus.h>
 #include <dborb/types.h>
 #include <dborb/util.h>
@@ -52,6 +53,7 @@ struct ni_dbus_variant {
 		dbus_int64_t	int64_value;
 		dbus_uint64_t	uint64_value;
 		double		double_value;
+		int		unix_fd_value;
 		unsigned char *	byte_array_value;
 		char **		string_array_value;
 		ni_dbus_dict_entry_t *dict_array_value;
@@ -96,6 +98,21 @@ typedef dbus_bool_t		ni_dbus_async_method_completion_t(ni_dbus_connection_t *con
 					const ni_dbus_method_t *method,
 					ni_dbus_message_t *call,
 					const ni_process_t *);
+/* Async methods can also hand blocking work to the worker pool (see dborb/workqueue.h).
+ * The work handler is called with the decoded arguments, like a synchronous handler,
+ * and returns a work item; it may take ownership of argument values by moving them into
+ * the work item. Once the work is done, the completion function is called on the main
+ * thread to build the reply. It owns the work item and must free it. If the client
+ * connection went away in the meantime, the reply is discarded. */
+typedef ni_work_t *		ni_dbus_async_work_handler_t(ni_dbus_object_t *object,
+					const ni_dbus_method_t *method,
+					unsigned int argc,
+					ni_dbus_variant_t *argv,
+					DBusError *error);
+typedef dbus_bool_t		ni_dbus_async_work_completion_t(const ni_dbus_method_t *method,
+					ni_work_t *work,
+					ni_dbus_message_t *reply,
+					DBusError *error);
 
 struct ni_dbus_method {
 	const char *		name;
@@ -106,6 +123,8 @@ struct ni_dbus_method {
 	ni_dbus_method_handler_ex_t *handler_ex;
 	ni_dbus_async_method_handler_t *async_handler;
 	ni_dbus_async_method_completion_t *async_completion;
+	ni_dbus_async_work_handler_t *async_work_handler;
+	ni_dbus_async_work_completion_t *async_work_completion;
 
 	ni_bool_t		suppress_logging;
 
@@ -263,6 +282,7 @@ extern void			ni_dbus_variant_set_int32(ni_dbus_variant_t *, int32_t);
 extern void			ni_dbus_variant_set_uint64(ni_dbus_variant_t *, uint64_t);
 extern void			ni_dbus_variant_set_int64(ni_dbus_variant_t *, int64_t);
 extern void			ni_dbus_variant_set_double(ni_dbus_variant_t *, double);
+extern void			ni_dbus_variant_set_unix_fd(ni_dbus_variant_t *, int);
 /* FIXME: we should really rename these to _assign_ */
 extern dbus_bool_t		ni_dbus_variant_assign_bool(ni_dbus_variant_t *, dbus_bool_t);
 extern dbus_bool_t		ni_dbus_variant_set_int(ni_dbus_variant_t *, int);
@@ -283,6 +303,7 @@ extern dbus_bool_t		ni_dbus_variant_get_int32(const ni_dbus_variant_t *, int32_t
 extern dbus_bool_t		ni_dbus_variant_get_uint64(const ni_dbus_variant_t *, uint64_t *);
 extern dbus_bool_t		ni_dbus_variant_get_int64(const ni_dbus_variant_t *, int64_t *);
 extern dbus_bool_t		ni_dbus_variant_get_double(const ni_dbus_variant_t *, double *);
+extern dbus_bool_t		ni_dbus_variant_get_unix_fd(const ni_dbus_variant_t *, int *);
 extern dbus_bool_t		ni_dbus_variant_get_int(const ni_dbus_variant_t *, int *);
 extern dbus_bool_t		ni_dbus_variant_get_uint(const ni_dbus_variant_t *, unsigned int *);
 extern dbus_bool_t		ni_dbus_variant_get_long(const ni_dbus_variant_t *, long *);
@@ -294,6 +315,8 @@ extern dbus_bool_t		ni_dbus_variant_get_byte_array_minmax(const ni_dbus_variant_
 extern void			ni_dbus_variant_init_byte_array(ni_dbus_variant_t *);
 extern void			ni_dbus_variant_set_byte_array(ni_dbus_variant_t *,
 					const unsigned char *, unsigned int len);
+extern void			ni_dbus_variant_set_byte_array_iovec(ni_dbus_variant_t *,
+					const struct iovec *, unsigned int);
 extern dbus_bool_t		ni_dbus_variant_append_byte_array(ni_dbus_variant_t *, unsigned char);
 extern void			ni_dbus_variant_init_string_array(ni_dbus_variant_t *);
 extern void			ni_dbus_variant_set_string_array(ni_dbus_variant_t *,
@@ -370,6 +393,7 @@ extern dbus_bool_t		ni_dbus_struct_get_string(const ni_dbus_variant_t *, unsigne
  * Client side functions
  */
 extern ni_dbus_client_t *	ni_dbus_client_open(const char *bus_type, const char *bus_name);
+extern ni_dbus_client_t *	ni_dbus_client_open_peer(const ni_dbus_client_t *, const char *bus_name);
 extern void			ni_dbus_client_free(ni_dbus_client_t *);
 extern void			ni_dbus_client_add_signal_handler(ni_dbus_client_t *client,
 					const char *sender,
@@ -406,6 +430,12 @@ extern int			ni_dbus_object_call_simple(const ni_dbus_object_t *,
 					int res_type, void *res_ptr);
 extern int			ni_dbus_object_call_async(ni_dbus_object_t *obj,
 					ni_dbus_async_callback_t *callback, const char *method, ...);
+extern int			ni_dbus_object_call_variant_async(ni_dbus_object_t *obj,
+					const char *interface, const char *method,
+					unsigned int nargs, const ni_dbus_variant_t *args,
+					ni_dbus_async_callback_t *callback);
+extern void			ni_dbus_object_wait_async(ni_dbus_object_t *obj);
+extern ni_bool_t		ni_dbus_object_can_pass_fds(const ni_dbus_object_t *obj);
 
 extern ni_dbus_message_t *	ni_dbus_object_call_new(const ni_dbus_object_t *, const char *method, ...);
 extern ni_dbus_message_t *	ni_dbus_object_call_new_va(const ni_dbus_object_t *obj,
@@ -0,0 +1,64 @@
+/*
+ * Event loop instrumentation
+ */
+
+#ifndef __TESTBUS_DBORB_LOOPSTATS_H__
+#define __TESTBUS_DBORB_LOOPSTATS_H__
+
+#include <stdint.h>
+#include <dborb/types.h>
+
+/*
+ * Latencies are collected in log2 buckets of microseconds; bucket i
+ * counts samples below (1 << i) usec. The last bucket catches everything
+ * that took longer than that.
+ */
+#define NI_LATENCY_BUCKETS	24
+
+typedef struct ni_latency_histogram {
+	uint64_t		count;
+	uint64_t		total_usec;
+	uint64_t		max_usec;
+	uint64_t		bucket[NI_LATENCY_BUCKETS];
+} ni_latency_histogram_t;
+
+typedef enum {
+	NI_LOOPSTATS_RECEIVE,
+	NI_LOOPSTATS_TRANSMIT,
+	NI_LOOPSTATS_HANGUP,
+	NI_LOOPSTATS_ERROR,
+	NI_LOOPSTATS_TIMER,
+
+	__NI_LOOPSTATS_EVENT_MAX
+} ni_loopstats_event_t;
+
+typedef struct ni_loopstats_entry {
+	const void *		key;
+	ni_loopstats_event_t	event;
+	char *			name;
+	ni_latency_histogram_t	latency;
+} ni_loopstats_entry_t;
+
+typedef struct ni_loopstats {
+	uint64_t		iterations;
+	ni_latency_histogram_t	wait;		/* time spent sleeping in poll/epoll */
+	ni_latency_histogram_t	busy;		/* time spent between two waits */
+
+	unsigned int		count;
+	ni_loopstats_entry_t *	data;
+} ni_loopstats_t;
+
+extern uint64_t			ni_loopstats_now(void);
+extern void			ni_loopstats_record_socket(const char *, ni_loopstats_event_t, uint64_t);
+extern void			ni_loopstats_record_timer(const void *, uint64_t);
+extern void			ni_loopstats_record_wait(uint64_t, uint64_t);
+extern const ni_loopstats_t *	ni_loopstats_get(void);
+extern void			ni_loopstats_reset(void);
+extern void			ni_loopstats_dump(void);
+extern void			ni_loopstats_catch_signal(int);
+extern void			ni_loopstats_check_signal(void);
+
+extern const char *		ni_loopstats_event_name(ni_loopstats_event_t);
+extern uint64_t			ni_latency_histogram_percentile(const ni_latency_histogram_t *, unsigned int);
+
+#endif /* __TESTBUS_DBORB_LOOPSTATS_H__ */
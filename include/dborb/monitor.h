@@ -42,8 +42,13 @@ struct ni_monitor {
 	const ni_event_class_t *class;
 
 	unsigned int		interval;	/* 0 if monitor has its own polling method */
+	unsigned int		max_interval;	/* back off up to this interval while idle; 0 means never */
 	ni_bool_t		push;		/* true iff we should actively push new messages */
 	ni_eventlog_t *		log;
+
+	/* Polling state, in msec */
+	unsigned long		poll_interval;
+	unsigned long long	poll_deadline;
 };
 
 typedef struct ni_monitor_array {
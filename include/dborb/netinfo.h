@@ -27,6 +27,14 @@ extern ni_xs_scope_t *	ni_server_dbus_xml_schema(void);
 extern void		ni_config_set_dbus_socket_path(const char *);
 extern const char *	ni_config_statedir(void);
 extern const char *	ni_config_backupdir(void);
+extern const char *	ni_config_spooldir(void);
+extern unsigned int	ni_config_spool_threshold(void);
+extern unsigned int	ni_config_spool_idle_timeout(void);
+extern unsigned int	ni_config_file_size_max(void);
+extern const char *	ni_config_process_cgroup(void);
+extern unsigned int	ni_config_run_queue_slots(void);
+extern ni_bool_t	ni_config_spawn_helper(void);
+extern unsigned int	ni_config_file_cache_size(void);
 
 extern ni_dbus_client_t *ni_create_dbus_client(const char *bus_name);
 
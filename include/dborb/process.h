@@ -8,6 +8,9 @@
 #ifndef __WICKED_PROCESS_H__
 #define __WICKED_PROCESS_H__
 
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdint.h>
 #include <dborb/logging.h>
 #include <dborb/util.h>
 
@@ -60,6 +63,33 @@ struct ni_process_exit_info {
 	/* TBD: stderr/stdout */
 	unsigned int		stdout_bytes;
 	unsigned int		stderr_bytes;
+
+	/* In tail-only capture mode, the amount of output that was
+	 * dropped to keep just the last N bytes */
+	uint64_t		stdout_discarded;
+	uint64_t		stderr_discarded;
+
+	/* Resource usage, as reported by wait4(), or by the process
+	 * cgroup if we ran the command in one. */
+	struct {
+		ni_bool_t	valid;
+		ni_bool_t	from_cgroup;
+		uint64_t	wall_usec;
+		uint64_t	user_usec;
+		uint64_t	sys_usec;
+		uint64_t	max_rss_kb;
+		uint64_t	io_read_bytes;
+		uint64_t	io_write_bytes;
+		uint64_t	voluntary_ctxsw;
+		uint64_t	involuntary_ctxsw;
+	} rusage;
+
+	/* Time the command spent in the agent's run queue, and the
+	 * number of commands waiting ahead of it when it arrived. */
+	struct {
+		uint64_t	wait_usec;
+		unsigned int	depth;
+	} queue;
 };
 
 /*
@@ -67,7 +97,9 @@ struct ni_process_exit_info {
  */
 struct ni_process {
 	ni_process_t *		next;		/* internal; for wait queue list */
+	ni_process_t **		prev;
 	ni_shellcmd_t *		process;
+	ni_socket_t *		exit_socket;	/* internal; pidfd watching for process exit */
 
 	pid_t			pid;
 	int			status;
@@ -78,6 +110,15 @@ struct ni_process {
 
 	ni_bool_t		use_terminal;
 
+	/* If set, the command runs in a cgroup of its own below this
+	 * (cgroup v2) directory, which gives us accounting that includes
+	 * all its descendants. */
+	char *			cgroup_parent;
+	char *			cgroup_path;	/* internal */
+
+	struct timeval		start_time;	/* internal */
+	struct rusage		rusage;		/* internal; filled in by wait4 */
+
 	ni_process_buffer_t	stdin, stdout, stderr;
 
 	ni_tempstate_t *	temp_state;
@@ -108,10 +149,13 @@ extern int			ni_process_exit_status_okay(const ni_process_t *);
 extern void			ni_shellcmd_free(ni_shellcmd_t *);
 
 extern void			ni_process_reap_children(void);
+extern ni_bool_t		ni_process_start_spawn_helper(void);
 
 extern void			ni_process_capture_stdout(ni_process_t *);
 extern void			ni_process_capture_stderr(ni_process_t *);
 extern ni_bool_t		ni_process_attach_input_regular_file(ni_process_t *, const char *filename);
+extern void			ni_process_buffer_throttle(ni_process_buffer_t *, ni_bool_t stop);
+extern void			ni_process_set_cgroup(ni_process_t *, const char *parent);
 
 static inline ni_shellcmd_t *
 ni_shellcmd_hold(ni_shellcmd_t *proc)
@@ -32,6 +32,7 @@ typedef struct ni_script_action	ni_script_action_t;
 typedef struct ni_shellcmd	ni_shellcmd_t;
 typedef struct ni_process	ni_process_t;
 typedef struct ni_process_exit_info  ni_process_exit_info_t;
+typedef struct ni_work		ni_work_t;
 
 typedef struct ni_monitor	ni_monitor_t;
 typedef struct ni_event		ni_event_t;
@@ -8,6 +8,7 @@
 #define __WICKED_UTIL_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dborb/types.h>
 #include <string.h>
 #include <stdio.h>
@@ -158,6 +159,10 @@ extern int		ni_backup_file_to(const char *, const char *);
 extern int		ni_restore_file_from(const char *, const char *);
 extern FILE *		ni_file_open(const char *, const char *, unsigned int);
 extern ni_buffer_t *	ni_file_read(FILE *);
+extern ni_bool_t	ni_file_read_fd(int, ni_buffer_t *);
+extern int		ni_file_memfd(const char *, const void *, size_t);
+extern int		ni_file_memfd_iovec(const char *, const struct iovec *, unsigned int);
+extern ni_bool_t	ni_file_is_sealed(int);
 extern int		ni_file_write(FILE *, const ni_buffer_t *);
 extern int		ni_file_write_safe(FILE *, const ni_buffer_t *);
 extern int		ni_file_write_path(const char *pathname, const ni_buffer_t *data);
@@ -290,6 +295,8 @@ extern void		ni_hashctx_finish(ni_hashctx_t *);
 extern unsigned int	ni_hashctx_get_digest_length(ni_hashctx_t *);
 extern int		ni_hashctx_get_digest(ni_hashctx_t *, void *, size_t);
 extern void		ni_hashctx_puts(ni_hashctx_t *, const char *);
+extern void		ni_hashctx_put(ni_hashctx_t *, const void *, size_t);
+extern ni_bool_t	ni_md5_digest(const void *, size_t, unsigned char *, size_t);
 
 
 /*
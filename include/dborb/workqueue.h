@@ -0,0 +1,40 @@
+/*
+ * Worker thread pool for blocking I/O
+ */
+
+#ifndef __TESTBUS_DBORB_WORKQUEUE_H__
+#define __TESTBUS_DBORB_WORKQUEUE_H__
+
+#include <dborb/types.h>
+
+/*
+ * A work item has two callbacks. The run() function is invoked in one
+ * of the worker threads, and must restrict itself to system calls and
+ * plain computation on memory owned by the work item. In particular, it
+ * must not touch buffers, sockets, timers, dbus objects or anything else
+ * that belongs to the main loop, and it should not log.
+ *
+ * Once run() has returned, complete() is invoked from ni_socket_wait(),
+ * on the main thread.
+ */
+typedef void			ni_work_func_t(ni_work_t *);
+
+struct ni_work {
+	ni_work_t *		next;		/* internal */
+
+	ni_work_func_t *	run;
+	ni_work_func_t *	complete;
+	void *			user_data;
+
+	void *			owner;		/* used by the dbus glue */
+};
+
+#define NI_WORKQUEUE_DEFAULT_THREADS	4
+#define NI_WORKQUEUE_MAX_THREADS	64
+
+extern ni_work_t *		ni_work_new(ni_work_func_t *run, ni_work_func_t *complete, void *user_data);
+extern void			ni_work_free(ni_work_t *);
+extern ni_bool_t		ni_work_submit(ni_work_t *);
+extern unsigned int		ni_workqueue_pending(void);
+
+#endif /* __TESTBUS_DBORB_WORKQUEUE_H__ */
@@ -4,6 +4,7 @@
 
 #include <testbus/types.h>
 #include <dborb/dbus.h>
+#include <dborb/codec.h>
 
 typedef struct ni_testbus_client_timeout ni_testbus_client_timeout_t;
 struct ni_testbus_client_timeout {
@@ -24,6 +25,8 @@ typedef struct ni_testus_client_host_state {
 	ni_bool_t		ready;
 } ni_testus_client_host_state_t;
 
+typedef void			ni_testbus_download_callback_t(ni_buffer_t *, void *user_data);
+
 extern void			ni_testbus_client_init(ni_dbus_client_t *client);
 extern ni_dbus_object_t *	ni_testbus_client_get_object(const char *path);
 extern ni_dbus_object_t *	ni_testbus_client_get_and_refresh_object(const char *path);
@@ -32,6 +35,12 @@ extern ni_dbus_object_t *	ni_testbus_client_container_child_by_name(ni_dbus_obje
 extern ni_dbus_object_t *	ni_testbus_client_create_host(const char *name);
 extern ni_dbus_object_t *	ni_testbus_client_create_test(const char *name, ni_dbus_object_t *parent);
 extern ni_dbus_object_t *	ni_testbus_client_create_tempfile(const char *name, unsigned int mode, ni_dbus_object_t *parent);
+extern ni_dbus_object_t *	ni_testbus_client_create_tempfile_ext(const char *name, unsigned int mode,
+					unsigned int size_max, ni_dbus_object_t *parent);
+extern ni_dbus_object_t *	ni_testbus_client_create_tempfile_by_hash(const char *name, unsigned int mode,
+					const ni_buffer_t *data, ni_dbus_object_t *parent);
+extern ni_dbus_object_t *	ni_testbus_client_upload_tempfile(const char *name, unsigned int mode,
+					const ni_buffer_t *data, ni_dbus_object_t *parent);
 extern ni_dbus_object_t *	ni_testbus_client_reconnect_host(const char *, ni_uuid_t *);
 extern ni_bool_t		ni_testbus_client_remove_host(const char *name);
 extern ni_bool_t		ni_testbus_client_delete(ni_dbus_object_t *);
@@ -43,14 +52,34 @@ extern ni_bool_t		ni_testbus_client_setenv(ni_dbus_object_t *, const char *name,
 extern char *			ni_testbus_client_getenv(ni_dbus_object_t *, const char *name);
 extern ni_bool_t		ni_testbus_client_eventlog_append(ni_dbus_object_t *, const ni_event_t *);
 extern ni_bool_t		ni_testbus_client_eventlog_purge(ni_dbus_object_t *, unsigned int until_seq);
+extern ni_bool_t		ni_testbus_client_get_eventloop_stats(ni_dbus_object_t *, ni_bool_t reset, ni_dbus_variant_t *);
+extern ni_bool_t		ni_testbus_client_get_buffer_pool_stats(ni_dbus_object_t *, ni_dbus_variant_t *);
+extern ni_bool_t		ni_testbus_client_get_codec_stats(ni_dbus_object_t *, ni_dbus_variant_t *);
 extern ni_buffer_t *		ni_testbus_client_agent_download_file(ni_dbus_object_t *, const char *);
 extern ni_bool_t		ni_testbus_client_agent_upload_file(ni_dbus_object_t *, const char *, const ni_buffer_t *);
 extern ni_bool_t		ni_testbus_client_upload_file(ni_dbus_object_t *, const ni_buffer_t *);
+extern ni_bool_t		ni_testbus_client_truncate_file(ni_dbus_object_t *);
+extern ni_bool_t		ni_testbus_client_upload_chain(ni_dbus_object_t *, ni_buffer_chain_t **);
+extern int			ni_testbus_client_append_chain_async(ni_dbus_object_t *, const ni_buffer_chain_t *,
+					ni_codec_t *, ni_dbus_async_callback_t *);
+extern ni_dbus_object_t *	ni_testbus_client_file_handle(const char *object_path, void *local_data);
+extern ni_bool_t		ni_testbus_client_retrieve_file(ni_dbus_object_t *, uint64_t *, ni_buffer_t *);
 extern ni_buffer_t *		ni_testbus_client_download_file(ni_dbus_object_t *);
+extern ni_buffer_t *		ni_testbus_client_download_file_delta(ni_dbus_object_t *, const ni_buffer_t *);
+extern ni_bool_t		ni_testbus_client_download_file_async(const char *object_path, ni_buffer_t *base,
+					ni_testbus_download_callback_t *, void *user_data);
+extern ni_bool_t		ni_testbus_client_agent_download_file_async(const char *bus_name, const char *path,
+					ni_testbus_download_callback_t *, void *user_data);
+extern ni_bool_t		ni_testbus_client_distribute_file(ni_dbus_object_t *, const ni_dbus_object_t *,
+					const char *dest_path, uint32_t *id);
+extern ni_bool_t		ni_testbus_client_get_distribution_status(ni_dbus_object_t *, uint32_t, ni_dbus_variant_t *);
 extern ni_bool_t		ni_testbus_agent_add_capability(ni_dbus_object_t *, const char *);
 extern ni_bool_t		ni_testbus_agent_add_capabilities(ni_dbus_object_t *, const ni_string_array_t *);
 extern ni_bool_t		ni_testbus_agent_add_environment(ni_dbus_object_t *, const ni_var_array_t *);
+extern ni_bool_t		ni_testbus_agent_file_distributed(ni_dbus_object_t *, uint32_t, ni_bool_t);
 extern ni_dbus_object_t *	ni_testbus_client_create_command(ni_dbus_object_t *, const ni_string_array_t *, ni_bool_t use_terminal);
+extern ni_dbus_object_t *	ni_testbus_client_create_command_ext(ni_dbus_object_t *, const ni_string_array_t *, ni_bool_t use_terminal,
+					int priority, unsigned int output_tail);
 extern ni_bool_t		ni_testbus_client_command_add_file(ni_dbus_object_t *, const char *, const ni_buffer_t *, unsigned int);
 extern ni_dbus_object_t *	ni_testbus_client_host_run(ni_dbus_object_t *, const ni_dbus_object_t *);
 extern ni_bool_t		ni_testbus_client_host_shutdown(ni_dbus_object_t *, ni_bool_t reboot_flag, ni_testus_client_host_state_t *state);
@@ -0,0 +1,30 @@
+
+#ifndef __TESTBUS_DELTA_H__
+#define __TESTBUS_DELTA_H__
+
+#include <dborb/types.h>
+#include <testbus/file.h>
+
+/*
+ * Each block of the receiver's copy is described by a 32bit rolling
+ * checksum (in network byte order) followed by its md5 digest.
+ */
+#define NI_TESTBUS_DELTA_SUM_LEN	(4 + NI_TESTBUS_MD5_LEN)
+
+#define NI_TESTBUS_DELTA_BLOCK_MIN	1024
+#define NI_TESTBUS_DELTA_BLOCK_MAX	(128 * 1024)
+
+/*
+ * The sender refuses to look at more checksums than this, since the
+ * delta is computed on the master's main loop.
+ */
+#define NI_TESTBUS_DELTA_BLOCKS_MAX	8192
+
+extern unsigned int		ni_testbus_delta_block_size(size_t);
+extern ni_buffer_t *		ni_testbus_delta_checksums(const void *, size_t, unsigned int block_size);
+extern ni_buffer_t *		ni_testbus_delta_compute(const void *, size_t, unsigned int block_size,
+					const unsigned char *sums, size_t sums_len, size_t literal_max);
+extern ni_buffer_t *		ni_testbus_delta_apply(const void *, size_t, unsigned int block_size,
+					const unsigned char *delta, size_t delta_len);
+
+#endif /* __TESTBUS_DELTA_H__ */
@@ -7,10 +7,53 @@
 #include <testbus/types.h>
 
 
-#define NI_TESTBUS_TMPFILE_SIZE_MAX	(1024 * 1024)
+/*
+ * Default limits; both can be changed in the config file (see <spool>).
+ * Files that grow beyond the spool threshold are moved from memory to
+ * an unlinked file in the spool directory.
+ */
+#define NI_TESTBUS_TMPFILE_SIZE_MAX	(64 * 1024 * 1024)
+#define NI_TESTBUS_SPOOL_THRESHOLD	(1024 * 1024)
+
+/*
+ * In-memory file contents are stored in segments of this size, so that
+ * appending never has to copy what is there already.
+ */
+#define NI_TESTBUS_BLOB_SEGMENT_SIZE	(64 * 1024)
 
 #define NI_TESTBUS_FILE_MAGIC	0xbadde5d
 
+#define NI_TESTBUS_MD5_LEN	16
+
+/*
+ * File contents on the master. Files with identical contents share
+ * one blob; a shared blob is copied before it is modified.
+ */
+struct ni_testbus_blob {
+	ni_testbus_blob_t **	prev;
+	ni_testbus_blob_t *	next;
+	unsigned int		refcount;
+
+	uint32_t		size;
+	unsigned long		mtime;		/* time of last change, in seconds */
+
+	/* In-memory contents. All segments but the last one are full. */
+	ni_buffer_t **		segments;
+	unsigned int		nsegments;
+
+	/* Contiguous copy of the segments, made on demand */
+	ni_buffer_t *		flat;
+
+	/* Contents spooled to disk */
+	int			spool_fd;
+	void *			spool_map;
+	size_t			spool_map_len;
+
+	/* Digest of the contents, computed on demand */
+	ni_bool_t		md5_valid;
+	unsigned char		md5[NI_TESTBUS_MD5_LEN];
+};
+
 struct ni_testbus_file {
 	uint32_t		__magic;
 	unsigned int		refcount;
@@ -24,8 +67,12 @@ struct ni_testbus_file {
 	unsigned int		iseq;		/* sequence number of last change */
 
 	char *			instance_path;	/* path name of file on disk, if needed */
-	ni_buffer_t *		data;
+	ni_buffer_t *		data;		/* agent: cached copy of the contents */
+	ni_testbus_blob_t *	blob;		/* master: file contents */
+	ni_bool_t		md5_valid;	/* agent: digest of the contents, as */
+	unsigned char		md5[NI_TESTBUS_MD5_LEN]; /* reported by the master */
 	uint32_t		size;
+	uint32_t		size_max;	/* 0 means use the default */
 };
 
 extern ni_bool_t		ni_testbus_file_serialize(const ni_testbus_file_t *, ni_dbus_variant_t *);
@@ -33,6 +80,15 @@ extern ni_testbus_file_t *	ni_testbus_file_deserialize(const ni_dbus_variant_t *
 extern ni_bool_t		ni_testbus_file_array_serialize(const ni_testbus_file_array_t *, ni_dbus_variant_t *);
 extern ni_testbus_file_array_t *ni_testbus_file_array_deserialize(const ni_dbus_variant_t *);
 extern void			ni_testbus_file_drop_cache(ni_testbus_file_t *);
+extern unsigned int		ni_testbus_file_size_max(const ni_testbus_file_t *);
+extern ni_bool_t		ni_testbus_file_append(ni_testbus_file_t *, const void *, size_t);
+extern void			ni_testbus_file_truncate(ni_testbus_file_t *);
+extern const void *		ni_testbus_file_get_data(ni_testbus_file_t *, uint64_t offset, unsigned int *count);
+extern unsigned int		ni_testbus_file_get_iovec(ni_testbus_file_t *, uint64_t offset, unsigned int *count,
+						struct iovec *, unsigned int);
+extern void			ni_testbus_file_share(ni_testbus_file_t *, ni_testbus_blob_t *);
+extern int			ni_testbus_spool_open(const char *tag);
+extern unsigned int		ni_testbus_spool_threshold(void);
 
 extern void			ni_testbus_file_array_init(ni_testbus_file_array_t *);
 extern void			ni_testbus_file_array_destroy(ni_testbus_file_array_t *);
@@ -41,6 +97,8 @@ extern void			ni_testbus_file_array_append(ni_testbus_file_array_t *, ni_testbus
 extern ni_bool_t		ni_testbus_file_array_remove(ni_testbus_file_array_t *, const ni_testbus_file_t *);
 extern ni_testbus_file_t *	ni_testbus_file_array_find_by_name(const ni_testbus_file_array_t *, const char *);
 extern ni_testbus_file_t *	ni_testbus_file_array_find_by_inum(const ni_testbus_file_array_t *, unsigned int);
+extern ni_testbus_blob_t *	ni_testbus_file_array_find_blob(const ni_testbus_file_array_t *,
+						const unsigned char *md5, uint32_t size);
 extern void			ni_testbus_file_array_set(ni_testbus_file_array_t *, unsigned int, ni_testbus_file_t *);
 extern void			ni_testbus_file_array_merge(ni_testbus_file_array_t *result, const ni_testbus_file_array_t *);
 
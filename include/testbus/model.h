@@ -37,6 +37,18 @@ ni_dbus_objectmodel_method_binding_t __ni_Testbus_##Interface##_##Method##_bindi
 #define NI_TESTBUS_ASYNC_METHOD_BINDING(Interface, Method) \
 	__NI_TESTBUS_ASYNC_METHOD_BINDING(Interface, Method, NI_TESTBUS_NAMESPACE "." #Interface)
 
+#define __NI_TESTBUS_WORK_METHOD_BINDING(Interface, Method, InterfaceName) \
+ni_dbus_objectmodel_method_binding_t __ni_Testbus_##Interface##_##Method##_binding = { \
+	.service = InterfaceName, \
+	.method = { \
+		.name = __NI_STR(Method), \
+		.async_work_handler = __ni_Testbus_##Interface##_##Method##_WorkCall, \
+		.async_work_completion = __ni_Testbus_##Interface##_##Method##_WorkCompletion, \
+	} \
+}
+#define NI_TESTBUS_WORK_METHOD_BINDING(Interface, Method) \
+	__NI_TESTBUS_WORK_METHOD_BINDING(Interface, Method, NI_TESTBUS_NAMESPACE "." #Interface)
+
 #define __NI_TESTBUS_EXT_METHOD_BINDING(Interface, Method, InterfaceName) \
 ni_dbus_objectmodel_method_binding_t __ni_Testbus_##Interface##_##Method##_binding = { \
 	.service = InterfaceName, \
@@ -66,10 +78,14 @@ extern const ni_dbus_class_t *	ni_testbus_fileset_class(void);
 extern const ni_dbus_class_t *	ni_testbus_file_class(void);
 extern const ni_dbus_class_t *	ni_testbus_testset_class(void);
 extern const ni_dbus_class_t *	ni_testbus_testcase_class(void);
+extern const ni_dbus_class_t *	ni_testbus_stats_class(void);
 
 extern const ni_dbus_service_t *ni_testbus_host_interface(void);
 extern const ni_dbus_service_t *ni_testbus_eventlog_interface(void);
 extern const ni_dbus_service_t *ni_testbus_process_interface(void);
 
+extern void			ni_testbus_bind_builtin_stats(void);
+extern void			ni_testbus_create_static_objects_stats(ni_dbus_server_t *);
+
 #endif /* __NI_TESTBUS_MODEL_H__ */
 
@@ -70,6 +70,15 @@
  */
 #define NI_TESTBUS_AGENT_FS_PATH	NI_TESTBUS_AGENT_BASE_PATH "/Filesystem"
 
+/*
+ * Object:
+ *	/Stats
+ * Interfaces:
+ *	Stats
+ * This object exists both on the master and on every agent.
+ */
+#define NI_TESTBUS_STATS_PATH		NI_TESTBUS_OBJECT_ROOT "/Stats"
+
 
 #define NI_TESTBUS_ROOT_INTERFACE	NI_TESTBUS_NAMESPACE
 
@@ -89,6 +98,8 @@
  *	Hostset
  * Methods:
  *	addHost(role, path)
+ *	distributeFile(file-path, dest-path)
+ *	getDistributionStatus(id)
  * Compatible with class:
  *	hostset -> container
  */
@@ -223,6 +234,19 @@
  */
 #define NI_TESTBUS_AGENT_FS_INTERFACE	NI_TESTBUS_AGENT_INTERFACE ".Filesystem"
 
+/*
+ * Interface:
+ *	Stats
+ * Methods:
+ *	getEventLoopStats()
+ *	resetEventLoopStats()
+ *	getBufferPoolStats()
+ *	getCodecStats()
+ * Compatible with class:
+ *	stats
+ */
+#define NI_TESTBUS_STATS_INTERFACE	NI_TESTBUS_NAMESPACE ".Stats"
+
 /*
  * Object classes used in the testbus model
  */
@@ -240,5 +264,6 @@
 #define NI_TESTBUS_HOSTSET_CLASS	"hostset"
 #define NI_TESTBUS_TESTCASE_CLASS	"testcase"
 #define NI_TESTBUS_PROCESS_CLASS	"process"
+#define NI_TESTBUS_STATS_CLASS		"stats"
 
 #endif /* __NI_TESTBUS_PROTOCOL_H__ */
@@ -5,6 +5,7 @@
 #include <dborb/types.h>
 
 typedef struct ni_testbus_file		ni_testbus_file_t;
+typedef struct ni_testbus_blob		ni_testbus_blob_t;
 typedef struct ni_testbus_file_array	ni_testbus_file_array_t;
 
 enum {
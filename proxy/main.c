@@ -645,6 +645,61 @@ io_endpoint_pullup(io_endpoint_t *ep)
 	return NULL;
 }
 
+/*
+ * Transmit the current write buffer plus as much of the write queue
+ * as we can in a single writev() call.
+ */
+#define IO_ENDPOINT_IOV_MAX	32
+
+static int
+io_endpoint_writev(io_endpoint_t *ep)
+{
+	struct iovec iov[IO_ENDPOINT_IOV_MAX];
+	unsigned int iovcnt = 0;
+	io_mbuf_t *mbuf;
+	int ret, count;
+
+	if (ep->wbuf == NULL)
+		return 0;
+
+	iov[iovcnt].iov_base = ni_buffer_head(ep->wbuf);
+	iov[iovcnt].iov_len = ni_buffer_count(ep->wbuf);
+	iovcnt++;
+
+	for (mbuf = ep->wqueue; mbuf && iovcnt < IO_ENDPOINT_IOV_MAX; mbuf = mbuf->next) {
+		if (mbuf->buffer == NULL)
+			break;
+		iov[iovcnt].iov_base = ni_buffer_head(mbuf->buffer);
+		iov[iovcnt].iov_len = ni_buffer_count(mbuf->buffer);
+		iovcnt++;
+	}
+
+	ret = writev(ep->wfd, iov, iovcnt);
+	if (ret <= 0)
+		return ret;
+
+	/* Consume what we've written, pulling up the next buffer
+	 * from the queue as we go. */
+	for (count = ret; count > 0; ) {
+		ni_buffer_t *bp = ep->wbuf;
+		int n = ni_buffer_count(bp);
+
+		if (n > count)
+			n = count;
+		ni_buffer_pull_head(bp, n);
+		count -= n;
+
+		if (ni_buffer_count(bp) == 0) {
+			ni_buffer_free(bp);
+			ep->wbuf = NULL;
+			if (count && !io_endpoint_pullup(ep))
+				break;
+		}
+	}
+
+	return ret;
+}
+
 static const char *
 io_endpoint_type_name(io_endpoint_type_t t)
 {
@@ -745,16 +800,9 @@ io_endpoint_doio(proxy_t *proxy, io_endpoint_t *ep, const struct pollfd *pfd)
 	}
 
 	if ((ep->wfd == pfd->fd) && pfd->revents & POLLOUT) {
-		ni_buffer_t *bp = ep->wbuf;
-
-		ret = write(ep->wfd, ni_buffer_head(bp), ni_buffer_count(bp));
+		ret = io_endpoint_writev(ep);
 		if (ret > 0) {
 			ni_debug_socket("%s: transmitted %u bytes", ep->name, ret);
-			ni_buffer_pull_head(bp, ret);
-			if (ni_buffer_count(bp) == 0) {
-				ni_buffer_free(bp);
-				ep->wbuf = NULL;
-			}
 		} else if (ret < 0) {
 			switch (errno) {
 			case EPIPE:
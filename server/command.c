@@ -285,10 +285,11 @@ ni_testbus_process_finalize(ni_testbus_process_t *proc)
 
 
 	for (i = 0; i < ofiles.count; ++i) {
-		ni_testbus_file_t *file = ofiles.data[i];
+		ni_testbus_file_t *file = ofiles.data[i], *ofile;
 
 		ni_debug_testbus("instantiating output file %s", file->name);
-		(void) ni_testbus_file_new(file->name, &proc->context.files, file->mode);
+		ofile = ni_testbus_file_new(file->name, &proc->context.files, file->mode);
+		ofile->size_max = file->size_max;
 		ni_testbus_file_array_remove(array, file);
 	}
 
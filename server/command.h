@@ -8,6 +8,8 @@ struct ni_testbus_command {
 	ni_string_array_t		argv;
 	ni_testbus_container_t		context;
 	ni_bool_t			use_terminal;
+	int				priority;
+	unsigned int			output_tail;		/* keep only the last N bytes of output */
 };
 
 struct ni_testbus_process {
@@ -8,6 +8,7 @@
 #include "command.h"
 #include "monitor.h"
 #include "testcase.h"
+#include "distribute.h"
 
 static ni_testbus_container_t *		__ni_testbus_global_context;
 
@@ -238,6 +239,7 @@ ni_testbus_container_destroy(ni_testbus_container_t *container)
 
 	ni_testbus_container_release_owned(ni_testbus_global_context(), container);
 	ni_testbus_container_release_owned(container, container);
+	ni_testbus_distribution_release(container);
 
 	if (container->ops->destroy)
 		container->ops->destroy(container);
@@ -413,6 +415,27 @@ __ni_testbus_container_get_file_by_name(ni_testbus_container_t *container, const
 	return NULL;
 }
 
+/*
+ * Find file contents with the given digest among the files this container
+ * can see, ie its own and those of its parents. We deliberately do not look
+ * at other contexts, so that a client cannot probe for (and get a copy of)
+ * files belonging to unrelated tests just by guessing their digest.
+ */
+ni_testbus_blob_t *
+ni_testbus_container_find_blob(ni_testbus_container_t *container, const unsigned char *md5, uint32_t size)
+{
+	for (; container; container = container->parent) {
+		ni_testbus_blob_t *blob;
+
+		if (ni_testbus_container_has_files(container)) {
+			blob = ni_testbus_file_array_find_blob(&container->files, md5, size);
+			if (blob)
+				return blob;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Test registration/lookup
  */
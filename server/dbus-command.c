@@ -3,6 +3,7 @@
 #include <dborb/dbus-service.h>
 #include <dborb/logging.h>
 #include <testbus/model.h>
+#include <testbus/file.h>
 
 #include "model.h"
 #include "command.h"
@@ -56,6 +57,8 @@ __ni_Testbus_CommandQueue_createCommand(ni_dbus_object_t *object, const ni_dbus_
 	ni_dbus_object_t *command_object;
 	ni_testbus_command_t *command;
 	ni_bool_t use_terminal = FALSE;
+	int32_t priority = 0;
+	uint32_t output_tail = 0;
 
 	if ((context = ni_testbus_container_unwrap(object, error)) == NULL)
 		return FALSE;
@@ -66,6 +69,14 @@ __ni_Testbus_CommandQueue_createCommand(ni_dbus_object_t *object, const ni_dbus_
 
 	if (ni_dbus_dict_get(&argv[1], "use-terminal"))
 		use_terminal = TRUE;
+	ni_dbus_dict_get_int32(&argv[1], "priority", &priority);
+	ni_dbus_dict_get_uint32(&argv[1], "output-tail", &output_tail);
+	if (output_tail > ni_testbus_file_size_max(NULL)) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "output-tail exceeds the maximum file size (%u bytes)",
+				ni_testbus_file_size_max(NULL));
+		ni_string_array_destroy(&cmd_argv);
+		return FALSE;
+	}
 
 	/* Create the new command and place it on the queue */
 	command = ni_testbus_command_new(context, &cmd_argv);
@@ -77,6 +88,8 @@ __ni_Testbus_CommandQueue_createCommand(ni_dbus_object_t *object, const ni_dbus_
 	}
 
 	command->use_terminal = use_terminal;
+	command->priority = priority;
+	command->output_tail = output_tail;
 
 	/* Register this object */
 	command_object = ni_testbus_command_wrap(object, command);
@@ -1,10 +1,14 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <dborb/dbus-errors.h>
 #include <dborb/dbus-service.h>
 #include <dborb/logging.h>
 #include <dborb/buffer.h>
+#include <dborb/codec.h>
 
 #include <testbus/file.h>
+#include <testbus/delta.h>
 
 #include "fileset.h"
 #include "model.h"
@@ -96,8 +100,31 @@ ni_objectmodel_get_testbus_file(const ni_dbus_object_t *object, ni_bool_t write_
 	return ni_testbus_file_unwrap(object, error);
 }
 
+static ni_testbus_file_t *
+__ni_testbus_fileset_create_file(ni_dbus_object_t *object, ni_testbus_container_t *context,
+		const char *name, unsigned int mode, DBusError *error)
+{
+	ni_testbus_file_t *file;
+
+	if (!ni_testbus_identifier_valid(name, error))
+		return NULL;
+
+	if (__ni_testbus_container_get_file_by_name(context, name) != NULL) {
+		dbus_set_error(error, NI_DBUS_ERROR_NAME_EXISTS, "tmpfile with this name already exists");
+		return NULL;
+	}
+
+	ni_debug_testbus("%s: creating file \"%s\"", object->path, name);
+	if ((file = ni_testbus_file_new(name, &context->files, mode)) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to create new file \"%s\"", name);
+		return NULL;
+	}
+
+	return file;
+}
+
 /*
- * Fileset.createFile(name, optional attrdict)
+ * Fileset.createFile(name, optional mode, optional size-limit)
  *
  */
 static dbus_bool_t
@@ -109,40 +136,110 @@ __ni_Testbus_Fileset_createFile(ni_dbus_object_t *object, const ni_dbus_method_t
 	ni_dbus_object_t *file_object;
 	ni_testbus_file_t *file;
 	const char *name;
-	uint32_t mode = 0;
+	uint32_t mode = 0, size_max = 0;
 
 	if ((context = ni_testbus_container_unwrap(object, error)) == NULL)
 		return FALSE;
 
 	if (argc == 0
 	 || !ni_dbus_variant_get_string(&argv[0], &name)
-	 || (argc == 2 && !ni_dbus_variant_get_uint32(&argv[1], &mode))
-	 || argc > 2)
+	 || (argc >= 2 && !ni_dbus_variant_get_uint32(&argv[1], &mode))
+	 || (argc >= 3 && !ni_dbus_variant_get_uint32(&argv[2], &size_max))
+	 || argc > 3)
 		return ni_dbus_error_invalid_args(error, object->path, method->name);
 
-	if (!ni_testbus_identifier_valid(name, error))
+	if ((file = __ni_testbus_fileset_create_file(object, context, name, mode, error)) == NULL)
 		return FALSE;
+	file->size_max = size_max;
 
-	if (__ni_testbus_container_get_file_by_name(context, name) != NULL) {
-		dbus_set_error(error, NI_DBUS_ERROR_NAME_EXISTS, "tmpfile with this name already exists");
+
+	/* Register this object */
+	file_object = ni_testbus_file_wrap(object, file);
+	ni_dbus_message_append_string(reply, file_object->path);
+
+	return TRUE;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Fileset, createFile);
+
+/*
+ * Fileset.createFileByHash(name, md5, size, optional mode)
+ * Create a file with the same contents as an existing file with this
+ * md5 digest and size. Only files visible in this context (ie those of
+ * the context itself and its parents) are considered. If there is no
+ * such file, this fails with NameUnknown, and the client should create
+ * and upload the file as usual.
+ */
+static dbus_bool_t
+__ni_Testbus_Fileset_createFileByHash(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_container_t *context;
+	ni_dbus_object_t *file_object;
+	ni_testbus_file_t *file;
+	ni_testbus_blob_t *blob;
+	const char *name;
+	uint32_t size, mode = 0;
+
+	if ((context = ni_testbus_container_unwrap(object, error)) == NULL)
 		return FALSE;
-	}
 
-	ni_debug_testbus("%s: creating file \"%s\"", object->path, name);
-	if ((file = ni_testbus_file_new(name, &context->files, mode)) == NULL) {
-		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to create new file \"%s\"", name);
+	if (argc < 3
+	 || !ni_dbus_variant_get_string(&argv[0], &name)
+	 || !ni_dbus_variant_is_byte_array(&argv[1])
+	 || argv[1].array.len != NI_TESTBUS_MD5_LEN
+	 || !ni_dbus_variant_get_uint32(&argv[2], &size)
+	 || (argc >= 4 && !ni_dbus_variant_get_uint32(&argv[3], &mode))
+	 || argc > 4)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if ((blob = ni_testbus_container_find_blob(context, argv[1].byte_array_value, size)) == NULL) {
+		dbus_set_error(error, NI_DBUS_ERROR_NAME_UNKNOWN, "no file with this digest");
 		return FALSE;
 	}
 
+	if ((file = __ni_testbus_fileset_create_file(object, context, name, mode, error)) == NULL)
+		return FALSE;
+	ni_testbus_file_share(file, blob);
 
-	/* Register this object */
 	file_object = ni_testbus_file_wrap(object, file);
 	ni_dbus_message_append_string(reply, file_object->path);
 
 	return TRUE;
 }
 
-static NI_TESTBUS_METHOD_BINDING(Fileset, createFile);
+static NI_TESTBUS_METHOD_BINDING(Fileset, createFileByHash);
+
+static dbus_bool_t
+__ni_testbus_tmpfile_append(ni_testbus_file_t *file, const void *data, size_t len, DBusError *error)
+{
+	unsigned int count, size_max;
+
+	/* If the data does not fit, we store as much as we can, so that a
+	 * huge log is truncated rather than lost entirely. */
+	size_max = ni_testbus_file_size_max(file);
+	if (file->size >= size_max)
+		count = 0;
+	else if (len > size_max - file->size)
+		count = size_max - file->size;
+	else
+		count = len;
+
+	if (count && !ni_testbus_file_append(file, data, count)) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to store file data");
+		return FALSE;
+	}
+
+	if (count < len) {
+		dbus_set_error(error, NI_DBUS_ERROR_BAD_SIZE, "file too big");
+		return FALSE;
+	}
+
+	ni_debug_testbus("file %s: appended %u bytes (now %u bytes total)",
+			file->name, count, file->size);
+	return TRUE;
+}
 
 /*
  * Tmpfile.append(data)
@@ -153,7 +250,6 @@ __ni_Testbus_Tmpfile_append(ni_dbus_object_t *object, const ni_dbus_method_t *me
 		ni_dbus_message_t *reply, DBusError *error)
 {
 	ni_testbus_file_t *file;
-	unsigned int count;
 
 	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
 		return FALSE;
@@ -162,35 +258,65 @@ __ni_Testbus_Tmpfile_append(ni_dbus_object_t *object, const ni_dbus_method_t *me
 	 || !ni_dbus_variant_is_byte_array(&argv[0]))
 		return ni_dbus_error_invalid_args(error, object->path, method->name);
 
-	count = argv[0].array.len;
-	if (file->data == NULL)
-		file->data = ni_buffer_new(count < 4096? count : 0);
+	return __ni_testbus_tmpfile_append(file, argv[0].byte_array_value, argv[0].array.len, error);
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, append);
 
-	if (count > NI_TESTBUS_TMPFILE_SIZE_MAX
-	 || count + ni_buffer_count(file->data) > NI_TESTBUS_TMPFILE_SIZE_MAX) {
-		dbus_set_error(error, NI_DBUS_ERROR_BAD_SIZE, "file too big");
+/*
+ * Tmpfile.appendFd(fd)
+ * Same as above, but the data is passed as a file descriptor. We map
+ * the file rather than reading it, so this is restricted to sealed
+ * memfds; reading from a pipe could block the master, and a file that
+ * is truncated while we have it mapped would crash it.
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_appendFd(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_file_t *file;
+	struct stat stb;
+	void *data;
+	dbus_bool_t rv;
+	int fd;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
 		return FALSE;
-	}
 
-	if (!ni_buffer_ensure_tailroom(file->data, count)) {
-		dbus_set_error(error, NI_DBUS_ERROR_BAD_SIZE, "file too big");
+	if (argc != 1
+	 || !ni_dbus_variant_get_unix_fd(&argv[0], &fd)
+	 || fstat(fd, &stb) < 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if (!ni_file_is_sealed(fd)) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "%s: file descriptor does not refer to a sealed memfd",
+				method->name);
 		return FALSE;
 	}
 
-	ni_buffer_put(file->data, argv[0].byte_array_value, count);
-	file->size = ni_buffer_count(file->data);
-	file->iseq++;
+	if (stb.st_size == 0)
+		return TRUE;
 
-	ni_debug_testbus("file %s: appended %u bytes (now %u bytes total)",
-			file->name, count, ni_buffer_count(file->data));
-	return TRUE;
+	data = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to map file data");
+		return FALSE;
+	}
+
+	rv = __ni_testbus_tmpfile_append(file, data, stb.st_size, error);
+	munmap(data, stb.st_size);
+	return rv;
 }
 
-static NI_TESTBUS_METHOD_BINDING(Tmpfile, append);
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, appendFd);
 
 /*
  * Tmpfile.retrieve(data)
+ * Chunks are at most 64K, which spans at most two segments of the file.
  */
+#define NI_TESTBUS_TMPFILE_IOV_MAX	2
+
 static dbus_bool_t
 __ni_Testbus_Tmpfile_retrieve(ni_dbus_object_t *object, const ni_dbus_method_t *method,
 		unsigned int argc, const ni_dbus_variant_t *argv,
@@ -212,18 +338,14 @@ __ni_Testbus_Tmpfile_retrieve(ni_dbus_object_t *object, const ni_dbus_method_t *
 		return ni_dbus_error_invalid_args(error, object->path, method->name);
 
 	ni_dbus_variant_init_byte_array(&res);
-	if (file->data == NULL) {
+	if (file->size == 0) {
 		ni_debug_testbus("%s: no data", file->name);
 	} else {
-		uint64_t size = ni_buffer_count(file->data);
-		unsigned char *data;
-
-		if (offset < size) {
-			data = ni_buffer_head(file->data) + offset;
-			if (size - offset < count)
-				count = size - offset;
-			ni_dbus_variant_set_byte_array(&res, data, count);
-		}
+		struct iovec iov[NI_TESTBUS_TMPFILE_IOV_MAX];
+		unsigned int iovcnt;
+
+		if ((iovcnt = ni_testbus_file_get_iovec(file, offset, &count, iov, NI_TESTBUS_TMPFILE_IOV_MAX)) != 0)
+			ni_dbus_variant_set_byte_array_iovec(&res, iov, iovcnt);
 	}
 
 	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
@@ -236,6 +358,283 @@ __ni_Testbus_Tmpfile_retrieve(ni_dbus_object_t *object, const ni_dbus_method_t *
 
 static NI_TESTBUS_METHOD_BINDING(Tmpfile, retrieve);
 
+/*
+ * Tmpfile.retrieveFd(offset, count)
+ * Return the data in a memfd rather than a byte array. A count of 0
+ * means everything up to the end of the file.
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_retrieveFd(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_testbus_file_t *file;
+	struct iovec *iov = NULL;
+	unsigned int iovcnt = 0;
+	uint64_t offset;
+	uint32_t count;
+	ni_bool_t rv;
+	int fd;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 2
+	 || !ni_dbus_variant_get_uint64(&argv[0], &offset)
+	 || !ni_dbus_variant_get_uint32(&argv[1], &count))
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if (count == 0)
+		count = file->size;
+	if (file->size != 0) {
+		unsigned int max = count / NI_TESTBUS_BLOB_SEGMENT_SIZE + 2;
+
+		iov = ni_calloc(max, sizeof(iov[0]));
+		iovcnt = ni_testbus_file_get_iovec(file, offset, &count, iov, max);
+	}
+	if (iovcnt == 0)
+		count = 0;
+
+	fd = ni_file_memfd_iovec(file->name, iov, iovcnt);
+	free(iov);
+	if (fd < 0) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to create memfd");
+		return FALSE;
+	}
+
+	ni_dbus_variant_set_unix_fd(&res, fd);
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	if (rv)
+		ni_debug_testbus("file %s: retrieved %u bytes", file->name, count);
+	ni_dbus_variant_destroy(&res);
+
+	return rv;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, retrieveFd);
+
+/*
+ * Tmpfile.appendEncoded(encoding, size, data)
+ * Same as append, but the data may have been compressed (see dborb/codec.c).
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_appendEncoded(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_file_t *file;
+	const char *encoding;
+	ni_buffer_t *data;
+	uint32_t size;
+	dbus_bool_t rv;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 3
+	 || !ni_dbus_variant_get_string(&argv[0], &encoding)
+	 || !ni_dbus_variant_get_uint32(&argv[1], &size))
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if ((data = ni_codec_decode_data(encoding, size, &argv[2], error)) == NULL)
+		return FALSE;
+
+	rv = __ni_testbus_tmpfile_append(file, ni_buffer_head(data), ni_buffer_count(data), error);
+	ni_buffer_free(data);
+	return rv;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, appendEncoded);
+
+/*
+ * Tmpfile.retrieveEncoded(offset, count, encoding)
+ * Same as retrieve, but compress the data using the codec the caller
+ * asked for, if that is worth it.
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_retrieveEncoded(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	struct iovec iov[NI_TESTBUS_TMPFILE_IOV_MAX];
+	ni_testbus_file_t *file;
+	ni_buffer_t *data = NULL;
+	unsigned int iovcnt = 0;
+	const char *encoding;
+	ni_codec_t *codec = NULL;
+	uint64_t offset;
+	uint32_t count;
+	ni_bool_t rv;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 3
+	 || !ni_dbus_variant_get_uint64(&argv[0], &offset)
+	 || !ni_dbus_variant_get_uint32(&argv[1], &count)
+	 || !ni_dbus_variant_get_string(&argv[2], &encoding)
+	 || count > 65536)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if (strcmp(encoding, NI_CODEC_IDENTITY) && !(codec = ni_codec_by_name(encoding))) {
+		dbus_set_error(error, DBUS_ERROR_NOT_SUPPORTED, "unsupported encoding \"%s\"", encoding);
+		return FALSE;
+	}
+
+	if (file->size != 0)
+		iovcnt = ni_testbus_file_get_iovec(file, offset, &count, iov, NI_TESTBUS_TMPFILE_IOV_MAX);
+	if (iovcnt == 0)
+		count = 0;
+
+	/* The codec needs the data in one piece */
+	if (iovcnt > 1) {
+		unsigned int i;
+
+		data = ni_buffer_new(count);
+		for (i = 0; i < iovcnt; ++i)
+			ni_buffer_put(data, iov[i].iov_base, iov[i].iov_len);
+		iov[0].iov_base = ni_buffer_head(data);
+	}
+
+	ni_codec_encode_dict(codec, iovcnt? iov[0].iov_base : NULL, count, &res);
+	if (data)
+		ni_buffer_free(data);
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	if (rv)
+		ni_debug_testbus("file %s: retrieved %u bytes", file->name, count);
+	ni_dbus_variant_destroy(&res);
+
+	return rv;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, retrieveEncoded);
+
+/*
+ * Tmpfile.retrieveDelta(block-size, checksums)
+ * The caller has an older version of this file, and sends us the
+ * checksums of its blocks. We return a delta that turns the caller's
+ * copy into the current contents (see testbus/delta.c). If that does
+ * not save enough, this fails with NotSupported, and the caller should
+ * download the whole file instead.
+ */
+#define NI_TESTBUS_DELTA_REPLY_MAX	(16 * 1024 * 1024)
+
+static dbus_bool_t
+__ni_Testbus_Tmpfile_retrieveDelta(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_testbus_file_t *file;
+	const void *data = NULL;
+	unsigned int count;
+	uint32_t block_size;
+	size_t literal_max;
+	ni_buffer_t *delta;
+	ni_bool_t rv;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 2
+	 || !ni_dbus_variant_get_uint32(&argv[0], &block_size)
+	 || block_size < NI_TESTBUS_DELTA_BLOCK_MIN
+	 || block_size > NI_TESTBUS_DELTA_BLOCK_MAX
+	 || !ni_dbus_variant_is_byte_array(&argv[1])
+	 || (argv[1].array.len % NI_TESTBUS_DELTA_SUM_LEN) != 0
+	 || argv[1].array.len / NI_TESTBUS_DELTA_SUM_LEN > NI_TESTBUS_DELTA_BLOCKS_MAX)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	count = file->size;
+	if (count != 0 && (data = ni_testbus_file_get_data(file, 0, &count)) == NULL) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "unable to read file data");
+		return FALSE;
+	}
+
+	literal_max = count / 2;
+	if (literal_max > NI_TESTBUS_DELTA_REPLY_MAX)
+		literal_max = NI_TESTBUS_DELTA_REPLY_MAX;
+
+	delta = ni_testbus_delta_compute(data, count, block_size,
+			argv[1].byte_array_value, argv[1].array.len, literal_max);
+	if (delta == NULL) {
+		dbus_set_error(error, DBUS_ERROR_NOT_SUPPORTED, "file changed too much for a delta transfer");
+		return FALSE;
+	}
+
+	ni_dbus_variant_set_byte_array(&res, ni_buffer_head(delta), ni_buffer_count(delta));
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	if (rv)
+		ni_debug_testbus("file %s: sent delta of %u bytes for %u bytes of data",
+				file->name, ni_buffer_count(delta), count);
+	ni_dbus_variant_destroy(&res);
+	ni_buffer_free(delta);
+
+	return rv;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, retrieveDelta);
+
+/*
+ * Tmpfile.truncate()
+ * Discard the contents of the file, so that it can be uploaded again.
+ * Agents that still have the old contents will use them as the base
+ * for a delta transfer.
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_truncate(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_file_t *file;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	ni_debug_testbus("file %s: truncated", file->name);
+	ni_testbus_file_truncate(file);
+	return TRUE;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, truncate);
+
+/*
+ * Tmpfile.delete()
+ * Remove the file from its container and unregister the object.
+ */
+static dbus_bool_t
+__ni_Testbus_Tmpfile_delete(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_container_t *context;
+	ni_testbus_file_t *file;
+
+	if ((file = ni_testbus_file_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if (object->parent == NULL
+	 || (context = ni_testbus_container_unwrap(object->parent, error)) == NULL)
+		return FALSE;
+
+	ni_testbus_file_get(file);
+	ni_testbus_container_remove_file(context, file);
+	ni_testbus_file_unregister(file);
+	ni_testbus_file_put(file);
+
+	return TRUE;
+}
+
+static NI_TESTBUS_METHOD_BINDING(Tmpfile, delete);
+
 static ni_dbus_property_t       __ni_Testbus_Tmpfile_properties[] = {
 	NI_DBUS_GENERIC_STRING_PROPERTY(testbus_file, name, name, RO),
 	NI_DBUS_GENERIC_UINT32_PROPERTY(testbus_file, size, size, RO),
@@ -250,8 +649,16 @@ ni_testbus_bind_builtin_file(void)
 	const ni_dbus_class_t *class;
 
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Fileset_createFile_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Fileset_createFileByHash_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_append_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_appendFd_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_retrieve_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_retrieveFd_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_appendEncoded_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_retrieveEncoded_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_retrieveDelta_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_truncate_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Tmpfile_delete_binding);
 	ni_dbus_objectmodel_bind_properties(&__ni_Testbus_Tmpfile_Properties_binding);
 
 	class = ni_testbus_file_class();
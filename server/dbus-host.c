@@ -10,6 +10,7 @@
 #include "model.h"
 #include "host.h"
 #include "command.h"
+#include "distribute.h"
 
 const char *
 xni_testbus_host_full_path(const ni_testbus_host_t *host)
@@ -360,6 +361,10 @@ ni_testbus_host_signal_process_scheduled(ni_dbus_object_t *host_object, ni_dbus_
 		goto out;
 	}
 	ni_dbus_dict_add_string(&argv[0], "object-path", process_object->path);
+	if (proc->command->priority)
+		ni_dbus_dict_add_int32(&argv[0], "priority", proc->command->priority);
+	if (proc->command->output_tail)
+		ni_dbus_dict_add_uint32(&argv[0], "output-tail", proc->command->output_tail);
 
 	if (!ni_testbus_file_array_serialize(&proc->context.files, &argv[1])) {
 		ni_error("unable to serialize fileset");
@@ -552,6 +557,45 @@ __ni_Testbus_Host_reboot(ni_dbus_object_t *object, const ni_dbus_method_t *metho
 
 NI_TESTBUS_METHOD_BINDING(Host, reboot);
 
+/*
+ * Host.fileDistributed(id, success)
+ *
+ * The agent reports that it has copied a file distributed to its host set
+ */
+static dbus_bool_t
+__ni_Testbus_Host_fileDistributed(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_testbus_distribution_target_t *target;
+	ni_testbus_distribution_t *dist;
+	ni_testbus_host_t *host;
+	dbus_bool_t success;
+	uint32_t id;
+
+	if ((host = ni_testbus_host_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 2
+	 || !ni_dbus_variant_get_uint32(&argv[0], &id)
+	 || !ni_dbus_variant_get_bool(&argv[1], &success))
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if ((dist = ni_testbus_distribution_by_id(id)) == NULL
+	 || (target = ni_testbus_distribution_get_target(dist, host)) == NULL) {
+		dbus_set_error(error, NI_DBUS_ERROR_NAME_UNKNOWN,
+				"host %s is not part of distribution %u", host->context.name, id);
+		return FALSE;
+	}
+
+	ni_debug_testbus("distribution %u: host %s %s", id, host->context.name,
+			success? "has a copy" : "failed to get a copy");
+	ni_testbus_distribution_complete(dist, target, success);
+	return TRUE;
+}
+
+NI_TESTBUS_METHOD_BINDING(Host, fileDistributed);
+
 /*
  * Hostset.addHost(name, host-object-path)
  */
@@ -663,6 +707,144 @@ __ni_Testbus_Hostset_reboot(ni_dbus_object_t *object, const ni_dbus_method_t *me
 
 NI_TESTBUS_METHOD_BINDING(Hostset, reboot);
 
+/*
+ * Send Host.distributeFile() signal, telling the agent where to copy
+ * the file from: either the master's file object, or the file system
+ * of another agent that already has a copy.
+ */
+static ni_bool_t
+__ni_testbus_host_signal_distribute(ni_testbus_distribution_t *dist, ni_testbus_distribution_target_t *target,
+		void *user_data)
+{
+	ni_dbus_server_t *server = user_data;
+	ni_dbus_object_t *host_object;
+	ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+
+	if (target->host->context.dbus_object_path == NULL
+	 || !(host_object = ni_dbus_server_get_object(server, target->host->context.dbus_object_path)))
+		return FALSE;
+
+	ni_dbus_variant_init_dict(&arg);
+	ni_dbus_dict_add_uint32(&arg, "id", dist->id);
+	ni_dbus_dict_add_string(&arg, "dest-path", dist->dest_path);
+	if (target->source < 0) {
+		ni_dbus_dict_add_string(&arg, "source-file", dist->file->object_path);
+	} else {
+		ni_testbus_host_t *source = dist->targets[target->source].host;
+
+		ni_dbus_dict_add_string(&arg, "source-agent", source->agent_bus_name);
+		ni_dbus_dict_add_string(&arg, "source-path", dist->dest_path);
+	}
+
+	ni_debug_testbus("distribution %u: host %s copies file from %s", dist->id, target->host->context.name,
+			target->source < 0? "master" : dist->targets[target->source].host->context.name);
+
+	ni_dbus_server_send_signal(server, host_object,
+			NI_TESTBUS_HOST_INTERFACE,
+			"distributeFile",
+			1, &arg);
+	ni_dbus_variant_destroy(&arg);
+	return TRUE;
+}
+
+/*
+ * Hostset.distributeFile(file-path, dest-path)
+ *
+ * Copy a file to all hosts in the set, storing it as dest-path on each
+ * of them. The call returns immediately; the caller can track the
+ * progress using getDistributionStatus() with the ID we return.
+ */
+static dbus_bool_t
+__ni_Testbus_Hostset_distributeFile(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_server_t *server = ni_dbus_object_get_server(object);
+	ni_dbus_object_t *root_object, *file_object = NULL;
+	const char *file_path, *dest_path;
+	ni_testbus_container_t *context;
+	ni_testbus_distribution_t *dist;
+	ni_testbus_file_t *file;
+
+	if ((context = ni_testbus_container_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 2
+	 || !ni_dbus_variant_get_string(&argv[0], &file_path)
+	 || !ni_dbus_variant_get_string(&argv[1], &dest_path)
+	 || dest_path[0] != '/')
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if (context->hosts.count == 0) {
+		dbus_set_error(error, DBUS_ERROR_FAILED, "no hosts to distribute the file to");
+		return FALSE;
+	}
+
+	root_object = ni_dbus_server_get_root_object(server);
+	if (root_object)
+		file_object = ni_dbus_object_lookup(root_object, file_path);
+	if (file_object == NULL) {
+		dbus_set_error(error, NI_DBUS_ERROR_NAME_UNKNOWN,
+				"unknown file object path %s", file_path);
+		return FALSE;
+	}
+
+	if (!(file = ni_testbus_file_unwrap(file_object, error)))
+		return FALSE;
+
+	dist = ni_testbus_distribution_new(context, file, dest_path, __ni_testbus_host_signal_distribute, server);
+	ni_testbus_distribution_start(dist);
+
+	ni_dbus_message_append_uint32(reply, dist->id);
+	return TRUE;
+}
+
+NI_TESTBUS_METHOD_BINDING(Hostset, distributeFile);
+
+/*
+ * Hostset.getDistributionStatus(id)
+ */
+static dbus_bool_t
+__ni_Testbus_Hostset_getDistributionStatus(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_testbus_container_t *context;
+	ni_testbus_distribution_t *dist;
+	unsigned int i;
+	dbus_bool_t rv;
+	uint32_t id;
+
+	if ((context = ni_testbus_container_unwrap(object, error)) == NULL)
+		return FALSE;
+
+	if (argc != 1 || !ni_dbus_variant_get_uint32(&argv[0], &id))
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	if ((dist = ni_testbus_distribution_by_id(id)) == NULL || dist->context != context) {
+		dbus_set_error(error, NI_DBUS_ERROR_NAME_UNKNOWN, "unknown distribution %u", id);
+		return FALSE;
+	}
+
+	ni_dbus_dict_array_init(&res);
+	for (i = 0; i < dist->count; ++i) {
+		ni_testbus_distribution_target_t *target = &dist->targets[i];
+		ni_dbus_variant_t *dict = ni_dbus_dict_array_add(&res);
+
+		ni_dbus_dict_add_string(dict, "host", target->host->context.name);
+		ni_dbus_dict_add_string(dict, "state", ni_testbus_distribution_state_name(target->state));
+		if (target->source >= 0)
+			ni_dbus_dict_add_string(dict, "source", dist->targets[target->source].host->context.name);
+	}
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+NI_TESTBUS_METHOD_BINDING(Hostset, getDistributionStatus);
+
 /*
  * Handle signals from agent
  */
@@ -723,9 +905,12 @@ ni_testbus_bind_builtin_host(void)
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Host_addCapability_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Host_shutdown_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Host_reboot_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Host_fileDistributed_binding);
 	ni_dbus_objectmodel_bind_properties(&__ni_Testbus_Host_Properties_binding);
 
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Hostset_addHost_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Hostset_shutdown_binding);
 	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Hostset_reboot_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Hostset_distributeFile_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Hostset_getDistributionStatus_binding);
 }
@@ -0,0 +1,271 @@
+/*
+ * Distributing a file to all hosts of a host set.
+ *
+ * Rather than having every agent download its own copy from the master,
+ * the hosts are arranged in a tree. The first host downloads the file
+ * from the master; every host that has a complete copy then serves it
+ * to NI_TESTBUS_DISTRIBUTE_FANOUT others, straight from its file system.
+ *
+ * Note that this does not reduce the amount of data on the wire. All
+ * agents talk to each other through the dbus-daemon on the master host,
+ * so every copy still passes through that daemon, and agents behind a
+ * dbus-proxy even send it across the proxy link twice (up to the daemon
+ * and back down). What it does buy us is that the master process itself
+ * serves the file just once, instead of having N downloads queue up
+ * behind its main loop, and that the copies are made in parallel.
+ *
+ * The master does not touch the data itself; it only tells each agent
+ * where to get the file from (using the Host.distributeFile signal),
+ * and the agents report back through Host.fileDistributed(). If a host
+ * fails, or goes away, the hosts below it in the tree get their copy
+ * from the next host up instead.
+ */
+
+#include <stdlib.h>
+#include <dborb/logging.h>
+#include <testbus/file.h>
+#include "distribute.h"
+#include "container.h"
+#include "host.h"
+
+static ni_testbus_distribution_t *ni_testbus_distributions;
+static unsigned int		ni_testbus_distribution_next_id = 1;
+
+static void			ni_testbus_distribution_kick(ni_testbus_distribution_t *);
+
+ni_testbus_distribution_t *
+ni_testbus_distribution_new(ni_testbus_container_t *context, ni_testbus_file_t *file, const char *dest_path,
+				ni_testbus_distribution_start_fn_t *start, void *user_data)
+{
+	ni_testbus_distribution_t *dist;
+	unsigned int i;
+
+	dist = ni_calloc(1, sizeof(*dist));
+	dist->id = ni_testbus_distribution_next_id++;
+	dist->context = context;
+	dist->file = ni_testbus_file_get(file);
+	ni_string_dup(&dist->dest_path, dest_path);
+	dist->start = start;
+	dist->user_data = user_data;
+
+	dist->count = context->hosts.count;
+	dist->targets = ni_calloc(dist->count, sizeof(dist->targets[0]));
+	for (i = 0; i < dist->count; ++i) {
+		ni_testbus_distribution_target_t *t = &dist->targets[i];
+
+		t->host = ni_testbus_host_get(context->hosts.data[i]);
+		t->source = i? (int) (i - 1) / NI_TESTBUS_DISTRIBUTE_FANOUT : -1;
+		t->state = NI_TESTBUS_DISTRIBUTE_WAITING;
+		if (t->host->agent_bus_name == NULL) {
+			ni_warn("distribution %u: host %s has no agent", dist->id, t->host->context.name);
+			t->state = NI_TESTBUS_DISTRIBUTE_FAILED;
+		}
+	}
+
+	dist->next = ni_testbus_distributions;
+	ni_testbus_distributions = dist;
+	return dist;
+}
+
+static void
+ni_testbus_distribution_free(ni_testbus_distribution_t *dist)
+{
+	unsigned int i;
+
+	for (i = 0; i < dist->count; ++i)
+		ni_testbus_host_put(dist->targets[i].host);
+	free(dist->targets);
+	ni_testbus_file_put(dist->file);
+	ni_string_free(&dist->dest_path);
+	free(dist);
+}
+
+void
+ni_testbus_distribution_start(ni_testbus_distribution_t *dist)
+{
+	ni_debug_testbus("distribution %u: sending %s to %u hosts as %s", dist->id,
+			dist->file->object_path, dist->count, dist->dest_path);
+	ni_testbus_distribution_kick(dist);
+}
+
+ni_testbus_distribution_t *
+ni_testbus_distribution_by_id(unsigned int id)
+{
+	ni_testbus_distribution_t *dist;
+
+	for (dist = ni_testbus_distributions; dist; dist = dist->next) {
+		if (dist->id == id)
+			return dist;
+	}
+	return NULL;
+}
+
+ni_testbus_distribution_target_t *
+ni_testbus_distribution_get_target(ni_testbus_distribution_t *dist, const ni_testbus_host_t *host)
+{
+	unsigned int i;
+
+	for (i = 0; i < dist->count; ++i) {
+		if (dist->targets[i].host == host)
+			return &dist->targets[i];
+	}
+	return NULL;
+}
+
+/*
+ * Find the closest host up the tree that has, or will have, a copy
+ * we can get the file from.
+ */
+static int
+ni_testbus_distribution_resolve_source(ni_testbus_distribution_t *dist, int source)
+{
+	while (source >= 0) {
+		ni_testbus_distribution_target_t *t = &dist->targets[source];
+
+		if (t->state != NI_TESTBUS_DISTRIBUTE_FAILED && t->host->agent_bus_name != NULL)
+			break;
+		source = t->source;
+	}
+	return source;
+}
+
+/*
+ * Start all hosts whose source has a complete copy of the file.
+ * If we cannot start a host, the hosts below it have to find
+ * another source, so we go through the list again.
+ */
+static void
+ni_testbus_distribution_kick(ni_testbus_distribution_t *dist)
+{
+	ni_bool_t again;
+	unsigned int i;
+
+	do {
+		again = FALSE;
+		for (i = 0; i < dist->count; ++i) {
+			ni_testbus_distribution_target_t *t = &dist->targets[i];
+
+			if (t->state != NI_TESTBUS_DISTRIBUTE_WAITING)
+				continue;
+
+			t->source = ni_testbus_distribution_resolve_source(dist, t->source);
+			if (t->source >= 0 && dist->targets[t->source].state != NI_TESTBUS_DISTRIBUTE_DONE)
+				continue;
+
+			t->state = NI_TESTBUS_DISTRIBUTE_TRANSFERRING;
+			if (!dist->start(dist, t, dist->user_data)) {
+				t->state = NI_TESTBUS_DISTRIBUTE_FAILED;
+				again = TRUE;
+			}
+		}
+	} while (again);
+}
+
+static void
+ni_testbus_distribution_check_finished(ni_testbus_distribution_t *dist)
+{
+	unsigned int i, ndone = 0;
+
+	for (i = 0; i < dist->count; ++i) {
+		switch (dist->targets[i].state) {
+		case NI_TESTBUS_DISTRIBUTE_DONE:
+			ndone++;
+			break;
+		case NI_TESTBUS_DISTRIBUTE_FAILED:
+			break;
+		default:
+			return;
+		}
+	}
+
+	ni_debug_testbus("distribution %u: finished, %u of %u hosts have a copy", dist->id, ndone, dist->count);
+}
+
+/*
+ * The agent tells us whether it was able to get the file. If it failed to
+ * get it from another host, it gets one more chance to get it from the
+ * next host up the tree (which may be the master).
+ */
+void
+ni_testbus_distribution_complete(ni_testbus_distribution_t *dist, ni_testbus_distribution_target_t *t, ni_bool_t ok)
+{
+	if (t->state != NI_TESTBUS_DISTRIBUTE_TRANSFERRING)
+		return;
+
+	if (ok) {
+		t->state = NI_TESTBUS_DISTRIBUTE_DONE;
+	} else
+	if (t->source >= 0 && !t->retried) {
+		ni_warn("distribution %u: host %s failed to copy file from %s, retrying",
+				dist->id, t->host->context.name,
+				dist->targets[t->source].host->context.name);
+		t->source = dist->targets[t->source].source;
+		t->retried = TRUE;
+		t->state = NI_TESTBUS_DISTRIBUTE_WAITING;
+	} else {
+		ni_warn("distribution %u: host %s failed to copy file", dist->id, t->host->context.name);
+		t->state = NI_TESTBUS_DISTRIBUTE_FAILED;
+	}
+
+	ni_testbus_distribution_kick(dist);
+	ni_testbus_distribution_check_finished(dist);
+}
+
+/*
+ * When an agent goes away, whatever it was doing has failed. The hosts
+ * that were going to copy the file from it will look elsewhere.
+ */
+void
+ni_testbus_distribution_host_disconnected(ni_testbus_host_t *host)
+{
+	ni_testbus_distribution_t *dist;
+
+	for (dist = ni_testbus_distributions; dist; dist = dist->next) {
+		ni_testbus_distribution_target_t *t;
+
+		if ((t = ni_testbus_distribution_get_target(dist, host)) == NULL)
+			continue;
+
+		if (t->state == NI_TESTBUS_DISTRIBUTE_WAITING
+		 || t->state == NI_TESTBUS_DISTRIBUTE_TRANSFERRING)
+			t->state = NI_TESTBUS_DISTRIBUTE_FAILED;
+
+		ni_testbus_distribution_kick(dist);
+		ni_testbus_distribution_check_finished(dist);
+	}
+}
+
+/*
+ * Called when the host set goes away
+ */
+void
+ni_testbus_distribution_release(ni_testbus_container_t *context)
+{
+	ni_testbus_distribution_t **pos, *dist;
+
+	pos = &ni_testbus_distributions;
+	while ((dist = *pos) != NULL) {
+		if (dist->context == context) {
+			*pos = dist->next;
+			ni_testbus_distribution_free(dist);
+		} else {
+			pos = &dist->next;
+		}
+	}
+}
+
+const char *
+ni_testbus_distribution_state_name(unsigned int state)
+{
+	switch (state) {
+	case NI_TESTBUS_DISTRIBUTE_WAITING:
+		return "waiting";
+	case NI_TESTBUS_DISTRIBUTE_TRANSFERRING:
+		return "transferring";
+	case NI_TESTBUS_DISTRIBUTE_DONE:
+		return "done";
+	case NI_TESTBUS_DISTRIBUTE_FAILED:
+		return "failed";
+	}
+	return "unknown";
+}
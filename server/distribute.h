@@ -0,0 +1,65 @@
+
+#ifndef __SERVER_DISTRIBUTE_H__
+#define __SERVER_DISTRIBUTE_H__
+
+#include "types.h"
+
+/*
+ * Each host that has received a copy of the file passes it on to
+ * this many others.
+ */
+#define NI_TESTBUS_DISTRIBUTE_FANOUT	4
+
+enum {
+	NI_TESTBUS_DISTRIBUTE_WAITING,
+	NI_TESTBUS_DISTRIBUTE_TRANSFERRING,
+	NI_TESTBUS_DISTRIBUTE_DONE,
+	NI_TESTBUS_DISTRIBUTE_FAILED,
+};
+
+typedef struct ni_testbus_distribution ni_testbus_distribution_t;
+typedef struct ni_testbus_distribution_target ni_testbus_distribution_target_t;
+
+struct ni_testbus_distribution_target {
+	ni_testbus_host_t *	host;
+	int			source;		/* index of the target we copy from, -1 for the master */
+	unsigned int		state;
+	ni_bool_t		retried;
+};
+
+/*
+ * The start callback is invoked for each host that can start copying the
+ * file, ie when its source has a complete copy. It returns FALSE if it
+ * could not tell the host's agent about it.
+ */
+typedef ni_bool_t		ni_testbus_distribution_start_fn_t(ni_testbus_distribution_t *,
+					ni_testbus_distribution_target_t *, void *user_data);
+
+struct ni_testbus_distribution {
+	ni_testbus_distribution_t *next;
+	unsigned int		id;
+
+	ni_testbus_container_t *context;
+	ni_testbus_file_t *	file;
+	char *			dest_path;
+
+	unsigned int		count;
+	ni_testbus_distribution_target_t *targets;
+
+	ni_testbus_distribution_start_fn_t *start;
+	void *			user_data;
+};
+
+extern ni_testbus_distribution_t *ni_testbus_distribution_new(ni_testbus_container_t *, ni_testbus_file_t *,
+					const char *dest_path,
+					ni_testbus_distribution_start_fn_t *, void *user_data);
+extern void			ni_testbus_distribution_start(ni_testbus_distribution_t *);
+extern ni_testbus_distribution_t *ni_testbus_distribution_by_id(unsigned int);
+extern ni_testbus_distribution_target_t *ni_testbus_distribution_get_target(ni_testbus_distribution_t *, const ni_testbus_host_t *);
+extern void			ni_testbus_distribution_complete(ni_testbus_distribution_t *,
+					ni_testbus_distribution_target_t *, ni_bool_t ok);
+extern void			ni_testbus_distribution_host_disconnected(ni_testbus_host_t *);
+extern void			ni_testbus_distribution_release(ni_testbus_container_t *);
+extern const char *		ni_testbus_distribution_state_name(unsigned int);
+
+#endif /* __SERVER_DISTRIBUTE_H__ */
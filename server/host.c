@@ -3,6 +3,7 @@
 #include <dborb/logging.h>
 #include "model.h"
 #include "host.h"
+#include "distribute.h"
 
 static void			ni_testbus_host_release(ni_testbus_container_t *);
 static void			ni_testbus_host_destroy(ni_testbus_container_t *);
@@ -136,6 +137,8 @@ ni_testbus_host_agent_disconnected(ni_testbus_host_t *host)
 	ni_testbus_env_destroy(&host->context.env);
 	ni_string_free(&host->agent_bus_name);
 	host->ready = FALSE;
+
+	ni_testbus_distribution_host_disconnected(host);
 }
 
 void
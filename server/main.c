@@ -18,10 +18,12 @@
 #include <getopt.h>
 #include <limits.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <dborb/netinfo.h>
 #include <dborb/logging.h>
 #include <dborb/socket.h>
+#include <dborb/loopstats.h>
 #include <dborb/dbus-model.h>
 #include <testbus/model.h>
 #include "model.h"
@@ -171,6 +173,7 @@ ni_testbus_bind_builtin()
 	ni_testbus_bind_builtin_process();
 	ni_testbus_bind_builtin_container();
 	ni_testbus_bind_builtin_eventlog();
+	ni_testbus_bind_builtin_stats();
 }
 
 static void
@@ -182,6 +185,7 @@ ni_testbus_create_static_objects(ni_dbus_server_t *server)
 //	ni_testbus_create_static_objects_command(server);
 	ni_testbus_create_static_objects_file(server);
 	ni_testbus_create_static_objects_test(server);
+	ni_testbus_create_static_objects_stats(server);
 }
 
 /*
@@ -214,6 +218,7 @@ ni_testbus_master(void)
 	if (!opt_foreground && ni_server_background(APP_IDENTITY) < 0)
 		ni_fatal("unable to background testbus master");
 
+	ni_loopstats_catch_signal(SIGUSR1);
 	while (!ni_caught_terminal_signal()) {
 		long timeout;
 
@@ -15,6 +15,7 @@
 #include <dborb/logging.h>
 #include <dborb/xml.h>
 #include <dborb/buffer.h>
+#include <dborb/codec.h>
 #include <dborb/dbus-errors.h>
 #include <dborb/dbus-service.h>
 #include <dborb/dbus-model.h>
@@ -22,6 +23,8 @@
 #include <dborb/process.h>
 #include <testbus/model.h>
 #include <testbus/client.h>
+#include <testbus/file.h>
+#include <testbus/delta.h>
 #include <testbus/process.h>
 #include <testbus/monitor.h>
 
@@ -968,221 +971,1741 @@ ni_testbus_agent_add_environment(ni_dbus_object_t *host_object, const ni_var_arr
 	return TRUE;
 }
 
+/*
+ * Client functions for the Stats interface. If no agent is given,
+ * we query the master.
+ */
+static ni_dbus_object_t *
+__ni_testbus_client_stats_object(ni_dbus_object_t *agent)
+{
+	ni_dbus_object_t *root, *stats;
+
+	if (!(root = agent) && !(root = ni_testbus_client_get_root()))
+		return NULL;
+
+	stats = ni_dbus_object_create(root, NI_TESTBUS_STATS_PATH, ni_testbus_stats_class(), NULL);
+	ni_objectmodel_bind_compatible_interfaces(stats);
+	return stats;
+}
+
+ni_bool_t
+ni_testbus_client_get_eventloop_stats(ni_dbus_object_t *agent, ni_bool_t reset, ni_dbus_variant_t *result)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_object_t *stats;
+
+	if (!(stats = __ni_testbus_client_stats_object(agent)))
+		return FALSE;
+
+	if (!ni_dbus_object_call_variant(stats, NULL, "getEventLoopStats", 0, NULL, 1, result, &error)) {
+		ni_dbus_print_error(&error, "%s.getEventLoopStats(): failed", stats->path);
+		dbus_error_free(&error);
+		return FALSE;
+	}
+
+	if (reset && !ni_dbus_object_call_variant(stats, NULL, "resetEventLoopStats", 0, NULL, 0, NULL, &error)) {
+		ni_dbus_print_error(&error, "%s.resetEventLoopStats(): failed", stats->path);
+		dbus_error_free(&error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+ni_bool_t
+ni_testbus_client_get_buffer_pool_stats(ni_dbus_object_t *agent, ni_dbus_variant_t *result)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_object_t *stats;
+
+	if (!(stats = __ni_testbus_client_stats_object(agent)))
+		return FALSE;
+
+	if (!ni_dbus_object_call_variant(stats, NULL, "getBufferPoolStats", 0, NULL, 1, result, &error)) {
+		ni_dbus_print_error(&error, "%s.getBufferPoolStats(): failed", stats->path);
+		dbus_error_free(&error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+ni_bool_t
+ni_testbus_client_get_codec_stats(ni_dbus_object_t *agent, ni_dbus_variant_t *result)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_object_t *stats;
+
+	if (!(stats = __ni_testbus_client_stats_object(agent)))
+		return FALSE;
+
+	if (!ni_dbus_object_call_variant(stats, NULL, "getCodecStats", 0, NULL, 1, result, &error)) {
+		ni_dbus_print_error(&error, "%s.getCodecStats(): failed", stats->path);
+		dbus_error_free(&error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Pipelined file transfers.
+ *
+ * Moving a file in small chunks with one synchronous call per chunk
+ * makes the transfer rate a function of the round trip time through
+ * the bus daemon, rather than of the available bandwidth. Instead, we
+ * keep a window of asynchronous calls in flight, each of them sent
+ * through a proxy of its own so that the callback knows which chunk it
+ * belongs to.
+ *
+ * Both the window and the chunk size start out small and grow with every
+ * chunk that completes, so that small files still take a single round
+ * trip. This also makes sure the first chunk of an agent upload (which
+ * truncates the file) has been written before anything else is sent.
+ *
+ * We wait for calls by blocking on the oldest one rather than going
+ * through the main loop, so this is safe to use from within a dbus
+ * callback - which is what the agent does when downloading files.
+ *
+ * A transfer can also run asynchronously, in which case each completed
+ * call sends the next ones, and the done callback is invoked once the
+ * last call has completed. The agent uses this to download the input
+ * files of a command concurrently.
+ *
+ * If compression is enabled in the config file, we use the *Encoded
+ * variants of the methods. When talking to a server that does not
+ * know about these, the first call fails, and we switch back to the
+ * plain methods. As the first call is always the only one in flight,
+ * there is nothing else to clean up at that point.
+ */
+#define NI_TESTBUS_TRANSFER_WINDOW_MAX	8
+#define NI_TESTBUS_TRANSFER_CHUNK_MIN	4096
+#define NI_TESTBUS_TRANSFER_ARGS_MAX	5
+
+typedef struct ni_testbus_transfer ni_testbus_transfer_t;
+typedef struct ni_testbus_transfer_slot ni_testbus_transfer_slot_t;
+
+typedef struct ni_testbus_transfer_ops ni_testbus_transfer_ops_t;
+struct ni_testbus_transfer_ops {
+	const char *		method;
+	unsigned int		chunk_max;	/* largest chunk the server accepts */
+	unsigned int		nargs;
+	void			(*build_args)(ni_testbus_transfer_t *, ni_testbus_transfer_slot_t *, ni_dbus_variant_t *);
+	ni_bool_t		(*complete)(ni_testbus_transfer_t *, ni_testbus_transfer_slot_t *, ni_dbus_message_t *);
+
+	const ni_testbus_transfer_ops_t *encoded;	/* variant that supports compression */
+	const ni_testbus_transfer_ops_t *fallback;	/* plain variant, if the server does not */
+};
+
+struct ni_testbus_transfer_slot {
+	ni_testbus_transfer_t *	xfer;
+	ni_dbus_object_t *	handle;
+	ni_bool_t		busy;
+	uint64_t		offset;
+	unsigned int		count;
+};
+
+struct ni_testbus_transfer {
+	const ni_testbus_transfer_ops_t *ops;
+	ni_codec_t *		codec;
+	const char *		name;		/* for messages */
+	const char *		path;		/* agent file system path */
+	uint32_t		session;	/* agent file handle, if the file is open */
+
+	const ni_buffer_t *	wbuf;		/* upload: data to send */
+	ni_buffer_t *		rbuf;		/* download: data is stored at the tail */
+
+	uint64_t		start;		/* offset of the first byte */
+	uint64_t		next;		/* offset of the next chunk to send */
+	uint64_t		end;		/* end of data, if known */
+
+	unsigned int		chunk;
+	unsigned int		window;
+	unsigned int		in_flight;
+	unsigned int		calls;
+	ni_bool_t		failed;
+	struct timeval		begin;
+
+	/* async transfers only */
+	void			(*done)(ni_testbus_transfer_t *);
+	void *			user_data;
+
+	ni_testbus_transfer_slot_t slot[NI_TESTBUS_TRANSFER_WINDOW_MAX];
+};
+
+static void		__ni_testbus_transfer_pump(ni_testbus_transfer_t *);
+
+static void
+ni_testbus_transfer_init(ni_testbus_transfer_t *xfer, const ni_testbus_transfer_ops_t *ops,
+				ni_dbus_client_t *client, const ni_dbus_class_t *class,
+				const char *object_path, const char *interface)
+{
+	unsigned int i;
+
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->ops = ops;
+	if (ops->encoded && (xfer->codec = ni_codec_default()) != NULL)
+		xfer->ops = ops->encoded;
+	xfer->name = object_path;
+	xfer->end = ~(uint64_t) 0;
+	xfer->chunk = NI_TESTBUS_TRANSFER_CHUNK_MIN;
+	xfer->window = 1;
+
+	for (i = 0; i < NI_TESTBUS_TRANSFER_WINDOW_MAX; ++i) {
+		ni_testbus_transfer_slot_t *slot = &xfer->slot[i];
+
+		slot->xfer = xfer;
+		slot->handle = ni_dbus_client_object_new(client, class, object_path, interface, slot);
+	}
+}
+
+static void
+ni_testbus_transfer_destroy(ni_testbus_transfer_t *xfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < NI_TESTBUS_TRANSFER_WINDOW_MAX; ++i) {
+		ni_testbus_transfer_slot_t *slot = &xfer->slot[i];
+
+		if (slot->handle)
+			ni_dbus_object_free(slot->handle);
+		slot->handle = NULL;
+	}
+}
+
+static void
+__ni_testbus_transfer_complete(ni_testbus_transfer_slot_t *slot, ni_dbus_message_t *reply)
+{
+	ni_testbus_transfer_t *xfer = slot->xfer;
+
+	slot->busy = FALSE;
+	xfer->in_flight--;
+
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		DBusError error = DBUS_ERROR_INIT;
+
+		if (xfer->calls == 1 && xfer->ops->fallback) {
+			dbus_set_error_from_message(&error, reply);
+			if (dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD)
+			 || dbus_error_has_name(&error, DBUS_ERROR_NOT_SUPPORTED)) {
+				ni_debug_testbus("%s.%s() not supported, falling back to %s()", xfer->name,
+						xfer->ops->method, xfer->ops->fallback->method);
+				xfer->ops = xfer->ops->fallback;
+				xfer->next = xfer->start;
+				xfer->calls = 0;
+				dbus_error_free(&error);
+				return;
+			}
+			dbus_error_free(&error);
+		}
+
+		/* Once one chunk failed, the others will likely fail for the
+		 * same reason; report just the first one. */
+		if (!xfer->failed) {
+			dbus_set_error_from_message(&error, reply);
+			ni_dbus_print_error(&error, "%s.%s(%u @%llu) failed", xfer->name, xfer->ops->method,
+					slot->count, (unsigned long long) slot->offset);
+			dbus_error_free(&error);
+		}
+		xfer->failed = TRUE;
+		return;
+	}
+
+	if (!xfer->ops->complete(xfer, slot, reply)) {
+		xfer->failed = TRUE;
+		return;
+	}
+
+	if (xfer->chunk < xfer->ops->chunk_max) {
+		xfer->chunk *= 2;
+		if (xfer->chunk > xfer->ops->chunk_max)
+			xfer->chunk = xfer->ops->chunk_max;
+	}
+	if (xfer->window < NI_TESTBUS_TRANSFER_WINDOW_MAX)
+		xfer->window++;
+}
+
+static void
+__ni_testbus_transfer_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
+{
+	ni_testbus_transfer_slot_t *slot = handle->handle;
+	ni_testbus_transfer_t *xfer = slot->xfer;
+
+	__ni_testbus_transfer_complete(slot, reply);
+
+	/* For async transfers, this may invoke the done callback, which
+	 * is free to destroy the transfer. */
+	if (xfer->done)
+		__ni_testbus_transfer_pump(xfer);
+}
+
+static ni_bool_t
+__ni_testbus_transfer_send(ni_testbus_transfer_t *xfer)
+{
+	const ni_testbus_transfer_ops_t *ops = xfer->ops;
+	ni_testbus_transfer_slot_t *slot = NULL;
+	ni_dbus_variant_t argv[NI_TESTBUS_TRANSFER_ARGS_MAX];
+	unsigned int i;
+	int rv;
+
+	for (i = 0; i < NI_TESTBUS_TRANSFER_WINDOW_MAX; ++i) {
+		if (!xfer->slot[i].busy) {
+			slot = &xfer->slot[i];
+			break;
+		}
+	}
+	ni_assert(slot);
+
+	slot->offset = xfer->next;
+	slot->count = xfer->chunk;
+	if (slot->count > xfer->end - xfer->next)
+		slot->count = xfer->end - xfer->next;
+
+	ni_dbus_variant_vector_init(argv, NI_TESTBUS_TRANSFER_ARGS_MAX);
+	ops->build_args(xfer, slot, argv);
+
+	rv = ni_dbus_object_call_variant_async(slot->handle, NULL, ops->method, ops->nargs, argv,
+				__ni_testbus_transfer_done);
+	ni_dbus_variant_vector_destroy(argv, NI_TESTBUS_TRANSFER_ARGS_MAX);
+
+	if (rv < 0) {
+		ni_error("%s.%s(%u @%llu): unable to send call", xfer->name, ops->method,
+				slot->count, (unsigned long long) slot->offset);
+		xfer->failed = TRUE;
+		return FALSE;
+	}
+
+	slot->busy = TRUE;
+	xfer->next += slot->count;
+	xfer->in_flight++;
+	xfer->calls++;
+	return TRUE;
+}
+
+/*
+ * Wait for the oldest call in flight
+ */
+static void
+__ni_testbus_transfer_wait(ni_testbus_transfer_t *xfer)
+{
+	ni_testbus_transfer_slot_t *oldest = NULL;
+	unsigned int i;
+
+	for (i = 0; i < NI_TESTBUS_TRANSFER_WINDOW_MAX; ++i) {
+		ni_testbus_transfer_slot_t *slot = &xfer->slot[i];
+
+		if (slot->busy && (oldest == NULL || slot->offset < oldest->offset))
+			oldest = slot;
+	}
+
+	if (oldest)
+		ni_dbus_object_wait_async(oldest->handle);
+}
+
+static ni_bool_t
+__ni_testbus_transfer_begin(ni_testbus_transfer_t *xfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < NI_TESTBUS_TRANSFER_WINDOW_MAX; ++i) {
+		if (xfer->slot[i].handle == NULL) {
+			ni_error("%s: unable to create proxy objects", xfer->name);
+			return FALSE;
+		}
+	}
+
+	ni_timer_get_time(&xfer->begin);
+	xfer->next = xfer->start;
+	return TRUE;
+}
+
+static void
+__ni_testbus_transfer_fill_window(ni_testbus_transfer_t *xfer)
+{
+	while (!xfer->failed && xfer->in_flight < xfer->window && xfer->next < xfer->end) {
+		if (!__ni_testbus_transfer_send(xfer))
+			break;
+	}
+}
+
+static void
+__ni_testbus_transfer_report(ni_testbus_transfer_t *xfer, const char *verb)
+{
+	unsigned long long bytes, usec;
+	struct timeval now;
+
+	ni_timer_get_time(&now);
+	usec = (now.tv_sec - xfer->begin.tv_sec) * 1000000ULL + now.tv_usec - xfer->begin.tv_usec;
+	bytes = (xfer->end < xfer->next? xfer->end : xfer->next) - xfer->start;
+	ni_debug_testbus("%s: %s %llu bytes in %llu.%03llu ms (%llu KB/s, %u calls, chunk size %u)",
+			xfer->name, verb, bytes, usec / 1000, usec % 1000,
+			usec? bytes * 1000000ULL / 1024 / usec : 0,
+			xfer->calls, xfer->chunk);
+}
+
+static ni_bool_t
+ni_testbus_transfer_run(ni_testbus_transfer_t *xfer, const char *verb)
+{
+	if (!__ni_testbus_transfer_begin(xfer))
+		return FALSE;
+
+	while (TRUE) {
+		__ni_testbus_transfer_fill_window(xfer);
+		if (xfer->in_flight == 0)
+			break;
+		__ni_testbus_transfer_wait(xfer);
+	}
+
+	if (xfer->failed)
+		return FALSE;
+
+	__ni_testbus_transfer_report(xfer, verb);
+	return TRUE;
+}
+
+/*
+ * Start an asynchronous transfer. The done callback is invoked when it
+ * has completed or failed, which may happen before this returns.
+ */
+static void
+ni_testbus_transfer_start(ni_testbus_transfer_t *xfer, void (*done)(ni_testbus_transfer_t *), void *user_data)
+{
+	xfer->done = done;
+	xfer->user_data = user_data;
+
+	if (!__ni_testbus_transfer_begin(xfer))
+		xfer->failed = TRUE;
+	__ni_testbus_transfer_pump(xfer);
+}
+
+static void
+__ni_testbus_transfer_pump(ni_testbus_transfer_t *xfer)
+{
+	__ni_testbus_transfer_fill_window(xfer);
+	if (xfer->in_flight == 0)
+		xfer->done(xfer);
+}
+
+/*
+ * Uploads take their data from the write buffer, downloads put it
+ * into the read buffer at the position corresponding to the offset.
+ * Chunks may complete out of order, so a download does not know where
+ * the data ends until everything is in.
+ */
+static void
+__ni_testbus_transfer_set_data(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				ni_dbus_variant_t *arg)
+{
+	const unsigned char *data = ni_buffer_head(xfer->wbuf);
+
+	ni_dbus_variant_set_byte_array(arg, data + (slot->offset - xfer->start), slot->count);
+}
+
+/*
+ * Same as above, for the *Encoded methods. The encoding, size and
+ * data arguments come in this order.
+ */
+static void
+__ni_testbus_transfer_set_encoded(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				ni_dbus_variant_t *argv)
+{
+	const unsigned char *data = ni_buffer_head(xfer->wbuf);
+	ni_buffer_t *encoded;
+
+	data += slot->offset - xfer->start;
+	ni_dbus_variant_set_uint32(&argv[1], slot->count);
+	if ((encoded = ni_codec_encode(xfer->codec, data, slot->count)) != NULL) {
+		ni_dbus_variant_set_string(&argv[0], xfer->codec->name);
+		ni_dbus_variant_set_byte_array(&argv[2], ni_buffer_head(encoded), ni_buffer_count(encoded));
+		ni_buffer_free(encoded);
+	} else {
+		ni_dbus_variant_set_string(&argv[0], NI_CODEC_IDENTITY);
+		ni_dbus_variant_set_byte_array(&argv[2], data, slot->count);
+	}
+}
+
+static ni_bool_t
+__ni_testbus_transfer_store(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				const void *data, unsigned int count)
+{
+	unsigned int pos;
+
+	if (count > slot->count)
+		count = slot->count;
+
+	/* A short read marks the end of the file. Anything beyond it
+	 * is ignored, even if the file has grown in the meantime. */
+	if (count < slot->count && slot->offset + count < xfer->end)
+		xfer->end = slot->offset + count;
+
+	pos = slot->offset - xfer->start;
+	if (!ni_buffer_ensure_tailroom(xfer->rbuf, pos + count))
+		return FALSE;
+	memcpy((unsigned char *) ni_buffer_tail(xfer->rbuf) + pos, data, count);
+	return TRUE;
+}
+
+static ni_bool_t
+__ni_testbus_transfer_put_data(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				ni_dbus_message_t *reply)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_bool_t rv = FALSE;
+
+	if (ni_dbus_message_get_args_variants(reply, &res, 1) != 1
+	 || !ni_dbus_variant_is_byte_array(&res)) {
+		ni_error("%s: incompatible return type in %s()", xfer->name, xfer->ops->method);
+		goto out;
+	}
+
+	rv = __ni_testbus_transfer_store(xfer, slot, res.byte_array_value, res.array.len);
+
+out:
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+static ni_bool_t
+__ni_testbus_transfer_put_encoded(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				ni_dbus_message_t *reply)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	DBusError error = DBUS_ERROR_INIT;
+	ni_buffer_t *data = NULL;
+	ni_bool_t rv = FALSE;
+
+	if (ni_dbus_message_get_args_variants(reply, &res, 1) != 1
+	 || !ni_dbus_variant_is_dict(&res)) {
+		ni_error("%s: incompatible return type in %s()", xfer->name, xfer->ops->method);
+		goto out;
+	}
+
+	if ((data = ni_codec_decode_dict(&res, &error)) == NULL) {
+		ni_dbus_print_error(&error, "%s: bad data returned by %s()", xfer->name, xfer->ops->method);
+		dbus_error_free(&error);
+		goto out;
+	}
+
+	rv = __ni_testbus_transfer_store(xfer, slot, ni_buffer_head(data), ni_buffer_count(data));
+
+out:
+	if (data)
+		ni_buffer_free(data);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+static ni_bool_t
+__ni_testbus_transfer_download_finish(ni_testbus_transfer_t *xfer)
+{
+	uint64_t end = xfer->end < xfer->next? xfer->end : xfer->next;
+
+	if (!ni_buffer_ensure_tailroom(xfer->rbuf, end - xfer->start))
+		return FALSE;
+	ni_buffer_push_tail(xfer->rbuf, end - xfer->start);
+	return TRUE;
+}
+
+static ni_bool_t
+__ni_testbus_transfer_upload_complete(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot,
+				ni_dbus_message_t *reply)
+{
+	return TRUE;
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_download_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_download_encoded_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_read_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_read_encoded_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_upload_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_upload_encoded_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_retrieve_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_retrieve_encoded_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_append_ops;
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_append_encoded_ops;
+
+/*
+ * Agent.Filesystem.download(path, offset, count)
+ */
+static void
+__ni_testbus_agent_download_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	ni_dbus_variant_set_string(&argv[0], xfer->path);
+	ni_dbus_variant_set_uint64(&argv[1], slot->offset);
+	ni_dbus_variant_set_uint32(&argv[2], slot->count);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_download_ops = {
+	.method		= "download",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 3,
+	.build_args	= __ni_testbus_agent_download_args,
+	.complete	= __ni_testbus_transfer_put_data,
+	.encoded	= &ni_testbus_agent_download_encoded_ops,
+};
+
+/*
+ * Agent.Filesystem.downloadEncoded(path, offset, count, encoding)
+ */
+static void
+__ni_testbus_agent_download_encoded_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	__ni_testbus_agent_download_args(xfer, slot, argv);
+	ni_dbus_variant_set_string(&argv[3], xfer->codec->name);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_download_encoded_ops = {
+	.method		= "downloadEncoded",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 4,
+	.build_args	= __ni_testbus_agent_download_encoded_args,
+	.complete	= __ni_testbus_transfer_put_encoded,
+	.fallback	= &ni_testbus_agent_download_ops,
+};
+
+/*
+ * Agent.Filesystem.read(handle, offset, count)
+ * Same as download, for a file we opened before.
+ */
+static void
+__ni_testbus_agent_read_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	ni_dbus_variant_set_uint32(&argv[0], xfer->session);
+	ni_dbus_variant_set_uint64(&argv[1], slot->offset);
+	ni_dbus_variant_set_uint32(&argv[2], slot->count);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_read_ops = {
+	.method		= "read",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 3,
+	.build_args	= __ni_testbus_agent_read_args,
+	.complete	= __ni_testbus_transfer_put_data,
+	.encoded	= &ni_testbus_agent_read_encoded_ops,
+};
+
+/*
+ * Agent.Filesystem.readEncoded(handle, offset, count, encoding)
+ */
+static void
+__ni_testbus_agent_read_encoded_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	__ni_testbus_agent_read_args(xfer, slot, argv);
+	ni_dbus_variant_set_string(&argv[3], xfer->codec->name);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_read_encoded_ops = {
+	.method		= "readEncoded",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 4,
+	.build_args	= __ni_testbus_agent_read_encoded_args,
+	.complete	= __ni_testbus_transfer_put_encoded,
+	.fallback	= &ni_testbus_agent_read_ops,
+};
+
+/*
+ * Agent.Filesystem.upload(path, offset, data)
+ */
+static void
+__ni_testbus_agent_upload_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	ni_dbus_variant_set_string(&argv[0], xfer->path);
+	ni_dbus_variant_set_uint64(&argv[1], slot->offset);
+	__ni_testbus_transfer_set_data(xfer, slot, &argv[2]);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_upload_ops = {
+	.method		= "upload",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 3,
+	.build_args	= __ni_testbus_agent_upload_args,
+	.complete	= __ni_testbus_transfer_upload_complete,
+	.encoded	= &ni_testbus_agent_upload_encoded_ops,
+};
+
+/*
+ * Agent.Filesystem.uploadEncoded(path, offset, encoding, size, data)
+ */
+static void
+__ni_testbus_agent_upload_encoded_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	ni_dbus_variant_set_string(&argv[0], xfer->path);
+	ni_dbus_variant_set_uint64(&argv[1], slot->offset);
+	__ni_testbus_transfer_set_encoded(xfer, slot, &argv[2]);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_agent_upload_encoded_ops = {
+	.method		= "uploadEncoded",
+	.chunk_max	= 1024 * 1024,
+	.nargs		= 5,
+	.build_args	= __ni_testbus_agent_upload_encoded_args,
+	.complete	= __ni_testbus_transfer_upload_complete,
+	.fallback	= &ni_testbus_agent_upload_ops,
+};
+
+/*
+ * Tmpfile.retrieve(offset, count)
+ */
+static void
+__ni_testbus_tmpfile_retrieve_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	ni_dbus_variant_set_uint64(&argv[0], slot->offset);
+	ni_dbus_variant_set_uint32(&argv[1], slot->count);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_retrieve_ops = {
+	.method		= "retrieve",
+	.chunk_max	= 64 * 1024,
+	.nargs		= 2,
+	.build_args	= __ni_testbus_tmpfile_retrieve_args,
+	.complete	= __ni_testbus_transfer_put_data,
+	.encoded	= &ni_testbus_tmpfile_retrieve_encoded_ops,
+};
+
+/*
+ * Tmpfile.retrieveEncoded(offset, count, encoding)
+ */
+static void
+__ni_testbus_tmpfile_retrieve_encoded_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	__ni_testbus_tmpfile_retrieve_args(xfer, slot, argv);
+	ni_dbus_variant_set_string(&argv[2], xfer->codec->name);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_retrieve_encoded_ops = {
+	.method		= "retrieveEncoded",
+	.chunk_max	= 64 * 1024,
+	.nargs		= 3,
+	.build_args	= __ni_testbus_tmpfile_retrieve_encoded_args,
+	.complete	= __ni_testbus_transfer_put_encoded,
+	.fallback	= &ni_testbus_tmpfile_retrieve_ops,
+};
+
+/*
+ * Tmpfile.append(data)
+ * There is no offset argument; we rely on the master processing our
+ * calls in the order they were sent.
+ */
+static void
+__ni_testbus_tmpfile_append_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	__ni_testbus_transfer_set_data(xfer, slot, &argv[0]);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_append_ops = {
+	.method		= "append",
+	.chunk_max	= 64 * 1024,
+	.nargs		= 1,
+	.build_args	= __ni_testbus_tmpfile_append_args,
+	.complete	= __ni_testbus_transfer_upload_complete,
+	.encoded	= &ni_testbus_tmpfile_append_encoded_ops,
+};
+
+/*
+ * Tmpfile.appendEncoded(encoding, size, data)
+ */
+static void
+__ni_testbus_tmpfile_append_encoded_args(ni_testbus_transfer_t *xfer, ni_testbus_transfer_slot_t *slot, ni_dbus_variant_t *argv)
+{
+	__ni_testbus_transfer_set_encoded(xfer, slot, argv);
+}
+
+static const ni_testbus_transfer_ops_t	ni_testbus_tmpfile_append_encoded_ops = {
+	.method		= "appendEncoded",
+	.chunk_max	= 64 * 1024,
+	.nargs		= 3,
+	.build_args	= __ni_testbus_tmpfile_append_encoded_args,
+	.complete	= __ni_testbus_transfer_upload_complete,
+	.fallback	= &ni_testbus_tmpfile_append_ops,
+};
+
+static void
+ni_testbus_transfer_init_agent(ni_testbus_transfer_t *xfer, const ni_testbus_transfer_ops_t *ops,
+				ni_dbus_object_t *agent, const char *path)
+{
+	ni_testbus_transfer_init(xfer, ops, ni_dbus_object_get_client(agent),
+				ni_testbus_filesystem_class(), NI_TESTBUS_AGENT_FS_PATH,
+				NI_TESTBUS_AGENT_FS_INTERFACE);
+	xfer->name = path;
+	xfer->path = path;
+}
+
+static void
+ni_testbus_transfer_init_tmpfile(ni_testbus_transfer_t *xfer, const ni_testbus_transfer_ops_t *ops,
+				ni_dbus_object_t *file_object)
+{
+	ni_testbus_transfer_init(xfer, ops, ni_dbus_object_get_client(file_object),
+				ni_testbus_file_class(), file_object->path,
+				NI_TESTBUS_TMPFILE_INTERFACE);
+}
+
+/*
+ * On local connections, bulk data can be passed as a file descriptor
+ * rather than being marshalled byte by byte through libdbus and the bus
+ * daemon. If the server does not support this, we fall back to the
+ * byte array methods; these functions return -NI_ERROR_METHOD_NOT_SUPPORTED
+ * in that case.
+ */
+static int
+__ni_testbus_client_fd_call_error(const ni_dbus_object_t *object, const char *method, DBusError *error)
+{
+	int rv = -NI_ERROR_GENERAL_FAILURE;
+
+	if (dbus_error_has_name(error, DBUS_ERROR_UNKNOWN_METHOD)
+	 || dbus_error_has_name(error, DBUS_ERROR_NOT_SUPPORTED)) {
+		ni_debug_testbus("%s.%s() not supported, falling back to byte arrays",
+				object->path, method);
+		rv = -NI_ERROR_METHOD_NOT_SUPPORTED;
+	} else {
+		ni_dbus_print_error(error, "%s.%s() failed", object->path, method);
+	}
+
+	dbus_error_free(error);
+	return rv;
+}
+
+/*
+ * Send the data as a memfd, which is passed as the last argument
+ */
+static int
+__ni_testbus_client_send_fd(ni_dbus_object_t *object, const char *interface, const char *method,
+				unsigned int nargs, ni_dbus_variant_t *argv, const ni_buffer_t *data)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	int fd;
+
+	if (!ni_dbus_object_can_pass_fds(object))
+		return -NI_ERROR_METHOD_NOT_SUPPORTED;
+
+	if ((fd = ni_file_memfd(method, ni_buffer_head(data), ni_buffer_count(data))) < 0)
+		return -NI_ERROR_METHOD_NOT_SUPPORTED;
+
+	ni_dbus_variant_set_unix_fd(&argv[nargs++], fd);
+	if (!ni_dbus_object_call_variant(object, interface, method, nargs, argv, 0, NULL, &error))
+		return __ni_testbus_client_fd_call_error(object, method, &error);
+
+	ni_debug_testbus("%s: sent %u bytes via %s()", object->path, ni_buffer_count(data), method);
+	return 0;
+}
+
+/*
+ * Receive a file descriptor, and append everything we can read from it
+ * to the result buffer.
+ */
+static int
+__ni_testbus_client_receive_fd(ni_dbus_object_t *object, const char *interface, const char *method,
+				unsigned int nargs, const ni_dbus_variant_t *argv, ni_buffer_t *result)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	size_t tail = result->tail;
+	int fd, rv = -NI_ERROR_GENERAL_FAILURE;
+
+	if (!ni_dbus_object_can_pass_fds(object))
+		return -NI_ERROR_METHOD_NOT_SUPPORTED;
+
+	if (!ni_dbus_object_call_variant(object, interface, method, nargs, argv, 1, &res, &error))
+		return __ni_testbus_client_fd_call_error(object, method, &error);
+
+	if (!ni_dbus_variant_get_unix_fd(&res, &fd)) {
+		ni_error("%s: incompatible return type in %s()", object->path, method);
+		goto out;
+	}
+
+	if (!ni_file_read_fd(fd, result)) {
+		ni_error("%s: unable to read data returned by %s()", object->path, method);
+		result->tail = tail;
+		goto out;
+	}
+
+	ni_debug_testbus("%s: received %u bytes via %s()", object->path,
+			(unsigned int) (result->tail - tail), method);
+	rv = 0;
+
+out:
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+/*
+ * Agent.Filesystem.open() returns a handle for reading the file, plus its size.
+ * Agents that do not support this make us fall back to download(), which
+ * opens the file again for every chunk.
+ */
+static ni_bool_t
+__ni_testbus_agent_open_result(const char *path, const ni_dbus_variant_t *res, uint32_t *session, uint64_t *size)
+{
+	if (!ni_dbus_dict_get_uint32(res, "handle", session)
+	 || !ni_dbus_dict_get_uint64(res, "size", size)) {
+		ni_error("%s: server didn't return file handle and size", path);
+		return FALSE;
+	}
+	ni_debug_testbus("%s: file handle %u, size=%llu", path, *session, (unsigned long long) *size);
+	return TRUE;
+}
+
 /*
  * Client function: download a file directly from an agent's file system
  */
 ni_buffer_t *
-ni_testbus_client_agent_download_file(ni_dbus_object_t *agent, const char *path)
+ni_testbus_client_agent_download_file(ni_dbus_object_t *agent, const char *path)
+{
+	const ni_testbus_transfer_ops_t *ops = &ni_testbus_agent_read_ops;
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_testbus_transfer_t xfer;
+	ni_buffer_t *result = NULL;
+	ni_dbus_object_t *filesystem;
+	uint32_t session = 0;
+	uint64_t size;
+	int status;
+
+	filesystem = ni_dbus_object_create(agent, NI_TESTBUS_AGENT_FS_PATH, ni_testbus_filesystem_class(), NULL);
+	ni_objectmodel_bind_compatible_interfaces(filesystem);
+
+	ni_dbus_variant_set_string(&arg, path);
+
+	result = ni_buffer_new(0);
+	status = __ni_testbus_client_receive_fd(filesystem, NI_TESTBUS_AGENT_FS_INTERFACE, "downloadFd", 1, &arg, result);
+	if (status == 0)
+		goto out;
+
+	ni_buffer_free(result);
+	result = NULL;
+	if (status != -NI_ERROR_METHOD_NOT_SUPPORTED)
+		goto out;
+
+	if (ni_dbus_object_call_variant(filesystem, NULL, "open", 1, &arg, 1, &res, &error)) {
+		if (!__ni_testbus_agent_open_result(path, &res, &session, &size))
+			goto out;
+	} else {
+		if (__ni_testbus_client_fd_call_error(filesystem, "open", &error) != -NI_ERROR_METHOD_NOT_SUPPORTED)
+			goto out;
+
+		if (!ni_dbus_object_call_variant(filesystem, NULL, "getInfo", 1, &arg, 1, &res, &error)) {
+			ni_dbus_print_error(&error, "%s.getFileInfo(%s): failed", agent->path, path);
+			dbus_error_free(&error);
+			goto out;
+		}
+
+		if (!ni_dbus_dict_get_uint64(&res, "size", &size)) {
+			ni_error("%s: server didn't return size attribute", path);
+			goto out;
+		}
+		ni_debug_testbus("%s: size=%Lu", path, (unsigned long long) size);
+		ops = &ni_testbus_agent_download_ops;
+	}
+
+	result = ni_buffer_new(size);
+
+	ni_testbus_transfer_init_agent(&xfer, ops, agent, path);
+	xfer.session = session;
+	xfer.rbuf = result;
+	xfer.end = size;
+	if (!ni_testbus_transfer_run(&xfer, "downloaded")
+	 || !__ni_testbus_transfer_download_finish(&xfer)) {
+		ni_buffer_free(result);
+		result = NULL;
+	}
+	ni_testbus_transfer_destroy(&xfer);
+
+	if (session) {
+		ni_dbus_variant_set_uint32(&arg, session);
+		if (!ni_dbus_object_call_variant(filesystem, NULL, "close", 1, &arg, 0, NULL, &error)) {
+			ni_dbus_print_error(&error, "%s.close(%u): failed", agent->path, session);
+			dbus_error_free(&error);
+		}
+	}
+
+out:
+	ni_dbus_variant_destroy(&arg);
+	ni_dbus_variant_destroy(&res);
+	return result;
+}
+
+/*
+ * Client function: upload a file directly to an agent's file system
+ */
+ni_bool_t
+ni_testbus_client_agent_upload_file(ni_dbus_object_t *agent, const char *path, const ni_buffer_t *wbuf)
+{
+	ni_dbus_variant_t argv[2];
+	ni_dbus_object_t *filesystem;
+	ni_testbus_transfer_t xfer;
+	ni_bool_t rv;
+	int status;
+
+	filesystem = ni_dbus_object_create(agent, NI_TESTBUS_AGENT_FS_PATH, ni_testbus_filesystem_class(), NULL);
+	ni_objectmodel_bind_compatible_interfaces(filesystem);
+
+	ni_dbus_variant_vector_init(argv, 2);
+	ni_dbus_variant_set_string(&argv[0], path);
+	status = __ni_testbus_client_send_fd(filesystem, NI_TESTBUS_AGENT_FS_INTERFACE, "uploadFd", 1, argv, wbuf);
+	ni_dbus_variant_vector_destroy(argv, 2);
+
+	if (status != -NI_ERROR_METHOD_NOT_SUPPORTED)
+		return status == 0;
+
+	ni_testbus_transfer_init_agent(&xfer, &ni_testbus_agent_upload_ops, agent, path);
+	xfer.wbuf = wbuf;
+	xfer.end = ni_buffer_count(wbuf);
+	rv = ni_testbus_transfer_run(&xfer, "uploaded");
+	ni_testbus_transfer_destroy(&xfer);
+
+	return rv;
+}
+
+ni_dbus_object_t *
+ni_testbus_client_create_tempfile(const char *name, unsigned int mode, ni_dbus_object_t *parent)
+{
+	return ni_testbus_client_create_tempfile_ext(name, mode, 0, parent);
+}
+
+/*
+ * Create a file with the given size limit. A limit of 0 means the
+ * master's default applies.
+ */
+ni_dbus_object_t *
+ni_testbus_client_create_tempfile_ext(const char *name, unsigned int mode, unsigned int size_max, ni_dbus_object_t *parent)
+{
+	ni_dbus_variant_t args[3];
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_object_t *result = NULL;
+
+	if (parent == NULL)
+		parent = ni_testbus_client_get_object_and_metadata(NI_TESTBUS_GLOBAL_CONTEXT_PATH);
+
+	ni_dbus_variant_vector_init(args, 3);
+	ni_dbus_variant_set_string(&args[0], name);
+	ni_dbus_variant_set_uint32(&args[1], mode);
+	ni_dbus_variant_set_uint32(&args[2], size_max);
+
+	if (!ni_dbus_object_call_variant(parent, NULL, "createFile", 3, args, 1, &res, &error)) {
+		ni_dbus_print_error(&error, "%s.createFile(%s): failed", parent->path, name);
+		dbus_error_free(&error);
+	} else {
+		result = __ni_testbus_handle_path_result(&res, "createFile");
+	}
+
+	ni_dbus_variant_vector_destroy(args, 3);
+	ni_dbus_variant_destroy(&res);
+	return result;
+}
+
+/*
+ * Try to create a file that shares its contents with an identical file
+ * the master already has. Returns NULL if there is no such file (or the
+ * master doesn't support this), in which case the caller has to upload
+ * the data.
+ */
+ni_dbus_object_t *
+ni_testbus_client_create_tempfile_by_hash(const char *name, unsigned int mode, const ni_buffer_t *data, ni_dbus_object_t *parent)
+{
+	ni_dbus_variant_t args[4];
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_object_t *result = NULL;
+	unsigned char md5[NI_TESTBUS_MD5_LEN];
+
+	if (ni_buffer_count(data) == 0
+	 || !ni_md5_digest(ni_buffer_head(data), ni_buffer_count(data), md5, sizeof(md5)))
+		return NULL;
+
+	if (parent == NULL)
+		parent = ni_testbus_client_get_object_and_metadata(NI_TESTBUS_GLOBAL_CONTEXT_PATH);
+
+	ni_dbus_variant_vector_init(args, 4);
+	ni_dbus_variant_set_string(&args[0], name);
+	ni_dbus_variant_set_byte_array(&args[1], md5, sizeof(md5));
+	ni_dbus_variant_set_uint32(&args[2], ni_buffer_count(data));
+	ni_dbus_variant_set_uint32(&args[3], mode);
+
+	if (!ni_dbus_object_call_variant(parent, NULL, "createFileByHash", 4, args, 1, &res, &error)) {
+		if (dbus_error_has_name(&error, NI_DBUS_ERROR_NAME_UNKNOWN)
+		 || dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD))
+			ni_debug_testbus("%s: no file matching %s, need to upload", parent->path, name);
+		else
+			ni_dbus_print_error(&error, "%s.createFileByHash(%s): failed", parent->path, name);
+		dbus_error_free(&error);
+	} else {
+		result = __ni_testbus_handle_path_result(&res, "createFileByHash");
+		if (result)
+			ni_debug_testbus("%s: %s has the same contents as an existing file", parent->path, name);
+	}
+
+	ni_dbus_variant_vector_destroy(args, 4);
+	ni_dbus_variant_destroy(&res);
+	return result;
+}
+
+/*
+ * Create a file and fill it with the given data. If the master
+ * already has a file with identical contents, we do not need to
+ * transfer the data at all.
+ */
+ni_dbus_object_t *
+ni_testbus_client_upload_tempfile(const char *name, unsigned int mode, const ni_buffer_t *data, ni_dbus_object_t *parent)
+{
+	ni_dbus_object_t *file_object;
+
+	if ((file_object = ni_testbus_client_create_tempfile_by_hash(name, mode, data, parent)) != NULL)
+		return file_object;
+
+	if ((file_object = ni_testbus_client_create_tempfile(name, mode, parent)) == NULL)
+		return NULL;
+
+	if (!ni_testbus_client_upload_file(file_object, data)) {
+		/* Don't leave a half-written file behind on the master */
+		ni_testbus_client_delete(file_object);
+		return NULL;
+	}
+
+	return file_object;
+}
+
+ni_bool_t
+__ni_testbus_client_upload_file(ni_dbus_object_t *file_object, ni_buffer_t *buffer)
+{
+	ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+	ni_testbus_transfer_t xfer;
+	ni_bool_t rv;
+	int status;
+
+	status = __ni_testbus_client_send_fd(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "appendFd", 0, &arg, buffer);
+	ni_dbus_variant_destroy(&arg);
+
+	if (status != -NI_ERROR_METHOD_NOT_SUPPORTED) {
+		if (status < 0)
+			return FALSE;
+		ni_buffer_pull_head(buffer, ni_buffer_count(buffer));
+		return TRUE;
+	}
+
+	ni_testbus_transfer_init_tmpfile(&xfer, &ni_testbus_tmpfile_append_ops, file_object);
+	xfer.wbuf = buffer;
+	xfer.end = ni_buffer_count(buffer);
+	if ((rv = ni_testbus_transfer_run(&xfer, "uploaded")) != FALSE)
+		ni_buffer_pull_head(buffer, ni_buffer_count(buffer));
+	ni_testbus_transfer_destroy(&xfer);
+
+	return rv;
+}
+
+ni_bool_t
+ni_testbus_client_upload_file(ni_dbus_object_t *file_object, const ni_buffer_t *buffer)
+{
+	ni_buffer_t copy = *buffer;
+
+	return __ni_testbus_client_upload_file(file_object, &copy);
+}
+
+ni_bool_t
+ni_testbus_client_truncate_file(ni_dbus_object_t *file_object)
+{
+	DBusError error = DBUS_ERROR_INIT;
+
+	if (!ni_dbus_object_call_variant(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "truncate", 0, NULL, 0, NULL, &error)) {
+		ni_dbus_print_error(&error, "%s.truncate(): failed", file_object->path);
+		dbus_error_free(&error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Upload and consume all data in a buffer chain. Data is gathered
+ * directly from the chain into the D-Bus message, so we can send
+ * larger chunks than a single buffer holds without copying things
+ * around first.
+ */
+#define NI_TESTBUS_UPLOAD_IOV_MAX	64
+#define NI_TESTBUS_UPLOAD_CHUNK_MAX	(64 * 1024)
+
+ni_bool_t
+ni_testbus_client_upload_chain(ni_dbus_object_t *file_object, ni_buffer_chain_t **chain)
+{
+	struct iovec iov[NI_TESTBUS_UPLOAD_IOV_MAX];
+	unsigned int iovcnt;
+
+	while ((iovcnt = ni_buffer_chain_iovec(*chain, iov, NI_TESTBUS_UPLOAD_IOV_MAX, NI_TESTBUS_UPLOAD_CHUNK_MAX)) != 0) {
+		DBusError error = DBUS_ERROR_INIT;
+		ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+		unsigned int count;
+
+		ni_dbus_variant_set_byte_array_iovec(&arg, iov, iovcnt);
+		count = arg.array.len;
+
+		if (!ni_dbus_object_call_variant(file_object, NULL, "append", 1, &arg, 0, NULL, &error)) {
+			ni_dbus_print_error(&error, "%s.append() failed", file_object->path);
+			dbus_error_free(&error);
+			ni_dbus_variant_destroy(&arg);
+			return FALSE;
+		}
+
+		ni_buffer_chain_pull(chain, count);
+		ni_dbus_variant_destroy(&arg);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Asynchronous version of the above, for streaming data while it is being
+ * produced. This sends a single append() call with as much data from the
+ * head of the chain as we can fit, but does not consume anything; the
+ * caller should pull the data from the chain once the callback reports
+ * success.
+ *
+ * If a codec is given, the data is compressed and sent using
+ * appendEncoded() instead. Callers need to be prepared for this to fail
+ * with UnknownMethod when talking to an older master, and try again
+ * without a codec.
+ *
+ * Returns the number of bytes sent (before compression), or a negative
+ * error code.
+ */
+int
+ni_testbus_client_append_chain_async(ni_dbus_object_t *file_object, const ni_buffer_chain_t *chain,
+				ni_codec_t *codec, ni_dbus_async_callback_t *callback)
+{
+	struct iovec iov[NI_TESTBUS_UPLOAD_IOV_MAX];
+	ni_dbus_variant_t argv[3];
+	ni_buffer_t *encoded = NULL;
+	unsigned int iovcnt, count;
+	int rv;
+
+	iovcnt = ni_buffer_chain_iovec(chain, iov, NI_TESTBUS_UPLOAD_IOV_MAX, NI_TESTBUS_UPLOAD_CHUNK_MAX);
+	if (iovcnt == 0)
+		return 0;
+
+	ni_dbus_variant_vector_init(argv, 3);
+	ni_dbus_variant_set_byte_array_iovec(&argv[2], iov, iovcnt);
+	count = argv[2].array.len;
+
+	if (codec == NULL) {
+		rv = ni_dbus_object_call_variant_async(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "append",
+					1, &argv[2], callback);
+	} else {
+		ni_dbus_variant_set_uint32(&argv[1], count);
+		if ((encoded = ni_codec_encode(codec, argv[2].byte_array_value, count)) != NULL) {
+			ni_dbus_variant_set_string(&argv[0], codec->name);
+			ni_dbus_variant_set_byte_array(&argv[2], ni_buffer_head(encoded), ni_buffer_count(encoded));
+			ni_buffer_free(encoded);
+		} else {
+			ni_dbus_variant_set_string(&argv[0], NI_CODEC_IDENTITY);
+		}
+
+		rv = ni_dbus_object_call_variant_async(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "appendEncoded",
+					3, argv, callback);
+	}
+	if (rv >= 0)
+		rv = count;
+
+	ni_dbus_variant_vector_destroy(argv, 3);
+	return rv;
+}
+
+/*
+ * Create a standalone handle for a Tmpfile object. Unlike the objects
+ * returned by ni_testbus_client_get_object() and friends, it is not part of
+ * the client's object tree, so it does not go away when the tree is
+ * refreshed. This makes it suitable for asynchronous calls; the local_data
+ * pointer can be used to find the caller's context in the callback.
+ * The caller must free the handle using ni_dbus_object_free().
+ */
+ni_dbus_object_t *
+ni_testbus_client_file_handle(const char *object_path, void *local_data)
+{
+	ni_dbus_object_t *root_object;
+
+	if (!(root_object = ni_testbus_client_get_root()))
+		return NULL;
+
+	return ni_dbus_client_object_new(ni_dbus_object_get_client(root_object),
+				ni_testbus_file_class(), object_path,
+				NI_TESTBUS_TMPFILE_INTERFACE, local_data);
+}
+
+/*
+ * Append everything from the given offset to the end of the file to the
+ * result buffer, and advance the offset accordingly. The file may still
+ * be growing; callers that want to follow it can simply call this again.
+ */
+ni_bool_t
+ni_testbus_client_retrieve_file(ni_dbus_object_t *file_object, uint64_t *offset, ni_buffer_t *result)
+{
+	ni_dbus_variant_t argv[2];
+	ni_testbus_transfer_t xfer;
+	unsigned int count = ni_buffer_count(result);
+	ni_bool_t rv = FALSE;
+	int status;
+
+	ni_dbus_variant_vector_init(argv, 2);
+	ni_dbus_variant_set_uint64(&argv[0], *offset);
+	ni_dbus_variant_set_uint32(&argv[1], 0);
+	status = __ni_testbus_client_receive_fd(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "retrieveFd", 2, argv, result);
+	ni_dbus_variant_vector_destroy(argv, 2);
+
+	if (status != -NI_ERROR_METHOD_NOT_SUPPORTED) {
+		if (status < 0)
+			return FALSE;
+		*offset += ni_buffer_count(result) - count;
+		return TRUE;
+	}
+
+	ni_testbus_transfer_init_tmpfile(&xfer, &ni_testbus_tmpfile_retrieve_ops, file_object);
+	xfer.rbuf = result;
+	xfer.start = *offset;
+	if (ni_testbus_transfer_run(&xfer, "retrieved")) {
+		count = ni_buffer_count(result);
+		if (__ni_testbus_transfer_download_finish(&xfer)) {
+			*offset += ni_buffer_count(result) - count;
+			rv = TRUE;
+		}
+	}
+	ni_testbus_transfer_destroy(&xfer);
+
+	return rv;
+}
+
+ni_buffer_t *
+ni_testbus_client_download_file(ni_dbus_object_t *file_object)
+{
+	ni_buffer_t *result;
+	uint64_t offset = 0;
+
+	ni_debug_testbus("ni_testbus_client_download_file(%s)", file_object->path);
+	result = ni_buffer_new(0);
+	if (!ni_testbus_client_retrieve_file(file_object, &offset, result)) {
+		ni_buffer_free(result);
+		return NULL;
+	}
+
+	ni_debug_testbus("%s: retrieved %u bytes of data", file_object->path, ni_buffer_count(result));
+	return result;
+}
+
+/*
+ * Download a file of which we have an older version. Only the blocks
+ * that changed are transferred; if that does not work out, we fall back
+ * to downloading the whole file.
+ */
+#define NI_TESTBUS_DELTA_MIN_SIZE	(64 * 1024)
+
+ni_buffer_t *
+ni_testbus_client_download_file_delta(ni_dbus_object_t *file_object, const ni_buffer_t *base)
 {
-	DBusError error = DBUS_ERROR_INIT;
-	ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+	ni_dbus_variant_t args[2];
 	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
-	ni_buffer_t *result = NULL;
-	ni_dbus_object_t *filesystem;
-	uint64_t offset, size;
+	DBusError error = DBUS_ERROR_INIT;
+	ni_buffer_t *sums = NULL, *result = NULL;
+	unsigned int block_size;
 
-	filesystem = ni_dbus_object_create(agent, NI_TESTBUS_AGENT_FS_PATH, ni_testbus_filesystem_class(), NULL);
-	ni_objectmodel_bind_compatible_interfaces(filesystem);
+	if (base == NULL || ni_buffer_count(base) < NI_TESTBUS_DELTA_MIN_SIZE)
+		return ni_testbus_client_download_file(file_object);
 
-	ni_dbus_variant_set_string(&arg, path);
-	if (!ni_dbus_object_call_variant(filesystem, NULL, "getInfo", 1, &arg, 1, &res, &error)) {
-		ni_dbus_print_error(&error, "%s.getFileInfo(%s): failed", agent->path, path);
+	block_size = ni_testbus_delta_block_size(ni_buffer_count(base));
+	sums = ni_testbus_delta_checksums(ni_buffer_head(base), ni_buffer_count(base), block_size);
+	if (sums == NULL)
+		return ni_testbus_client_download_file(file_object);
+
+	ni_dbus_variant_vector_init(args, 2);
+	ni_dbus_variant_set_uint32(&args[0], block_size);
+	ni_dbus_variant_set_byte_array(&args[1], ni_buffer_head(sums), ni_buffer_count(sums));
+
+	if (!ni_dbus_object_call_variant(file_object, NI_TESTBUS_TMPFILE_INTERFACE, "retrieveDelta", 2, args, 1, &res, &error)) {
+		if (dbus_error_has_name(&error, DBUS_ERROR_NOT_SUPPORTED)
+		 || dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD))
+			ni_debug_testbus("%s: no delta transfer (%s)", file_object->path, error.message);
+		else
+			ni_dbus_print_error(&error, "%s.retrieveDelta() failed", file_object->path);
 		dbus_error_free(&error);
-		goto out;
+	} else if (!ni_dbus_variant_is_byte_array(&res)) {
+		ni_error("%s: unexpected return type in retrieveDelta()", file_object->path);
+	} else {
+		result = ni_testbus_delta_apply(ni_buffer_head(base), ni_buffer_count(base), block_size,
+				res.byte_array_value, res.array.len);
+		if (result) {
+			unsigned int sent = ni_buffer_count(sums) + res.array.len;
+			unsigned int size = ni_buffer_count(result);
+
+			ni_debug_testbus("%s: delta transfer of %u bytes took %u bytes (%u%% saved)",
+					file_object->path, size, sent,
+					size > sent? (unsigned int) ((size - sent) * 100ULL / size) : 0);
+		}
 	}
 
-	if (!ni_dbus_dict_get_uint64(&res, "size", &size)) {
-		ni_error("%s: server didn't return size attribute", path);
-		goto out;
-	}
-	ni_debug_testbus("%s: size=%Lu", path, (unsigned long long) size);
+	ni_dbus_variant_vector_destroy(args, 2);
+	ni_dbus_variant_destroy(&res);
+	ni_buffer_free(sums);
 
-	result = ni_buffer_new(size);
-	for (offset = 0; offset < size; ) {
-		ni_dbus_variant_t argv[3];
-		ni_dbus_variant_vector_init(argv, 3);
-		unsigned int count;
+	if (result == NULL)
+		result = ni_testbus_client_download_file(file_object);
+	return result;
+}
 
-		ni_dbus_variant_set_string(&argv[0], path);
-		ni_dbus_variant_set_uint64(&argv[1], offset);
-		ni_dbus_variant_set_uint32(&argv[2], 4096);
+/*
+ * Asynchronous file download, as used by the agent to fetch the input
+ * files of a command. This goes through the same steps as the synchronous
+ * functions above: a delta transfer if we have an older version, then
+ * retrieveFd() if the connection can pass file descriptors, and finally
+ * a pipelined transfer using retrieve(). Each step falls back to the
+ * next one if the server does not support it.
+ */
+typedef struct ni_testbus_download ni_testbus_download_t;
+struct ni_testbus_download {
+	ni_dbus_object_t *	handle;
+	char *			path;		/* agent file system path */
+	ni_dbus_client_t *	peer;
+	ni_testbus_transfer_t	xfer;
+	ni_bool_t		xfer_active;
+
+	ni_buffer_t *		base;
+	ni_buffer_t *		sums;
+	unsigned int		block_size;
+	ni_buffer_t *		result;
+
+	ni_testbus_download_callback_t *callback;
+	void *			user_data;
+};
 
-		ni_dbus_variant_destroy(&res);
-		if (!ni_dbus_object_call_variant(filesystem, NULL, "download", 3, argv, 1, &res, &error)) {
-			ni_dbus_variant_vector_destroy(argv, 3);
-			goto out_fail;
-		}
-		ni_dbus_variant_vector_destroy(argv, 3);
+static const char *
+__ni_testbus_download_name(const ni_testbus_download_t *dl)
+{
+	return dl->path? dl->path : dl->handle->path;
+}
 
-		if (!ni_dbus_variant_is_byte_array(&res)) {
-			ni_error("incompatible return type in Filesystem.download()");
-			goto out_fail;
-		}
+static void
+__ni_testbus_download_finish(ni_testbus_download_t *dl, ni_buffer_t *result)
+{
+	if (result)
+		ni_debug_testbus("%s: retrieved %u bytes of data", __ni_testbus_download_name(dl), ni_buffer_count(result));
+	else
+		ni_error("%s: download failed", __ni_testbus_download_name(dl));
+
+	dl->callback(result, dl->user_data);
+
+	if (dl->xfer_active)
+		ni_testbus_transfer_destroy(&dl->xfer);
+	if (dl->base)
+		ni_buffer_free(dl->base);
+	if (dl->sums)
+		ni_buffer_free(dl->sums);
+	if (dl->result)
+		ni_buffer_free(dl->result);
+	ni_dbus_object_free(dl->handle);
+	if (dl->peer)
+		ni_dbus_client_free(dl->peer);
+	ni_string_free(&dl->path);
+	free(dl);
+}
+
+static ni_bool_t
+__ni_testbus_download_unsupported(ni_testbus_download_t *dl, const char *method, ni_dbus_message_t *reply)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_bool_t rv = FALSE;
 
-		count = ni_buffer_tailroom(result);
-		if (count > res.array.len)
-			count = res.array.len;
-		ni_buffer_put(result, res.byte_array_value, count);
-		offset += count;
+	dbus_set_error_from_message(&error, reply);
+	if (dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD)
+	 || dbus_error_has_name(&error, DBUS_ERROR_NOT_SUPPORTED)) {
+		ni_debug_testbus("%s.%s() not supported (%s)", __ni_testbus_download_name(dl), method, error.message);
+		rv = TRUE;
+	} else {
+		ni_dbus_print_error(&error, "%s.%s() failed", __ni_testbus_download_name(dl), method);
 	}
+	dbus_error_free(&error);
+	return rv;
+}
+
+/*
+ * Once the transfer is done, close the agent's file handle (if we have
+ * one) before reporting the result.
+ */
+static void
+__ni_testbus_download_xfer_finish(ni_testbus_download_t *dl)
+{
+	ni_buffer_t *result = dl->result;
 
-	ni_debug_testbus("%s: downloaded %u bytes", path, ni_buffer_count(result));
+	dl->result = NULL;
+	__ni_testbus_download_finish(dl, result);
+}
 
-out:
-	ni_dbus_variant_destroy(&arg);
-	ni_dbus_variant_destroy(&res);
-	return result;
+static void
+__ni_testbus_download_close_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
+{
+	ni_testbus_download_t *dl = handle->handle;
 
-out_fail:
-	ni_buffer_free(result);
-	result = NULL;
-	goto out;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+		__ni_testbus_download_unsupported(dl, "close", reply);
+	__ni_testbus_download_xfer_finish(dl);
 }
 
-/*
- * Client function: upload a file directly to an agent's file system
- */
-ni_bool_t
-ni_testbus_client_agent_upload_file(ni_dbus_object_t *agent, const char *path, const ni_buffer_t *wbuf)
+static void
+__ni_testbus_download_xfer_done(ni_testbus_transfer_t *xfer)
 {
-	DBusError error = DBUS_ERROR_INIT;
-	ni_buffer_t data = *wbuf;
-	ni_dbus_object_t *filesystem;
-	uint64_t offset = 0;
+	ni_testbus_download_t *dl = xfer->user_data;
 
-	filesystem = ni_dbus_object_create(agent, NI_TESTBUS_AGENT_FS_PATH, ni_testbus_filesystem_class(), NULL);
-	ni_objectmodel_bind_compatible_interfaces(filesystem);
+	if (!xfer->failed && __ni_testbus_transfer_download_finish(xfer)) {
+		__ni_testbus_transfer_report(xfer, "retrieved");
+	} else {
+		ni_buffer_free(dl->result);
+		dl->result = NULL;
+	}
 
-	while (ni_buffer_count(&data)) {
-		static const unsigned int wblksz = 4096;
-		ni_dbus_variant_t argv[3];
-		unsigned int count;
+	if (xfer->session) {
+		ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+		int rv;
 
-		count = ni_buffer_count(&data);
-		if (count > wblksz)
-			count = wblksz;
+		ni_dbus_variant_set_uint32(&arg, xfer->session);
+		rv = ni_dbus_object_call_variant_async(dl->handle, NI_TESTBUS_AGENT_FS_INTERFACE, "close",
+					1, &arg, __ni_testbus_download_close_done);
+		ni_dbus_variant_destroy(&arg);
+		if (rv >= 0)
+			return;
+	}
 
-		ni_dbus_variant_vector_init(argv, 3);
-		ni_dbus_variant_set_string(&argv[0], path);
-		ni_dbus_variant_set_uint64(&argv[1], offset);
-		ni_dbus_variant_set_byte_array(&argv[2], ni_buffer_head(&data), count);
+	__ni_testbus_download_xfer_finish(dl);
+}
 
-		if (!ni_dbus_object_call_variant(filesystem, NULL, "upload", 3, argv, 0, NULL, &error)) {
-			ni_dbus_print_error(&error, "%s.upload(%s, %Lu, %u) failed", filesystem->path, path,
-							(unsigned long long) offset, count);
-			dbus_error_free(&error);
-			ni_dbus_variant_vector_destroy(argv, 3);
-			return FALSE;
+static void
+__ni_testbus_download_xfer_start(ni_testbus_download_t *dl)
+{
+	dl->xfer_active = TRUE;
+	dl->xfer.rbuf = dl->result = ni_buffer_new(0);
+	ni_testbus_transfer_start(&dl->xfer, __ni_testbus_download_xfer_done, dl);
+}
+
+static void
+__ni_testbus_download_open_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
+{
+	ni_testbus_download_t *dl = handle->handle;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	uint32_t session;
+	uint64_t size;
+
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		if (__ni_testbus_download_unsupported(dl, "open", reply)) {
+			ni_testbus_transfer_init_agent(&dl->xfer, &ni_testbus_agent_download_ops, dl->handle, dl->path);
+			__ni_testbus_download_xfer_start(dl);
+		} else {
+			__ni_testbus_download_finish(dl, NULL);
 		}
-		ni_dbus_variant_vector_destroy(argv, 3);
+		return;
+	}
 
-		ni_buffer_pull_head(&data, count);
+	if (ni_dbus_message_get_args_variants(reply, &res, 1) != 1
+	 || !__ni_testbus_agent_open_result(dl->path, &res, &session, &size)) {
+		ni_dbus_variant_destroy(&res);
+		__ni_testbus_download_finish(dl, NULL);
+		return;
 	}
+	ni_dbus_variant_destroy(&res);
 
-	ni_debug_testbus("%s: uploaded %u bytes", path, ni_buffer_count(wbuf));
-	return TRUE;
+	ni_testbus_transfer_init_agent(&dl->xfer, &ni_testbus_agent_read_ops, dl->handle, dl->path);
+	dl->xfer.session = session;
+	dl->xfer.end = size;
+	__ni_testbus_download_xfer_start(dl);
 }
 
-ni_dbus_object_t *
-ni_testbus_client_create_tempfile(const char *name, unsigned int mode, ni_dbus_object_t *parent)
+static void
+__ni_testbus_download_chunked(ni_testbus_download_t *dl)
 {
-	ni_dbus_variant_t marg = NI_DBUS_VARIANT_INIT;
-	ni_dbus_object_t *result;
+	if (dl->path) {
+		ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+		int rv;
 
-	if (parent == NULL)
-		parent = ni_testbus_client_get_object_and_metadata(NI_TESTBUS_GLOBAL_CONTEXT_PATH);
+		ni_dbus_variant_set_string(&arg, dl->path);
+		rv = ni_dbus_object_call_variant_async(dl->handle, NI_TESTBUS_AGENT_FS_INTERFACE, "open",
+					1, &arg, __ni_testbus_download_open_done);
+		ni_dbus_variant_destroy(&arg);
+		if (rv < 0)
+			__ni_testbus_download_finish(dl, NULL);
+		return;
+	}
 
-	ni_dbus_variant_set_uint32(&marg, mode);
-	result = __ni_testbus_client_container_create_child(parent, "createFile", name, &marg);
-	ni_dbus_variant_destroy(&marg);
-	return result;
+	ni_testbus_transfer_init_tmpfile(&dl->xfer, &ni_testbus_tmpfile_retrieve_ops, dl->handle);
+	__ni_testbus_download_xfer_start(dl);
 }
 
-ni_bool_t
-__ni_testbus_client_upload_file(ni_dbus_object_t *file_object, ni_buffer_t *buffer)
+static void
+__ni_testbus_download_fd_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
 {
-	while (ni_buffer_count(buffer)) {
-		DBusError error = DBUS_ERROR_INIT;
-		ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
-		unsigned int count = ni_buffer_count(buffer);
+	ni_testbus_download_t *dl = handle->handle;
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	const char *method = dl->path? "downloadFd" : "retrieveFd";
+	ni_buffer_t *result = NULL;
+	int fd;
 
-		if (count > 4096)
-			count = 4096;
-		ni_dbus_variant_set_byte_array(&arg, ni_buffer_head(buffer), count);
-		if (!ni_dbus_object_call_variant(file_object, NULL, "append", 1, &arg, 0, NULL, &error)) {
-			ni_dbus_print_error(&error, "%s.append() failed", file_object->path);
-			dbus_error_free(&error);
-			ni_dbus_variant_destroy(&arg);
-			return FALSE;
-		}
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		if (__ni_testbus_download_unsupported(dl, method, reply))
+			__ni_testbus_download_chunked(dl);
+		else
+			__ni_testbus_download_finish(dl, NULL);
+		return;
+	}
 
-		ni_buffer_pull_head(buffer, count);
-		ni_dbus_variant_destroy(&arg);
+	if (ni_dbus_message_get_args_variants(reply, &res, 1) != 1
+	 || !ni_dbus_variant_get_unix_fd(&res, &fd)) {
+		ni_error("%s: incompatible return type in %s()", __ni_testbus_download_name(dl), method);
+	} else {
+		result = ni_buffer_new(0);
+		if (!ni_file_read_fd(fd, result)) {
+			ni_error("%s: unable to read data returned by %s()", __ni_testbus_download_name(dl), method);
+			ni_buffer_free(result);
+			result = NULL;
+		}
 	}
+	ni_dbus_variant_destroy(&res);
 
-	return TRUE;
+	__ni_testbus_download_finish(dl, result);
 }
 
-ni_bool_t
-ni_testbus_client_upload_file(ni_dbus_object_t *file_object, const ni_buffer_t *buffer)
+static void
+__ni_testbus_download_full(ni_testbus_download_t *dl)
 {
-	ni_buffer_t copy = *buffer;
+	ni_dbus_variant_t argv[2];
+	int rv;
 
-	return __ni_testbus_client_upload_file(file_object, &copy);
+	if (!ni_dbus_object_can_pass_fds(dl->handle)) {
+		__ni_testbus_download_chunked(dl);
+		return;
+	}
+
+	ni_dbus_variant_vector_init(argv, 2);
+	if (dl->path) {
+		ni_dbus_variant_set_string(&argv[0], dl->path);
+		rv = ni_dbus_object_call_variant_async(dl->handle, NI_TESTBUS_AGENT_FS_INTERFACE, "downloadFd",
+					1, argv, __ni_testbus_download_fd_done);
+	} else {
+		ni_dbus_variant_set_uint64(&argv[0], 0);
+		ni_dbus_variant_set_uint32(&argv[1], 0);
+		rv = ni_dbus_object_call_variant_async(dl->handle, NI_TESTBUS_TMPFILE_INTERFACE, "retrieveFd",
+					2, argv, __ni_testbus_download_fd_done);
+	}
+	ni_dbus_variant_vector_destroy(argv, 2);
+
+	if (rv < 0)
+		__ni_testbus_download_chunked(dl);
 }
 
-ni_buffer_t *
-ni_testbus_client_download_file(ni_dbus_object_t *file_object)
+static void
+__ni_testbus_download_delta_done(ni_dbus_object_t *handle, ni_dbus_message_t *reply)
 {
-	static const unsigned int ioblksize = 4096;
-	DBusError error = DBUS_ERROR_INIT;
+	ni_testbus_download_t *dl = handle->handle;
 	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
 	ni_buffer_t *result = NULL;
-	uint64_t offset = 0;
 
-	ni_debug_testbus("ni_testbus_client_download_file(%s)", file_object->path);
-	result = ni_buffer_new(0);
-	while (TRUE) {
-		ni_dbus_variant_t argv[2];
-		ni_dbus_variant_vector_init(argv, 2);
-		unsigned int count;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		(void) __ni_testbus_download_unsupported(dl, "retrieveDelta", reply);
+	} else
+	if (ni_dbus_message_get_args_variants(reply, &res, 1) != 1
+	 || !ni_dbus_variant_is_byte_array(&res)) {
+		ni_error("%s: unexpected return type in retrieveDelta()", handle->path);
+	} else {
+		result = ni_testbus_delta_apply(ni_buffer_head(dl->base), ni_buffer_count(dl->base), dl->block_size,
+				res.byte_array_value, res.array.len);
+		if (result)
+			ni_debug_testbus("%s: delta transfer of %u bytes took %u bytes",
+					handle->path, ni_buffer_count(result),
+					ni_buffer_count(dl->sums) + res.array.len);
+	}
+	ni_dbus_variant_destroy(&res);
 
-		ni_dbus_variant_set_uint64(&argv[0], offset);
-		ni_dbus_variant_set_uint32(&argv[1], ioblksize);
+	if (result)
+		__ni_testbus_download_finish(dl, result);
+	else
+		__ni_testbus_download_full(dl);
+}
 
-		ni_dbus_variant_destroy(&res);
-		if (!ni_dbus_object_call_variant(file_object, NULL, "retrieve", 2, argv, 1, &res, &error)) {
-			ni_dbus_print_error(&error, "%s.run(%u @%u): failed", file_object->path, ioblksize, offset);
-			ni_dbus_variant_vector_destroy(argv, 3);
-			goto out_fail;
-		}
-		ni_dbus_variant_vector_destroy(argv, 2);
+static ni_bool_t
+__ni_testbus_download_delta(ni_testbus_download_t *dl)
+{
+	ni_dbus_variant_t argv[2];
+	int rv;
 
-		if (!ni_dbus_variant_is_byte_array(&res)) {
-			ni_error("incompatible return type in Filesystem.retrieve()");
-			goto out_fail;
-		}
+	if (dl->base == NULL || ni_buffer_count(dl->base) < NI_TESTBUS_DELTA_MIN_SIZE)
+		return FALSE;
 
-		count = res.array.len;
-		if (!ni_buffer_ensure_tailroom(result, count))
-			goto out_fail;
+	dl->block_size = ni_testbus_delta_block_size(ni_buffer_count(dl->base));
+	dl->sums = ni_testbus_delta_checksums(ni_buffer_head(dl->base), ni_buffer_count(dl->base), dl->block_size);
+	if (dl->sums == NULL)
+		return FALSE;
 
-		ni_buffer_put(result, res.byte_array_value, count);
-		offset += count;
-		
-		if (count < ioblksize)
-			break;
+	ni_dbus_variant_vector_init(argv, 2);
+	ni_dbus_variant_set_uint32(&argv[0], dl->block_size);
+	ni_dbus_variant_set_byte_array(&argv[1], ni_buffer_head(dl->sums), ni_buffer_count(dl->sums));
+	rv = ni_dbus_object_call_variant_async(dl->handle, NI_TESTBUS_TMPFILE_INTERFACE, "retrieveDelta",
+				2, argv, __ni_testbus_download_delta_done);
+	ni_dbus_variant_vector_destroy(argv, 2);
+
+	return rv >= 0;
+}
+
+/*
+ * Start downloading the file. If base is given, it is an older version of
+ * the file, and is consumed by this function. The callback is invoked
+ * with the contents (which it then owns), or NULL on failure. This may
+ * happen before this function returns.
+ */
+ni_bool_t
+ni_testbus_client_download_file_async(const char *object_path, ni_buffer_t *base,
+				ni_testbus_download_callback_t *callback, void *user_data)
+{
+	ni_testbus_download_t *dl;
+
+	dl = ni_calloc(1, sizeof(*dl));
+	if (!(dl->handle = ni_testbus_client_file_handle(object_path, dl))) {
+		if (base)
+			ni_buffer_free(base);
+		free(dl);
+		return FALSE;
 	}
 
-	ni_debug_testbus("%s: retrieved %u bytes of data", file_object->path, ni_buffer_count(result));
-out:
-	ni_dbus_variant_destroy(&res);
-	return result;
+	dl->base = base;
+	dl->callback = callback;
+	dl->user_data = user_data;
 
-out_fail:
-	ni_buffer_free(result);
-	result = NULL;
-	goto out;
+	ni_debug_testbus("%s: starting download", object_path);
+	if (!__ni_testbus_download_delta(dl))
+		__ni_testbus_download_full(dl);
+	return TRUE;
+}
+
+/*
+ * Same as above, but download the file from the file system of another
+ * agent. We talk to it through our connection to the master's bus, so
+ * this does not open a new connection.
+ */
+ni_bool_t
+ni_testbus_client_agent_download_file_async(const char *bus_name, const char *path,
+				ni_testbus_download_callback_t *callback, void *user_data)
+{
+	ni_dbus_object_t *root_object;
+	ni_testbus_download_t *dl;
+
+	if (!(root_object = ni_testbus_client_get_root()))
+		return FALSE;
+
+	dl = ni_calloc(1, sizeof(*dl));
+	dl->peer = ni_dbus_client_open_peer(ni_dbus_object_get_client(root_object), bus_name);
+	dl->handle = ni_dbus_client_object_new(dl->peer, ni_testbus_filesystem_class(),
+				NI_TESTBUS_AGENT_FS_PATH, NI_TESTBUS_AGENT_FS_INTERFACE, dl);
+	if (dl->handle == NULL) {
+		ni_dbus_client_free(dl->peer);
+		free(dl);
+		return FALSE;
+	}
+
+	ni_string_dup(&dl->path, path);
+	dl->callback = callback;
+	dl->user_data = user_data;
+
+	ni_debug_testbus("%s: starting download from %s", path, bus_name);
+	__ni_testbus_download_full(dl);
+	return TRUE;
 }
 
 /*
@@ -1190,6 +2713,19 @@ out_fail:
  */
 ni_dbus_object_t *
 ni_testbus_client_create_command(ni_dbus_object_t *container_object, const ni_string_array_t *cmd_args, ni_bool_t use_terminal)
+{
+	return ni_testbus_client_create_command_ext(container_object, cmd_args, use_terminal, 0, 0);
+}
+
+/*
+ * Commands with a higher priority are started first when the agent
+ * has more commands to run than free slots.
+ * If output_tail is non-zero, the agent keeps only the last output_tail
+ * bytes of the command's stdout and stderr.
+ */
+ni_dbus_object_t *
+ni_testbus_client_create_command_ext(ni_dbus_object_t *container_object, const ni_string_array_t *cmd_args, ni_bool_t use_terminal,
+			int priority, unsigned int output_tail)
 {
 	DBusError error = DBUS_ERROR_INIT;
 	ni_dbus_variant_t argv[2];
@@ -1203,6 +2739,10 @@ ni_testbus_client_create_command(ni_dbus_object_t *container_object, const ni_st
 
 	if (use_terminal)
 		ni_dbus_dict_add_bool(&argv[1], "use-terminal", TRUE);
+	if (priority)
+		ni_dbus_dict_add_int32(&argv[1], "priority", priority);
+	if (output_tail)
+		ni_dbus_dict_add_uint32(&argv[1], "output-tail", output_tail);
 
 	if (!ni_dbus_object_call_variant(container_object, NULL, "createCommand", 2, argv, 1, &res, &error)) {
 		ni_dbus_print_error(&error, "%s.run(): failed", container_object->path);
@@ -1221,20 +2761,16 @@ ni_testbus_client_command_add_file(ni_dbus_object_t *cmd_object, const char *nam
 {
 	ni_dbus_object_t *file_object;
 
-	file_object = ni_testbus_client_create_tempfile(name, mode, cmd_object);
+	if (!(mode & NI_TESTBUS_FILE_READ))
+		file_object = ni_testbus_client_create_tempfile(name, mode, cmd_object);
+	else
+		file_object = ni_testbus_client_upload_tempfile(name, mode, data, cmd_object);
+
 	if (!file_object) {
 		ni_error("%s: unable to create input file \"%s\"", cmd_object->path, name);
 		return FALSE;
 	}
 
-	if (mode & NI_TESTBUS_FILE_READ) {
-		ni_buffer_t data_copy;
-
-		data_copy = *data; /* Need to copy data to allow advancing the head pointer */
-		if (!__ni_testbus_client_upload_file(file_object, &data_copy))
-			return FALSE;
-	}
-
 	return TRUE;
 }
 
@@ -1667,3 +3203,80 @@ ni_testbus_client_host_wait_for_reboot(unsigned int nhosts, ni_testus_client_hos
 	return rv;
 }
 
+
+/*
+ * Distribute a file to all hosts of a host set
+ */
+ni_bool_t
+ni_testbus_client_distribute_file(ni_dbus_object_t *container_object, const ni_dbus_object_t *file_object,
+				const char *dest_path, uint32_t *id)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_variant_t argv[2];
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_bool_t rv = FALSE;
+
+	ni_dbus_variant_vector_init(argv, 2);
+	ni_dbus_variant_set_string(&argv[0], file_object->path);
+	ni_dbus_variant_set_string(&argv[1], dest_path);
+
+	if (!ni_dbus_object_call_variant(container_object, NI_TESTBUS_HOSTSET_INTERFACE, "distributeFile",
+				2, argv, 1, &res, &error)) {
+		ni_dbus_print_error(&error, "%s.distributeFile(): failed", container_object->path);
+		dbus_error_free(&error);
+	} else
+	if (!ni_dbus_variant_get_uint32(&res, id)) {
+		ni_error("failed to decode distributeFile() response");
+	} else {
+		rv = TRUE;
+	}
+
+	ni_dbus_variant_vector_destroy(argv, 2);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+ni_bool_t
+ni_testbus_client_get_distribution_status(ni_dbus_object_t *container_object, uint32_t id, ni_dbus_variant_t *result)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_variant_t arg = NI_DBUS_VARIANT_INIT;
+	ni_bool_t rv;
+
+	ni_dbus_variant_set_uint32(&arg, id);
+	rv = ni_dbus_object_call_variant(container_object, NI_TESTBUS_HOSTSET_INTERFACE, "getDistributionStatus",
+				1, &arg, 1, result, &error);
+	if (!rv) {
+		ni_dbus_print_error(&error, "%s.getDistributionStatus(): failed", container_object->path);
+		dbus_error_free(&error);
+	}
+
+	ni_dbus_variant_destroy(&arg);
+	return rv;
+}
+
+/*
+ * Callback from agent to master: we have (or have not) copied a
+ * distributed file
+ */
+ni_bool_t
+ni_testbus_agent_file_distributed(ni_dbus_object_t *host_object, uint32_t id, ni_bool_t success)
+{
+	DBusError error = DBUS_ERROR_INIT;
+	ni_dbus_variant_t argv[2];
+	ni_bool_t rv;
+
+	ni_dbus_variant_vector_init(argv, 2);
+	ni_dbus_variant_set_uint32(&argv[0], id);
+	ni_dbus_variant_set_bool(&argv[1], success);
+
+	rv = ni_dbus_object_call_variant(host_object, NI_TESTBUS_HOST_INTERFACE, "fileDistributed",
+				2, argv, 0, NULL, &error);
+	if (!rv) {
+		ni_dbus_print_error(&error, "%s.fileDistributed(): failed", host_object->path);
+		dbus_error_free(&error);
+	}
+
+	ni_dbus_variant_vector_destroy(argv, 2);
+	return rv;
+}
@@ -41,6 +41,7 @@ DEFINE_CLASS_FUNCTION(fileset,		NI_TESTBUS_FILESET_CLASS);
 DEFINE_CLASS_FUNCTION(file,		NI_TESTBUS_FILE_CLASS);
 DEFINE_CLASS_FUNCTION(testset,		NI_TESTBUS_TESTSET_CLASS);
 DEFINE_CLASS_FUNCTION(testcase,		NI_TESTBUS_TESTCASE_CLASS);
+DEFINE_CLASS_FUNCTION(stats,		NI_TESTBUS_STATS_CLASS);
 DEFINE_SERVICE_FUNCTION(host,		NI_TESTBUS_HOST_INTERFACE);
 DEFINE_SERVICE_FUNCTION(eventlog,	NI_TESTBUS_EVENTLOG_INTERFACE);
 DEFINE_SERVICE_FUNCTION(process,	NI_TESTBUS_PROCESS_INTERFACE);
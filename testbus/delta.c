@@ -0,0 +1,345 @@
+/*
+ * Block level delta transfer, along the lines of rsync.
+ *
+ * When an input file changes on the master, the agent usually still has
+ * the previous version. Rather than downloading the whole file again, the
+ * agent sends a checksum for each block of its copy, and the master looks
+ * for these blocks in the new contents, at any byte offset. It then
+ * returns a delta, which tells the agent which blocks to copy from the
+ * old version, and contains the data of everything else.
+ *
+ * The delta is a sequence of instructions, with all integers in network
+ * byte order:
+ *
+ *   'C' <first block:u32> <number of blocks:u32>
+ *	Copy blocks from the old version.
+ *   'D' <length:u32> <data>
+ *	Literal data.
+ */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dborb/logging.h>
+#include <dborb/buffer.h>
+#include <dborb/util.h>
+
+#include <testbus/delta.h>
+
+/*
+ * Pick a block size for a file. Smaller blocks find more matches, but
+ * we do not want to send more than a few thousand checksums.
+ */
+unsigned int
+ni_testbus_delta_block_size(size_t len)
+{
+	unsigned int block_size = NI_TESTBUS_DELTA_BLOCK_MIN;
+
+	while (block_size < NI_TESTBUS_DELTA_BLOCK_MAX && len / block_size > NI_TESTBUS_DELTA_BLOCKS_MAX)
+		block_size <<= 1;
+	return block_size;
+}
+
+/*
+ * The rolling checksum from rsync. The low 16 bits are the sum of all
+ * bytes in the window, the high 16 bits are the sum of those partial sums.
+ * It can be updated in constant time when the window moves by one byte.
+ */
+static inline uint32_t
+__ni_testbus_delta_weak(const unsigned char *data, unsigned int len)
+{
+	uint32_t a = 0, b = 0;
+	unsigned int i;
+
+	for (i = 0; i < len; ++i) {
+		a += data[i];
+		b += (len - i) * data[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+static inline uint32_t
+__ni_testbus_delta_roll(uint32_t weak, unsigned int len, unsigned char out, unsigned char in)
+{
+	uint32_t a = weak & 0xffff, b = weak >> 16;
+
+	a = (a - out + in) & 0xffff;
+	b = (b - len * out + a) & 0xffff;
+	return a | (b << 16);
+}
+
+static void
+__ni_testbus_delta_put_u32(ni_buffer_t *bp, uint32_t value)
+{
+	value = htonl(value);
+	ni_buffer_put(bp, &value, 4);
+}
+
+static ni_bool_t
+__ni_testbus_delta_get_u32(ni_buffer_t *bp, uint32_t *value)
+{
+	if (ni_buffer_get(bp, value, 4) < 0)
+		return FALSE;
+	*value = ntohl(*value);
+	return TRUE;
+}
+
+/*
+ * Receiver side: compute the checksums of all full blocks of our copy.
+ * A trailing partial block is simply sent again.
+ * Returns NULL if the file has more blocks than the sender accepts; it
+ * should be downloaded in full instead.
+ */
+ni_buffer_t *
+ni_testbus_delta_checksums(const void *data, size_t len, unsigned int block_size)
+{
+	unsigned int i, nblocks;
+	ni_buffer_t *sums;
+
+	if (len / block_size > NI_TESTBUS_DELTA_BLOCKS_MAX)
+		return NULL;
+	nblocks = len / block_size;
+
+	sums = ni_buffer_new(nblocks * NI_TESTBUS_DELTA_SUM_LEN);
+	for (i = 0; i < nblocks; ++i) {
+		const unsigned char *block = data + i * block_size;
+		unsigned char md5[NI_TESTBUS_MD5_LEN];
+
+		if (!ni_md5_digest(block, block_size, md5, sizeof(md5))) {
+			ni_buffer_free(sums);
+			return NULL;
+		}
+		__ni_testbus_delta_put_u32(sums, __ni_testbus_delta_weak(block, block_size));
+		ni_buffer_put(sums, md5, sizeof(md5));
+	}
+
+	return sums;
+}
+
+/*
+ * Sender side
+ */
+typedef struct ni_testbus_delta_state {
+	const unsigned char *	data;
+	ni_buffer_t *		delta;
+
+	size_t			literal_start;
+	size_t			literal_total;
+	size_t			literal_max;
+
+	unsigned int		copy_start;
+	unsigned int		copy_count;
+} ni_testbus_delta_state_t;
+
+static void
+__ni_testbus_delta_flush_copy(ni_testbus_delta_state_t *st)
+{
+	if (st->copy_count == 0)
+		return;
+
+	ni_buffer_ensure_tailroom(st->delta, 9);
+	ni_buffer_putc(st->delta, 'C');
+	__ni_testbus_delta_put_u32(st->delta, st->copy_start);
+	__ni_testbus_delta_put_u32(st->delta, st->copy_count);
+	st->copy_count = 0;
+}
+
+static ni_bool_t
+__ni_testbus_delta_flush_literal(ni_testbus_delta_state_t *st, size_t end)
+{
+	size_t len = end - st->literal_start;
+
+	if (len == 0)
+		return TRUE;
+
+	st->literal_total += len;
+	if (st->literal_total > st->literal_max)
+		return FALSE;
+
+	__ni_testbus_delta_flush_copy(st);
+	ni_buffer_ensure_tailroom(st->delta, 5 + len);
+	ni_buffer_putc(st->delta, 'D');
+	__ni_testbus_delta_put_u32(st->delta, len);
+	ni_buffer_put(st->delta, st->data + st->literal_start, len);
+	st->literal_start = end;
+	return TRUE;
+}
+
+static void
+__ni_testbus_delta_add_copy(ni_testbus_delta_state_t *st, unsigned int block)
+{
+	if (st->copy_count && st->copy_start + st->copy_count == block) {
+		st->copy_count++;
+		return;
+	}
+
+	__ni_testbus_delta_flush_copy(st);
+	st->copy_start = block;
+	st->copy_count = 1;
+}
+
+/*
+ * Find a block with the given checksums. The hash table is indexed by
+ * the rolling checksum, and holds block numbers plus one; collisions are
+ * resolved by linear probing.
+ */
+static int
+__ni_testbus_delta_lookup(const uint32_t *table, unsigned int mask,
+			const unsigned char *sums, uint32_t weak,
+			const unsigned char *window, unsigned int block_size)
+{
+	unsigned char md5[NI_TESTBUS_MD5_LEN];
+	ni_bool_t have_md5 = FALSE;
+	unsigned int slot;
+
+	for (slot = (weak ^ (weak >> 16)) & mask; table[slot]; slot = (slot + 1) & mask) {
+		unsigned int block = table[slot] - 1;
+		const unsigned char *sum = sums + block * NI_TESTBUS_DELTA_SUM_LEN;
+		uint32_t block_weak;
+
+		memcpy(&block_weak, sum, 4);
+		if (ntohl(block_weak) != weak)
+			continue;
+
+		if (!have_md5) {
+			if (!ni_md5_digest(window, block_size, md5, sizeof(md5)))
+				return -1;
+			have_md5 = TRUE;
+		}
+		if (!memcmp(sum + 4, md5, sizeof(md5)))
+			return block;
+	}
+
+	return -1;
+}
+
+/*
+ * Compute the delta that turns the receiver's copy into the given data.
+ * Returns NULL if this would take more than literal_max bytes of literal
+ * data; in that case, sending the whole file is the better option.
+ */
+ni_buffer_t *
+ni_testbus_delta_compute(const void *data, size_t len, unsigned int block_size,
+			const unsigned char *sums, size_t sums_len, size_t literal_max)
+{
+	ni_testbus_delta_state_t st;
+	unsigned int i, nblocks, table_size;
+	uint32_t *table, weak = 0;
+	size_t pos = 0;
+
+	nblocks = sums_len / NI_TESTBUS_DELTA_SUM_LEN;
+
+	for (table_size = 16; table_size < 2 * nblocks; table_size <<= 1)
+		;
+	table = ni_calloc(table_size, sizeof(table[0]));
+	for (i = 0; i < nblocks; ++i) {
+		uint32_t block_weak;
+		unsigned int slot;
+
+		memcpy(&block_weak, sums + i * NI_TESTBUS_DELTA_SUM_LEN, 4);
+		block_weak = ntohl(block_weak);
+
+		slot = (block_weak ^ (block_weak >> 16)) & (table_size - 1);
+		while (table[slot])
+			slot = (slot + 1) & (table_size - 1);
+		table[slot] = i + 1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.data = data;
+	st.delta = ni_buffer_new(0);
+	st.literal_max = literal_max;
+
+	if (nblocks && len >= block_size)
+		weak = __ni_testbus_delta_weak(st.data, block_size);
+
+	while (nblocks && pos + block_size <= len) {
+		int block;
+
+		block = __ni_testbus_delta_lookup(table, table_size - 1, sums, weak, st.data + pos, block_size);
+		if (block >= 0) {
+			if (!__ni_testbus_delta_flush_literal(&st, pos))
+				goto failed;
+			__ni_testbus_delta_add_copy(&st, block);
+
+			pos += block_size;
+			st.literal_start = pos;
+			if (pos + block_size <= len)
+				weak = __ni_testbus_delta_weak(st.data + pos, block_size);
+			continue;
+		}
+
+		if (pos + block_size < len)
+			weak = __ni_testbus_delta_roll(weak, block_size, st.data[pos], st.data[pos + block_size]);
+		pos++;
+
+		/* Give up early if this is not going anywhere */
+		if (st.literal_total + (pos - st.literal_start) > literal_max)
+			goto failed;
+	}
+
+	if (!__ni_testbus_delta_flush_literal(&st, len))
+		goto failed;
+	__ni_testbus_delta_flush_copy(&st);
+
+	free(table);
+	return st.delta;
+
+failed:
+	free(table);
+	ni_buffer_free(st.delta);
+	return NULL;
+}
+
+/*
+ * Receiver side: rebuild the file from our old copy and the delta.
+ */
+ni_buffer_t *
+ni_testbus_delta_apply(const void *old, size_t old_len, unsigned int block_size,
+			const unsigned char *delta, size_t delta_len)
+{
+	ni_buffer_t in, *result;
+
+	ni_buffer_init_reader(&in, (void *) delta, delta_len);
+	result = ni_buffer_new(old_len);
+
+	while (ni_buffer_count(&in)) {
+		uint32_t first, count;
+		int op;
+
+		switch ((op = ni_buffer_getc(&in))) {
+		case 'C':
+			if (!__ni_testbus_delta_get_u32(&in, &first)
+			 || !__ni_testbus_delta_get_u32(&in, &count)
+			 || first > old_len / block_size
+			 || count > old_len / block_size - first)
+				goto failed;
+
+			count *= block_size;
+			if (!ni_buffer_ensure_tailroom(result, count))
+				goto failed;
+			ni_buffer_put(result, old + first * block_size, count);
+			break;
+
+		case 'D':
+			if (!__ni_testbus_delta_get_u32(&in, &count)
+			 || count > ni_buffer_count(&in)
+			 || !ni_buffer_ensure_tailroom(result, count))
+				goto failed;
+
+			ni_buffer_put(result, ni_buffer_head(&in), count);
+			ni_buffer_pull_head(&in, count);
+			break;
+
+		default:
+			goto failed;
+		}
+	}
+
+	return result;
+
+failed:
+	ni_error("delta transfer: malformed delta");
+	ni_buffer_free(result);
+	return NULL;
+}
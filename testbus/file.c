@@ -1,13 +1,20 @@
 
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dborb/netinfo.h>
 #include <dborb/logging.h>
 #include <dborb/util.h>
 #include <dborb/buffer.h>
+#include <dborb/socket.h>
 
 #include <testbus/file.h>
 
 static void		ni_testbus_file_free(ni_testbus_file_t *file);
+static void		ni_testbus_blob_put(ni_testbus_blob_t *);
 
 ni_testbus_file_t *
 ni_testbus_file_new(const char *name, ni_testbus_file_array_t *file_array, unsigned int mode)
@@ -65,12 +72,609 @@ ni_testbus_file_drop_cache(ni_testbus_file_t *file)
 		ni_buffer_free(file->data);
 	file->data = NULL;
 
+	if (file->blob)
+		ni_testbus_blob_put(file->blob);
+	file->blob = NULL;
+
 	if (file->instance_path) {
 		unlink(file->instance_path);
 		ni_string_free(&file->instance_path);
 	}
 }
 
+/*
+ * File storage.
+ *
+ * Small files are kept in memory, as a list of fixed size segments, so
+ * that appending to a file never copies the data that is already there.
+ * Once a file grows beyond the spool threshold, its contents are moved to
+ * an unlinked file in the spool directory, and reads are served from an
+ * mmap of that file. This keeps large test logs from eating up all memory
+ * on the master. If an idle timeout is configured, files that have not
+ * changed for that long are spooled, too, unless they fit into a single
+ * segment.
+ *
+ * The contents live in a blob, which may be shared by several files
+ * when a client creates a file by hash (see ni_testbus_file_share).
+ * This way, a test script that is handed to 200 commands is stored
+ * only once.
+ */
+#define NI_TESTBUS_SPOOL_MAP_CHUNK	(16 * 1024 * 1024)
+
+/*
+ * Idle files smaller than this stay in memory. Spooling them would save
+ * at most one segment, and cost us a file descriptor each.
+ */
+#define NI_TESTBUS_SPOOL_IDLE_MIN	NI_TESTBUS_BLOB_SEGMENT_SIZE
+
+/*
+ * When spooling fails, files keep growing in memory. Whatever made it
+ * fail (no more file descriptors, a full or missing spool directory)
+ * usually affects all files, so we do not try again for a while.
+ */
+#define NI_TESTBUS_SPOOL_RETRY_DELAY	60
+
+static ni_testbus_blob_t *	ni_testbus_blobs;
+static const ni_timer_t *	ni_testbus_blob_idle_timer;
+static unsigned long		ni_testbus_spool_retry;
+
+static void			__ni_testbus_blob_arm_idle_timer(void);
+
+static unsigned long
+__ni_testbus_blob_now(void)
+{
+	struct timeval now;
+
+	ni_timer_get_time(&now);
+	return now.tv_sec;
+}
+
+static ni_testbus_blob_t *
+ni_testbus_blob_new(void)
+{
+	ni_testbus_blob_t *blob;
+
+	blob = ni_malloc(sizeof(*blob));
+	blob->refcount = 1;
+	blob->spool_fd = -1;
+
+	if ((blob->next = ni_testbus_blobs) != NULL)
+		blob->next->prev = &blob->next;
+	blob->prev = &ni_testbus_blobs;
+	ni_testbus_blobs = blob;
+	return blob;
+}
+
+static ni_testbus_blob_t *
+ni_testbus_blob_get(ni_testbus_blob_t *blob)
+{
+	ni_assert(blob->refcount);
+	blob->refcount++;
+	return blob;
+}
+
+static void
+__ni_testbus_blob_drop_flat(ni_testbus_blob_t *blob)
+{
+	if (blob->flat)
+		ni_buffer_free(blob->flat);
+	blob->flat = NULL;
+}
+
+static void
+__ni_testbus_blob_drop_segments(ni_testbus_blob_t *blob)
+{
+	unsigned int i;
+
+	for (i = 0; i < blob->nsegments; ++i)
+		ni_buffer_free(blob->segments[i]);
+	free(blob->segments);
+	blob->segments = NULL;
+	blob->nsegments = 0;
+
+	__ni_testbus_blob_drop_flat(blob);
+}
+
+static void
+ni_testbus_blob_put(ni_testbus_blob_t *blob)
+{
+	ni_assert(blob->refcount);
+	if (--(blob->refcount) != 0)
+		return;
+
+	if ((*blob->prev = blob->next) != NULL)
+		blob->next->prev = blob->prev;
+
+	__ni_testbus_blob_drop_segments(blob);
+	if (blob->spool_map)
+		munmap(blob->spool_map, blob->spool_map_len);
+	if (blob->spool_fd >= 0)
+		close(blob->spool_fd);
+	free(blob);
+}
+
+int
+ni_testbus_spool_open(const char *tag)
+{
+	const char *dir = ni_config_spooldir();
+	char pathbuf[PATH_MAX];
+	int fd;
+
+#ifdef O_TMPFILE
+	if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+		return fd;
+#endif
+
+	snprintf(pathbuf, sizeof(pathbuf), "%s/testbus-%s.XXXXXX", dir, tag? tag : "spool");
+	if ((fd = mkostemp(pathbuf, O_CLOEXEC)) < 0) {
+		ni_error("unable to create spool file in %s: %m", dir);
+		return -1;
+	}
+	unlink(pathbuf);
+	return fd;
+}
+
+unsigned int
+ni_testbus_spool_threshold(void)
+{
+	unsigned int threshold;
+
+	if ((threshold = ni_config_spool_threshold()) == 0)
+		threshold = NI_TESTBUS_SPOOL_THRESHOLD;
+	return threshold;
+}
+
+unsigned int
+ni_testbus_file_size_max(const ni_testbus_file_t *file)
+{
+	unsigned int size_max;
+
+	size_max = file? file->size_max : 0;
+	if (size_max == 0 && (size_max = ni_config_file_size_max()) == 0)
+		size_max = NI_TESTBUS_TMPFILE_SIZE_MAX;
+	return size_max;
+}
+
+static ni_bool_t
+__ni_testbus_blob_spool_write(ni_testbus_blob_t *blob, const char *name, const void *data, size_t count, off_t offset)
+{
+	while (count) {
+		ssize_t written;
+
+		written = pwrite(blob->spool_fd, data, count, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			ni_error("file %s: unable to write to spool file: %m", name);
+			return FALSE;
+		}
+		data += written;
+		count -= written;
+		offset += written;
+	}
+	return TRUE;
+}
+
+static ni_bool_t
+__ni_testbus_blob_spool(ni_testbus_blob_t *blob, const char *name)
+{
+	off_t offset = 0;
+	unsigned int i;
+
+	if ((blob->spool_fd = ni_testbus_spool_open(name)) < 0)
+		return FALSE;
+
+	ni_debug_testbus("file %s: spooling to disk", name);
+	for (i = 0; i < blob->nsegments; ++i) {
+		ni_buffer_t *seg = blob->segments[i];
+
+		if (!__ni_testbus_blob_spool_write(blob, name, ni_buffer_head(seg), ni_buffer_count(seg), offset)) {
+			close(blob->spool_fd);
+			blob->spool_fd = -1;
+			return FALSE;
+		}
+		offset += ni_buffer_count(seg);
+	}
+
+	__ni_testbus_blob_drop_segments(blob);
+	return TRUE;
+}
+
+/*
+ * Append to the in-memory segments. Only the last segment is ever
+ * reallocated, and only while it is smaller than a full segment, so that
+ * small files do not take up a whole segment.
+ */
+static ni_bool_t
+__ni_testbus_blob_put_segments(ni_testbus_blob_t *blob, const void *data, size_t count)
+{
+	while (count) {
+		ni_buffer_t *seg = NULL;
+		size_t n;
+
+		if (blob->nsegments)
+			seg = blob->segments[blob->nsegments - 1];
+		if (seg == NULL || ni_buffer_count(seg) >= NI_TESTBUS_BLOB_SEGMENT_SIZE) {
+			if ((blob->nsegments % 16) == 0)
+				blob->segments = ni_realloc(blob->segments, (blob->nsegments + 16) * sizeof(seg));
+			n = count < NI_TESTBUS_BLOB_SEGMENT_SIZE? count : NI_TESTBUS_BLOB_SEGMENT_SIZE;
+			seg = ni_buffer_new(n);
+			blob->segments[blob->nsegments++] = seg;
+		}
+
+		n = NI_TESTBUS_BLOB_SEGMENT_SIZE - ni_buffer_count(seg);
+		if (n > count)
+			n = count;
+		if (!ni_buffer_ensure_tailroom(seg, n))
+			return FALSE;
+		ni_buffer_put(seg, data, n);
+
+		data += n;
+		count -= n;
+	}
+	return TRUE;
+}
+
+static ni_bool_t
+__ni_testbus_blob_append(ni_testbus_blob_t *blob, const char *name, const void *data, size_t count)
+{
+	if (blob->spool_fd < 0 && blob->size + count > ni_testbus_spool_threshold()
+	 && __ni_testbus_blob_now() >= ni_testbus_spool_retry) {
+		if (!__ni_testbus_blob_spool(blob, name)) {
+			ni_warn("file %s: unable to spool, keeping it in memory", name);
+			ni_testbus_spool_retry = __ni_testbus_blob_now() + NI_TESTBUS_SPOOL_RETRY_DELAY;
+		}
+	}
+
+	if (blob->spool_fd >= 0) {
+		if (!__ni_testbus_blob_spool_write(blob, name, data, count, blob->size))
+			return FALSE;
+	} else {
+		__ni_testbus_blob_drop_flat(blob);
+		if (!__ni_testbus_blob_put_segments(blob, data, count))
+			return FALSE;
+		__ni_testbus_blob_arm_idle_timer();
+	}
+
+	blob->size += count;
+	blob->mtime = __ni_testbus_blob_now();
+	blob->md5_valid = FALSE;
+	return TRUE;
+}
+
+static const void *
+__ni_testbus_blob_map(ni_testbus_blob_t *blob, const char *name)
+{
+	/* Mapping beyond the end of the file is fine as long as we don't
+	 * touch those pages, so map generously to avoid remapping the file
+	 * after every append. */
+	if (blob->spool_map_len < blob->size) {
+		size_t len;
+
+		len = (blob->size + NI_TESTBUS_SPOOL_MAP_CHUNK - 1) & ~(NI_TESTBUS_SPOOL_MAP_CHUNK - 1);
+		if (blob->spool_map)
+			munmap(blob->spool_map, blob->spool_map_len);
+		blob->spool_map_len = 0;
+
+		blob->spool_map = mmap(NULL, len, PROT_READ, MAP_SHARED, blob->spool_fd, 0);
+		if (blob->spool_map == MAP_FAILED) {
+			ni_error("file %s: unable to map spool file: %m", name);
+			blob->spool_map = NULL;
+			return NULL;
+		}
+		blob->spool_map_len = len;
+	}
+
+	return blob->spool_map;
+}
+
+/*
+ * Describe up to max iovecs worth of the blob's contents, starting at the
+ * given offset. Returns the number of iovecs, and trims *count to the
+ * number of bytes they cover.
+ */
+static unsigned int
+__ni_testbus_blob_get_iovec(ni_testbus_blob_t *blob, const char *name, uint64_t offset, unsigned int *count,
+				struct iovec *iov, unsigned int max)
+{
+	unsigned int i, n = 0, total = 0, want;
+	size_t pos;
+
+	if (offset >= blob->size || max == 0) {
+		*count = 0;
+		return 0;
+	}
+	if (blob->size - offset < *count)
+		*count = blob->size - offset;
+	want = *count;
+
+	if (blob->spool_fd >= 0) {
+		const unsigned char *map;
+
+		if ((map = __ni_testbus_blob_map(blob, name)) == NULL) {
+			*count = 0;
+			return 0;
+		}
+		iov[0].iov_base = (void *) (map + offset);
+		iov[0].iov_len = want;
+		return 1;
+	}
+
+	i = offset / NI_TESTBUS_BLOB_SEGMENT_SIZE;
+	pos = offset % NI_TESTBUS_BLOB_SEGMENT_SIZE;
+	while (total < want && n < max && i < blob->nsegments) {
+		ni_buffer_t *seg = blob->segments[i++];
+		size_t len;
+
+		len = ni_buffer_count(seg) - pos;
+		if (len > want - total)
+			len = want - total;
+
+		iov[n].iov_base = (unsigned char *) ni_buffer_head(seg) + pos;
+		iov[n].iov_len = len;
+		total += len;
+		n++;
+		pos = 0;
+	}
+
+	*count = total;
+	return n;
+}
+
+/*
+ * Return a contiguous view of the blob's contents. For in-memory blobs
+ * whose contents span several segments, this makes a copy, which is kept
+ * until the blob changes.
+ */
+static const void *
+__ni_testbus_blob_get_data(ni_testbus_blob_t *blob, const char *name, uint64_t offset, unsigned int *count)
+{
+	struct iovec iov;
+	unsigned int i;
+
+	if (offset >= blob->size) {
+		*count = 0;
+		return NULL;
+	}
+	if (blob->size - offset < *count)
+		*count = blob->size - offset;
+
+	if (blob->spool_fd < 0 && blob->flat == NULL && *count > 1
+	 && offset / NI_TESTBUS_BLOB_SEGMENT_SIZE != (offset + *count - 1) / NI_TESTBUS_BLOB_SEGMENT_SIZE) {
+		blob->flat = ni_buffer_new(blob->size);
+		for (i = 0; i < blob->nsegments; ++i)
+			ni_buffer_put(blob->flat, ni_buffer_head(blob->segments[i]), ni_buffer_count(blob->segments[i]));
+	}
+
+	if (blob->flat)
+		return ni_buffer_head(blob->flat) + offset;
+
+	if (__ni_testbus_blob_get_iovec(blob, name, offset, count, &iov, 1) == 0)
+		return NULL;
+	return iov.iov_base;
+}
+
+static ni_bool_t
+__ni_testbus_blob_md5(ni_testbus_blob_t *blob)
+{
+	struct iovec iov[16];
+	uint64_t offset = 0;
+	ni_hashctx_t *ctx;
+
+	if (blob->md5_valid)
+		return TRUE;
+
+	if ((ctx = ni_hashctx_new()) == NULL)
+		return FALSE;
+
+	ni_hashctx_begin(ctx);
+	while (offset < blob->size) {
+		unsigned int i, n, count = blob->size - offset;
+
+		if ((n = __ni_testbus_blob_get_iovec(blob, "blob", offset, &count, iov, 16)) == 0)
+			break;
+		for (i = 0; i < n; ++i)
+			ni_hashctx_put(ctx, iov[i].iov_base, iov[i].iov_len);
+		offset += count;
+	}
+	ni_hashctx_finish(ctx);
+
+	if (offset == blob->size)
+		blob->md5_valid = ni_hashctx_get_digest(ctx, blob->md5, sizeof(blob->md5)) == (int) sizeof(blob->md5);
+	ni_hashctx_free(ctx);
+	return blob->md5_valid;
+}
+
+/*
+ * Give the file a private copy of its blob before modifying it
+ */
+static ni_bool_t
+__ni_testbus_file_unshare(ni_testbus_file_t *file)
+{
+	ni_testbus_blob_t *shared = file->blob, *copy;
+	struct iovec iov[16];
+	uint64_t offset = 0;
+
+	ni_debug_testbus("file %s: copying shared contents", file->name);
+
+	copy = ni_testbus_blob_new();
+	while (offset < shared->size) {
+		unsigned int i, n, count = shared->size - offset;
+
+		if ((n = __ni_testbus_blob_get_iovec(shared, file->name, offset, &count, iov, 16)) == 0)
+			goto failed;
+		for (i = 0; i < n; ++i) {
+			if (!__ni_testbus_blob_append(copy, file->name, iov[i].iov_base, iov[i].iov_len))
+				goto failed;
+		}
+		offset += count;
+	}
+
+	file->blob = copy;
+	ni_testbus_blob_put(shared);
+	return TRUE;
+
+failed:
+	ni_testbus_blob_put(copy);
+	return FALSE;
+}
+
+/*
+ * Spool blobs that have not changed in a while. They will most likely
+ * be read once more at most, when the client downloads them.
+ */
+static void
+__ni_testbus_blob_idle_timeout(void *user_data, const ni_timer_t *timer)
+{
+	unsigned long now = __ni_testbus_blob_now();
+	unsigned int idle_timeout = ni_config_spool_idle_timeout();
+	ni_testbus_blob_t *blob;
+
+	ni_testbus_blob_idle_timer = NULL;
+	for (blob = ni_testbus_blobs; blob; blob = blob->next) {
+		if (blob->spool_fd >= 0 || blob->size < NI_TESTBUS_SPOOL_IDLE_MIN)
+			continue;
+		if (now - blob->mtime < idle_timeout)
+			continue;
+
+		/* Keep going; the other blobs may still fit. We retry this
+		 * one the next time the timer fires. */
+		if (!__ni_testbus_blob_spool(blob, "idle"))
+			ni_warn("unable to spool idle file of %u bytes, keeping it in memory", blob->size);
+	}
+
+	for (blob = ni_testbus_blobs; blob; blob = blob->next) {
+		if (blob->spool_fd < 0 && blob->size >= NI_TESTBUS_SPOOL_IDLE_MIN) {
+			__ni_testbus_blob_arm_idle_timer();
+			break;
+		}
+	}
+}
+
+static void
+__ni_testbus_blob_arm_idle_timer(void)
+{
+	unsigned int idle_timeout;
+
+	if (ni_testbus_blob_idle_timer != NULL)
+		return;
+	if ((idle_timeout = ni_config_spool_idle_timeout()) == 0)
+		return;
+
+	ni_testbus_blob_idle_timer = ni_timer_register(idle_timeout * 1000, __ni_testbus_blob_idle_timeout, NULL);
+}
+
+/*
+ * Append data to a file. The caller is expected to enforce the size limit.
+ */
+ni_bool_t
+ni_testbus_file_append(ni_testbus_file_t *file, const void *data, size_t count)
+{
+	if (file->blob == NULL)
+		file->blob = ni_testbus_blob_new();
+	else if (file->blob->refcount > 1 && !__ni_testbus_file_unshare(file))
+		return FALSE;
+
+	if (!__ni_testbus_blob_append(file->blob, file->name, data, count))
+		return FALSE;
+
+	file->size = file->blob->size;
+	file->iseq++;
+	return TRUE;
+}
+
+/*
+ * Discard the contents of a file. Other files sharing the same blob
+ * are not affected.
+ */
+void
+ni_testbus_file_truncate(ni_testbus_file_t *file)
+{
+	if (file->blob) {
+		ni_testbus_blob_put(file->blob);
+		file->blob = NULL;
+	}
+	file->size = 0;
+	file->iseq++;
+}
+
+/*
+ * Return a pointer to the file contents at the given offset, and trim
+ * *count to the number of bytes available there. The pointer is valid
+ * until the file is modified.
+ * This needs the contents in one piece, which may involve a copy; prefer
+ * ni_testbus_file_get_iovec() where possible.
+ */
+const void *
+ni_testbus_file_get_data(ni_testbus_file_t *file, uint64_t offset, unsigned int *count)
+{
+	if (file->blob == NULL) {
+		*count = 0;
+		return NULL;
+	}
+	return __ni_testbus_blob_get_data(file->blob, file->name, offset, count);
+}
+
+/*
+ * Same as above, but describe the file contents with up to max iovecs
+ * rather than a single pointer. If max is too small to cover all of it,
+ * *count is trimmed accordingly.
+ */
+unsigned int
+ni_testbus_file_get_iovec(ni_testbus_file_t *file, uint64_t offset, unsigned int *count,
+				struct iovec *iov, unsigned int max)
+{
+	if (file->blob == NULL) {
+		*count = 0;
+		return 0;
+	}
+	return __ni_testbus_blob_get_iovec(file->blob, file->name, offset, count, iov, max);
+}
+
+/*
+ * Find the contents of a file in this array with the given digest and size.
+ * Comparing sizes is cheap, so we only hash those blobs whose size
+ * matches, and cache the digest until the blob is modified again.
+ */
+ni_testbus_blob_t *
+ni_testbus_file_array_find_blob(const ni_testbus_file_array_t *array, const unsigned char *md5, uint32_t size)
+{
+	unsigned int i;
+
+	if (size == 0)
+		return NULL;
+
+	for (i = 0; i < array->count; ++i) {
+		ni_testbus_blob_t *blob = array->data[i]->blob;
+
+		if (blob == NULL || blob->size != size)
+			continue;
+		if (!__ni_testbus_blob_md5(blob))
+			continue;
+		if (!memcmp(blob->md5, md5, sizeof(blob->md5)))
+			return blob;
+	}
+
+	return NULL;
+}
+
+/*
+ * Make the file share the given contents
+ */
+void
+ni_testbus_file_share(ni_testbus_file_t *file, ni_testbus_blob_t *blob)
+{
+	ni_testbus_blob_get(blob);
+	if (file->blob)
+		ni_testbus_blob_put(file->blob);
+	file->blob = blob;
+	file->size = blob->size;
+	file->iseq++;
+
+	ni_debug_testbus("file %s: sharing %u bytes with %u other file(s)",
+			file->name, blob->size, blob->refcount - 1);
+}
+
 ni_testbus_file_array_t *
 ni_testbus_file_array_new(void)
 {
@@ -208,6 +812,11 @@ ni_testbus_file_serialize(const ni_testbus_file_t *file, ni_dbus_variant_t *dict
 	ni_dbus_dict_add_uint32(dict, "mode", file->mode);
 	if (file->object_path)
 		ni_dbus_dict_add_string(dict, "object-path", file->object_path);
+
+	/* Tell the agent the digest of input files, so that it can check
+	 * its file cache before downloading them. */
+	if ((file->mode & NI_TESTBUS_FILE_READ) && file->blob && __ni_testbus_blob_md5(file->blob))
+		ni_dbus_dict_add_byte_array(dict, "md5", file->blob->md5, sizeof(file->blob->md5));
 	return TRUE;
 }
 
@@ -215,6 +824,7 @@ ni_testbus_file_t *
 ni_testbus_file_deserialize(const ni_dbus_variant_t *dict, ni_testbus_file_array_t *container)
 {
 	ni_testbus_file_t *file;
+	const ni_dbus_variant_t *var;
 	const char *name, *path;
 	uint32_t inum, iseq, mode;
 
@@ -234,6 +844,13 @@ ni_testbus_file_deserialize(const ni_dbus_variant_t *dict, ni_testbus_file_array
 		ni_string_dup(&file->object_path, path);
 	}
 
+	if ((var = ni_dbus_dict_get(dict, "md5")) != NULL) {
+		unsigned int len;
+
+		file->md5_valid = ni_dbus_variant_get_byte_array_minmax(var, file->md5, &len,
+						sizeof(file->md5), sizeof(file->md5));
+	}
+
 	return file;
 }
 
@@ -66,6 +66,28 @@ ni_testbus_process_exit_info_serialize(const ni_process_exit_info_t *exit_info,
 	/* For now, we're not capturing stdout/stderr */
 	ni_dbus_dict_add_uint32(dict, "stdout-total-bytes", exit_info->stdout_bytes);
 	ni_dbus_dict_add_uint32(dict, "stderr-total-bytes", exit_info->stderr_bytes);
+	if (exit_info->stdout_discarded)
+		ni_dbus_dict_add_uint64(dict, "stdout-discarded-bytes", exit_info->stdout_discarded);
+	if (exit_info->stderr_discarded)
+		ni_dbus_dict_add_uint64(dict, "stderr-discarded-bytes", exit_info->stderr_discarded);
+
+	ni_dbus_dict_add_uint64(dict, "queue-wait-usec", exit_info->queue.wait_usec);
+	ni_dbus_dict_add_uint32(dict, "queue-depth", exit_info->queue.depth);
+
+	if (exit_info->rusage.valid) {
+		ni_dbus_variant_t *usage = ni_dbus_dict_add(dict, "resource-usage");
+
+		ni_dbus_variant_init_dict(usage);
+		ni_dbus_dict_add_string(usage, "source", exit_info->rusage.from_cgroup? "cgroup" : "wait4");
+		ni_dbus_dict_add_uint64(usage, "wall-usec", exit_info->rusage.wall_usec);
+		ni_dbus_dict_add_uint64(usage, "user-usec", exit_info->rusage.user_usec);
+		ni_dbus_dict_add_uint64(usage, "system-usec", exit_info->rusage.sys_usec);
+		ni_dbus_dict_add_uint64(usage, "max-rss-kb", exit_info->rusage.max_rss_kb);
+		ni_dbus_dict_add_uint64(usage, "io-read-bytes", exit_info->rusage.io_read_bytes);
+		ni_dbus_dict_add_uint64(usage, "io-write-bytes", exit_info->rusage.io_write_bytes);
+		ni_dbus_dict_add_uint64(usage, "voluntary-ctxsw", exit_info->rusage.voluntary_ctxsw);
+		ni_dbus_dict_add_uint64(usage, "involuntary-ctxsw", exit_info->rusage.involuntary_ctxsw);
+	}
 	return TRUE;
 }
 
@@ -73,6 +95,7 @@ ni_process_exit_info_t *
 ni_testbus_process_exit_info_deserialize(const ni_dbus_variant_t *dict)
 {
 	ni_process_exit_info_t *exit_info;
+	const ni_dbus_variant_t *usage;
 	uint32_t u32;
 	dbus_bool_t b;
 
@@ -97,6 +120,28 @@ ni_testbus_process_exit_info_deserialize(const ni_dbus_variant_t *dict)
 		exit_info->stdout_bytes = u32;
 	if (ni_dbus_dict_get_uint32(dict, "stderr-total-bytes", &u32))
 		exit_info->stderr_bytes = u32;
+	ni_dbus_dict_get_uint64(dict, "stdout-discarded-bytes", &exit_info->stdout_discarded);
+	ni_dbus_dict_get_uint64(dict, "stderr-discarded-bytes", &exit_info->stderr_discarded);
+
+	ni_dbus_dict_get_uint64(dict, "queue-wait-usec", &exit_info->queue.wait_usec);
+	if (ni_dbus_dict_get_uint32(dict, "queue-depth", &u32))
+		exit_info->queue.depth = u32;
+
+	if ((usage = ni_dbus_dict_get(dict, "resource-usage")) != NULL) {
+		const char *source;
+
+		exit_info->rusage.valid = TRUE;
+		if (ni_dbus_dict_get_string(usage, "source", &source))
+			exit_info->rusage.from_cgroup = ni_string_eq(source, "cgroup");
+		ni_dbus_dict_get_uint64(usage, "wall-usec", &exit_info->rusage.wall_usec);
+		ni_dbus_dict_get_uint64(usage, "user-usec", &exit_info->rusage.user_usec);
+		ni_dbus_dict_get_uint64(usage, "system-usec", &exit_info->rusage.sys_usec);
+		ni_dbus_dict_get_uint64(usage, "max-rss-kb", &exit_info->rusage.max_rss_kb);
+		ni_dbus_dict_get_uint64(usage, "io-read-bytes", &exit_info->rusage.io_read_bytes);
+		ni_dbus_dict_get_uint64(usage, "io-write-bytes", &exit_info->rusage.io_write_bytes);
+		ni_dbus_dict_get_uint64(usage, "voluntary-ctxsw", &exit_info->rusage.voluntary_ctxsw);
+		ni_dbus_dict_get_uint64(usage, "involuntary-ctxsw", &exit_info->rusage.involuntary_ctxsw);
+	}
 
 	return exit_info;
 }
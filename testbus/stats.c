@@ -0,0 +1,173 @@
+/*
+ * Stats interface, shared by master and agent.
+ */
+
+#include <dborb/logging.h>
+#include <dborb/loopstats.h>
+#include <dborb/buffer.h>
+#include <dborb/codec.h>
+#include <dborb/dbus.h>
+#include <dborb/dbus-errors.h>
+#include <testbus/model.h>
+
+void
+ni_testbus_create_static_objects_stats(ni_dbus_server_t *server)
+{
+	ni_objectmodel_create_object(server, NI_TESTBUS_STATS_PATH, ni_testbus_stats_class(), NULL);
+}
+
+static void
+__ni_testbus_stats_serialize_latency(ni_dbus_variant_t *dict, const char *name, const ni_latency_histogram_t *hist)
+{
+	ni_dbus_variant_init_dict(dict);
+	ni_dbus_dict_add_string(dict, "name", name);
+	ni_dbus_dict_add_uint64(dict, "count", hist->count);
+	ni_dbus_dict_add_uint64(dict, "total-usec", hist->total_usec);
+	ni_dbus_dict_add_uint64(dict, "max-usec", hist->max_usec);
+	ni_dbus_dict_add_uint64(dict, "p50-usec", ni_latency_histogram_percentile(hist, 50));
+	ni_dbus_dict_add_uint64(dict, "p90-usec", ni_latency_histogram_percentile(hist, 90));
+	ni_dbus_dict_add_uint64(dict, "p99-usec", ni_latency_histogram_percentile(hist, 99));
+}
+
+/*
+ * Stats.getEventLoopStats()
+ */
+static dbus_bool_t
+__ni_Testbus_Stats_getEventLoopStats(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	const ni_loopstats_t *stats = ni_loopstats_get();
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_dbus_variant_t *callbacks;
+	dbus_bool_t rv;
+	unsigned int i;
+
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	ni_dbus_variant_init_dict(&res);
+	ni_dbus_dict_add_uint64(&res, "iterations", stats->iterations);
+	__ni_testbus_stats_serialize_latency(ni_dbus_dict_add(&res, "wait"), "poll-wait", &stats->wait);
+	__ni_testbus_stats_serialize_latency(ni_dbus_dict_add(&res, "busy"), "busy", &stats->busy);
+
+	callbacks = ni_dbus_dict_add(&res, "callbacks");
+	ni_dbus_dict_array_init(callbacks);
+	for (i = 0; i < stats->count; ++i) {
+		const ni_loopstats_entry_t *entry = &stats->data[i];
+
+		__ni_testbus_stats_serialize_latency(ni_dbus_dict_array_add(callbacks), entry->name, &entry->latency);
+	}
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+NI_TESTBUS_METHOD_BINDING(Stats, getEventLoopStats);
+
+/*
+ * Stats.resetEventLoopStats()
+ */
+static dbus_bool_t
+__ni_Testbus_Stats_resetEventLoopStats(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	ni_loopstats_reset();
+	return TRUE;
+}
+
+NI_TESTBUS_METHOD_BINDING(Stats, resetEventLoopStats);
+
+/*
+ * Stats.getBufferPoolStats()
+ */
+static dbus_bool_t
+__ni_Testbus_Stats_getBufferPoolStats(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_buffer_pool_stats_t stats[32];
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	unsigned int i, count;
+	dbus_bool_t rv;
+
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	count = ni_buffer_pool_get_stats(stats, 32);
+
+	ni_dbus_dict_array_init(&res);
+	for (i = 0; i < count; ++i) {
+		ni_dbus_variant_t *dict = ni_dbus_dict_array_add(&res);
+
+		ni_dbus_dict_add_uint64(dict, "size", stats[i].size);
+		ni_dbus_dict_add_uint64(dict, "allocs", stats[i].allocs);
+		ni_dbus_dict_add_uint64(dict, "hits", stats[i].hits);
+		ni_dbus_dict_add_uint32(dict, "in-use", stats[i].in_use);
+		ni_dbus_dict_add_uint32(dict, "high-water", stats[i].high_water);
+		ni_dbus_dict_add_uint32(dict, "cached", stats[i].cached);
+	}
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+NI_TESTBUS_METHOD_BINDING(Stats, getBufferPoolStats);
+
+/*
+ * Stats.getCodecStats()
+ */
+static void
+__ni_testbus_stats_serialize_codec(ni_dbus_variant_t *dict, const ni_codec_stats_t *stats)
+{
+	ni_dbus_variant_init_dict(dict);
+	ni_dbus_dict_add_uint64(dict, "calls", stats->calls);
+	ni_dbus_dict_add_uint64(dict, "skipped", stats->skipped);
+	ni_dbus_dict_add_uint64(dict, "bytes-in", stats->bytes_in);
+	ni_dbus_dict_add_uint64(dict, "bytes-out", stats->bytes_out);
+	ni_dbus_dict_add_uint64(dict, "cpu-usec", stats->cpu_usec);
+}
+
+static dbus_bool_t
+__ni_Testbus_Stats_getCodecStats(ni_dbus_object_t *object, const ni_dbus_method_t *method,
+		unsigned int argc, const ni_dbus_variant_t *argv,
+		ni_dbus_message_t *reply, DBusError *error)
+{
+	ni_dbus_variant_t res = NI_DBUS_VARIANT_INIT;
+	ni_codec_t *codec;
+	unsigned int i;
+	dbus_bool_t rv;
+
+	if (argc != 0)
+		return ni_dbus_error_invalid_args(error, object->path, method->name);
+
+	ni_dbus_dict_array_init(&res);
+	for (i = 0; (codec = ni_codec_get(i)) != NULL; ++i) {
+		ni_dbus_variant_t *dict = ni_dbus_dict_array_add(&res);
+
+		ni_dbus_dict_add_string(dict, "name", codec->name);
+		__ni_testbus_stats_serialize_codec(ni_dbus_dict_add(dict, "encode"), &codec->encode);
+		__ni_testbus_stats_serialize_codec(ni_dbus_dict_add(dict, "decode"), &codec->decode);
+	}
+
+	rv = ni_dbus_message_serialize_variants(reply, 1, &res, error);
+	ni_dbus_variant_destroy(&res);
+	return rv;
+}
+
+NI_TESTBUS_METHOD_BINDING(Stats, getCodecStats);
+
+void
+ni_testbus_bind_builtin_stats(void)
+{
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Stats_getEventLoopStats_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Stats_resetEventLoopStats_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Stats_getBufferPoolStats_binding);
+	ni_dbus_objectmodel_bind_method(&__ni_Testbus_Stats_getCodecStats_binding);
+}